@@ -49,14 +49,101 @@ extern "C" {
 #define CAN_IOCTL_ENABLE_MESSAGE_ACCEPT     _IO(CAN_MAGIC_TYPE, 17)
 
 /*
- *  TODO -  If we want an application to get these, it should be via an IOCTL interface.
- *          For now, the /proc API works.
+ *  Binary statistics.  The /proc API has the same information in text form.
  */
-#if 0
-#define CAN_IOCTL_GET_FILE_STATS            _IOR(CAN_MAGIC_TYPE, 18)
-#define CAN_IOCTL_GET_DEVICE_STATS          _IOR(CAN_MAGIC_TYPE, 19)
+#define CAN_IOCTL_GET_FILE_STATS            _IOR(CAN_MAGIC_TYPE, 18, struct can_file_stats_t)
+#define CAN_IOCTL_GET_DEVICE_STATS          _IOR(CAN_MAGIC_TYPE, 19, struct can_device_stats_t)
 #define CAN_IOCTL_RESET_DEVICE_STATS        _IO(CAN_MAGIC_TYPE, 20)
-#endif
+
+/*
+ *  Per CAN ID traffic table.
+ */
+#define CAN_IOCTL_GET_ID_STATS              _IOWR(CAN_MAGIC_TYPE, 21, struct can_id_stats_request_t)
+#define CAN_IOCTL_RESET_ID_STATS            _IO(CAN_MAGIC_TYPE, 22)
+
+/*
+ *  In-driver gateway.  Routes are added on the source device's file and 
+ *  forward matching received frames straight to another device's transmit 
+ *  queue.  See struct can_route_t.
+ */
+#define CAN_IOCTL_ADD_ROUTE                 _IOWR(CAN_MAGIC_TYPE, 23, struct can_route_t)
+#define CAN_IOCTL_DELETE_ROUTE              _IOW(CAN_MAGIC_TYPE, 24, unsigned int)
+#define CAN_IOCTL_GET_ROUTE_STATS           _IOWR(CAN_MAGIC_TYPE, 25, struct can_route_stats_t)
+
+/*
+ *  The last frames the device received, whether or not anyone had it
+ *  open.  See struct can_history_request_t.
+ */
+#define CAN_IOCTL_GET_HISTORY               _IOWR(CAN_MAGIC_TYPE, 26, struct can_history_request_t)
+
+/*
+ *  Triggered capture, a frozen window of traffic around a trigger.
+ *  See struct can_capture_config_t.
+ */
+#define CAN_IOCTL_SET_CAPTURE               _IOW(CAN_MAGIC_TYPE, 27, struct can_capture_config_t)
+#define CAN_IOCTL_ARM_CAPTURE               _IO(CAN_MAGIC_TYPE, 28)
+#define CAN_IOCTL_GET_CAPTURE               _IOWR(CAN_MAGIC_TYPE, 29, struct can_capture_request_t)
+
+/*
+ *  Consumer groups, where each received frame goes to just one of the
+ *  group's files.  See struct can_group_config_t.
+ */
+#define CAN_IOCTL_JOIN_GROUP                _IOW(CAN_MAGIC_TYPE, 30, struct can_group_config_t)
+#define CAN_IOCTL_LEAVE_GROUP               _IO(CAN_MAGIC_TYPE, 31)
+#define CAN_IOCTL_GET_GROUP_STATS           _IOWR(CAN_MAGIC_TYPE, 32, struct can_group_stats_t)
+
+/*
+ *  What a file receives, and status changes without the receive queue.
+ *  See CAN_CLASS_DATA and struct can_status_t.
+ */
+#define CAN_IOCTL_SET_CLASSES               _IOW(CAN_MAGIC_TYPE, 33, unsigned int)
+#define CAN_IOCTL_SET_STATUS_EVENTFD        _IOW(CAN_MAGIC_TYPE, 34, int)
+#define CAN_IOCTL_GET_STATUS                _IOR(CAN_MAGIC_TYPE, 35, struct can_status_t)
+
+/*
+ *  Minimum time between a file's CANBUS_STATUS_CHANGE records, in
+ *  microseconds, at most CAN_STATUS_MAX_INTERVAL_US.  0 is none.
+ */
+#define CAN_IOCTL_SET_STATUS_INTERVAL       _IOW(CAN_MAGIC_TYPE, 36, unsigned int)
+
+/*
+ *  What the device does with a frame nobody acknowledges, and the frames
+ *  a file wrote that were given up on.  See struct can_tx_policy_t.
+ */
+#define CAN_IOCTL_SET_TX_POLICY             _IOW(CAN_MAGIC_TYPE, 37, struct can_tx_policy_t)
+#define CAN_IOCTL_GET_TX_POLICY             _IOR(CAN_MAGIC_TYPE, 38, struct can_tx_policy_t)
+#define CAN_IOCTL_GET_TX_DROPPED            _IOWR(CAN_MAGIC_TYPE, 39, struct can_tx_dropped_request_t)
+
+/*
+ *  How the device gets back on the bus after BUS OFF, and starting that
+ *  by hand.  See struct can_recovery_t.
+ */
+#define CAN_IOCTL_SET_RECOVERY              _IOW(CAN_MAGIC_TYPE, 40, struct can_recovery_t)
+#define CAN_IOCTL_GET_RECOVERY              _IOR(CAN_MAGIC_TYPE, 41, struct can_recovery_t)
+#define CAN_IOCTL_RECOVER                   _IO(CAN_MAGIC_TYPE, 42)
+
+/*
+ *  Frames the driver transmits by itself every period, and changing
+ *  their data in place.  See struct can_cyclic_t.
+ */
+#define CAN_IOCTL_ADD_CYCLIC                _IOWR(CAN_MAGIC_TYPE, 43, struct can_cyclic_t)
+#define CAN_IOCTL_UPDATE_CYCLIC             _IOW(CAN_MAGIC_TYPE, 44, struct can_cyclic_update_t)
+#define CAN_IOCTL_DELETE_CYCLIC             _IOW(CAN_MAGIC_TYPE, 45, unsigned int)
+#define CAN_IOCTL_GET_CYCLIC_STATS          _IOWR(CAN_MAGIC_TYPE, 46, struct can_cyclic_stats_t)
+
+/*
+ *  A write() at an absolute time, and when it actually went out.  See
+ *  struct can_timed_tx_t.
+ */
+#define CAN_IOCTL_TIMED_WRITE               _IOWR(CAN_MAGIC_TYPE, 47, struct can_timed_tx_t)
+#define CAN_IOCTL_GET_TIMED_TX              _IOR(CAN_MAGIC_TYPE, 48, struct can_timed_tx_t)
+
+/*
+ *  A record for every frame a file writes once it has gone out or been
+ *  given up on.  See struct can_tx_complete_t.
+ */
+#define CAN_IOCTL_SET_TX_COMPLETE           _IOW(CAN_MAGIC_TYPE, 49, struct can_tx_complete_config_t)
+#define CAN_IOCTL_GET_TX_COMPLETE           _IOWR(CAN_MAGIC_TYPE, 50, struct can_tx_complete_request_t)
 
 
 /*
@@ -96,8 +183,8 @@ typedef struct CANBUS_STATUS_CHANGE_
     unsigned int StatusChangeFlag;  /*  Set to CANBUS_STATUS_CHANGE_FLAG for now. */
     unsigned int Status1;           /*  Uses CanStatusChange1 bits */
     unsigned int Status2;           /*  Protocol stats - Driver should not use this. */
-    unsigned int Status3;           /* */ 
-    unsigned int Status4;           /* */ 
+    unsigned int Status3;           /*  Status changes ORed into this one after the first */
+    unsigned int Status4;           /*  CAN_STATE_xxx after this change */ 
 
 } CANBUS_STATUS_CHANGE, *PCANBUS_STATUS_CHANGE;
 
@@ -121,6 +208,96 @@ enum  CanStatusChange1 {
     Csc1CrcErr      = 0x00000040,   /*  Receive CRC Error */
     Csc1FormErr     = 0x00000080,   /*  Format Error */
     Csc1StuffErr    = 0x00000100,   /*  Bit stuffing error */
+    Csc1BusOn       = 0x00000200,   /*  Back on the bus after BUS OFF */
+    Csc1Passive     = 0x00000400,   /*  Error passive, errors > 127 */
+};
+
+
+/*
+ *  The controller's fault confinement state, from ESR1 FLT_CONF and the
+ *  warning bits.  RECOVERING is BUS OFF with the controller counting the
+ *  128 x 11 recessive bits it needs to come back.
+ */
+#define CAN_STATE_ERROR_ACTIVE      0
+#define CAN_STATE_WARNING           1
+#define CAN_STATE_PASSIVE           2
+#define CAN_STATE_BUS_OFF           3
+#define CAN_STATE_RECOVERING        4
+#define CAN_NUM_STATES              5
+
+
+/*
+ *  A file has at most one CANBUS_STATUS_CHANGE unread.  Status changes
+ *  before it is read are ORed into its Status1, and counted in Status3,
+ *  rather than queued behind it.  With CAN_IOCTL_SET_STATUS_INTERVAL the
+ *  next record is also held back until the interval since the last one 
+ *  is up, collecting the changes meanwhile the same way.
+ */
+#define CAN_STATUS_MAX_INTERVAL_US  10000000
+
+/*
+ *  Status changes less than this apart are an error storm, for the
+ *  storm_xxx device stats.
+ */
+#define CAN_STORM_GAP_MS            10
+
+
+/*
+ *  Log-linear histogram, used for latency and count distributions.
+ *
+ *  Values below CAN_HIST_SUB_BUCKETS get a bucket each.  Above that, every 
+ *  power of two is split into CAN_HIST_SUB_BUCKETS equal sized buckets, so 
+ *  the resolution is always better than 1/CAN_HIST_SUB_BUCKETS of the value.
+ *  Anything at or above 2^32 lands in the last bucket.  Times are in 
+ *  nanoseconds, counts are raw.
+ */
+#define CAN_HIST_SUB_BITS       3
+#define CAN_HIST_SUB_BUCKETS    (1 << CAN_HIST_SUB_BITS)
+#define CAN_HIST_NUM_BUCKETS    ((32 - CAN_HIST_SUB_BITS + 1) * CAN_HIST_SUB_BUCKETS)
+
+/*
+ *  Smallest value that lands in bucket b_, for user space percentile math.
+ *  The largest is CAN_HIST_BUCKET_LOWER(b_ + 1) - 1.
+ */
+#define CAN_HIST_BUCKET_LOWER(b_)                                           \
+    (((b_) < CAN_HIST_SUB_BUCKETS) ? (unsigned long long)(b_) :             \
+        ((unsigned long long)(CAN_HIST_SUB_BUCKETS +                        \
+            ((b_) & (CAN_HIST_SUB_BUCKETS - 1)))                            \
+            << (((b_) >> CAN_HIST_SUB_BITS) - 1)))
+
+struct can_histogram_t {
+
+    unsigned long long count;                           /* Number of samples */
+    unsigned long long sum;                             /* Sum of all samples, for averaging */
+    unsigned long long max;                             /* Largest sample seen */
+    unsigned long long buckets[CAN_HIST_NUM_BUCKETS];   /* Sample counts per bucket */
+};
+
+
+/*
+ *  Bus load over one window.  These are filled in when the statistics 
+ *  are read, from the on-wire bit counts of every frame received or 
+ *  transmitted.
+ */
+struct can_bus_load_t {
+
+    unsigned int utilization_x100;      /* Percent of bus time used, x100 (5000 = 50.00%) */
+    unsigned int frames_per_sec;
+    unsigned int bits_per_sec;
+};
+
+
+/*
+ *  One of the driver's spinlocks.  acquired and contended always count.
+ *  The histograms only fill with the lock_timing module parameter set,
+ *  timing costs two clock reads per hold.
+ */
+struct can_lock_stats_t {
+
+    unsigned long long acquired;
+    unsigned long long contended;       /* Someone else had it, so we spun */
+    struct can_histogram_t wait_hist;   /* Spinning, contended takes only, ns */
+    struct can_histogram_t hold_hist;   /* Taken to released, ns */
 };
 
 
@@ -144,9 +321,9 @@ struct can_device_stats_t {
     unsigned int form_error_count;      /* Total number of these errors. */
     unsigned int bitstuff_error_count;  /* Total number of these errors. */
 
-    struct timespec total_isr_time;     /* Total time spent in ISR, for user space averaging. */
-    struct timespec cur_isr_time;       /* Time spent in very last ISR. */
-    struct timespec max_isr_time;       /* High water mark of time spent all ISRs. */
+    unsigned long long total_isr_time_ns;   /* Total time spent in ISR, for user space averaging. */
+    unsigned long long cur_isr_time_ns;     /* Time spent in very last ISR. */
+    unsigned long long max_isr_time_ns;     /* High water mark of time spent all ISRs. */
 
     unsigned long long total_mb_used;   /* Total MB used ever, for user space averaging. */
     unsigned int cur_mb_used;           /* MBs used in very last ISR. */
@@ -155,6 +332,595 @@ struct can_device_stats_t {
     unsigned int cur_tx_queue_count;    /* Depth of our write (tx) queue "now" */
     unsigned int max_tx_queue_count;    /* High water mark of our write queue */
 
+    struct can_histogram_t isr_time_hist;       /* ISR duration, ns */
+    struct can_histogram_t mb_per_isr_hist;     /* Mailboxes drained per ISR */
+    struct can_histogram_t isr_interval_hist;   /* Time between ISR entries, ns */
+
+    unsigned int bitrate;                       /* Configured bitrate, bits/sec */
+    unsigned long long total_bus_bits;          /* On-wire bits of every frame seen */
+    struct can_bus_load_t bus_load_100ms;       /* Last 100 ms */
+    struct can_bus_load_t bus_load_1s;          /* Last second */
+    struct can_bus_load_t bus_load_10s;         /* Last 10 seconds */
+
+    unsigned long long gateway_tx_count;        /* Frames forwarded from other devices, transmitted */
+    struct can_histogram_t gateway_latency_hist;/* Their source ISR entry to TX mailbox load, ns */
+
+    struct can_lock_stats_t register_lock;      /* Hardware and ISR state */
+    struct can_lock_stats_t tx_lock;            /* Transmit queue and TX mailbox */
+    struct can_lock_stats_t reader_lock;        /* List of open files */
+
+    unsigned long long status_coalesced;        /* Status changes ORed into a record, rather than queued */
+    unsigned int storm_count;                   /* Error storms, see CAN_STORM_GAP_MS */
+    unsigned long long storm_total_ns;          /* Time spent in them */
+    unsigned long long storm_max_ns;            /* The longest */
+    unsigned long long storm_cur_ns;            /* The one going on now, or the last */
+
+    unsigned long long tx_aborted;              /* Frames aborted in TX_MB on an ACK error */
+    unsigned long long tx_retried;              /* Aborted frames loaded again */
+    unsigned long long tx_dropped;              /* Frames given up on, see struct can_tx_policy_t */
+    unsigned long long tx_holds;                /* Times the queue was held for a backoff */
+
+    unsigned int can_state;                     /* CAN_STATE_xxx now */
+    unsigned int state_entries[CAN_NUM_STATES]; /* Times each was entered */
+    unsigned long long state_time_ns[CAN_NUM_STATES];   /* Time spent in each, up to now */
+    unsigned long long recoveries;              /* BUS OFF and back */
+    unsigned long long last_bus_off_ns;         /* BUS OFF to TX_MB in use again, the last time */
+    unsigned long long max_bus_off_ns;          /* The longest */
+
+    unsigned long long timed_tx;                /* CAN_IOCTL_TIMED_WRITE frames sent */
+    struct can_histogram_t timed_load_hist;     /* Their deadline to TX_MB load, ns */
+    struct can_histogram_t timed_tx_hist;       /* Their deadline to start on the bus, ns */
+
+};
+
+
+/*
+ *  Traffic seen for one CAN ID.  Times are the estimated time the frame 
+ *  was on the bus (from the Flexcan timestamp), in CLOCK_MONOTONIC ns.
+ *  The mean period is total_period_ns / (count - 1), and the rate is its 
+ *  inverse.  The period fields are only valid once count > 1.
+ */
+struct can_id_stats_t {
+
+    unsigned int id;                        /* 11 or 29 bit ID, not the MB register format */
+    unsigned int type;                      /* CmtStandard or CmtExtended */
+    unsigned int last_dlc;                  /* DLC of the most recent frame */
+    unsigned int dlc_changes;               /* Times the DLC differed from the previous frame */
+    unsigned long long count;               /* Frames seen */
+    unsigned long long last_ns;             /* When the most recent frame was seen */
+    unsigned long long last_period_ns;      /* Most recent inter-arrival time */
+    unsigned long long min_period_ns;       /* Shortest inter-arrival time */
+    unsigned long long max_period_ns;       /* Longest inter-arrival time */
+    unsigned long long total_period_ns;     /* Sum of inter-arrival times, for the mean */
+};
+
+
+/*
+ *  CAN_IOCTL_GET_ID_STATS walks the table from start_index, copying
+ *  up to max_entries IDs that have been seen into entries.  Call again
+ *  with start_index = next_index until num_entries comes back 0.
+ */
+struct can_id_stats_request_t {
+
+    unsigned int start_index;               /* In: table position to start at, 0 first time */
+    unsigned int max_entries;               /* In: room in entries */
+    unsigned long long entries;             /* In: user pointer to struct can_id_stats_t[max_entries] */
+    unsigned int num_entries;               /* Out: entries filled in */
+    unsigned int next_index;                /* Out: start_index for the next call */
+    unsigned int overflow_count;            /* Out: extended ID frames with no room in the table */
+};
+
+
+/*
+ *  One received frame, from the history ring or a capture.  seq counts
+ *  every frame the device has received since it was probed, from 0,
+ *  with no gaps.
+ */
+struct can_history_entry_t {
+
+    unsigned long long seq;
+    unsigned long long timestamp_ns;        /* When it was on the bus, CLOCK_MONOTONIC */
+    CANBUS_MESSAGE message;
+};
+
+
+/*
+ *  CAN_IOCTL_GET_HISTORY copies frames from the history ring, oldest
+ *  first, into entries.  Start from the oldest frame still held, from
+ *  seq from, or from the first frame at or after timestamp_ns from.
+ *  To follow the bus, call again with CAN_HISTORY_FROM_SEQ and
+ *  from = next_seq.  Frames overwritten before we got to them are
+ *  counted in lost, and the copy carries on with the oldest one left.
+ *
+ *  The ring holds the history_size module parameter's worth of frames,
+ *  0 turns it off and the ioctl fails with ENODEV.
+ */
+#define CAN_HISTORY_ALL         0
+#define CAN_HISTORY_FROM_SEQ    1
+#define CAN_HISTORY_FROM_TIME   2
+
+struct can_history_request_t {
+
+    unsigned int start;                     /* In: CAN_HISTORY_xxx */
+    unsigned int max_entries;               /* In: room in entries */
+    unsigned long long from;                /* In: seq or timestamp_ns, per start */
+    unsigned long long entries;             /* In: user pointer to struct can_history_entry_t[max_entries] */
+    unsigned int num_entries;               /* Out: entries filled in */
+    unsigned int size;                      /* Out: frames the ring holds */
+    unsigned long long first_seq;           /* Out: oldest frame held when we started */
+    unsigned long long next_seq;            /* Out: seq of the frame after the last one returned */
+    unsigned long long lost;                /* Out: frames from the start point overwritten first */
+};
+
+
+/*
+ *  Triggered capture.  Like a scope, the device keeps the last 
+ *  pre_frames frames while armed, and when the trigger fires it records
+ *  post_frames more and freezes.  The window is exact however late user
+ *  space gets to it, and it stays frozen until CAN_IOCTL_ARM_CAPTURE or
+ *  another CAN_IOCTL_SET_CAPTURE.  There is one capture per device.
+ *
+ *  The trigger fires on:
+ *
+ *  - CAN_CAPTURE_ON_FRAME   a frame whose type and ID match as for a 
+ *                           gateway route, and whose data matches
+ *                           (Data[i] & data_mask[i]) == data_value[i]
+ *                           for every i.  A zero data_mask is any data.
+ *  - CAN_CAPTURE_ON_STATUS  a CANBUS_STATUS_CHANGE with any of the
+ *                           status_mask Csc1 bits, e.g. Csc1BusOff.
+ *
+ *  Status changes are recorded in the window too, as a 
+ *  CANBUS_STATUS_CHANGE in place of the message, with the seq of the 
+ *  frame after them.  CAN_IOCTL_SET_CAPTURE arms the trigger, with 
+ *  trigger 0 it turns capture off and frees the buffer.
+ */
+#define CAN_CAPTURE_ON_FRAME    0x00000001
+#define CAN_CAPTURE_ON_STATUS   0x00000002
+
+#define CAN_CAPTURE_MAX_FRAMES  65536       /* pre_frames + post_frames + 1 */
+
+struct can_capture_config_t {
+
+    unsigned int trigger;                   /* CAN_CAPTURE_ON_xxx, either fires */
+    unsigned int match_type;                /* CmtStandard, CmtExtended or CmtUndefined for either */
+    unsigned int match_id;
+    unsigned int match_mask;
+    unsigned char data_mask[8];
+    unsigned char data_value[8];
+    unsigned int status_mask;               /* Csc1xxx bits */
+    unsigned int pre_frames;                /* Kept from before the trigger */
+    unsigned int post_frames;               /* Recorded after it */
+};
+
+#define CAN_CAPTURE_OFF         0
+#define CAN_CAPTURE_ARMED       1           /* Waiting for the trigger */
+#define CAN_CAPTURE_TRIGGERED   2           /* Recording post_frames */
+#define CAN_CAPTURE_FROZEN      3           /* Window complete */
+
+/*
+ *  CAN_IOCTL_GET_CAPTURE.  Once FROZEN, copies the window into entries
+ *  in order.  The same buffer can be mmap()ed read only from the 
+ *  device, it is a ring of slots entries with the window starting at 
+ *  first_slot.
+ */
+struct can_capture_request_t {
+
+    unsigned int wait;                      /* In: nonzero sleeps until FROZEN */
+    unsigned int max_entries;               /* In: room in entries, can be 0 */
+    unsigned long long entries;             /* In: user pointer to struct can_history_entry_t[max_entries] */
+    unsigned int state;                     /* Out: CAN_CAPTURE_xxx */
+    unsigned int num_entries;               /* Out: entries filled in */
+    unsigned int window;                    /* Out: entries in the frozen window */
+    unsigned int trigger_entry;             /* Out: the trigger's index in the window */
+    unsigned int slots;                     /* Out: entries in the mmap() buffer */
+    unsigned int first_slot;                /* Out: where the window starts in it */
+    unsigned long long trigger_seq;         /* Out: seq of the trigger entry */
+    unsigned long long trigger_ns;          /* Out: and when it was */
+    unsigned long long triggers;            /* Out: times it has fired since the device was probed */
+};
+
+
+/*
+ *  splice() from the device to a pipe streams what would have been
+ *  read() as fixed size log records instead, packed back to back with 
+ *  no headers, so a logger can splice on from the pipe to a file and 
+ *  never touch the data.  A status change is a record with
+ *  CAN_LOG_STATUS set, its Status1 in id and no data.  The length 
+ *  asked for is rounded down to whole records.
+ */
+#define CAN_LOG_EXTENDED        0x01
+#define CAN_LOG_STATUS          0x02
+
+struct can_log_record_t {
+
+    unsigned long long timestamp_ns;        /* Entry to the ISR that received it, CLOCK_MONOTONIC */
+    unsigned int id;                        /* Plain 11 or 29 bit ID, or Status1 */
+    unsigned char flags;                    /* CAN_LOG_xxx */
+    unsigned char dlc;
+    unsigned short reserved;                /* 0 */
+    unsigned char data[8];
+};
+
+
+/*
+ *  A gateway route.  A received frame matches if its type is match_type
+ *  (or match_type is CmtUndefined, either) and (id & match_mask) == (match_id & match_mask),
+ *  with ids as plain 11 or 29 bit numbers, not the MB register format.
+ *  A copy goes to the transmit queue of /dev/ta_canbus<dest_index>,
+ *  which must be a different device:
+ *
+ *  - CAN_ROUTE_REWRITE_ID  replaces the id with new_id, same frame type.
+ *  - CAN_ROUTE_MASK_DATA   replaces each data byte with 
+ *                          (byte & data_and[i]) | data_or[i].
+ *
+ *  Frames the destination can't take, because its queue already holds
+ *  CAN_ROUTE_MAX_QUEUED frames or its message pool is empty, are dropped
+ *  and counted.  A frame that matches several routes goes out on each.
+ */
+#define CAN_ROUTE_REWRITE_ID    0x00000001
+#define CAN_ROUTE_MASK_DATA     0x00000002
+
+#define CAN_ROUTE_MAX_QUEUED    256
+
+struct can_route_t {
+
+    unsigned int route_id;                  /* Out: for delete and stats, unique per source device */
+    unsigned int dest_index;                /* N of the /dev/ta_canbusN to transmit on */
+    unsigned int match_type;                /* CmtStandard, CmtExtended or CmtUndefined for either */
+    unsigned int match_id;
+    unsigned int match_mask;
+    unsigned int flags;                     /* CAN_ROUTE_xxx */
+    unsigned int new_id;                    /* With CAN_ROUTE_REWRITE_ID */
+    unsigned char data_and[8];              /* With CAN_ROUTE_MASK_DATA */
+    unsigned char data_or[8];
+};
+
+
+/*
+ *  CAN_IOCTL_GET_ROUTE_STATS.  The time from the source ISR to the
+ *  frame starting on the destination bus is in the destination's
+ *  gateway_latency_hist.
+ */
+struct can_route_stats_t {
+
+    unsigned int route_id;                  /* In */
+    struct can_route_t route;               /* Out: as added */
+    unsigned long long hits;                /* Frames that matched */
+    unsigned long long forwarded;           /* Queued on the destination */
+    unsigned long long drops;               /* Matched but dropped, see above */
+};
+
+
+/*
+ *  A consumer group, for spreading the decode of received frames over
+ *  several threads.  CAN_IOCTL_JOIN_GROUP on a file that has message
+ *  accept on makes it a member of the device's group called name,
+ *  creating the group if it doesn't exist.  Each received frame then
+ *  goes to just one member instead of every file:
+ *
+ *  - CAN_GROUP_ROUND_ROBIN     to each member in turn.
+ *  - CAN_GROUP_HASH_ID         by a hash of the ID, so all frames with 
+ *                              one ID go to one member, in order.
+ *
+ *  Files outside any group still get every frame, and every member gets
+ *  every status change.  A member that leaves, or closes, hands its
+ *  unread frames to the rest of the group, and with CAN_GROUP_HASH_ID
+ *  a new member takes the unread frames of the IDs it takes over, so
+ *  no frame is lost or read twice and each ID stays in order.  The
+ *  group goes away with its last member.
+ */
+#define CAN_GROUP_NAME_LEN      16
+#define CAN_GROUP_MAX_MEMBERS   16
+
+#define CAN_GROUP_ROUND_ROBIN   0
+#define CAN_GROUP_HASH_ID       1
+
+struct can_group_config_t {
+
+    char name[CAN_GROUP_NAME_LEN];          /* NUL terminated */
+    unsigned int policy;                    /* CAN_GROUP_xxx, the same for every member */
+};
+
+
+/*
+ *  CAN_IOCTL_GET_GROUP_STATS.  member_frames[i] is what the i'th member,
+ *  in order of joining, has been handed through groups since it opened,
+ *  its can_file_stats_t group_frames.
+ */
+struct can_group_stats_t {
+
+    char name[CAN_GROUP_NAME_LEN];          /* In */
+    unsigned int policy;                    /* Out */
+    unsigned int num_members;
+    unsigned long long frames;              /* Frames delivered to the group */
+    unsigned long long requeued;            /* Unread frames moved between members */
+    unsigned long long member_frames[CAN_GROUP_MAX_MEMBERS];
+};
+
+
+/*
+ *  What happens to the frame in the TX mailbox when nobody acknowledges
+ *  it, CAN_IOCTL_SET_TX_POLICY.  One per device, CAN_TX_FLUSH to start.
+ *
+ *  CAN_TX_FLUSH   Abort it, and drop it and every frame queued behind it.
+ *  CAN_TX_DROP    Abort it and drop it, the queue carries on.
+ *  CAN_TX_RETRY   Abort it and load it again, up to max_retries times,
+ *                 then drop it and carry on.
+ *  CAN_TX_HOLD    Abort it, and keep it and the queue.  It is loaded
+ *                 again after backoff_min_us, doubling up to
+ *                 backoff_max_us while the errors go on, or as soon as
+ *                 a frame is received.  Nothing is dropped.
+ */
+#define CAN_TX_FLUSH                0
+#define CAN_TX_DROP                 1
+#define CAN_TX_RETRY                2
+#define CAN_TX_HOLD                 3
+#define CAN_TX_BUS_OFF              4       /* Not a policy, dropped by CAN_BOFF_TX_FLUSH */
+
+struct can_tx_policy_t {
+
+    unsigned int policy;                    /* CAN_TX_xxx */
+    unsigned int max_retries;               /* CAN_TX_RETRY */
+    unsigned int backoff_min_us;            /* CAN_TX_HOLD, not 0 */
+    unsigned int backoff_max_us;            /* CAN_TX_HOLD, at least backoff_min_us */
+};
+
+
+/*
+ *  A frame this file wrote that the device gave up on.  seq counts the
+ *  file's dropped frames from 0.
+ */
+struct can_tx_dropped_t {
+
+    unsigned long long seq;
+    unsigned long long timestamp_ns;        /* When, CLOCK_MONOTONIC */
+    unsigned int policy;                    /* The CAN_TX_xxx that dropped it */
+    unsigned int attempts;                  /* Times it was loaded into TX_MB */
+    CANBUS_MESSAGE message;
+};
+
+#define CAN_TX_DROPPED_MAX          16
+
+/*
+ *  CAN_IOCTL_GET_TX_DROPPED copies the file's dropped frames from 
+ *  start_seq on.  The file keeps the last CAN_TX_DROPPED_MAX, lost says 
+ *  how many before those were missed.  Pass next_seq as start_seq next 
+ *  time.
+ */
+struct can_tx_dropped_request_t {
+
+    unsigned long long start_seq;           /* In */
+    unsigned long long next_seq;            /* Out */
+    unsigned long long lost;
+    unsigned int num_entries;
+    struct can_tx_dropped_t entries[CAN_TX_DROPPED_MAX];
+};
+
+
+/*
+ *  Getting back on the bus after BUS OFF, CAN_IOCTL_SET_RECOVERY.  One 
+ *  per device, CAN_RECOVER_AUTO and CAN_BOFF_TX_KEEP to start.
+ *
+ *  CAN_RECOVER_AUTO     The controller starts recovering at once.
+ *  CAN_RECOVER_DELAYED  It stays off the bus for delay_us first.
+ *  CAN_RECOVER_MANUAL   It stays off the bus until CAN_IOCTL_RECOVER.
+ *
+ *  Whatever is queued to transmit waits for the bus with 
+ *  CAN_BOFF_TX_KEEP, or is dropped with CAN_BOFF_TX_FLUSH, and reported
+ *  to its writer with CAN_TX_BUS_OFF, see CAN_IOCTL_GET_TX_DROPPED.  
+ *  Writes while off the bus are queued either way.
+ */
+#define CAN_RECOVER_AUTO            0
+#define CAN_RECOVER_DELAYED         1
+#define CAN_RECOVER_MANUAL          2
+
+#define CAN_BOFF_TX_KEEP            0
+#define CAN_BOFF_TX_FLUSH           1
+
+#define CAN_RECOVERY_MAX_DELAY_US   10000000
+
+struct can_recovery_t {
+
+    unsigned int mode;                      /* CAN_RECOVER_xxx */
+    unsigned int delay_us;                  /* CAN_RECOVER_DELAYED */
+    unsigned int tx;                        /* CAN_BOFF_TX_xxx */
+};
+
+
+/*
+ *  A cyclic transmit job, CAN_IOCTL_ADD_CYCLIC.  The driver queues
+ *  message for transmit every period_us from an hrtimer, the same as a
+ *  write() from the file that added it, with no thread to wake.  The
+ *  first one goes at start_ns, CLOCK_MONOTONIC, or at once if that is 0
+ *  or already past.  The job stops after count frames, or runs until
+ *  CAN_IOCTL_DELETE_CYCLIC or that file is closed if count is 0.
+ *
+ *  A period with the transmit queue holding CAN_CYCLIC_MAX_QUEUED frames
+ *  or the message pool empty is skipped, rather than sending late.
+ */
+#define CAN_CYCLIC_MIN_PERIOD_US    100
+#define CAN_CYCLIC_MAX_PERIOD_US    60000000
+#define CAN_CYCLIC_MAX_QUEUED       256
+
+struct can_cyclic_t {
+
+    unsigned int job_id;                    /* Out: for update, delete and stats, unique per device */
+    unsigned int period_us;
+    unsigned int count;                     /* Frames to send, 0 for no limit */
+    unsigned long long start_ns;            /* First frame, CLOCK_MONOTONIC, 0 for now */
+    CANBUS_MESSAGE message;
+};
+
+/*
+ *  CAN_IOCTL_UPDATE_CYCLIC replaces a job's data.  Every frame the job
+ *  queues after it returns has the new data, none has a mix of old and
+ *  new.  Frames already queued keep the old.
+ */
+struct can_cyclic_update_t {
+
+    unsigned int job_id;
+    unsigned int data_length;               /* 0..8 */
+    unsigned char data[8];
+};
+
+/*
+ *  CAN_IOCTL_GET_CYCLIC_STATS.  The achieved period is the time between
+ *  two of the job's frames being queued.  Its distance from period_us, 
+ *  either way, goes in jitter_hist.  Time spent in the queue behind 
+ *  other frames isn't in it.
+ */
+struct can_cyclic_stats_t {
+
+    unsigned int job_id;                    /* In */
+    unsigned int active;                    /* 0 once count frames are sent */
+    struct can_cyclic_t job;                /* Out: as added, with the latest data */
+    unsigned long long sent;                /* Frames queued */
+    unsigned long long skipped;             /* Periods skipped, see above */
+    unsigned long long missed;              /* Periods the hrtimer fired too late for */
+    unsigned long long min_period_ns;       /* Achieved, valid once sent > 1 */
+    unsigned long long max_period_ns;
+    struct can_histogram_t jitter_hist;     /* |achieved - period_us|, ns */
+    struct can_histogram_t late_hist;       /* Due to frame queued, ns */
+};
+
+
+/*
+ *  A frame to transmit at deadline_ns, CLOCK_MONOTONIC, with
+ *  CAN_IOCTL_TIMED_WRITE.  An hrtimer loads it into the TX mailbox at
+ *  that time, or at once if it is already past.  From one frame time
+ *  before, the driver stops loading queued frames, so the mailbox is
+ *  free for it.  If it is busy anyway, with a frame that lost arbitration
+ *  or is held, the timed frame goes out next.
+ *
+ *  A file has one timed frame at a time, a second CAN_IOCTL_TIMED_WRITE
+ *  before the first is sent or dropped fails with -EBUSY.  With wait set
+ *  the ioctl returns once it is, with the results filled in.  Without,
+ *  or if the wait is interrupted (-EINTR, the frame still goes), 
+ *  CAN_IOCTL_GET_TIMED_TX gets them later.
+ *
+ *  tx_ns is from the TX mailbox's time stamp, which the controller takes
+ *  as the frame's identifier starts on the bus.
+ */
+#define CAN_TIMED_MAX_AHEAD_NS      60000000000ULL
+
+#define CAN_TIMED_NONE              0       /* Nothing written yet */
+#define CAN_TIMED_PENDING           1       /* Waiting for deadline_ns */
+#define CAN_TIMED_LOADED            2       /* In TX_MB or first in the queue */
+#define CAN_TIMED_SENT              3
+#define CAN_TIMED_DROPPED           4       /* See CAN_IOCTL_GET_TX_DROPPED */
+
+struct can_timed_tx_t {
+
+    CANBUS_MESSAGE message;                 /* In */
+    unsigned long long deadline_ns;         /* In, at most CAN_TIMED_MAX_AHEAD_NS from now */
+    unsigned int wait;                      /* In: return once it is sent or dropped */
+    unsigned int status;                    /* Out: CAN_TIMED_xxx */
+    unsigned long long load_ns;             /* Out: when it was loaded, or put first in the queue */
+    unsigned long long tx_ns;               /* Out: CAN_TIMED_SENT, when it started on the bus */
+};
+
+
+/*
+ *  TX complete records, CAN_IOCTL_SET_TX_COMPLETE.  With enable set,
+ *  every frame the file write()s afterwards gets a struct
+ *  can_tx_complete_t once it has gone out or been given up on, in the
+ *  file's completion queue, which CAN_IOCTL_GET_TX_COMPLETE empties.
+ *  write() also takes a struct can_tx_write_t, to give the record a
+ *  cookie of the caller's.  A plain CANBUS_MESSAGE has cookie 0.
+ *
+ *  The ISR only fills the record in.  A CAN_IOCTL_GET_TX_COMPLETE
+ *  waiting for records is woken once batch of them are ready, or the
+ *  file has no more frames to go out, not for each one.  The queue holds
+ *  CAN_TX_COMPLETE_MAX, a reader further behind loses the oldest.
+ *
+ *  tx_ns is from the TX mailbox's time stamp, as for CAN_IOCTL_TIMED_WRITE,
+ *  so the time spent queued behind other frames is tx_ns - write_ns.
+ */
+#define CAN_TX_COMPLETE_MAX         256
+
+#define CAN_TX_COMPLETE_SENT        0
+#define CAN_TX_COMPLETE_DROPPED     1       /* policy says why, see CAN_IOCTL_GET_TX_DROPPED */
+
+struct can_tx_complete_config_t {
+
+    unsigned int enable;                    /* For frames written from now on */
+    unsigned int batch;                     /* 1..CAN_TX_COMPLETE_MAX records per wakeup */
+};
+
+#pragma pack(1)
+
+struct can_tx_write_t {
+
+    CANBUS_MESSAGE message;                 /* As for a plain write(), all 8 data bytes */
+    unsigned long long cookie;              /* Back in the frame's struct can_tx_complete_t */
+};
+
+#pragma pack()
+
+struct can_tx_complete_t {
+
+    unsigned long long seq;                 /* Counts the file's records from 0 */
+    unsigned long long cookie;
+    unsigned long long write_ns;            /* When write() queued it, CLOCK_MONOTONIC */
+    unsigned long long tx_ns;               /* SENT: when it started on the bus.  DROPPED: when given up */
+    unsigned int status;                    /* CAN_TX_COMPLETE_xxx */
+    unsigned int policy;                    /* DROPPED: the CAN_TX_xxx that dropped it */
+    unsigned int attempts;                  /* Times it was loaded into the TX mailbox */
+    unsigned int id;                        /* The frame's Id */
+};
+
+/*
+ *  CAN_IOCTL_GET_TX_COMPLETE takes up to max_entries records, oldest
+ *  first.  With wait set it first sleeps until a batch is ready, see
+ *  above, and returns -EINTR if a signal comes first.
+ */
+struct can_tx_complete_request_t {
+
+    unsigned long long entries;             /* In: user pointer to struct can_tx_complete_t[max_entries] */
+    unsigned int max_entries;               /* In */
+    unsigned int wait;                      /* In */
+    unsigned int num_entries;               /* Out */
+    unsigned int in_flight;                 /* Out: frames written with no record yet */
+    unsigned long long lost;                /* Out: records overwritten unread since the last call */
+};
+
+
+/*
+ *  The classes of record a file receives, CAN_IOCTL_SET_CLASSES.  The
+ *  default is CAN_CLASS_DEFAULT, everything in the receive queue as
+ *  before classes existed.
+ *
+ *  - CAN_CLASS_DATA          frames from the bus.
+ *  - CAN_CLASS_STATUS        CANBUS_STATUS_CHANGE records.
+ *  - CAN_CLASS_TX_ECHO       with self reception on, the frames this 
+ *                            device transmitted, coming back.  A received
+ *                            frame is taken as the echo if it is identical
+ *                            to the one last transmitted and not echoed yet.
+ *  - CAN_CLASS_STATUS_EVENT  status changes outside the receive queue.
+ *                            The latest is kept in a struct can_status_t
+ *                            for CAN_IOCTL_GET_STATUS, and the eventfd
+ *                            given to CAN_IOCTL_SET_STATUS_EVENTFD, if 
+ *                            any, is signalled.  -1 removes the eventfd.
+ *
+ *  A file that leaves a class out costs the ISR nothing for it.
+ */
+#define CAN_CLASS_DATA              0x00000001
+#define CAN_CLASS_STATUS            0x00000002
+#define CAN_CLASS_TX_ECHO           0x00000004
+#define CAN_CLASS_STATUS_EVENT      0x00000008
+
+#define CAN_CLASS_DEFAULT           (CAN_CLASS_DATA | CAN_CLASS_STATUS | CAN_CLASS_TX_ECHO)
+
+
+/*
+ *  CAN_IOCTL_GET_STATUS, the last status change a CAN_CLASS_STATUS_EVENT
+ *  file was told about.
+ */
+struct can_status_t {
+
+    unsigned long long count;               /* Status changes seen with CAN_CLASS_STATUS_EVENT on */
+    unsigned long long timestamp_ns;        /* When the latest happened, as capture_ns */
+    CANBUS_STATUS_CHANGE latest;            /* Zero until the first */
 };
 
 
@@ -171,6 +937,32 @@ struct can_file_stats_t {
     unsigned int cur_rx_queue_count;                    /* Depth of our read (rx) queue "now" */
     unsigned int max_rx_queue_count;                    /* High water mark of our read queue */
 
+    struct can_histogram_t isr_to_enqueue_hist;         /* ISR entry to our receive queue, ns */
+    struct can_histogram_t enqueue_to_wakeup_hist;      /* Receive queue to reader running, ns */
+    struct can_histogram_t enqueue_to_copy_hist;        /* Receive queue to copy_to_user() done, ns */
+
+    unsigned long long splice_count;                    /* Total number of splice()s from this file */
+    unsigned long long splice_records;                  /* Frames handed to a pipe as struct can_log_record_t */
+    unsigned long long splice_requeued;                 /* Frames a pipe refused, back on the receive queue */
+
+    struct can_lock_stats_t rx_lock;                    /* Our receive queue */
+
+    unsigned long long group_frames;                    /* Frames handed to us as a consumer group member */
+
+    unsigned long long rx_data;                         /* CAN_CLASS_DATA records queued for us */
+    unsigned long long rx_status;                       /* CAN_CLASS_STATUS records queued for us */
+    unsigned long long rx_tx_echo;                      /* CAN_CLASS_TX_ECHO records queued for us */
+    unsigned long long status_events;                   /* CAN_CLASS_STATUS_EVENT updates */
+    unsigned long long status_coalesced;                /* Status changes ORed into our unread or held back record */
+
+    unsigned long long tx_aborted;                      /* Our frames aborted on an ACK error */
+    unsigned long long tx_retried;                      /* Our aborted frames loaded again */
+    unsigned long long tx_dropped;                      /* Our frames given up on, see CAN_IOCTL_GET_TX_DROPPED */
+
+    unsigned long long tx_complete;                     /* Records put in our completion queue */
+    unsigned long long tx_complete_wakeups;             /* Batches ready, each one wakeup at most */
+    unsigned long long tx_complete_lost;                /* Records overwritten unread */
+
 };
 
 
@@ -8,6 +8,9 @@
  *  use of resources, but again this is the highest priority ISR and 
  *  anything we can do to minimize latency is desirable.
  *
+ *  Each device has its own pool, so one bus running flat out can't
+ *  starve the other, and the two ISRs never share a lock.
+ *
  ***************************************************************************/
 #include "can_private.h"
 
@@ -21,67 +24,52 @@
  */
 #define NUM_MSGS_IN_CHUNK   (CHUNK_SIZE / sizeof(struct kcanbus_message))
 
-/*
- *  Dynamic array of pointers to arrays.
- */
-static struct kcanbus_message **chunk_array = NULL;
-static int num_chunks_allocated;
-
-/*
- *  Our kcanbus message pool itself.  The list head for the 
- *  free linked data structures.
- */
-static struct list_head msg_pool;
-
-/*
- *  We use our own self-contained lock here.
- */
-static spinlock_t msg_pool_lock;
-
-/*
- *  If we run out of messages, don't stream the error.
- *  But also don't spend a lot of time trying not to either.
- */
-static int in_nomem_condition;
-
 
 /*
  *  Our kmalloc() function.  Returns a pointer or NULL.
  */
-struct kcanbus_message * alloc_kcanbus_message(void)
+struct kcanbus_message * alloc_kcanbus_message(struct canbus_device_t *dev)
 {
+    struct can_message_pool *pool = &dev->pool;
     unsigned long flags;
     struct kcanbus_message *msg;
     struct list_head *entry;
 
-    spin_lock_irqsave(&msg_pool_lock, flags);
+    spin_lock_irqsave(&pool->lock, flags);
 
-    if (list_empty(&msg_pool)){
+    if (list_empty(&pool->free_list)){
         /*
          *  Limit the streaming error messages.
          */
-        if (!in_nomem_condition){
-            in_nomem_condition = 1;
-            printk(KERN_ERR "alloc_kcanbus_message Failed!\n");
+        if (!pool->in_nomem_condition){
+            pool->in_nomem_condition = 1;
+            can_event(dev, CAN_EVENT_POOL_EMPTY, 0);
+        }
+        else{
+            can_event_count(dev, CAN_EVENT_POOL_EMPTY);
         }
         msg = NULL;
     }
     else{
-        entry = msg_pool.next;
+        entry = pool->free_list.next;
         list_del_init(entry);
+        pool->free_count--;
         msg = list_entry(entry, struct kcanbus_message, entry);
 
         if (msg->signature != KCANBUS_SIGNATURE){
-            printk(KERN_ERR "Message Signature check Failed! %s %d\n", __FILE__, __LINE__);
+            can_event(dev, CAN_EVENT_MSG_SIGNATURE, __LINE__);
             msg = NULL;
             goto EXIT;
         }
 
+        msg->flags = 0;
+        msg->tx_file = NULL;
+        msg->tx_attempts = 0;
         memset(&msg->user_message, 0, sizeof(CANBUS_MESSAGE));
     }
 
 EXIT:    
-    spin_unlock_irqrestore(&msg_pool_lock, flags);
+    spin_unlock_irqrestore(&pool->lock, flags);
 
     return msg;
 }
@@ -90,9 +78,11 @@ EXIT:
 /*
  *  Our kfree() function.  We verify that it's our memory via
  *  signature or we complain and leave, without touching it.
+ *  The message must go back to the device it came from.
  */
-void free_kcanbus_message(struct kcanbus_message *msg)
+void free_kcanbus_message(struct canbus_device_t *dev, struct kcanbus_message *msg)
 {
+    struct can_message_pool *pool = &dev->pool;
     unsigned long flags;
     struct list_head *entry;
 
@@ -100,62 +90,80 @@ void free_kcanbus_message(struct kcanbus_message *msg)
      *  kfree() accepts NULLs, but we don't expect to.
      */
     if (msg == NULL){
-        printk(KERN_ERR "free_kcanbus_message got a NULL\n");
+        can_event(dev, CAN_EVENT_NULL_FREE, 0);
         return;
     }
 
     if (msg->signature != KCANBUS_SIGNATURE){
-        printk(KERN_ERR "Message Signature check Failed! %s %d\n", 
-                __FILE__, __LINE__);
+        can_event(dev, CAN_EVENT_MSG_SIGNATURE, __LINE__);
         return;
     }
 
     entry = &msg->entry;
 
-    spin_lock_irqsave(&msg_pool_lock, flags);
+    spin_lock_irqsave(&pool->lock, flags);
 
     INIT_LIST_HEAD(entry);
-    list_add(entry, &msg_pool);
-    in_nomem_condition = 0;
+    list_add(entry, &pool->free_list);
+    pool->free_count++;
+    pool->in_nomem_condition = 0;
 
-    spin_unlock_irqrestore(&msg_pool_lock, flags);
+    spin_unlock_irqrestore(&pool->lock, flags);
 }
 
 
 /*
- *  Init the kcanbus message pool.
+ *  Init the device's message pool with exactly max_msg_count messages,
+ *  in chunks of up to NUM_MSGS_IN_CHUNK.  Returns 0 or -ENOMEM, in
+ *  which case nothing is left allocated.
  */
-int init_kcanbus_message_pool(int max_msg_count)
+int init_kcanbus_message_pool(struct canbus_device_t *dev, int max_msg_count)
 {
-    int malloc_size;
+    struct can_message_pool *pool = &dev->pool;
+    int chunk_count;
+    int remaining;
     int i, j;
     struct kcanbus_message *msg;
 
-    INIT_LIST_HEAD(&msg_pool);
-    spin_lock_init(&msg_pool_lock);
+    INIT_LIST_HEAD(&pool->free_list);
+    spin_lock_init(&pool->lock);
+
+    pool->size = 0;
+    pool->free_count = 0;
+    pool->in_nomem_condition = 0;
 
-    malloc_size = max_msg_count * sizeof(struct kcanbus_message);
-    num_chunks_allocated = malloc_size / CHUNK_SIZE;
-    if (malloc_size % CHUNK_SIZE){
-        num_chunks_allocated++;
+    pool->num_chunks = (max_msg_count + NUM_MSGS_IN_CHUNK - 1) / NUM_MSGS_IN_CHUNK;
+
+    pool->chunk_array = kcalloc(pool->num_chunks, sizeof(void *), GFP_KERNEL);
+    if (!pool->chunk_array){
+        pool->num_chunks = 0;
+        return -ENOMEM;
     }
 
-    chunk_array = kmalloc(num_chunks_allocated * sizeof(void *), GFP_KERNEL);
+    remaining = max_msg_count;
+
+    for (i = 0; i<pool->num_chunks; i++){
 
-    for (i = 0; i<num_chunks_allocated; i++){
+        chunk_count = min_t(int, remaining, NUM_MSGS_IN_CHUNK);
 
-        chunk_array[i] = kmalloc(CHUNK_SIZE, GFP_KERNEL);
-        memset(chunk_array[i], 0, CHUNK_SIZE);
-        
-        for (j=0; j<NUM_MSGS_IN_CHUNK; j++){
-            msg = &chunk_array[i][j];
+        pool->chunk_array[i] = kzalloc(chunk_count * sizeof(struct kcanbus_message), GFP_KERNEL);
+        if (!pool->chunk_array[i]){
+            destroy_kcanbus_message_pool(dev);
+            return -ENOMEM;
+        }
+
+        for (j = 0; j<chunk_count; j++){
+            msg = &pool->chunk_array[i][j];
             INIT_LIST_HEAD(&msg->entry);
             msg->signature = KCANBUS_SIGNATURE;
-            list_add(&msg->entry, &msg_pool);
+            list_add(&msg->entry, &pool->free_list);
         }
+
+        remaining -= chunk_count;
     }
 
-    in_nomem_condition = 0;
+    pool->size = max_msg_count;
+    pool->free_count = max_msg_count;
 
     return 0;
 }
@@ -164,18 +172,31 @@ int init_kcanbus_message_pool(int max_msg_count)
 /*
  *  Cleanup
  */
-void destroy_kcanbus_message_pool(void)
+void destroy_kcanbus_message_pool(struct canbus_device_t *dev)
 {
+    struct can_message_pool *pool = &dev->pool;
     int i;
 
-    for (i = 0; i<num_chunks_allocated; i++){
-        if (chunk_array[i])
-            kfree(chunk_array[i]);
+    if (pool->chunk_array){
+        for (i = 0; i<pool->num_chunks; i++){
+            kfree(pool->chunk_array[i]);
+        }
+        kfree(pool->chunk_array);
     }
 
-    if (chunk_array)
-        kfree(chunk_array);
+    pool->chunk_array = NULL;
+    pool->num_chunks = 0;
+    pool->size = 0;
+    pool->free_count = 0;
+    INIT_LIST_HEAD(&pool->free_list);
 }
 
 
-
+/*
+ *  For /proc.  Not locked, it's a snapshot anyway.
+ */
+void kcanbus_message_pool_usage(struct canbus_device_t *dev, int *size, int *free_count)
+{
+    *size = dev->pool.size;
+    *free_count = ACCESS_ONCE(dev->pool.free_count);
+}
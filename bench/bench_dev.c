@@ -0,0 +1,117 @@
+/****************************************************************************
+ *  bench_dev.c
+ *
+ *  ta_canbus_bench backend for the real character device.
+ *
+ ***************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "bench_io.h"
+
+
+static const char *dev_path;
+
+
+
+/*
+ *  Only here so the signal interrupts read(), no SA_RESTART.
+ */
+static void dev_signal_handler(int sig)
+{
+    (void)sig;
+}
+
+
+static int dev_open(void)
+{
+    int fd;
+
+    fd = open(dev_path, O_RDWR);
+
+    return (fd < 0) ? -errno : fd;
+}
+
+
+static void dev_close(int handle)
+{
+    close(handle);
+}
+
+
+static ssize_t dev_read(int handle, CANBUS_MESSAGE *message)
+{
+    ssize_t ret;
+
+    ret = read(handle, message, sizeof(CANBUS_MESSAGE));
+
+    return (ret < 0) ? -errno : ret;
+}
+
+
+static ssize_t dev_write(int handle, const CANBUS_MESSAGE *message)
+{
+    ssize_t ret;
+
+    ret = write(handle, message, sizeof(CANBUS_MESSAGE));
+
+    return (ret < 0) ? -errno : ret;
+}
+
+
+static int dev_ioctl(int handle, unsigned long request, void *arg)
+{
+    int ret;
+
+    ret = ioctl(handle, request, arg);
+
+    return (ret < 0) ? -errno : ret;
+}
+
+
+static void dev_interrupt(pthread_t thread)
+{
+    pthread_kill(thread, SIGUSR1);
+}
+
+
+static void dev_resume(void)
+{
+}
+
+
+static void dev_shutdown(void)
+{
+}
+
+
+static const struct bench_io dev_io = {
+    .name =         "dev",
+    .open =         dev_open,
+    .close =        dev_close,
+    .read =         dev_read,
+    .write =        dev_write,
+    .ioctl =        dev_ioctl,
+    .interrupt =    dev_interrupt,
+    .resume =       dev_resume,
+    .shutdown =     dev_shutdown,
+};
+
+
+const struct bench_io *bench_io_start(const char *device)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dev_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    dev_path = device;
+
+    return &dev_io;
+}
@@ -0,0 +1,53 @@
+/****************************************************************************
+ *  bench_io.h
+ *
+ *  How ta_canbus_bench talks to a driver.  bench_dev.c uses the real
+ *  /dev/ta_canbusN (a board, or a TA_CANBUS_VIRTUAL build), sim/sim_io.c
+ *  calls the driver core directly against the host register model.
+ *
+ *  Handles are small integers.  Errors come back as -errno.
+ *
+ ***************************************************************************/
+#ifndef BENCH_IO_H__
+#define BENCH_IO_H__
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "../TaCanbusApi.h"
+
+
+struct bench_io {
+
+    const char *name;
+
+    int (*open)(void);
+    void (*close)(int handle);
+
+    /*
+     *  One message each.  read() blocks, and returns -EINTR once
+     *  interrupt() has been called for the thread.
+     */
+    ssize_t (*read)(int handle, CANBUS_MESSAGE *message);
+    ssize_t (*write)(int handle, const CANBUS_MESSAGE *message);
+    int (*ioctl)(int handle, unsigned long request, void *arg);
+
+    /*
+     *  Kick a thread out of a blocked read(), and let reads block
+     *  again once all such threads have been joined.
+     */
+    void (*interrupt)(pthread_t thread);
+    void (*resume)(void);
+
+    void (*shutdown)(void);
+};
+
+
+/*
+ *  Each backend provides this.  device is the -d option,
+ *  which a backend is free to ignore.
+ */
+const struct bench_io *bench_io_start(const char *device);
+
+
+#endif
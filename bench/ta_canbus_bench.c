@@ -0,0 +1,825 @@
+/****************************************************************************
+ *  ta_canbus_bench.c
+ *
+ *  Throughput and latency of the character device interface, as JSON
+ *  on stdout so runs can be compared across driver versions.
+ *
+ *  Every frame the bench writes comes back through the driver, by
+ *  loopback (CAN_IOCTL_ENABLE_LOOPBACK) and self reception, so a single
+ *  controller is enough.  Bench frames carry bench_id, a sequence number
+ *  in Data[0..3] and a per phase tag in Data[4..7], anything else read
+ *  (e.g. the vflexcan traffic generator) is skipped.
+ *
+ *  Phases:
+ *
+ *      roundtrip   One file writes a frame and blocks reading it back,
+ *                  one frame at a time.  Latency is write() entry to
+ *                  read() return.
+ *
+ *      scaling     For 1..N reader files, one writer streams frames while
+ *                  each reader thread reads all of them.  The writer stays
+ *                  at most window frames ahead of the slowest reader, so
+ *                  the message pool doesn't run dry.  Latency is write()
+ *                  entry to read() return, over every reader.
+ *
+ *  Syscall counts are the bench's own read() / write() / ioctl() calls.
+ *
+ ***************************************************************************/
+#include <errno.h>
+#include <getopt.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench_io.h"
+
+
+#define BENCH_FORMAT_VERSION    1
+
+/*
+ *  No progress for this long and a phase gives up on the missing frames.
+ */
+#define BENCH_STALL_NS          1000000000ULL
+
+
+typedef unsigned long long u64;
+
+
+struct bench_config {
+
+    const char *device;
+    unsigned long long frames;          /* Per scaling step */
+    unsigned long long rt_frames;       /* Round trips */
+    unsigned int max_readers;
+    unsigned int window;                /* Writer lead over the slowest reader */
+    unsigned int bench_id;              /* 11 bit CAN ID of bench frames */
+    int loopback;                       /* Turn on CAN_IOCTL_ENABLE_LOOPBACK */
+};
+
+
+struct syscall_counts {
+
+    unsigned long long reads;
+    unsigned long long writes;
+    unsigned long long ioctls;
+};
+
+
+struct phase;
+
+struct bench_thread {
+
+    pthread_t thread;
+    struct phase *phase;
+    int handle;
+    unsigned long long frames;          /* Bench frames received or sent */
+    unsigned long long next_seq;        /* Highest sequence seen + 1 */
+    struct syscall_counts calls;
+    struct can_histogram_t latency;
+    u64 finish_ns;
+    int done;
+};
+
+
+struct phase {
+
+    const struct bench_config *cfg;
+    unsigned int tag;
+    unsigned long long frames;
+    u64 *sent_ns;                       /* write() entry time, by sequence */
+    int stop;
+
+    struct bench_thread writer;
+    struct bench_thread *readers;
+    unsigned int num_readers;
+};
+
+
+static const struct bench_io *io;
+static unsigned int ioctl_count;
+
+
+
+static u64 bench_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int bench_ioctl(int handle, unsigned long request, void *arg)
+{
+    ioctl_count++;
+    return io->ioctl(handle, request, arg);
+}
+
+
+
+/****************************************************************************
+ *  The driver's log-linear histogram, see TaCanbusApi.h.
+ */
+static void hist_add(struct can_histogram_t *hist, u64 value)
+{
+    unsigned int bucket;
+    unsigned int shift;
+
+    if (value < CAN_HIST_SUB_BUCKETS){
+        bucket = (unsigned int)value;
+    }
+    else if (value >> 32){
+        bucket = CAN_HIST_NUM_BUCKETS - 1;
+    }
+    else{
+        shift = 31 - __builtin_clz((unsigned int)value) - CAN_HIST_SUB_BITS;
+        bucket = ((shift + 1) << CAN_HIST_SUB_BITS) +
+                    (((unsigned int)value >> shift) & (CAN_HIST_SUB_BUCKETS - 1));
+    }
+
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max){
+        hist->max = value;
+    }
+}
+
+
+static void hist_merge(struct can_histogram_t *to, const struct can_histogram_t *from)
+{
+    int i;
+
+    for (i = 0; i<CAN_HIST_NUM_BUCKETS; i++){
+        to->buckets[i] += from->buckets[i];
+    }
+    to->count += from->count;
+    to->sum += from->sum;
+    if (from->max > to->max){
+        to->max = from->max;
+    }
+}
+
+
+/*
+ *  Upper edge of the bucket holding the per_million'th sample.
+ */
+static u64 hist_percentile(const struct can_histogram_t *hist, unsigned int per_million)
+{
+    unsigned long long rank;
+    unsigned long long seen = 0;
+    int i;
+
+    if (!hist->count){
+        return 0;
+    }
+
+    rank = (hist->count * per_million + 999999) / 1000000;
+    if (!rank){
+        rank = 1;
+    }
+
+    for (i = 0; i<CAN_HIST_NUM_BUCKETS - 1; i++){
+        seen += hist->buckets[i];
+        if (seen >= rank){
+            u64 upper = CAN_HIST_BUCKET_LOWER(i + 1) - 1;
+            return (upper < hist->max) ? upper : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+
+
+/****************************************************************************
+ *  JSON output
+ */
+static void json_latency(const char *name, const struct can_histogram_t *hist, const char *indent)
+{
+    printf( "%s\"%s\": {\"count\": %llu, \"mean\": %llu, \"p50\": %llu, \"p90\": %llu, "
+            "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+            indent, name,
+            hist->count,
+            hist->count ? hist->sum / hist->count : 0,
+            hist_percentile(hist, 500000),
+            hist_percentile(hist, 900000),
+            hist_percentile(hist, 990000),
+            hist_percentile(hist, 999000),
+            hist->max);
+}
+
+
+static void json_syscalls(const struct syscall_counts *calls, unsigned long long frames, const char *indent)
+{
+    unsigned long long total = calls->reads + calls->writes + calls->ioctls;
+
+    printf( "%s\"syscalls\": {\"read\": %llu, \"write\": %llu, \"ioctl\": %llu, "
+            "\"total\": %llu, \"per_frame\": %.3f}",
+            indent, calls->reads, calls->writes, calls->ioctls,
+            total, frames ? (double)total / frames : 0.0);
+}
+
+
+static double per_sec(unsigned long long count, u64 ns)
+{
+    return ns ? (double)count * 1e9 / ns : 0.0;
+}
+
+
+
+/****************************************************************************
+ *  Frames
+ */
+static void make_frame(const struct phase *phase, unsigned long long seq, CANBUS_MESSAGE *message)
+{
+    unsigned int s = (unsigned int)seq;
+
+    memset(message, 0, sizeof(CANBUS_MESSAGE));
+
+    message->Id = (phase->cfg->bench_id & 0x7FF) << 18;
+    message->Type = CmtStandard;
+    message->DataLength = 8;
+    message->Data[0] = (unsigned char)(s >> 24);
+    message->Data[1] = (unsigned char)(s >> 16);
+    message->Data[2] = (unsigned char)(s >> 8);
+    message->Data[3] = (unsigned char)s;
+    message->Data[4] = (unsigned char)(phase->tag >> 24);
+    message->Data[5] = (unsigned char)(phase->tag >> 16);
+    message->Data[6] = (unsigned char)(phase->tag >> 8);
+    message->Data[7] = (unsigned char)phase->tag;
+}
+
+
+/*
+ *  Returns 1 and the sequence number for one of this phase's frames.
+ */
+static int frame_seq(const struct phase *phase, const CANBUS_MESSAGE *message, unsigned long long *seq)
+{
+    const unsigned char *d = message->Data;
+    unsigned int tag;
+
+    if ((message->Id & CANBUS_STATUS_CHANGE_FLAG) == CANBUS_STATUS_CHANGE_FLAG ||
+        message->Type != CmtStandard ||
+        message->Id != (phase->cfg->bench_id & 0x7FF) << 18 ||
+        message->DataLength != 8){
+        return 0;
+    }
+
+    tag = ((unsigned int)d[4] << 24) | ((unsigned int)d[5] << 16) | ((unsigned int)d[6] << 8) | d[7];
+    if (tag != phase->tag){
+        return 0;
+    }
+
+    *seq = ((unsigned int)d[0] << 24) | ((unsigned int)d[1] << 16) | ((unsigned int)d[2] << 8) | d[3];
+
+    return *seq < phase->frames;
+}
+
+
+
+/****************************************************************************
+ *  Threads
+ */
+static void *roundtrip_fn(void *arg)
+{
+    struct bench_thread *t = arg;
+    struct phase *phase = t->phase;
+    CANBUS_MESSAGE message;
+    unsigned long long seq;
+    unsigned long long i;
+    u64 start_ns;
+    ssize_t ret;
+    int matched;
+
+    for (i = 0; i<phase->frames && !__atomic_load_n(&phase->stop, __ATOMIC_ACQUIRE); i++){
+
+        make_frame(phase, i, &message);
+
+        start_ns = bench_ns();
+        ret = io->write(t->handle, &message);
+        t->calls.writes++;
+        if (ret < 0){
+            break;
+        }
+
+        matched = 0;
+        while (!matched && !__atomic_load_n(&phase->stop, __ATOMIC_ACQUIRE)){
+
+            ret = io->read(t->handle, &message);
+            t->calls.reads++;
+
+            if (ret == -EINTR){
+                continue;
+            }
+            if (ret <= 0){
+                break;
+            }
+            matched = frame_seq(phase, &message, &seq) && seq == i;
+        }
+
+        if (!matched){
+            break;
+        }
+
+        hist_add(&t->latency, bench_ns() - start_ns);
+        __atomic_store_n(&t->frames, i + 1, __ATOMIC_RELEASE);
+    }
+
+    t->finish_ns = bench_ns();
+    __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+
+static void *reader_fn(void *arg)
+{
+    struct bench_thread *t = arg;
+    struct phase *phase = t->phase;
+    CANBUS_MESSAGE message;
+    unsigned long long seq;
+    u64 sent_ns;
+    u64 now_ns;
+    ssize_t ret;
+
+    while (t->frames < phase->frames && !__atomic_load_n(&phase->stop, __ATOMIC_ACQUIRE)){
+
+        ret = io->read(t->handle, &message);
+        t->calls.reads++;
+        now_ns = bench_ns();
+
+        if (ret == -EINTR){
+            continue;
+        }
+        if (ret <= 0){
+            break;
+        }
+        if (!frame_seq(phase, &message, &seq)){
+            continue;
+        }
+
+        sent_ns = __atomic_load_n(&phase->sent_ns[seq], __ATOMIC_ACQUIRE);
+        if (sent_ns && now_ns > sent_ns){
+            hist_add(&t->latency, now_ns - sent_ns);
+        }
+
+        __atomic_store_n(&t->frames, t->frames + 1, __ATOMIC_RELEASE);
+        if (seq + 1 > t->next_seq){
+            __atomic_store_n(&t->next_seq, seq + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    t->finish_ns = bench_ns();
+    __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+
+/*
+ *  How far the slowest reader has got.
+ */
+static unsigned long long readers_next_seq(const struct phase *phase)
+{
+    unsigned long long min_seq = ~0ULL;
+    unsigned long long seq;
+    unsigned int i;
+
+    for (i = 0; i<phase->num_readers; i++){
+        seq = __atomic_load_n(&phase->readers[i].next_seq, __ATOMIC_ACQUIRE);
+        if (seq < min_seq){
+            min_seq = seq;
+        }
+    }
+
+    return min_seq;
+}
+
+
+static void *writer_fn(void *arg)
+{
+    struct bench_thread *t = arg;
+    struct phase *phase = t->phase;
+    unsigned int window = phase->cfg->window;
+    CANBUS_MESSAGE message;
+    unsigned long long seq;
+    u64 wait_ns;
+    ssize_t ret;
+
+    for (seq = 0; seq<phase->frames && !__atomic_load_n(&phase->stop, __ATOMIC_ACQUIRE); seq++){
+
+        /*
+         *  Lost frames never come back, so only wait a while.
+         */
+        wait_ns = 0;
+        while (seq >= readers_next_seq(phase) + window &&
+               !__atomic_load_n(&phase->stop, __ATOMIC_ACQUIRE)){
+            if (!wait_ns){
+                wait_ns = bench_ns();
+            }
+            else if (bench_ns() - wait_ns > BENCH_STALL_NS / 10){
+                break;
+            }
+            sched_yield();
+        }
+
+        make_frame(phase, seq, &message);
+
+        __atomic_store_n(&phase->sent_ns[seq], bench_ns(), __ATOMIC_RELEASE);
+        ret = io->write(t->handle, &message);
+        t->calls.writes++;
+        if (ret < 0){
+            break;
+        }
+
+        __atomic_store_n(&t->frames, seq + 1, __ATOMIC_RELEASE);
+    }
+
+    t->finish_ns = bench_ns();
+    __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+
+/*
+ *  Wait for the phase's threads to finish, giving up once nothing has
+ *  moved for BENCH_STALL_NS, then kick any blocked readers and join.
+ */
+static void run_phase(struct phase *phase, struct bench_thread **threads, unsigned int count)
+{
+    unsigned long long progress;
+    unsigned long long last_progress = ~0ULL;
+    u64 last_change_ns = bench_ns();
+    unsigned int done;
+    unsigned int i;
+
+    for (;;){
+
+        progress = 0;
+        done = 0;
+        for (i = 0; i<count; i++){
+            progress += __atomic_load_n(&threads[i]->frames, __ATOMIC_ACQUIRE);
+            done += __atomic_load_n(&threads[i]->done, __ATOMIC_ACQUIRE);
+        }
+
+        if (done == count){
+            break;
+        }
+
+        if (progress != last_progress){
+            last_progress = progress;
+            last_change_ns = bench_ns();
+        }
+        else if (bench_ns() - last_change_ns > BENCH_STALL_NS){
+            break;
+        }
+
+        usleep(1000);
+    }
+
+    __atomic_store_n(&phase->stop, 1, __ATOMIC_RELEASE);
+
+    for (;;){
+        done = 0;
+        for (i = 0; i<count; i++){
+            if (__atomic_load_n(&threads[i]->done, __ATOMIC_ACQUIRE)){
+                done++;
+            }
+            else{
+                io->interrupt(threads[i]->thread);
+            }
+        }
+        if (done == count){
+            break;
+        }
+        usleep(1000);
+    }
+
+    for (i = 0; i<count; i++){
+        pthread_join(threads[i]->thread, NULL);
+    }
+
+    io->resume();
+}
+
+
+
+/****************************************************************************
+ *  Phases
+ */
+static int open_reader(void)
+{
+    int handle;
+
+    handle = io->open();
+    if (handle >= 0){
+        bench_ioctl(handle, CAN_IOCTL_ENABLE_MESSAGE_ACCEPT, NULL);
+    }
+
+    return handle;
+}
+
+
+static unsigned long long device_isr_count(int handle)
+{
+    static struct can_device_stats_t stats;
+
+    if (bench_ioctl(handle, CAN_IOCTL_GET_DEVICE_STATS, &stats) < 0){
+        return 0;
+    }
+
+    return stats.isr_count;
+}
+
+
+static int bench_roundtrip(const struct bench_config *cfg, unsigned int tag)
+{
+    struct phase phase;
+    struct bench_thread *t = &phase.writer;
+    unsigned long long isr_count;
+    unsigned int ioctls;
+    u64 start_ns;
+
+    memset(&phase, 0, sizeof(phase));
+    phase.cfg = cfg;
+    phase.tag = tag;
+    phase.frames = cfg->rt_frames;
+    t->phase = &phase;
+
+    t->handle = open_reader();
+    if (t->handle < 0){
+        fprintf(stderr, "open %s: %s\n", cfg->device, strerror(-t->handle));
+        return -1;
+    }
+
+    ioctls = ioctl_count;
+    isr_count = device_isr_count(t->handle);
+    start_ns = bench_ns();
+
+    pthread_create(&t->thread, NULL, roundtrip_fn, t);
+    run_phase(&phase, &t, 1);
+
+    isr_count = device_isr_count(t->handle) - isr_count;
+    t->calls.ioctls = ioctl_count - ioctls;
+
+    printf("  \"roundtrip\": {\n");
+    printf("    \"frames\": %llu,\n", t->frames);
+    printf("    \"lost\": %llu,\n", phase.frames - t->frames);
+    printf("    \"elapsed_ns\": %llu,\n", t->finish_ns - start_ns);
+    printf("    \"frames_per_sec\": %.1f,\n", per_sec(t->frames, t->finish_ns - start_ns));
+    printf("    \"isr_count\": %llu,\n", isr_count);
+    json_latency("latency_ns", &t->latency, "    ");
+    printf(",\n");
+    json_syscalls(&t->calls, t->frames, "    ");
+    printf("\n  },\n");
+
+    io->close(t->handle);
+
+    return 0;
+}
+
+
+static int bench_scaling_step(const struct bench_config *cfg, unsigned int tag, unsigned int num_readers, int last)
+{
+    struct phase phase;
+    struct bench_thread **threads;
+    struct can_histogram_t *latency;
+    struct syscall_counts calls;
+    unsigned long long received = 0;
+    unsigned long long isr_count;
+    unsigned int ioctls;
+    u64 start_ns;
+    u64 read_end_ns = 0;
+    unsigned int i;
+    int ret = -1;
+
+    memset(&phase, 0, sizeof(phase));
+    phase.cfg = cfg;
+    phase.tag = tag;
+    phase.frames = cfg->frames;
+    phase.num_readers = num_readers;
+    phase.sent_ns = calloc(cfg->frames, sizeof(u64));
+    phase.readers = calloc(num_readers, sizeof(struct bench_thread));
+    threads = calloc(num_readers + 1, sizeof(struct bench_thread *));
+    latency = calloc(1, sizeof(struct can_histogram_t));
+    if (!phase.sent_ns || !phase.readers || !threads || !latency){
+        fprintf(stderr, "out of memory\n");
+        goto FAILED_ALLOC;
+    }
+
+    /*
+     *  The writer doesn't accept messages, its copies would
+     *  only pile up in the pool.
+     */
+    phase.writer.phase = &phase;
+    phase.writer.handle = io->open();
+    if (phase.writer.handle < 0){
+        fprintf(stderr, "open %s: %s\n", cfg->device, strerror(-phase.writer.handle));
+        goto FAILED_ALLOC;
+    }
+
+    for (i = 0; i<num_readers; i++){
+        phase.readers[i].phase = &phase;
+        phase.readers[i].handle = open_reader();
+        if (phase.readers[i].handle < 0){
+            fprintf(stderr, "open %s: %s\n", cfg->device, strerror(-phase.readers[i].handle));
+            goto FAILED_OPEN;
+        }
+    }
+
+    ioctls = ioctl_count;
+    isr_count = device_isr_count(phase.writer.handle);
+    start_ns = bench_ns();
+
+    for (i = 0; i<num_readers; i++){
+        threads[i] = &phase.readers[i];
+        pthread_create(&threads[i]->thread, NULL, reader_fn, threads[i]);
+    }
+    threads[num_readers] = &phase.writer;
+    pthread_create(&phase.writer.thread, NULL, writer_fn, &phase.writer);
+
+    run_phase(&phase, threads, num_readers + 1);
+
+    isr_count = device_isr_count(phase.writer.handle) - isr_count;
+
+    memset(&calls, 0, sizeof(calls));
+    calls.writes = phase.writer.calls.writes;
+    calls.ioctls = ioctl_count - ioctls;
+    for (i = 0; i<num_readers; i++){
+        calls.reads += phase.readers[i].calls.reads;
+        received += phase.readers[i].frames;
+        hist_merge(latency, &phase.readers[i].latency);
+        if (phase.readers[i].finish_ns > read_end_ns){
+            read_end_ns = phase.readers[i].finish_ns;
+        }
+    }
+
+    printf("    {\n");
+    printf("      \"readers\": %u,\n", num_readers);
+    printf("      \"frames_written\": %llu,\n", phase.writer.frames);
+    printf("      \"frames_read\": %llu,\n", received);
+    printf("      \"lost\": %llu,\n", phase.writer.frames * num_readers - received);
+    printf("      \"write_frames_per_sec\": %.1f,\n",
+            per_sec(phase.writer.frames, phase.writer.finish_ns - start_ns));
+    printf("      \"read_frames_per_sec\": %.1f,\n", per_sec(received, read_end_ns - start_ns));
+    printf("      \"read_frames_per_sec_per_reader\": %.1f,\n",
+            per_sec(received, read_end_ns - start_ns) / num_readers);
+    printf("      \"isr_count\": %llu,\n", isr_count);
+    json_latency("latency_ns", latency, "      ");
+    printf(",\n");
+    json_syscalls(&calls, received, "      ");
+    printf("\n    }%s\n", last ? "" : ",");
+
+    ret = 0;
+
+FAILED_OPEN:
+    while (i-- > 0){
+        io->close(phase.readers[i].handle);
+    }
+    io->close(phase.writer.handle);
+
+FAILED_ALLOC:
+    free(latency);
+    free(threads);
+    free(phase.readers);
+    free(phase.sent_ns);
+
+    return ret;
+}
+
+
+static void json_driver_version(void)
+{
+    char version[64] = "";
+    FILE *f;
+
+    f = fopen("/sys/module/ta_canbus/version", "r");
+    if (f){
+        if (fgets(version, sizeof(version), f)){
+            version[strcspn(version, "\n")] = 0;
+        }
+        fclose(f);
+    }
+
+    if (version[0]){
+        printf("  \"driver_version\": \"%s\",\n", version);
+    }
+    else{
+        printf("  \"driver_version\": null,\n");
+    }
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -d device    character device (default /dev/ta_canbus0)\n"
+        "  -n frames    frames per scaling step (default 100000)\n"
+        "  -l frames    round trips (default 10000)\n"
+        "  -r readers   scale from 1 to this many readers (default 4)\n"
+        "  -w window    writer lead over the slowest reader (default 256)\n"
+        "  -i id        11 bit CAN ID of bench frames (default 0x7E5)\n"
+        "  -L           leave loopback off, another node must ack\n",
+        name);
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct bench_config cfg = {
+        .device = "/dev/ta_canbus0",
+        .frames = 100000,
+        .rt_frames = 10000,
+        .max_readers = 4,
+        .window = 256,
+        .bench_id = 0x7E5,
+        .loopback = 1,
+    };
+    unsigned int tag;
+    unsigned int readers;
+    int control;
+    int ret = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:n:l:r:w:i:Lh")) != -1){
+
+        switch (c){
+            case 'd': cfg.device = optarg; break;
+            case 'n': cfg.frames = strtoull(optarg, NULL, 0); break;
+            case 'l': cfg.rt_frames = strtoull(optarg, NULL, 0); break;
+            case 'r': cfg.max_readers = strtoul(optarg, NULL, 0); break;
+            case 'w': cfg.window = strtoul(optarg, NULL, 0); break;
+            case 'i': cfg.bench_id = strtoul(optarg, NULL, 0); break;
+            case 'L': cfg.loopback = 0; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (!cfg.frames || !cfg.window || !cfg.max_readers){
+        usage(argv[0]);
+        return 2;
+    }
+
+    io = bench_io_start(cfg.device);
+    if (!io){
+        return 1;
+    }
+
+    /*
+     *  Loopback and self reception are device wide,
+     *  this handle holds them for the run.
+     */
+    control = io->open();
+    if (control < 0){
+        fprintf(stderr, "open %s: %s\n", cfg.device, strerror(-control));
+        io->shutdown();
+        return 1;
+    }
+
+    if (cfg.loopback){
+        bench_ioctl(control, CAN_IOCTL_ENABLE_LOOPBACK, NULL);
+    }
+    bench_ioctl(control, CAN_IOCTL_ENABLE_SELF_RECEPTION, NULL);
+
+    tag = (unsigned int)bench_ns();
+
+    printf("{\n");
+    printf("  \"format_version\": %d,\n", BENCH_FORMAT_VERSION);
+    printf("  \"backend\": \"%s\",\n", io->name);
+    printf("  \"device\": \"%s\",\n", cfg.device);
+    json_driver_version();
+    printf( "  \"config\": {\"frames\": %llu, \"roundtrip_frames\": %llu, \"max_readers\": %u, "
+            "\"window\": %u, \"bench_id\": %u, \"loopback\": %s},\n",
+            cfg.frames, cfg.rt_frames, cfg.max_readers, cfg.window, cfg.bench_id,
+            cfg.loopback ? "true" : "false");
+
+    if (cfg.rt_frames){
+        ret = bench_roundtrip(&cfg, tag++);
+    }
+
+    printf("  \"scaling\": [\n");
+    for (readers = 1; readers <= cfg.max_readers && !ret; readers++){
+        ret = bench_scaling_step(&cfg, tag++, readers, readers == cfg.max_readers);
+    }
+    printf("  ]\n");
+    printf("}\n");
+
+    bench_ioctl(control, CAN_IOCTL_DISABLE_SELF_RECEPTION, NULL);
+    if (cfg.loopback){
+        bench_ioctl(control, CAN_IOCTL_DISABLE_LOOPBACK, NULL);
+    }
+    io->close(control);
+
+    io->shutdown();
+
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,268 @@
+/****************************************************************************
+ *  busload.c
+ *
+ *  Bus load estimator.  Every frame we receive or finish transmitting
+ *  adds its on-wire bit count to the current 100 ms slot of a ring.
+ *  The 100 ms, 1 s and 10 s windows are summed from the ring only when
+ *  somebody asks, so the ISR cost is one frame length calculation and
+ *  two adds per frame.
+ *
+ *  Frame length is the full on-wire length:  SOF, arbitration, control,
+ *  data, CRC, delimiters, ACK, EOF and the 3 bit intermission.  Stuff bits
+ *  are either the worst case for the frame's length (the default) or,
+ *  with busload_exact_stuffing=1, counted from the actual bit stream
+ *  including the CRC.
+ *
+ ***************************************************************************/
+#include <linux/math64.h>
+
+#include "can_private.h"
+
+
+static bool busload_exact_stuffing;
+module_param(busload_exact_stuffing, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(busload_exact_stuffing,
+                "Count real stuff bits for bus load instead of the worst case (costs ~1us per frame)");
+
+
+/*
+ *  Fixed overhead after the stuffed part of a frame:
+ *  CRC delimiter (1), ACK slot + delimiter (2), EOF (7), intermission (3).
+ */
+#define FRAME_TAIL_BITS         13
+
+/*
+ *  Length of the stuffed part (SOF through CRC) without data.
+ */
+#define STANDARD_STUFFED_BITS   34
+#define EXTENDED_STUFFED_BITS   54
+
+#define CAN_CRC15_POLY          0x4599
+
+
+/*
+ *  Collects the stuffed part of the frame, MSB first, and runs the
+ *  CRC over it as it goes.
+ */
+struct frame_bits {
+    unsigned char bit[EXTENDED_STUFFED_BITS + 64];
+    unsigned int len;
+    unsigned int crc;
+};
+
+
+static void put_bits(struct frame_bits *fb, unsigned int value, int count, int crc)
+{
+    unsigned int b;
+
+    while (count--){
+
+        b = (value >> count) & 0x1;
+        fb->bit[fb->len++] = b;
+
+        if (crc){
+            if (b ^ ((fb->crc >> 14) & 0x1)){
+                fb->crc = ((fb->crc << 1) ^ CAN_CRC15_POLY) & 0x7FFF;
+            }
+            else{
+                fb->crc = (fb->crc << 1) & 0x7FFF;
+            }
+        }
+    }
+}
+
+
+/**
+ *  Build the real bit stream and count the stuff bits in it.
+ */
+static unsigned int count_stuff_bits(const CANBUS_MESSAGE *message, unsigned int dlc)
+{
+    struct frame_bits fb;
+    unsigned int id;
+    unsigned int i;
+    unsigned int run;
+    unsigned int prev;
+    unsigned int stuff = 0;
+
+    fb.len = 0;
+    fb.crc = 0;
+
+    put_bits(&fb, 0, 1, 1);                             /* SOF */
+
+    if (message->Type == CmtExtended){
+        id = message->Id & 0x1FFFFFFF;
+        put_bits(&fb, id >> 18, 11, 1);                 /* Base ID */
+        put_bits(&fb, 0x3, 2, 1);                       /* SRR, IDE */
+        put_bits(&fb, id & 0x3FFFF, 18, 1);             /* Extended ID */
+        put_bits(&fb, 0, 3, 1);                         /* RTR, r1, r0 */
+    }
+    else{
+        id = (message->Id & MB_ID_STANDARD_MASK) >> 18;
+        put_bits(&fb, id, 11, 1);                       /* ID */
+        put_bits(&fb, 0, 3, 1);                         /* RTR, IDE, r0 */
+    }
+
+    put_bits(&fb, dlc, 4, 1);
+
+    for (i = 0; i<dlc; i++){
+        put_bits(&fb, message->Data[i], 8, 1);
+    }
+
+    put_bits(&fb, fb.crc, 15, 0);
+
+    /*
+     *  After 5 equal bits the transmitter inserts the complement,
+     *  which then starts the next run.
+     */
+    prev = fb.bit[0];
+    run = 1;
+
+    for (i = 1; i<fb.len; i++){
+
+        if (fb.bit[i] == prev){
+            run++;
+            if (run == 5){
+                stuff++;
+                prev = !prev;
+                run = 1;
+            }
+        }
+        else{
+            prev = fb.bit[i];
+            run = 1;
+        }
+    }
+
+    return stuff;
+}
+
+
+/**
+ *  On-wire length of a data frame in bits.
+ */
+unsigned int can_frame_bits(const CANBUS_MESSAGE *message)
+{
+    unsigned int dlc;
+    unsigned int stuffed;
+    unsigned int stuff;
+
+    dlc = (message->DataLength > 8) ? 8 : message->DataLength;
+
+    if (message->Type == CmtExtended){
+        stuffed = EXTENDED_STUFFED_BITS + 8 * dlc;
+    }
+    else{
+        stuffed = STANDARD_STUFFED_BITS + 8 * dlc;
+    }
+
+    if (busload_exact_stuffing){
+        stuff = count_stuff_bits(message, dlc);
+    }
+    else{
+        stuff = (stuffed - 1) / 4;
+    }
+
+    return stuffed + stuff + FRAME_TAIL_BITS;
+}
+
+
+/*
+ *  Move the ring forward to the slot that now_ns falls in,
+ *  zeroing every slot we skip over.
+ */
+static void advance_busload(struct can_busload_ring *load, u64 now_ns)
+{
+    u64 elapsed;
+    unsigned int slots;
+
+    if (now_ns < load->slot_start_ns + BUSLOAD_SLOT_NS){
+        return;
+    }
+
+    elapsed = now_ns - load->slot_start_ns;
+
+    if (elapsed >= (u64)BUSLOAD_SLOT_NS * BUSLOAD_NUM_SLOTS){
+        memset(load->bits, 0, sizeof(load->bits));
+        memset(load->frames, 0, sizeof(load->frames));
+        load->slot_start_ns = now_ns;
+        return;
+    }
+
+    slots = (unsigned int)div_u64(elapsed, BUSLOAD_SLOT_NS);
+
+    load->slot_start_ns += (u64)slots * BUSLOAD_SLOT_NS;
+
+    while (slots--){
+        load->cur = (load->cur + 1) % BUSLOAD_NUM_SLOTS;
+        load->bits[load->cur] = 0;
+        load->frames[load->cur] = 0;
+    }
+}
+
+
+/**
+ *  Account for one frame on the wire.  ISR, with the register lock held.
+ */
+void can_busload_add(struct canbus_device_t *dev, unsigned int bits, u64 now_ns)
+{
+    struct can_busload_ring *load = &dev->busload;
+
+    advance_busload(load, now_ns);
+
+    load->bits[load->cur] += bits;
+    load->frames[load->cur]++;
+
+    dev->stats.total_bus_bits += bits;
+}
+
+
+/*
+ *  Sum the last num_slots completed slots.
+ */
+static void fill_window(struct can_busload_ring *load,
+                        unsigned int bitrate,
+                        unsigned int num_slots,
+                        struct can_bus_load_t *window)
+{
+    u64 bits = 0;
+    u64 frames = 0;
+    u64 window_ms = (u64)num_slots * (BUSLOAD_SLOT_NS / NSEC_PER_MSEC);
+    unsigned int slot = load->cur;
+    unsigned int i;
+
+    for (i = 0; i<num_slots; i++){
+        slot = (slot + BUSLOAD_NUM_SLOTS - 1) % BUSLOAD_NUM_SLOTS;
+        bits += load->bits[slot];
+        frames += load->frames[slot];
+    }
+
+    window->bits_per_sec = (unsigned int)div64_u64(bits * 1000, window_ms);
+    window->frames_per_sec = (unsigned int)div64_u64(frames * 1000, window_ms);
+
+    if (bitrate){
+        window->utilization_x100 = (unsigned int)div64_u64(bits * 1000 * 10000,
+                                                        window_ms * bitrate);
+    }
+    else{
+        window->utilization_x100 = 0;
+    }
+}
+
+
+/**
+ *  Compute the 100 ms, 1 s and 10 s windows as of now.
+ *  Caller must hold the register lock.
+ */
+void can_busload_fill(  struct canbus_device_t *dev, 
+                        struct can_bus_load_t *load_100ms,
+                        struct can_bus_load_t *load_1s,
+                        struct can_bus_load_t *load_10s)
+{
+    struct can_busload_ring *load = &dev->busload;
+
+    advance_busload(load, can_clock_ns());
+
+    fill_window(load, dev->bitrate, 1, load_100ms);
+    fill_window(load, dev->bitrate, 10, load_1s);
+    fill_window(load, dev->bitrate, BUSLOAD_NUM_SLOTS - 1, load_10s);
+}
@@ -0,0 +1,140 @@
+/****************************************************************************
+ *  can_devices.c
+ *
+ *  Which controllers we have.  Each probed Flexcan takes the lowest free
+ *  index, which is its minor number and the N in /dev/ta_canbusN and
+ *  /proc/ta_canbusN.  Everything else about a controller lives in its
+ *  canbus_device_t, so the controllers run independently, their ISRs
+ *  included.
+ *
+ *  A controller takes its index as soon as probe starts, but other
+ *  controllers' routes only find it with can_device_lookup() once it is
+ *  registered, fully set up.
+ *
+ ***************************************************************************/
+#include "can_private.h"
+
+
+static struct canbus_device_t *can_devices[CAN_MAX_DEVICES];   /* Registered */
+static struct canbus_device_t *can_indexes[CAN_MAX_DEVICES];   /* Registered or still probing */
+DEFINE_SPINLOCK(can_devices_lock);
+
+
+/**
+ *  Give dev an index and a name.  Returns 0, or -ENOSPC if
+ *  CAN_MAX_DEVICES are already probed.
+ */
+int can_device_reserve(struct canbus_device_t *dev)
+{
+    unsigned long flags;
+    int err = -ENOSPC;
+    int i;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    spin_lock_irqsave(&can_devices_lock, flags);
+
+    for (i = 0; i<CAN_MAX_DEVICES; i++){
+        if (!can_indexes[i]){
+            can_indexes[i] = dev;
+            dev->index = i;
+            err = 0;
+            break;
+        }
+    }
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    spin_unlock_irqrestore(&can_devices_lock, flags);
+
+    if (!err){
+        snprintf(dev->name, sizeof(dev->name), DEVICE_NAME "%d", dev->index);
+    }
+
+    return err;
+}
+
+
+/**
+ *  dev is ready for other devices to route to.
+ */
+void can_device_register(struct canbus_device_t *dev)
+{
+    unsigned long flags;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    spin_lock_irqsave(&can_devices_lock, flags);
+
+    can_devices[dev->index] = dev;
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    spin_unlock_irqrestore(&can_devices_lock, flags);
+}
+
+
+/**
+ *  No new routes to dev.  It keeps its index.
+ */
+void can_device_unregister(struct canbus_device_t *dev)
+{
+    unsigned long flags;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    spin_lock_irqsave(&can_devices_lock, flags);
+
+    if (dev->index >= 0 && dev->index < CAN_MAX_DEVICES && can_devices[dev->index] == dev){
+        can_devices[dev->index] = NULL;
+    }
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    spin_unlock_irqrestore(&can_devices_lock, flags);
+}
+
+
+/**
+ *  dev is going, another probe may have its index.
+ */
+void can_device_release(struct canbus_device_t *dev)
+{
+    unsigned long flags;
+
+    can_device_unregister(dev);
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    spin_lock_irqsave(&can_devices_lock, flags);
+
+    if (dev->index >= 0 && dev->index < CAN_MAX_DEVICES && can_indexes[dev->index] == dev){
+        can_indexes[dev->index] = NULL;
+    }
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    spin_unlock_irqrestore(&can_devices_lock, flags);
+}
+
+
+/**
+ *  The registered device with minor number index, or NULL.  Caller holds 
+ *  can_devices_lock, and the device is only good until it drops it.
+ */
+struct canbus_device_t *can_device_lookup(int index)
+{
+    if (index < 0 || index >= CAN_MAX_DEVICES){
+        return NULL;
+    }
+
+    return can_devices[index];
+}
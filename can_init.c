@@ -6,14 +6,32 @@
  *  driver provides a char driver API, not a network API.
  *
  ***************************************************************************/
+#include <linux/device.h>
+
 #include "can_private.h"
 
 
+/*
+ *  Messages in each device's pool.
+ */
+#define CAN_MESSAGE_POOL_SIZE   10000
+
+
+/*
+ *  One chrdev region and class for all the devices, minor N is
+ *  /dev/ta_canbusN, see can_devices.c.
+ */
+static dev_t can_devno_base;
+static struct class *can_class;
+
+
 struct file_operations canbus_fops = {
     .owner =            THIS_MODULE,
     .read =             can_read,
     .write =            can_write,
     .unlocked_ioctl =   can_ioctl,
+    .mmap =             can_mmap,
+    .splice_read =      can_splice_read,
     .llseek =           no_llseek,
     .open =             can_open,
     .release =          can_release,    /* when the file struct is freed - TODO - fork / dup? */
@@ -32,6 +50,9 @@ MODULE_DEVICE_TABLE(of, flexcan_of_match);
 
 static const struct platform_device_id flexcan_id_table[] = {
     { .name = "flexcan", },
+#ifdef TA_CANBUS_VIRTUAL
+    { .name = "vflexcan", },
+#endif
     { /* sentinel */ },
 };
 MODULE_DEVICE_TABLE(platform, flexcan_id_table);
@@ -58,24 +79,36 @@ static int flexcan_probe(struct platform_device *pdev)
     memset(dev, 0, sizeof(struct canbus_device_t));
     dev->signature = CANBUS_DEVICE_SIGNATURE;
 
-    err = alloc_chrdev_region(&dev->devno, 0, 1, DEVICE_NAME);
-    if (err < 0){
+    err = can_device_reserve(dev);
+    if (err){
         printk( KERN_ERR PRINTK_DEV_NAME 
-                "Failed alloc_chrdev_region() = %d\n", err);
-        goto FAILED_ALLOC_CHRDEV_REGION;
+                "Failed, already driving %d devices\n", CAN_MAX_DEVICES);
+        goto FAILED_DEVICE_RESERVE;
     }
 
+    dev->devno = MKDEV(MAJOR(can_devno_base), dev->index);
     dev->major_dev_number = MAJOR(dev->devno);
 
-    printk( KERN_INFO PRINTK_DEV_NAME "devno=%d major_dev_num=%d\n",
-            dev->devno, dev->major_dev_number);
+    printk( KERN_INFO PRINTK_DEV_NAME "%s devno=%d major_dev_num=%d\n",
+            dev->name, dev->devno, dev->major_dev_number);
 
-    spin_lock_init(&dev->register_lock);
+    can_lock_init(&dev->register_lock);
+    can_lock_init(&dev->tx_lock);
+    can_lock_init(&dev->reader_lock);
 
-    INIT_LIST_HEAD(&dev->transmit_queue);
     INIT_LIST_HEAD(&dev->reader_list);
+    init_can_tx(dev);
+    init_can_cyclic(dev);
+    init_can_timed(dev);
+    init_can_errstate(dev);
+    init_can_gateway(dev);
+    init_can_groups(dev);
+    init_can_capture(dev);
 
-    err = init_kcanbus_message_pool(10000);
+    init_can_event_log(dev);
+    init_can_status(dev);
+
+    err = init_kcanbus_message_pool(dev, CAN_MESSAGE_POOL_SIZE);
 
     if(err){
         printk(KERN_ERR PRINTK_DEV_NAME "Failed allocating canbus message pool!\n");
@@ -83,6 +116,38 @@ static int flexcan_probe(struct platform_device *pdev)
         goto FAILED_KMEM_CACHE_CREATE;
     }
 
+    err = init_can_idstats(dev);
+
+    if(err){
+        printk(KERN_ERR PRINTK_DEV_NAME "Failed allocating per ID statistics!\n");
+        goto FAILED_INIT_IDSTATS;
+    }
+
+    err = init_can_history(dev);
+
+    if(err){
+        printk(KERN_ERR PRINTK_DEV_NAME "Failed allocating the history ring!\n");
+        goto FAILED_INIT_HISTORY;
+    }
+
+    /*
+     *  The virtual Flexcan has RAM for registers and a timer for an
+     *  interrupt, none of the platform resources below exist.
+     */
+    if (vflexcan_is_virtual(pdev)){
+
+        err = vflexcan_attach(pdev, dev);
+        if (err){
+            printk(KERN_ERR PRINTK_DEV_NAME "Failed attaching the virtual Flexcan %d\n", err);
+            goto FAILED_DEVM_PINCTRL_GET_SELECT_DEFAULT;
+        }
+
+        platform_set_drvdata(pdev, dev);
+        dev->pdev = pdev;
+
+        goto HARDWARE_READY;
+    }
+
     /*
      *  Enable the correct TX / RX pins for CANbus 
      *  as defined by the dev tree.
@@ -200,7 +265,7 @@ static int flexcan_probe(struct platform_device *pdev)
                         IRQF_SHARED, /* needed? */
                         /*IRQF_SHARED | IRQF_ONESHOT, needed? */
                         /*IRQF_ONESHOT,  needed? */
-                        DEVICE_NAME,
+                        dev->name,
                         dev);
     if (err){
         printk( KERN_ERR PRINTK_DEV_NAME 
@@ -208,6 +273,8 @@ static int flexcan_probe(struct platform_device *pdev)
         goto FAILED_REQUEST_THREADED_IRQ;
     }
 
+HARDWARE_READY:
+
     /*
      *  Set up the Flexcan module itself.
      */
@@ -225,6 +292,12 @@ static int flexcan_probe(struct platform_device *pdev)
         }
     }
 
+    /*
+     *  Other devices may route to us from here on, and may already
+     *  have by the time cdev_add() fails.
+     */
+    can_device_register(dev);
+
     /*
      *  Do this last!  After cdev_add(), we are live!
      */
@@ -237,10 +310,17 @@ static int flexcan_probe(struct platform_device *pdev)
         goto FAILED_CDEV_ADD;
     }
 
+    dev->class_dev = device_create(can_class, &pdev->dev, dev->devno, dev, "%s", dev->name);
+    if (IS_ERR(dev->class_dev)){
+        err = PTR_ERR(dev->class_dev);
+        printk(KERN_ERR PRINTK_DEV_NAME "Failed device_create() %d\n", err);
+        goto FAILED_DEVICE_CREATE;
+    }
+
     add_can_proc_files(dev);
 
-    dev_info(&pdev->dev, "device registered (reg_base=%p, irq=%d)\n",
-         dev->registers, dev->irq);
+    dev_info(&pdev->dev, "%s registered (reg_base=%p, irq=%d)\n",
+         dev->name, dev->registers, dev->irq);
 
     return 0;
 
@@ -249,7 +329,26 @@ static int flexcan_probe(struct platform_device *pdev)
  *  Error cases and cleanup.
  */
 
+/*
+ *  Stop other devices routing to us before anything goes away.
+ */
+FAILED_DEVICE_CREATE:
+    can_device_unregister(dev);
+    destroy_can_gateway(dev);
+    cdev_del(&dev->cdev);
+    goto FAILED_UNREGISTERED;
+
 FAILED_CDEV_ADD:
+    can_device_unregister(dev);
+    destroy_can_gateway(dev);
+
+FAILED_UNREGISTERED:
+    if (dev->vflexcan){
+        vflexcan_detach(dev);
+        platform_set_drvdata(pdev, NULL);
+        goto FAILED_DEVM_PINCTRL_GET_SELECT_DEFAULT;
+    }
+
     free_irq(dev->irq, dev);
 
 FAILED_REQUEST_THREADED_IRQ:
@@ -280,12 +379,25 @@ FAILED_GET_MEM_RESOURCE_SIZE:
 FAILED_GET_MEM_RESOURCE:
 FAILED_CLOCK:
 FAILED_DEVM_PINCTRL_GET_SELECT_DEFAULT:
-    destroy_kcanbus_message_pool();
+    destroy_can_capture(dev);
+    destroy_can_history(dev);
 
-FAILED_KMEM_CACHE_CREATE:
-    unregister_chrdev_region(dev->devno, 1);
+FAILED_INIT_HISTORY:
+    destroy_can_idstats(dev);
 
-FAILED_ALLOC_CHRDEV_REGION:
+FAILED_INIT_IDSTATS:
+    destroy_kcanbus_message_pool(dev);
+
+FAILED_KMEM_CACHE_CREATE:
+    destroy_can_errstate(dev);
+    destroy_can_cyclic(dev);
+    destroy_can_timed(dev);
+    destroy_can_tx(dev);
+    destroy_can_status(dev);
+    destroy_can_event_log(dev);
+    can_device_release(dev);
+
+FAILED_DEVICE_RESERVE:
     kfree(dev);
 
 FAILED_KMALLOC:
@@ -303,11 +415,24 @@ static int flexcan_remove(struct platform_device *pdev)
         return -1;
     }
 
+    /*
+     *  Stop other devices routing to us before anything goes away.
+     */
+    can_device_unregister(dev);
+    destroy_can_gateway(dev);
+
     remove_can_proc_files(dev);
 
+    device_destroy(can_class, dev->devno);
+
     cdev_del(&dev->cdev);
 
-    free_irq(dev->irq, dev);
+    if (dev->vflexcan){
+        vflexcan_detach(dev);
+    }
+    else{
+        free_irq(dev->irq, dev);
+    }
     platform_set_drvdata(pdev, NULL);
     clk_disable_unprepare(dev->clk_per);
     clk_disable_unprepare(dev->clk_ipg);
@@ -331,9 +456,33 @@ static int flexcan_remove(struct platform_device *pdev)
                             dev->mem_size);
     }
 
-    destroy_kcanbus_message_pool();
+    destroy_can_capture(dev);
+
+    destroy_can_history(dev);
+
+    destroy_can_idstats(dev);
+
+    destroy_can_status(dev);
+
+    destroy_can_errstate(dev);
+
+    destroy_can_cyclic(dev);
+
+    destroy_can_timed(dev);
+
+    destroy_can_tx(dev);
+
+    /*
+     *  Files closed just now are freed a grace period later, and give
+     *  their queued messages back to our pool.
+     */
+    rcu_barrier();
+
+    destroy_kcanbus_message_pool(dev);
+
+    destroy_can_event_log(dev);
 
-    unregister_chrdev_region(dev->devno, 1);
+    can_device_release(dev);
 
     kfree(dev);
 
@@ -351,7 +500,68 @@ static struct platform_driver flexcan_driver = {
     .remove = flexcan_remove,
     .id_table = flexcan_id_table,
 };
-module_platform_driver(flexcan_driver);
+
+
+/*
+ *  Not module_platform_driver(), the devices share a chrdev region
+ *  and class, and TA_CANBUS_VIRTUAL builds also register the virtual
+ *  Flexcans here.
+ */
+static int __init flexcan_init(void)
+{
+    int err;
+
+    err = alloc_chrdev_region(&can_devno_base, 0, CAN_MAX_DEVICES, DEVICE_NAME);
+    if (err < 0){
+        printk( KERN_ERR PRINTK_DEV_NAME 
+                "Failed alloc_chrdev_region() = %d\n", err);
+        goto FAILED_ALLOC_CHRDEV_REGION;
+    }
+
+    can_class = class_create(THIS_MODULE, DEVICE_NAME);
+    if (IS_ERR(can_class)){
+        err = PTR_ERR(can_class);
+        printk(KERN_ERR PRINTK_DEV_NAME "Failed class_create() = %d\n", err);
+        goto FAILED_CLASS_CREATE;
+    }
+
+    err = platform_driver_register(&flexcan_driver);
+    if (err){
+        goto FAILED_DRIVER_REGISTER;
+    }
+
+    err = vflexcan_register_devices();
+    if (err){
+        goto FAILED_VFLEXCAN_REGISTER;
+    }
+
+    return 0;
+
+
+FAILED_VFLEXCAN_REGISTER:
+    platform_driver_unregister(&flexcan_driver);
+
+FAILED_DRIVER_REGISTER:
+    class_destroy(can_class);
+
+FAILED_CLASS_CREATE:
+    unregister_chrdev_region(can_devno_base, CAN_MAX_DEVICES);
+
+FAILED_ALLOC_CHRDEV_REGION:
+    return err;
+}
+module_init(flexcan_init);
+
+
+static void __exit flexcan_exit(void)
+{
+    vflexcan_unregister_devices();
+    platform_driver_unregister(&flexcan_driver);
+    rcu_barrier();
+    class_destroy(can_class);
+    unregister_chrdev_region(can_devno_base, CAN_MAX_DEVICES);
+}
+module_exit(flexcan_exit);
 
 
 MODULE_AUTHOR(  "Michael Becker <mbecker@tainstruments.com>");
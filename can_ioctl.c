@@ -9,6 +9,9 @@
 #include "can_private.h"
 
 
+#define CAN_CLASSES     (CAN_CLASS_DATA | CAN_CLASS_STATUS | CAN_CLASS_TX_ECHO | CAN_CLASS_STATUS_EVENT)
+
+
 /* 
  * unlocked_ioctl 
  */
@@ -16,8 +19,14 @@ long can_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
     struct canbus_file_t *file;
     struct canbus_device_t *dev;
+    struct can_device_stats_t *dev_stats;
+    struct can_status_t status;
+    struct eventfd_ctx *eventfd;
+    unsigned int classes;
+    int fd;
     unsigned int reg;
     unsigned long flags;
+    long ret;
 
     /*
      *  Recover our file and device data.  Sanity check it.
@@ -125,14 +134,14 @@ long can_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
             /*
              *  LOCK --------------------------------------------------------
              */
-            spin_lock_irqsave(&dev->register_lock, flags);
+            can_lock_irqsave(&dev->register_lock, flags);
 
             hw_enable_loopback_mode(dev);
 
             /*
              *  UNLOCK --------------------------------------------------------
              */
-            spin_unlock_irqrestore(&dev->register_lock, flags);
+            can_unlock_irqrestore(&dev->register_lock, flags);
             break;
 
 
@@ -140,14 +149,14 @@ long can_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
             /*
              *  LOCK --------------------------------------------------------
              */
-            spin_lock_irqsave(&dev->register_lock, flags);
+            can_lock_irqsave(&dev->register_lock, flags);
 
             hw_disable_loopback_mode(dev);
 
             /*
              *  UNLOCK --------------------------------------------------------
              */
-            spin_unlock_irqrestore(&dev->register_lock, flags);
+            can_unlock_irqrestore(&dev->register_lock, flags);
             break;
 
 
@@ -155,14 +164,14 @@ long can_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
             /*
              *  LOCK --------------------------------------------------------
              */
-            spin_lock_irqsave(&dev->register_lock, flags);
+            can_lock_irqsave(&dev->register_lock, flags);
 
             hw_enable_self_reception(dev);
 
             /*
              *  UNLOCK --------------------------------------------------------
              */
-            spin_unlock_irqrestore(&dev->register_lock, flags);
+            can_unlock_irqrestore(&dev->register_lock, flags);
             break;
 
 
@@ -170,14 +179,14 @@ long can_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
             /*
              *  LOCK --------------------------------------------------------
              */
-            spin_lock_irqsave(&dev->register_lock, flags);
+            can_lock_irqsave(&dev->register_lock, flags);
 
             hw_disable_self_reception(dev);
 
             /*
              *  UNLOCK --------------------------------------------------------
              */
-            spin_unlock_irqrestore(&dev->register_lock, flags);
+            can_unlock_irqrestore(&dev->register_lock, flags);
             break;
 
         /*
@@ -185,9 +194,229 @@ long can_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
          */
         case CAN_IOCTL_ENABLE_MESSAGE_ACCEPT:
             file->accept_messages = 1;
+            file->rx_classes = file->classes;
+            break;
+
+
+        /*
+         *  The ISR only looks at rx_classes, so a class we don't want
+         *  costs it nothing.
+         */
+        case CAN_IOCTL_SET_CLASSES:
+            if (copy_from_user(&classes, (void __user *)arg, sizeof(unsigned int))){
+                return -EFAULT;
+            }
+
+            if (classes & ~CAN_CLASSES){
+                return -EINVAL;
+            }
+
+            file->classes = classes;
+            if (file->accept_messages){
+                file->rx_classes = classes;
+            }
+            break;
+
+
+        case CAN_IOCTL_SET_STATUS_EVENTFD:
+            if (copy_from_user(&fd, (void __user *)arg, sizeof(int))){
+                return -EFAULT;
+            }
+
+            eventfd = NULL;
+            if (fd >= 0){
+                eventfd = eventfd_ctx_fdget(fd);
+                if (IS_ERR(eventfd)){
+                    return PTR_ERR(eventfd);
+                }
+            }
+
+            /*
+             *  The ISR signals it under register_lock.
+             *
+             *  LOCK --------------------------------------------------------
+             */
+            can_lock_irqsave(&dev->register_lock, flags);
+
+            swap(eventfd, file->status_eventfd);
+
+            /*
+             *  UNLOCK --------------------------------------------------------
+             */
+            can_unlock_irqrestore(&dev->register_lock, flags);
+
+            if (eventfd){
+                eventfd_ctx_put(eventfd);
+            }
+            break;
+
+
+        case CAN_IOCTL_GET_STATUS:
+            /*
+             *  LOCK --------------------------------------------------------
+             */
+            can_lock_irqsave(&dev->register_lock, flags);
+
+            status = file->status;
+
+            /*
+             *  UNLOCK --------------------------------------------------------
+             */
+            can_unlock_irqrestore(&dev->register_lock, flags);
+
+            if (copy_to_user((void __user *)arg, &status, sizeof(struct can_status_t))){
+                return -EFAULT;
+            }
             break;
 
 
+        case CAN_IOCTL_SET_STATUS_INTERVAL:
+            return can_status_set_interval(file, arg);
+
+
+        case CAN_IOCTL_SET_TX_POLICY:
+        case CAN_IOCTL_GET_TX_POLICY:
+        case CAN_IOCTL_GET_TX_DROPPED:
+            return can_tx_ioctl(file, cmd, arg);
+
+
+        case CAN_IOCTL_SET_RECOVERY:
+        case CAN_IOCTL_GET_RECOVERY:
+        case CAN_IOCTL_RECOVER:
+            return can_errstate_ioctl(dev, cmd, arg);
+
+
+        case CAN_IOCTL_ADD_CYCLIC:
+        case CAN_IOCTL_UPDATE_CYCLIC:
+        case CAN_IOCTL_DELETE_CYCLIC:
+        case CAN_IOCTL_GET_CYCLIC_STATS:
+            return can_cyclic_ioctl(file, cmd, arg);
+
+
+        case CAN_IOCTL_TIMED_WRITE:
+        case CAN_IOCTL_GET_TIMED_TX:
+            return can_timed_ioctl(file, cmd, arg);
+
+
+        case CAN_IOCTL_SET_TX_COMPLETE:
+        case CAN_IOCTL_GET_TX_COMPLETE:
+            return can_tx_complete_ioctl(file, cmd, arg);
+
+
+        case CAN_IOCTL_GET_FILE_STATS:
+            /*
+             *  LOCK --------------------------------------------------------
+             */
+            can_lock_irqsave(&file->rx_lock, flags);
+
+            file->stats.rx_lock = file->rx_lock.stats;
+
+            /*
+             *  UNLOCK --------------------------------------------------------
+             */
+            can_unlock_irqrestore(&file->rx_lock, flags);
+
+            if (copy_to_user((void *)arg, &file->stats, sizeof(struct can_file_stats_t))){
+                return -EFAULT;
+            }
+            break;
+
+
+        /*
+         *  Too big for the stack, and we don't want to copy_to_user() 
+         *  with the lock held, so snapshot into a bounce buffer.
+         */
+        case CAN_IOCTL_GET_DEVICE_STATS:
+            dev_stats = kmalloc(sizeof(struct can_device_stats_t), GFP_KERNEL);
+            if (!dev_stats){
+                return -ENOMEM;
+            }
+
+            /*
+             *  LOCK --------------------------------------------------------
+             */
+            can_lock_irqsave(&dev->register_lock, flags);
+            can_lock(&dev->reader_lock);
+            can_lock(&dev->tx_lock);
+
+            memcpy(dev_stats, &dev->stats, sizeof(struct can_device_stats_t));
+            dev_stats->bitrate = dev->bitrate;
+            can_busload_fill(   dev, 
+                                &dev_stats->bus_load_100ms,
+                                &dev_stats->bus_load_1s,
+                                &dev_stats->bus_load_10s);
+
+            dev_stats->register_lock = dev->register_lock.stats;
+            dev_stats->reader_lock = dev->reader_lock.stats;
+            dev_stats->tx_lock = dev->tx_lock.stats;
+            can_errstate_fill(dev, dev_stats);
+
+            /*
+             *  UNLOCK --------------------------------------------------------
+             */
+            can_unlock(&dev->tx_lock);
+            can_unlock(&dev->reader_lock);
+            can_unlock_irqrestore(&dev->register_lock, flags);
+
+            ret = 0;
+            if (copy_to_user((void *)arg, dev_stats, sizeof(struct can_device_stats_t))){
+                ret = -EFAULT;
+            }
+
+            kfree(dev_stats);
+            return ret;
+
+
+        case CAN_IOCTL_RESET_DEVICE_STATS:
+            /*
+             *  LOCK --------------------------------------------------------
+             */
+            can_lock_irqsave(&dev->register_lock, flags);
+            can_lock(&dev->reader_lock);
+            can_lock(&dev->tx_lock);
+
+            reset_can_device_stats(dev);
+
+            /*
+             *  UNLOCK --------------------------------------------------------
+             */
+            can_unlock(&dev->tx_lock);
+            can_unlock(&dev->reader_lock);
+            can_unlock_irqrestore(&dev->register_lock, flags);
+            break;
+
+
+        case CAN_IOCTL_GET_ID_STATS:
+            return can_idstats_ioctl(dev, arg);
+
+
+        case CAN_IOCTL_RESET_ID_STATS:
+            reset_can_idstats(dev);
+            break;
+
+
+        case CAN_IOCTL_ADD_ROUTE:
+        case CAN_IOCTL_DELETE_ROUTE:
+        case CAN_IOCTL_GET_ROUTE_STATS:
+            return can_gateway_ioctl(dev, cmd, arg);
+
+
+        case CAN_IOCTL_GET_HISTORY:
+            return can_history_ioctl(dev, arg);
+
+
+        case CAN_IOCTL_SET_CAPTURE:
+        case CAN_IOCTL_ARM_CAPTURE:
+        case CAN_IOCTL_GET_CAPTURE:
+            return can_capture_ioctl(dev, cmd, arg);
+
+
+        case CAN_IOCTL_JOIN_GROUP:
+        case CAN_IOCTL_LEAVE_GROUP:
+        case CAN_IOCTL_GET_GROUP_STATS:
+            return can_group_ioctl(file, cmd, arg);
+
+
         default:
             printk(KERN_ERR PRINTK_DEV_NAME "Unknown IOCTL! %x\n", cmd);
             return -EINVAL;
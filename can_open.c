@@ -3,6 +3,10 @@
  *
  *  Contains the open and release routines for the driver.
  *
+ *  The ISR walks dev->reader_list under RCU, so adding and removing a
+ *  file never waits for it.  A closed file is freed, along with anything
+ *  the ISR queued to it meanwhile, once the ISR can no longer see it.
+ *
  ***************************************************************************/
 #include "can_private.h"
 
@@ -33,9 +37,14 @@ int can_open (struct inode *inode, struct file *filp)
 
     file->signature = CANBUS_FILE_SIGNATURE;
     file->dev = dev;
+    file->classes = CAN_CLASS_DEFAULT;
 
+    can_lock_init(&file->rx_lock);
     INIT_LIST_HEAD(&file->receive_queue);
     init_waitqueue_head(&file->receive_wq);
+    can_status_open(file);
+    can_timed_open(file);
+    can_tx_complete_open(file);
 
     INIT_LIST_HEAD(&file->reader_list_entry);
 
@@ -44,14 +53,14 @@ int can_open (struct inode *inode, struct file *filp)
     /*
      *  LOCK --------------------------------------------------------
      */
-    spin_lock_irqsave(&dev->register_lock, flags);
+    can_lock_irqsave(&dev->reader_lock, flags);
 
-    list_add(&file->reader_list_entry, &dev->reader_list);
+    list_add_rcu(&file->reader_list_entry, &dev->reader_list);
 
     /*
      *  UNLOCK ------------------------------------------------------
      */
-    spin_unlock_irqrestore(&dev->register_lock, flags);
+    can_unlock_irqrestore(&dev->reader_lock, flags);
 
     /*
      *  We do not seek, this is a stream.
@@ -65,6 +74,48 @@ int can_open (struct inode *inode, struct file *filp)
 }
 
 
+/**
+ *  A grace period after close, no ISR can still be queueing to file.
+ */
+static void can_free_file(struct rcu_head *rcu)
+{
+    struct canbus_file_t *file = container_of(rcu, struct canbus_file_t, rcu);
+    struct canbus_device_t *dev = file->dev;
+    struct kcanbus_message *message;
+    struct list_head *element;
+
+    while ( !list_empty(&file->receive_queue) ){
+
+        element = file->receive_queue.next;
+        list_del(element);
+        message = list_entry(element, struct kcanbus_message, entry);
+        
+        if (message->signature != KCANBUS_SIGNATURE){
+            /*
+             *  "If" we get here, we have some sort of internal memory corruption.
+             *  We can't know if this memory area is even ours, so we'll inform someone
+             *  that we are broke, and ignore the memory.  This is a memory leak, but 
+             *  done on purpose so we don't double free something, or free a pointer 
+             *  that wasn't even allocated.
+             */
+            printk(KERN_ERR "Signature check Failed! %s %d\n", __FILE__, __LINE__);
+        }
+        else{
+            free_kcanbus_message(dev, message);
+        }
+    }
+
+    if (file->status_eventfd){
+        eventfd_ctx_put(file->status_eventfd);
+    }
+
+    can_tx_complete_close(file);
+
+    file->signature = 0;
+    kfree(file);
+}
+
+
 /*
  *  Closing the Device.
  */
@@ -72,8 +123,6 @@ int can_release (struct inode *inode, struct file *filp)
 {
     struct canbus_file_t *file;
     struct canbus_device_t *dev;
-    struct kcanbus_message *message;
-    struct list_head *element;
     unsigned long flags;
 
     file = filp->private_data;
@@ -88,44 +137,35 @@ int can_release (struct inode *inode, struct file *filp)
         return -EBADFD;
     }
 
+    /*
+     *  Hand our share of any consumer group's frames to the others.
+     */
+    can_group_release(file);
+
+    /*
+     *  Stop our cyclic jobs, and our frames still to go out have nobody
+     *  to report drops to.
+     */
+    can_cyclic_release(file);
+    can_tx_release(file);
+
     /*
      *  LOCK --------------------------------------------------------
      */
-    spin_lock_irqsave(&dev->register_lock, flags);
+    can_lock_irqsave(&dev->reader_lock, flags);
 
-    list_del(&file->reader_list_entry);
+    list_del_rcu(&file->reader_list_entry);
 
     /*
      *  UNLOCK ------------------------------------------------------
      */
-    spin_unlock_irqrestore(&dev->register_lock, flags);
+    can_unlock_irqrestore(&dev->reader_lock, flags);
 
     /*
-     *  We are closing and we just unlinked ourselves from the 
-     *  reader_list, no locks needed here.
+     *  The ISR may be walking past us right now, and may still queue a
+     *  frame or two.  Drain and free once it can't.
      */
-    while ( !list_empty(&file->receive_queue) ){
-
-        element = file->receive_queue.next;
-        list_del(element);
-        message = list_entry(element, struct kcanbus_message, entry);
-        
-        if (message->signature != KCANBUS_SIGNATURE){
-            /*
-             *  "If" we get here, we have some sort of internal memory corruption.
-             *  We can't know if this memory area is even ours, so we'll inform someone
-             *  that we are broke, and ignore the memory.  This is a memory leak, but 
-             *  done on purpose so we don't double free something, or free a pointer 
-             *  that wasn't even allocated.
-             */
-            printk(KERN_ERR "Signature check Failed! %s %d\n", __FILE__, __LINE__);
-        }
-        else{
-            free_kcanbus_message(message);
-        }
-    }
-
-    kfree(file);
+    call_rcu(&file->rcu, can_free_file);
 
     return 0;
 }
@@ -37,6 +37,15 @@
 #include <linux/delay.h>
 #include <linux/sched.h>
 #include <linux/sched/rt.h>
+#include <linux/ktime.h>
+#include <linux/rculist.h>
+#include <linux/hash.h>
+#include <linux/eventfd.h>
+#include <linux/bitops.h>
+#include <linux/atomic.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/hrtimer.h>
 
 #include "flexcan_registers.h"
 #include "flexcan_bitrate.h"
@@ -49,7 +58,46 @@
 #define DEVICE_NAME "ta_canbus"
 #define PRINTK_DEV_NAME DEVICE_NAME ": "
 
-#define MINOR_DEV_NUMBER 0
+/*
+ *  Controllers we can drive at once.  Device N is /dev/ta_canbusN and
+ *  /proc/ta_canbusN, with minor number N.  The i.MX6 has two.
+ */
+#define CAN_MAX_DEVICES 8
+
+
+/*
+ *  Lock order, outermost first.  Never take one while holding a later
+ *  one, and skipping any of them is fine:
+ *
+ *      can_devices_lock        Registry, see can_devices.c
+ *      dev->register_lock      Hardware registers and what the ISR owns
+ *      dev->reader_lock        Changes to dev->reader_list
+ *      file->rx_lock           One file's receive_queue and its counts
+ *      dev->tx_lock            transmit_queue, the TX mailbox, its counts,
+ *                              the ACK error policy and the drop rings
+ *      pool.lock, events,      Self-contained, any context
+ *      status_work_lock
+ *
+ *  The ISR takes register_lock for the whole interrupt, and the others
+ *  briefly inside it.  read() only takes its own rx_lock, write() only
+ *  tx_lock and open() / close() only reader_lock, and tx_lock briefly on
+ *  close, so none of them waits for a whole ISR, or for each other.
+ *
+ *  The ISR walks reader_list under rcu_read_lock() rather than
+ *  reader_lock, and close() frees its canbus_file_t with call_rcu().
+ *  So open() and close() never wait for the ISR and it never waits
+ *  for them.  They still take reader_lock with interrupts off, since
+ *  the device stats take it inside register_lock.
+ *
+ *  They are all a struct can_lock, a spinlock that keeps its own
+ *  struct can_lock_stats_t, taken with can_lock() / can_lock_irqsave().
+ */
+struct can_lock {
+
+    spinlock_t lock;
+    u64 locked_ns;                  /* can_clock_ns() when taken, 0 if not timing */
+    struct can_lock_stats_t stats;  /* Under lock */
+};
 
 
 /* Kcan */
@@ -59,9 +107,216 @@ struct kcanbus_message {
     
     unsigned int signature;
     struct list_head entry;
+    u64 capture_ns;                 /* can_clock_ns() at entry to the ISR that received it */
+    u64 enqueue_ns;                 /* can_clock_ns() when added to a receive_queue */
+    unsigned int flags;             /* KCANBUS_xxx */
+    struct canbus_device_t *gateway_dest;   /* KCANBUS_FORWARDED, until it is submitted */
+    struct canbus_file_t *tx_file;  /* Writer, or NULL, for the TX drop reports.  Under tx_lock once queued */
+    unsigned int tx_attempts;       /* Times loaded into TX_MB */
+    u64 tx_deadline_ns;             /* KCANBUS_TIMED, when to load it */
+    u64 tx_write_ns;                /* KCANBUS_TX_COMPLETE, when write() queued it */
+    u64 tx_cookie;                  /* KCANBUS_TX_COMPLETE, from struct can_tx_write_t */
     CANBUS_MESSAGE user_message;
 };
 
+#define KCANBUS_FORWARDED   0x00000001  /* Queued by the gateway, capture_ns is the source ISR */
+#define KCANBUS_GROUP       0x00000002  /* On a receive_queue as one consumer group member's share */
+#define KCANBUS_TIMED       0x00000004  /* CAN_IOCTL_TIMED_WRITE, see timed.c */
+#define KCANBUS_TX_COMPLETE 0x00000008  /* Its writer wants a TX complete record, see tx_complete.c */
+
+
+/*
+ *  Bus load ring, 100 ms per slot.  One extra slot is the one
+ *  currently filling, so there are 10 s of complete slots.
+ */
+#define BUSLOAD_SLOT_NS     (100 * NSEC_PER_MSEC)
+#define BUSLOAD_NUM_SLOTS   101
+
+struct can_busload_ring {
+
+    u64 slot_start_ns;                  /* can_clock_ns() when slot cur started */
+    unsigned int cur;                   /* Slot being filled now */
+    u32 bits[BUSLOAD_NUM_SLOTS];        /* On-wire bits per slot */
+    u32 frames[BUSLOAD_NUM_SLOTS];      /* Frames per slot */
+};
+
+
+/*
+ *  Per CAN ID statistics, see idstats.c.
+ */
+#define IDSTATS_NUM_STANDARD    2048
+
+struct can_idstats_table {
+
+    struct can_id_stats_t *standard;    /* Indexed by the 11 bit ID */
+    struct can_id_stats_t *extended;    /* Open addressed by hash of the 29 bit ID */
+    unsigned int extended_slots;        /* Power of 2 */
+    unsigned int extended_bits;         /* log2(extended_slots) */
+    unsigned int overflow_count;        /* Extended frames we had no room for */
+};
+
+
+/*
+ *  The last frames received, see history.c.  Under register_lock.
+ */
+struct can_history_ring {
+
+    struct can_history_entry_t *ring;   /* size entries, NULL when off */
+    unsigned int size;                  /* Power of 2, or 0 when off */
+    u64 head;                           /* seq the next frame gets */
+};
+
+
+/*
+ *  Triggered capture, see capture.c.
+ */
+struct can_capture {
+
+    struct can_capture_config_t config;
+    struct can_history_entry_t *buffer;     /* slots entries, NULL when off */
+    unsigned int slots;                     /* pre_frames + post_frames + 1 */
+    unsigned long buffer_size;              /* Bytes, whole pages for mmap() */
+    int state;                              /* CAN_CAPTURE_xxx */
+    unsigned int next_slot;                 /* Where the next entry goes */
+    u64 written;                            /* Entries since armed */
+    u64 trigger_written;                    /* written when the trigger went in */
+    unsigned int remaining;                 /* post_frames still to record */
+    u64 trigger_seq;
+    u64 trigger_ns;
+    u64 triggers;
+    struct mutex mutex;                     /* Config, copy out and mmap(), outside register_lock */
+    atomic_t mapped;                        /* VMAs on buffer */
+    wait_queue_head_t wq;                   /* Woken when it freezes */
+};
+
+
+/*
+ *  Deferred event log, so the hot paths never printk.
+ *  See event_log.c.
+ */
+enum can_event_code {
+    CAN_EVENT_TX_WARN,
+    CAN_EVENT_RX_WARN,
+    CAN_EVENT_BUS_OFF,
+    CAN_EVENT_BIT1_ERR,
+    CAN_EVENT_BIT0_ERR,
+    CAN_EVENT_ACK_ERR,
+    CAN_EVENT_CRC_ERR,
+    CAN_EVENT_FORM_ERR,
+    CAN_EVENT_STUFF_ERR,
+    CAN_EVENT_NO_ERR_BIT,
+    CAN_EVENT_DEV_SIGNATURE,        /* arg is __LINE__ */
+    CAN_EVENT_FILE_SIGNATURE,       /* arg is __LINE__ */
+    CAN_EVENT_MSG_SIGNATURE,        /* arg is __LINE__ */
+    CAN_EVENT_NULL_FREE,
+    CAN_EVENT_POOL_EMPTY,
+    CAN_EVENT_COUNT
+};
+
+/*
+ *  Must be a power of 2.
+ */
+#define CAN_EVENT_RING_SIZE     64
+
+struct can_event_record {
+
+    unsigned int seq;               /* Ring index + 1 once the record is complete, 0 while writing */
+    enum can_event_code code;
+    unsigned int arg;
+    u64 ns;                         /* can_clock_ns() when it happened */
+};
+
+struct can_event_log {
+
+    struct can_event_record ring[CAN_EVENT_RING_SIZE];
+    atomic_t head;                  /* Next index a producer will claim */
+    unsigned int tail;              /* Next index the worker will print, worker only */
+    atomic_t counts[CAN_EVENT_COUNT];
+    atomic_t dropped;               /* Overwritten before the worker got to them */
+    struct delayed_work work;
+    int running;
+    unsigned long next_burst;       /* jiffies, worker only */
+};
+
+
+/*
+ *  Preallocated messages, see alloc.c.
+ */
+struct can_message_pool {
+
+    struct kcanbus_message **chunk_array;   /* Dynamic array of pointers to arrays */
+    int num_chunks;
+    int size;                               /* Messages in the pool */
+    int free_count;                         /* How many of them are free right now */
+    struct list_head free_list;
+    spinlock_t lock;                        /* Self-contained, any context */
+    int in_nomem_condition;                 /* Logged running out, only count it until a free */
+};
+
+
+/*
+ *  A gateway route, see gateway.c.  On the source device's routes list,
+ *  under its register_lock.
+ */
+#define CAN_MAX_ROUTES  32
+
+struct can_route {
+
+    struct list_head entry;
+    struct canbus_device_t *dest;   /* Valid while on a routes list */
+    struct can_route_t config;      /* As added, config.route_id is ours */
+    u64 hits;
+    u64 forwarded;
+    u64 drops;
+};
+
+
+/*
+ *  A cyclic transmit job, see cyclic.c.  On its device's cyclic_jobs
+ *  list, and everything here under its tx_lock.
+ */
+#define CAN_MAX_CYCLIC  32
+
+struct can_cyclic {
+
+    struct list_head entry;
+    struct canbus_device_t *dev;
+    struct canbus_file_t *owner;    /* The file that added it, deleted when it closes */
+    struct can_cyclic_t config;     /* As added, with the latest data */
+    u64 period_ns;
+    int active;                     /* timer is running it */
+    u64 last_ns;                    /* When the last frame was queued, 0 before the first */
+    struct hrtimer timer;
+    u64 sent;
+    u64 skipped;
+    u64 missed;
+    u64 min_period_ns;
+    u64 max_period_ns;
+    struct can_histogram_t jitter_hist;
+    struct can_histogram_t late_hist;
+};
+
+
+/*
+ *  A consumer group, see group.c.  On its device's groups list, under 
+ *  register_lock.
+ */
+#define CAN_MAX_GROUPS          8
+#define CAN_GROUP_SLOT_BITS     6
+#define CAN_GROUP_SLOTS         (1 << CAN_GROUP_SLOT_BITS)
+
+struct can_group {
+
+    struct list_head entry;
+    struct can_group_config_t config;
+    unsigned int num_members;
+    unsigned int next_member;                           /* CAN_GROUP_ROUND_ROBIN, last one handed a frame */
+    struct canbus_file_t *members[CAN_GROUP_MAX_MEMBERS];   /* In order of joining */
+    unsigned char slots[CAN_GROUP_SLOTS];               /* CAN_GROUP_HASH_ID, ID hash to members[] index */
+    u64 frames;
+    u64 requeued;
+};
+
 
 /* CanD */
 #define CANBUS_DEVICE_SIGNATURE 0x446e6143
@@ -70,19 +325,31 @@ struct canbus_device_t {
 
     unsigned int signature;         
     struct cdev cdev;                               /* Char device structure */
-    spinlock_t register_lock;                       /* HW Lock, also for transmit_queue */
+    struct can_lock register_lock;                  /* HW Lock, see the lock order above */
+    struct can_lock tx_lock;                        /* transmit_queue and TX_MB */
+    struct can_lock reader_lock;                    /* reader_list */
     struct FLEXCAN_HW_REGISTERS __iomem *registers; /* Access to the real Flexcan HW. */
-    struct list_head transmit_queue;                /* Queue of messages to TX */
-    struct list_head reader_list;                   /* List of open readers */
-    int transmit_in_progress;                       /* Are we transmitting now? */
+    struct list_head transmit_queue;                /* Queue of messages to TX, under tx_lock */
+    struct list_head reader_list;                   /* List of open readers, RCU, changed under reader_lock */
+    int transmit_in_progress;                       /* Are we transmitting now?  Under tx_lock */
     int major_dev_number;                           /* Our major device number */
     dev_t devno;                                    /* Our devno */
+    int index;                                      /* Minor number, N in /dev/ta_canbusN */
+    char name[16];                                  /* "ta_canbusN", for /proc and the log */
+    struct device *class_dev;                       /* The /dev node */
     u32 clock_freq;                                 /* PER clock */
+    unsigned int bitrate;                           /* Configured bus bitrate, bits/sec */
+    unsigned int bit_time_ns;                       /* One tick of the Flexcan TIMER */
+    int self_reception;                             /* We receive our own TX frames */
+    unsigned int tx_frame_bits;                     /* On-wire size of the frame in TX_MB, under tx_lock */
+    CANBUS_MESSAGE tx_echo;                         /* The frame in TX_MB, for CAN_CLASS_TX_ECHO, under tx_lock */
+    int tx_echo_pending;                            /* It hasn't come back yet, under tx_lock */
     struct clk *clk_ipg;                            /* Linux clock structs for this core */
     struct clk *clk_per;                            /* Linux clock structs for this core */
     struct resource *mem_resource;                  /* Memory resource from the dev tree*/
     resource_size_t mem_size;                       /* Size of the memory resource */
     int irq;                                        /* CANbus IRQ number */
+    struct vflexcan *vflexcan;                      /* Virtual controller, or NULL, see vflexcan.c */
 
     int stby_gpio;
     enum of_gpio_flags stby_gpio_flags;
@@ -91,7 +358,69 @@ struct canbus_device_t {
     int id;
 
     int prior_errors_found;                         /* Where there errors found in the last isr? */
+    u64 last_isr_ns;                                /* can_clock_ns() at the last isr entry */
+    struct can_busload_ring busload;                /* Bus load accounting, see busload.c */
+    struct can_idstats_table idstats;               /* Per CAN ID statistics, see idstats.c */
+    struct can_history_ring history;                /* Recent frames, see history.c */
+    struct can_capture capture;                     /* Triggered capture, see capture.c */
     struct can_device_stats_t stats;                /* Device based statistics */
+
+    struct can_message_pool pool;                   /* Messages for this device only */
+    struct can_event_log events;                    /* Deferred printk, see event_log.c */
+
+    struct list_head routes;                        /* Gateway routes from here, under register_lock */
+    unsigned int num_routes;
+    unsigned int next_route_id;
+
+    struct list_head groups;                        /* Consumer groups, under register_lock */
+    unsigned int num_groups;
+
+    struct delayed_work status_work;                /* Queues held back status changes, see status.c */
+    int status_work_running;
+    spinlock_t status_work_lock;                    /* Self-contained, any context */
+    u64 status_work_due_ns;                         /* When status_work runs, 0 if it isn't pending */
+    u64 storm_last_ns;                              /* Last status change, for the storm stats, under register_lock */
+
+    /*
+     *  ACK error handling, see tx.c.  Under tx_lock.
+     */
+    struct kcanbus_message *tx_current;             /* The frame in TX_MB, or NULL */
+    struct can_tx_policy_t tx_policy;               /* CAN_IOCTL_SET_TX_POLICY */
+    int tx_held;                                    /* CAN_TX_HOLD backing off, tx_current waits for tx_timer */
+    u64 tx_backoff_ns;                              /* The current backoff, 0 after a success */
+    struct hrtimer tx_timer;
+    int tx_bus_off;                                 /* Off the bus, tx_current and the queue wait */
+    int tx_aborting;                                /* ABORT written, waiting for TX_MB's IFLAG */
+    int tx_abort_keep;                              /* BUS OFF wrote it, keep tx_current */
+    unsigned int tx_abort_esr1;                     /* The ACK error's ESR1, for the trace */
+
+    struct list_head cyclic_jobs;                   /* Cyclic transmit, see cyclic.c.  Under tx_lock */
+    unsigned int num_cyclic;
+    unsigned int next_cyclic_id;
+
+    struct list_head timed_queue;                   /* Timed frames by deadline, see timed.c.  Under tx_lock */
+    struct hrtimer timed_timer;
+    int tx_fence;                                   /* The next timed frame is due, keep TX_MB free */
+
+    /*
+     *  Fault confinement state, see errstate.c.  Under register_lock,
+     *  the state itself is stats.can_state.
+     */
+    u64 state_entered_ns;                           /* When stats.can_state was entered */
+    struct can_recovery_t recovery;                 /* CAN_IOCTL_SET_RECOVERY */
+    int boff_recovering;                            /* The controller is counting its way back */
+    u64 bus_off_ns;                                 /* When BUS OFF was entered */
+    u64 recover_start_ns;                           /* When the recovery started */
+    unsigned int esr1_stash;                        /* ESR1 error bits the poll read, for the ISR */
+    struct hrtimer state_timer;                     /* Recovery delay and the state poll */
+
+    /*
+     *  ISR scratch, under register_lock.  Keep the larger data off
+     *  the stack, we have 1 - 2 page limit.
+     */
+    CANBUS_MESSAGE rx_messages[FLEXCAN_NUM_MESSAGE_BUFFERS - FIRST_RX_MB];
+    unsigned int rx_timestamps[FLEXCAN_NUM_MESSAGE_BUFFERS - FIRST_RX_MB];
+    CANBUS_MESSAGE *rx_msg_ptrs[FLEXCAN_NUM_MESSAGE_BUFFERS - FIRST_RX_MB];
 };
 
 
@@ -103,12 +432,53 @@ struct canbus_file_t {
     unsigned int signature;         /* Used to sanity check typecasted pointers. */
     struct canbus_device_t *dev;    /* Back pointer to the canbus_device_t structure. */
     int accept_messages;            /* We need to explicitly turn on getting messages. */
+    unsigned int classes;           /* CAN_CLASS_xxx asked for */
+    unsigned int rx_classes;        /* classes once accept_messages is on, 0 before.  What the ISR looks at */
 
     struct list_head reader_list_entry; /* entry into dev->reader_list */
+    struct rcu_head rcu;                /* Freed a grace period after close */
+    struct can_group *group;            /* Consumer group we're in, or NULL.  Under dev's register_lock */
+
+    struct eventfd_ctx *status_eventfd; /* CAN_IOCTL_SET_STATUS_EVENTFD, or NULL.  Under dev's register_lock */
+    struct can_status_t status;         /* CAN_CLASS_STATUS_EVENT.  Under dev's register_lock */
 
+    struct can_lock rx_lock;        /* receive_queue and the rx_queue counts, see the lock order */
     struct list_head receive_queue;
     wait_queue_head_t receive_wq;
 
+    /*
+     *  Status coalescing, see status.c.  Under rx_lock.
+     */
+    struct kcanbus_message *status_pending; /* Our unread status record in receive_queue, or NULL */
+    CANBUS_STATUS_CHANGE status_held;       /* Held back by the interval or an empty pool, Status1 0 if none */
+    u64 status_held_ns;                     /* capture_ns of the first change held */
+    u64 status_queued_ns;                   /* When our last status record was queued */
+    u64 status_interval_ns;                 /* CAN_IOCTL_SET_STATUS_INTERVAL */
+
+    /*
+     *  Our frames the device gave up on, see tx.c.  Under dev's tx_lock.
+     */
+    struct can_tx_dropped_t tx_dropped[CAN_TX_DROPPED_MAX];
+    u64 tx_dropped_head;                    /* Dropped so far, the next seq */
+
+    /*
+     *  Our timed frame, see timed.c.  Under dev's tx_lock.
+     */
+    struct can_timed_tx_t timed_tx;
+    wait_queue_head_t timed_wq;
+
+    /*
+     *  Our TX complete records, see tx_complete.c.  Under dev's tx_lock.
+     */
+    struct can_tx_complete_t *tx_complete;  /* Ring of CAN_TX_COMPLETE_MAX, NULL until first enabled */
+    u64 tx_complete_head;                   /* Records so far, the next seq */
+    u64 tx_complete_tail;                   /* The next seq to read */
+    int tx_complete_on;                     /* Flag the frames we write */
+    unsigned int tx_complete_batch;
+    unsigned int tx_in_flight;              /* Flagged frames with no record yet */
+    int tx_complete_ready;                  /* A batch is ready, the reader has been woken */
+    wait_queue_head_t tx_complete_wq;
+
     struct can_file_stats_t stats;   
 };
 
@@ -128,6 +498,8 @@ int can_release (struct inode *, struct file *);
 ssize_t can_read (struct file *, char __user *, size_t, loff_t *);
 ssize_t can_write (struct file *, const char __user *, size_t, loff_t *);
 long can_ioctl (struct file *, unsigned int, unsigned long);    /* unlocked_ioctl */
+int can_mmap (struct file *, struct vm_area_struct *);
+ssize_t can_splice_read (struct file *, loff_t *, struct pipe_inode_info *, size_t, unsigned int);
 
 
 /*
@@ -140,17 +512,456 @@ int remove_can_proc_files(struct canbus_device_t *dev);
 /*
  *  Our own memory allocation routines.
  */
-int init_kcanbus_message_pool(int max_msg_count);
-void destroy_kcanbus_message_pool(void);
-void free_kcanbus_message(struct kcanbus_message *msg);
-struct kcanbus_message * alloc_kcanbus_message(void);
+int init_kcanbus_message_pool(struct canbus_device_t *dev, int max_msg_count);
+void destroy_kcanbus_message_pool(struct canbus_device_t *dev);
+void free_kcanbus_message(struct canbus_device_t *dev, struct kcanbus_message *msg);
+struct kcanbus_message * alloc_kcanbus_message(struct canbus_device_t *dev);
+void kcanbus_message_pool_usage(struct canbus_device_t *dev, int *size, int *free_count);
+
+
+/*
+ *  Which controllers are probed, see can_devices.c.
+ */
+int can_device_reserve(struct canbus_device_t *dev);
+void can_device_register(struct canbus_device_t *dev);
+void can_device_unregister(struct canbus_device_t *dev);
+void can_device_release(struct canbus_device_t *dev);
+struct canbus_device_t *can_device_lookup(int index);
+
+/*
+ *  Nests outside every register_lock.
+ */
+extern spinlock_t can_devices_lock;
+
+
+/*
+ *  Gateway between controllers, see gateway.c.
+ */
+struct seq_file;
+
+void init_can_gateway(struct canbus_device_t *dev);
+void destroy_can_gateway(struct canbus_device_t *dev);
+void can_gateway_route( struct canbus_device_t *dev,
+                        const CANBUS_MESSAGE *frame,
+                        u64 capture_ns,
+                        struct list_head *forward_list);
+void can_gateway_submit(struct list_head *forward_list);
+void can_gateway_tx_started(struct canbus_device_t *dev,
+                            const struct kcanbus_message *message);
+long can_gateway_ioctl( struct canbus_device_t *dev, 
+                        unsigned int cmd, 
+                        unsigned long arg);
+void show_can_gateway(struct canbus_device_t *dev, struct seq_file *m);
+
+
+/*
+ *  Consumer groups, see group.c.
+ */
+void init_can_groups(struct canbus_device_t *dev);
+void can_group_release(struct canbus_file_t *file);
+long can_group_ioctl(   struct canbus_file_t *file, 
+                        unsigned int cmd, 
+                        unsigned long arg);
+void show_can_groups(struct canbus_device_t *dev, struct seq_file *m);
+
+
+/*
+ *  Coalesced status changes, see status.c.
+ */
+void init_can_status(struct canbus_device_t *dev);
+void destroy_can_status(struct canbus_device_t *dev);
+void can_status_open(struct canbus_file_t *file);
+void can_status_enqueue(struct canbus_file_t *file,
+                        const CANBUS_STATUS_CHANGE *status_change,
+                        u64 capture_ns,
+                        u64 enqueue_ns);
+void can_status_storm(struct canbus_device_t *dev, u64 now_ns);
+int can_status_deliver( struct canbus_device_t *dev,
+                        const CANBUS_STATUS_CHANGE *status_change,
+                        u64 capture_ns);
+long can_status_set_interval(struct canbus_file_t *file, unsigned long arg);
+
+
+/*
+ *  Fault confinement state machine, see errstate.c.  The update is under
+ *  register_lock.
+ */
+void init_can_errstate(struct canbus_device_t *dev);
+void destroy_can_errstate(struct canbus_device_t *dev);
+void can_errstate_update(   struct canbus_device_t *dev,
+                            unsigned int esr1,
+                            u64 now_ns,
+                            CANBUS_STATUS_CHANGE *status_change);
+void can_errstate_fill(struct canbus_device_t *dev, struct can_device_stats_t *stats);
+long can_errstate_ioctl(struct canbus_device_t *dev,
+                        unsigned int cmd,
+                        unsigned long arg);
+void show_can_errstate(struct canbus_device_t *dev, struct seq_file *m);
+
+
+/*
+ *  Transmit path and ACK errors, see tx.c.  tx_lock held for 
+ *  can_tx_submit() through can_tx_aborted().
+ */
+void init_can_tx(struct canbus_device_t *dev);
+void destroy_can_tx(struct canbus_device_t *dev);
+int can_tx_submit(struct canbus_device_t *dev, struct kcanbus_message *message);
+int can_tx_submit_first(struct canbus_device_t *dev, struct kcanbus_message *message);
+void can_tx_complete(struct canbus_device_t *dev);
+void can_tx_ack_error(struct canbus_device_t *dev, unsigned int esr1);
+void can_tx_aborted(struct canbus_device_t *dev);
+void can_tx_bus_alive(struct canbus_device_t *dev);
+void can_tx_release(struct canbus_file_t *file);
+void can_tx_bus_off(struct canbus_device_t *dev, int flush);
+void can_tx_bus_on(struct canbus_device_t *dev);
+long can_tx_ioctl(  struct canbus_file_t *file,
+                    unsigned int cmd,
+                    unsigned long arg);
+
+
+/*
+ *  Cyclic transmit jobs, see cyclic.c.
+ */
+void init_can_cyclic(struct canbus_device_t *dev);
+void destroy_can_cyclic(struct canbus_device_t *dev);
+void can_cyclic_release(struct canbus_file_t *file);
+long can_cyclic_ioctl(  struct canbus_file_t *file,
+                        unsigned int cmd,
+                        unsigned long arg);
+void show_can_cyclic(struct canbus_device_t *dev, struct seq_file *m);
+
+
+/*
+ *  Timed transmit, see timed.c.  can_timed_done() under tx_lock.
+ */
+void init_can_timed(struct canbus_device_t *dev);
+void destroy_can_timed(struct canbus_device_t *dev);
+void can_timed_open(struct canbus_file_t *file);
+void can_timed_done(struct canbus_device_t *dev,
+                    struct kcanbus_message *message,
+                    unsigned int status);
+long can_timed_ioctl(   struct canbus_file_t *file,
+                        unsigned int cmd,
+                        unsigned long arg);
+
+
+/*
+ *  TX complete records, see tx_complete.c.  can_tx_complete_write() and
+ *  can_tx_complete_done() under tx_lock.
+ */
+void can_tx_complete_open(struct canbus_file_t *file);
+void can_tx_complete_close(struct canbus_file_t *file);
+void can_tx_complete_write(struct canbus_file_t *file, struct kcanbus_message *message);
+void can_tx_complete_done(  struct canbus_device_t *dev,
+                            struct kcanbus_message *message,
+                            unsigned int status,
+                            unsigned int policy,
+                            u64 tx_ns);
+long can_tx_complete_ioctl( struct canbus_file_t *file,
+                            unsigned int cmd,
+                            unsigned long arg);
+
+
+/*
+ *  Deferred event log, see event_log.c.
+ */
+int init_can_event_log(struct canbus_device_t *dev);
+void destroy_can_event_log(struct canbus_device_t *dev);
+void can_event(struct canbus_device_t *dev, enum can_event_code code, unsigned int arg);
+void can_event_count(struct canbus_device_t *dev, enum can_event_code code);
+void show_can_events(struct canbus_device_t *dev, struct seq_file *m);
+
+
+/*
+ *  Bus load estimator.
+ */
+unsigned int can_frame_bits(const CANBUS_MESSAGE *message);
+void can_busload_add(struct canbus_device_t *dev, unsigned int bits, u64 now_ns);
+void can_busload_fill(  struct canbus_device_t *dev, 
+                        struct can_bus_load_t *load_100ms,
+                        struct can_bus_load_t *load_1s,
+                        struct can_bus_load_t *load_10s);
+
+
+/*
+ *  Per CAN ID statistics.
+ */
+int init_can_idstats(struct canbus_device_t *dev);
+void destroy_can_idstats(struct canbus_device_t *dev);
+void reset_can_idstats(struct canbus_device_t *dev);
+void can_idstats_update(struct canbus_device_t *dev,
+                        const CANBUS_MESSAGE *message,
+                        u64 frame_ns);
+long can_idstats_ioctl(struct canbus_device_t *dev, unsigned long arg);
+
+
+/*
+ *  History ring.
+ */
+int init_can_history(struct canbus_device_t *dev);
+void destroy_can_history(struct canbus_device_t *dev);
+long can_history_ioctl(struct canbus_device_t *dev, unsigned long arg);
+
+
+/*
+ *  Triggered capture.  Everything else is under register_lock.
+ */
+void init_can_capture(struct canbus_device_t *dev);
+void destroy_can_capture(struct canbus_device_t *dev);
+void can_capture_record(struct canbus_device_t *dev,
+                        const CANBUS_MESSAGE *message,
+                        u64 ns,
+                        int is_status);
+long can_capture_ioctl( struct canbus_device_t *dev, 
+                        unsigned int cmd, 
+                        unsigned long arg);
+
+
+/*
+ *  Statistics helpers.
+ */
+void can_histogram_reset(struct can_histogram_t *hist);
+u64 can_histogram_percentile(   const struct can_histogram_t *hist,
+                                unsigned int per_million);
+void reset_can_device_stats(struct canbus_device_t *dev);
+void can_record_delivery(   struct canbus_file_t *file,
+                            const struct kcanbus_message *message,
+                            u64 wakeup_ns,
+                            u64 copy_ns);
+
+
+/**
+ *  Monotonic, high resolution time for all driver measurements.
+ */
+static inline u64 can_clock_ns(void)
+{
+    return ktime_to_ns(ktime_get());
+}
+
+
+/**
+ *  Convert a 16 bit Flexcan timestamp to can_clock_ns() time, given a
+ *  reference pair read close together.  The timer counts bit times and
+ *  wraps every 65536 of them, so this is only good for timestamps less
+ *  than one wrap older than the reference.
+ */
+static inline u64 can_timestamp_to_ns(  struct canbus_device_t *dev,
+                                        u64 ref_ns,
+                                        unsigned int ref_timer,
+                                        unsigned int timestamp)
+{
+    return ref_ns - (u64)((ref_timer - timestamp) & TIMER_MASK) * dev->bit_time_ns;
+}
+
+
+/**
+ *  Record one sample.  This is called from the ISR, so it is only a 
+ *  couple of shifts and adds, no division.  Caller handles locking.
+ */
+static inline void can_histogram_add(struct can_histogram_t *hist, u64 value)
+{
+    unsigned int bucket;
+    unsigned int shift;
+
+    if (value < CAN_HIST_SUB_BUCKETS){
+        bucket = (unsigned int)value;
+    }
+    else if (value >> 32){
+        bucket = CAN_HIST_NUM_BUCKETS - 1;
+    }
+    else{
+        shift = fls((unsigned int)value) - 1 - CAN_HIST_SUB_BITS;
+        bucket = ((shift + 1) << CAN_HIST_SUB_BITS) + 
+                    (((unsigned int)value >> shift) & (CAN_HIST_SUB_BUCKETS - 1));
+    }
+
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max){
+        hist->max = value;
+    }
+}
+
+
+/*
+ *  struct can_lock.  Contention is counted with a trylock first, which
+ *  is free when the lock is there for the taking.  Times only with the
+ *  lock_timing module parameter, see can_stats.c.
+ */
+extern bool can_lock_timing;
+
+static inline void can_lock_init(struct can_lock *lock)
+{
+    spin_lock_init(&lock->lock);
+    lock->locked_ns = 0;
+    memset(&lock->stats, 0, sizeof(lock->stats));
+}
+
+
+/**
+ *  Take lock, with interrupts already off.
+ */
+static inline void can_lock(struct can_lock *lock)
+{
+    u64 wait_ns = 0;
+    int contended = 0;
+
+    if (unlikely(!spin_trylock(&lock->lock))){
+        contended = 1;
+        if (can_lock_timing){
+            wait_ns = can_clock_ns();
+        }
+        spin_lock(&lock->lock);
+    }
+
+    lock->locked_ns = can_lock_timing ? can_clock_ns() : 0;
+    lock->stats.acquired++;
+
+    if (contended){
+        lock->stats.contended++;
+        if (wait_ns && lock->locked_ns){
+            can_histogram_add(&lock->stats.wait_hist, lock->locked_ns - wait_ns);
+        }
+    }
+}
+
+
+static inline void can_unlock(struct can_lock *lock)
+{
+    if (lock->locked_ns){
+        can_histogram_add(&lock->stats.hold_hist, can_clock_ns() - lock->locked_ns);
+    }
+    spin_unlock(&lock->lock);
+}
+
+
+#define can_lock_irqsave(lock_, flags_)         \
+    do {                                        \
+        local_irq_save(flags_);                 \
+        can_lock(lock_);                        \
+    } while (0)
+
+#define can_unlock_irqrestore(lock_, flags_)    \
+    do {                                        \
+        can_unlock(lock_);                      \
+        local_irq_restore(flags_);              \
+    } while (0)
+
+
+/**
+ *  A frame's ID as a plain 11 or 29 bit number, rather than in the
+ *  MB register format CANBUS_MESSAGE uses.
+ */
+static inline unsigned int can_frame_id(const CANBUS_MESSAGE *message)
+{
+    if (message->Type == CmtStandard){
+        return (message->Id & MB_ID_STANDARD_MASK) >> 18;
+    }
+    return message->Id & 0x1FFFFFFF;
+}
+
+
+/**
+ *  Is frame our own last transmit coming back?  Only asked with self
+ *  reception on.  register_lock held.
+ */
+static inline int can_is_tx_echo(struct canbus_device_t *dev, const CANBUS_MESSAGE *frame)
+{
+    int echo = 0;
+
+    if (!ACCESS_ONCE(dev->tx_echo_pending)){
+        return 0;
+    }
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock(&dev->tx_lock);
+
+    if (dev->tx_echo_pending &&
+        frame->Type == dev->tx_echo.Type &&
+        can_frame_id(frame) == can_frame_id(&dev->tx_echo) &&
+        frame->DataLength == dev->tx_echo.DataLength &&
+        !memcmp(frame->Data, dev->tx_echo.Data, min_t(unsigned int, frame->DataLength, 8))){
+
+        dev->tx_echo_pending = 0;
+        echo = 1;
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock(&dev->tx_lock);
+
+    return echo;
+}
+
+
+/**
+ *  The member of group that gets frame.  register_lock held.
+ */
+static inline struct canbus_file_t *can_group_member(   struct can_group *group,
+                                                        const CANBUS_MESSAGE *frame)
+{
+    if (group->config.policy == CAN_GROUP_HASH_ID){
+        return group->members[group->slots[hash_32(can_frame_id(frame), CAN_GROUP_SLOT_BITS)]];
+    }
+
+    if (++group->next_member >= group->num_members){
+        group->next_member = 0;
+    }
+    return group->members[group->next_member];
+}
+
+
+/**
+ *  Put a received frame in the history ring.  One record write no matter
+ *  who is reading.  register_lock held.
+ */
+static inline void can_history_add( struct canbus_device_t *dev,
+                                    const CANBUS_MESSAGE *message,
+                                    u64 frame_ns)
+{
+    struct can_history_ring *history = &dev->history;
+    struct can_history_entry_t *entry;
+
+    if (!history->size){
+        history->head++;
+        return;
+    }
+
+    entry = &history->ring[history->head & (history->size - 1)];
+    entry->seq = history->head++;
+    entry->timestamp_ns = frame_ns;
+    memcpy(&entry->message, message, sizeof(CANBUS_MESSAGE));
+}
+
+
+/**
+ *  Give the triggered capture a received frame, or a status change as
+ *  a CANBUS_STATUS_CHANGE.  Before can_history_add(), so the entry gets
+ *  the frame's seq.  register_lock held.
+ */
+static inline void can_capture_add( struct canbus_device_t *dev,
+                                    const CANBUS_MESSAGE *message,
+                                    u64 ns,
+                                    int is_status)
+{
+    if (dev->capture.state == CAN_CAPTURE_ARMED || 
+        dev->capture.state == CAN_CAPTURE_TRIGGERED){
+        can_capture_record(dev, message, ns, is_status);
+    }
+}
 
 
 /****************************************************************************
  *  Hardware Accessors
  *
  *  You need to hold the register lock before accessing these,
- *  in general that is.
+ *  in general that is.  TX_MB is the exception: transmitting, aborting
+ *  and its interrupt mask bit are under tx_lock, nothing else at run
+ *  time touches IMASK.
  */
 void
 hw_initialize_hardware(struct canbus_device_t *dev);
@@ -195,9 +1006,35 @@ hw_enable_self_reception(struct canbus_device_t *dev);
 void
 hw_disable_self_reception(struct canbus_device_t *dev);
 
-void
+/**
+ *  Write ABORT to TX_MB without waiting for it.  1 if written, and
+ *  TX_MB's IFLAG comes when the frame is aborted or went out anyway, 0
+ *  if the IFLAG is already set.
+ */
+int
 hw_abort_transmit(struct canbus_device_t *dev);
 
+/**
+ *  TX_MB's IFLAG came.  1 if the frame was aborted, 0 if it went
+ *  out.
+ */
+int
+hw_tx_aborted(struct canbus_device_t *dev);
+
+/**
+ *  When the frame TX_MB just sent started on the bus, in can_clock_ns()
+ *  time, from its time stamp.  Good for 65536 bit times after.
+ */
+u64
+hw_get_tx_timestamp_ns(struct canbus_device_t *dev);
+
+/**
+ *  CTRL1_BOFF_REC.  With automatic off the controller stays in BUS OFF
+ *  until it is turned back on.
+ */
+void
+hw_set_bus_off_recovery(struct canbus_device_t *dev, int automatic);
+
 void
 get_iflags(  struct canbus_device_t *dev,
             unsigned int *iflag1, 
@@ -206,6 +1043,31 @@ get_iflags(  struct canbus_device_t *dev,
 /***************************************************************************/
 
 
+/*
+ *  The RAM backed "vflexcan" controller, see vflexcan.c.  Only in
+ *  TA_CANBUS_VIRTUAL builds, otherwise no device is ever virtual.
+ */
+#ifdef TA_CANBUS_VIRTUAL
+
+#include "flexcan_model.h"
+
+int vflexcan_register_devices(void);
+void vflexcan_unregister_devices(void);
+int vflexcan_is_virtual(struct platform_device *pdev);
+int vflexcan_attach(struct platform_device *pdev, struct canbus_device_t *dev);
+void vflexcan_detach(struct canbus_device_t *dev);
+
+#else
+
+static inline int vflexcan_register_devices(void) { return 0; }
+static inline void vflexcan_unregister_devices(void) { }
+static inline int vflexcan_is_virtual(struct platform_device *pdev) { return 0; }
+static inline int vflexcan_attach(struct platform_device *pdev, struct canbus_device_t *dev) { return -ENODEV; }
+static inline void vflexcan_detach(struct canbus_device_t *dev) { }
+
+#endif
+
+
 #endif
 
 
@@ -12,22 +12,75 @@
  ***************************************************************************/
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/math64.h>
 
 #include "can_private.h"
 
 
 /*
- *  There should be a way to pass a user defined pointer back and forth
- *  between proc_create / proc_create_data, but I can't find it, and 
- *  this is only for debugging for now.
+ *  One line summary of a histogram, the full buckets are 
+ *  available from the stats ioctls.
  */
-static struct canbus_device_t *canbus_dev = NULL;
+static void show_histogram(struct seq_file *m, const char *name, 
+                            const struct can_histogram_t *hist)
+{
+    seq_printf( m, "%s p50 %llu p99 %llu p99.9 %llu max %llu count %llu\n",
+                name,
+                can_histogram_percentile(hist, 500000),
+                can_histogram_percentile(hist, 990000),
+                can_histogram_percentile(hist, 999000),
+                hist->max,
+                hist->count);
+}
+
+
+static void show_timespec(struct seq_file *m, const char *name, u64 ns)
+{
+    u32 nsec;
+    u64 sec;
+
+    sec = div_u64_rem(ns, NSEC_PER_SEC, &nsec);
+    seq_printf(m, "%s %llu sec %u nsec\n", name, sec, nsec);
+}
+
+
+static void show_bus_load(struct seq_file *m, const char *name, 
+                            const struct can_bus_load_t *load)
+{
+    seq_printf( m, "%s %u.%02u%% %u fps %u bps\n",
+                name,
+                load->utilization_x100 / 100,
+                load->utilization_x100 % 100,
+                load->frames_per_sec,
+                load->bits_per_sec);
+}
+
+
+static void show_lock_stats(struct seq_file *m, const char *name, 
+                            const struct can_lock_stats_t *stats)
+{
+    char hist_name[32];
+
+    seq_printf(m, "%sAcquired %llu\n", name, stats->acquired);
+    seq_printf(m, "%sContended %llu\n", name, stats->contended);
+
+    snprintf(hist_name, sizeof(hist_name), "%sWaitNs", name);
+    show_histogram(m, hist_name, &stats->wait_hist);
+    snprintf(hist_name, sizeof(hist_name), "%sHoldNs", name);
+    show_histogram(m, hist_name, &stats->hold_hist);
+}
 
 
 static int ta_canbus_proc_show(struct seq_file *m, void *v)
 {
-    struct list_head *element;
+    struct canbus_device_t *canbus_dev = m->private;
     struct canbus_file_t *file;
+    struct can_bus_load_t load_100ms;
+    struct can_bus_load_t load_1s;
+    struct can_bus_load_t load_10s;
+    unsigned long flags;
+    int pool_size;
+    int pool_free;
 
     /*
      *  We are deliberately doing this without the needed locks, so we 
@@ -54,15 +107,9 @@ static int ta_canbus_proc_show(struct seq_file *m, void *v)
     seq_printf(m, "Form %u\n", canbus_dev->stats.form_error_count);
     seq_printf(m, "Stuff %u\n", canbus_dev->stats.bitstuff_error_count);
 
-    seq_printf( m, "TotalIsrTime %ld sec %ld nsec\n", 
-                canbus_dev->stats.total_isr_time.tv_sec, 
-                canbus_dev->stats.total_isr_time.tv_nsec);
-    seq_printf( m, "CurIsrTime %ld sec %ld nsec\n", 
-                canbus_dev->stats.cur_isr_time.tv_sec, 
-                canbus_dev->stats.cur_isr_time.tv_nsec);
-    seq_printf( m, "MaxIsrTime %ld sec %ld nsec\n", 
-                canbus_dev->stats.max_isr_time.tv_sec, 
-                canbus_dev->stats.max_isr_time.tv_nsec);
+    show_timespec(m, "TotalIsrTime", canbus_dev->stats.total_isr_time_ns);
+    show_timespec(m, "CurIsrTime", canbus_dev->stats.cur_isr_time_ns);
+    show_timespec(m, "MaxIsrTime", canbus_dev->stats.max_isr_time_ns);
 
     seq_printf(m, "TotalMbUsed %llu\n", canbus_dev->stats.total_mb_used);
     seq_printf(m, "CurMbUsed %u\n", canbus_dev->stats.cur_mb_used);
@@ -71,13 +118,74 @@ static int ta_canbus_proc_show(struct seq_file *m, void *v)
     seq_printf(m, "CurTxQueueCount %u\n", canbus_dev->stats.cur_tx_queue_count);
     seq_printf(m, "MaxTxQueueCount %u\n", canbus_dev->stats.max_tx_queue_count);
 
-    list_for_each(element, &canbus_dev->reader_list){
+    kcanbus_message_pool_usage(canbus_dev, &pool_size, &pool_free);
+    seq_printf(m, "PoolSize %d\n", pool_size);
+    seq_printf(m, "PoolFree %d\n", pool_free);
+
+    show_histogram(m, "IsrTimeNs", &canbus_dev->stats.isr_time_hist);
+    show_histogram(m, "MbPerIsr", &canbus_dev->stats.mb_per_isr_hist);
+    show_histogram(m, "IsrIntervalNs", &canbus_dev->stats.isr_interval_hist);
+
+    /*
+     *  The bus load windows move as we read them, so they do need the lock.
+     */
+    can_lock_irqsave(&canbus_dev->register_lock, flags);
+    can_busload_fill(canbus_dev, &load_100ms, &load_1s, &load_10s);
+    can_unlock_irqrestore(&canbus_dev->register_lock, flags);
+
+    seq_printf(m, "Bitrate %u\n", canbus_dev->bitrate);
+    seq_printf(m, "TotalBusBits %llu\n", canbus_dev->stats.total_bus_bits);
+    show_bus_load(m, "BusLoad100ms", &load_100ms);
+    show_bus_load(m, "BusLoad1s", &load_1s);
+    show_bus_load(m, "BusLoad10s", &load_10s);
+
+    seq_printf(m, "HistorySize %u\n", canbus_dev->history.size);
+    seq_printf(m, "HistoryFrames %llu\n", canbus_dev->history.head);
+    seq_printf(m, "CaptureState %d\n", canbus_dev->capture.state);
+    seq_printf(m, "CaptureTriggers %llu\n", canbus_dev->capture.triggers);
+
+    show_can_events(canbus_dev, m);
+
+    seq_printf(m, "StatusCoalesced %llu\n", canbus_dev->stats.status_coalesced);
+    seq_printf(m, "Storms %u\n", canbus_dev->stats.storm_count);
+    show_timespec(m, "TotalStormTime", canbus_dev->stats.storm_total_ns);
+    show_timespec(m, "MaxStormTime", canbus_dev->stats.storm_max_ns);
+    show_timespec(m, "CurStormTime", canbus_dev->stats.storm_cur_ns);
+
+    seq_printf(m, "TxPolicy %u\n", canbus_dev->tx_policy.policy);
+    seq_printf(m, "TxHeld %d\n", canbus_dev->tx_held);
+    seq_printf(m, "TxAborted %llu\n", canbus_dev->stats.tx_aborted);
+    seq_printf(m, "TxRetried %llu\n", canbus_dev->stats.tx_retried);
+    seq_printf(m, "TxDropped %llu\n", canbus_dev->stats.tx_dropped);
+    seq_printf(m, "TxHolds %llu\n", canbus_dev->stats.tx_holds);
+    show_can_cyclic(canbus_dev, m);
+
+    seq_printf(m, "TimedTx %llu\n", canbus_dev->stats.timed_tx);
+    show_histogram(m, "TimedLoadNs", &canbus_dev->stats.timed_load_hist);
+    show_histogram(m, "TimedTxNs", &canbus_dev->stats.timed_tx_hist);
+
+    show_can_errstate(canbus_dev, m);
+
+    seq_printf(m, "GatewayTx %llu\n", canbus_dev->stats.gateway_tx_count);
+    show_histogram(m, "GatewayLatencyNs", &canbus_dev->stats.gateway_latency_hist);
+    show_can_gateway(canbus_dev, m);
+    show_can_groups(canbus_dev, m);
+
+    show_lock_stats(m, "RegisterLock", &canbus_dev->register_lock.stats);
+    show_lock_stats(m, "ReaderLock", &canbus_dev->reader_lock.stats);
+    show_lock_stats(m, "TxLock", &canbus_dev->tx_lock.stats);
+
+    /*
+     *  The files can't be freed under us, and open() and close() don't
+     *  wait for us.
+     */
+    rcu_read_lock();
+
+    list_for_each_entry_rcu(file, &canbus_dev->reader_list, reader_list_entry){
 
-        file = list_entry(element, struct canbus_file_t, reader_list_entry);
-        
         if (file->signature != CANBUS_FILE_SIGNATURE){
             printk(KERN_ERR "File Signature check Failed! %s %d\n", __FILE__, __LINE__);
-            return 0;
+            break;
         }
 
         if (!file->accept_messages){
@@ -91,15 +199,72 @@ static int ta_canbus_proc_show(struct seq_file *m, void *v)
         seq_printf(m, "TxsDirect %llu\n", file->stats.write_transmits_directly_sent);
         seq_printf(m, "CurReadsQueued %u\n", file->stats.cur_rx_queue_count);
         seq_printf(m, "MaxReadsQueued %u\n", file->stats.max_rx_queue_count);
+
+        show_histogram(m, "IsrToEnqueueNs", &file->stats.isr_to_enqueue_hist);
+        show_histogram(m, "EnqueueToWakeupNs", &file->stats.enqueue_to_wakeup_hist);
+        show_histogram(m, "EnqueueToCopyNs", &file->stats.enqueue_to_copy_hist);
+        show_lock_stats(m, "RxLock", &file->rx_lock.stats);
+        seq_printf(m, "GroupFrames %llu\n", file->stats.group_frames);
+        seq_printf(m, "Classes 0x%x\n", file->classes);
+        seq_printf(m, "RxData %llu\n", file->stats.rx_data);
+        seq_printf(m, "RxStatus %llu\n", file->stats.rx_status);
+        seq_printf(m, "RxTxEcho %llu\n", file->stats.rx_tx_echo);
+        seq_printf(m, "StatusEvents %llu\n", file->stats.status_events);
+        seq_printf(m, "StatusCoalesced %llu\n", file->stats.status_coalesced);
+        seq_printf(m, "TxAborted %llu\n", file->stats.tx_aborted);
+        seq_printf(m, "TxRetried %llu\n", file->stats.tx_retried);
+        seq_printf(m, "TxDropped %llu\n", file->stats.tx_dropped);
+        seq_printf(m, "TxComplete %llu\n", file->stats.tx_complete);
+        seq_printf(m, "TxCompleteWakeups %llu\n", file->stats.tx_complete_wakeups);
+        seq_printf(m, "TxCompleteLost %llu\n", file->stats.tx_complete_lost);
     }
 
+    rcu_read_unlock();
+
     return 0;
 }
 
 
 static int ta_canbus_proc_open(struct inode *inode, struct file *file)
 {
-    return single_open(file, ta_canbus_proc_show, NULL);
+    return single_open(file, ta_canbus_proc_show, PDE_DATA(inode));
+}
+
+
+/*
+ *  Writing anything to the /proc file resets the device statistics.
+ *  e.g.  echo 1 > /proc/ta_canbus0
+ */
+static ssize_t ta_canbus_proc_write(struct file *file, const char __user *buf,
+                                    size_t count, loff_t *ppos)
+{
+    struct seq_file *m = file->private_data;
+    struct canbus_device_t *canbus_dev = m->private;
+    unsigned long flags;
+
+    if (canbus_dev->signature != CANBUS_DEVICE_SIGNATURE){
+        printk( KERN_ERR PRINTK_DEV_NAME 
+                "Failed signature check! %s %d\n", __FILE__, __LINE__);
+        return -EBADFD;
+    }
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&canbus_dev->register_lock, flags);
+    can_lock(&canbus_dev->reader_lock);
+    can_lock(&canbus_dev->tx_lock);
+
+    reset_can_device_stats(canbus_dev);
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    can_unlock(&canbus_dev->tx_lock);
+    can_unlock(&canbus_dev->reader_lock);
+    can_unlock_irqrestore(&canbus_dev->register_lock, flags);
+
+    return count;
 }
 
 
@@ -107,23 +272,27 @@ static const struct file_operations ta_canbus_proc_fops = {
     .owner      = THIS_MODULE,
     .open       = ta_canbus_proc_open,
     .read       = seq_read,
+    .write      = ta_canbus_proc_write,
     .llseek     = seq_lseek,
     .release    = single_release,
 };
 
 
+/*
+ *  /proc/ta_canbusN, one per device.
+ */
 int add_can_proc_files(struct canbus_device_t *dev)
 {
-    canbus_dev = dev;
-    proc_create("ta_canbus", 0, NULL, &ta_canbus_proc_fops);
+    if (!proc_create_data(dev->name, S_IRUGO | S_IWUSR, NULL, &ta_canbus_proc_fops, dev)){
+        return -ENOMEM;
+    }
     return 0;
 }
 
 
 int remove_can_proc_files(struct canbus_device_t *dev)
 {
-    canbus_dev = NULL;
-    remove_proc_entry("ta_canbus", NULL);
+    remove_proc_entry(dev->name, NULL);
     return 0;
 }
 
@@ -10,9 +10,11 @@
  *
  ***************************************************************************/
 #include "can_private.h"
+#include "can_trace.h"
 
 
-ssize_t can_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+static ssize_t 
+do_can_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
 {
     struct canbus_file_t *file;
     struct kcanbus_message *message;
@@ -20,6 +22,7 @@ ssize_t can_read (struct file *filp, char __user *buf, size_t count, loff_t *f_p
     ssize_t ret;
     unsigned long flags;
     struct canbus_device_t *dev;
+    u64 wakeup_ns;
 
     /*
      *  Recover our per file and per device data structures.
@@ -54,14 +57,14 @@ ssize_t can_read (struct file *filp, char __user *buf, size_t count, loff_t *f_p
     /*
      *  LOCK --------------------------------------------------------
      */
-    spin_lock_irqsave(&dev->register_lock, flags);
+    can_lock_irqsave(&file->rx_lock, flags);
 
     while (list_empty(&file->receive_queue)){
 
         /*
          *  UNLOCK --------------------------------------------------
          */
-        spin_unlock_irqrestore(&dev->register_lock, flags);
+        can_unlock_irqrestore(&file->rx_lock, flags);
 
         if ( wait_event_interruptible(  file->receive_wq, 
                     !list_empty(&file->receive_queue))){
@@ -71,7 +74,7 @@ ssize_t can_read (struct file *filp, char __user *buf, size_t count, loff_t *f_p
         /*
          *  LOCK --------------------------------------------------------
          */
-        spin_lock_irqsave(&dev->register_lock, flags);
+        can_lock_irqsave(&file->rx_lock, flags);
     }
 
     element = file->receive_queue.next;
@@ -80,20 +83,40 @@ ssize_t can_read (struct file *filp, char __user *buf, size_t count, loff_t *f_p
     
     file->stats.cur_rx_queue_count--;
 
+    if (message == file->status_pending){
+        file->status_pending = NULL;
+    }
+
     /*
      *  UNLOCK ------------------------------------------------------
      */
-    spin_unlock_irqrestore(&dev->register_lock, flags);
+    can_unlock_irqrestore(&file->rx_lock, flags);
+
+    wakeup_ns = can_clock_ns();
 
     if (copy_to_user(buf, &message->user_message, sizeof(CANBUS_MESSAGE))){
         ret = -EFAULT;
     }
     else{
         ret = sizeof(CANBUS_MESSAGE);
+        can_record_delivery(file, message, wakeup_ns, can_clock_ns());
     }
     
-    free_kcanbus_message(message);
+    free_kcanbus_message(dev, message);
 
     return ret;
 }
 
+
+ssize_t can_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    ssize_t ret;
+
+    trace_can_read_entry(filp->private_data, count);
+
+    ret = do_can_read(filp, buf, count, f_pos);
+
+    trace_can_read_exit(filp->private_data, ret);
+
+    return ret;
+}
@@ -0,0 +1,329 @@
+/****************************************************************************
+ *  can_splice.c
+ *
+ *  splice() from the device to a pipe, for loggers.  Instead of one
+ *  CANBUS_MESSAGE per read(), each call drains as much of the receive
+ *  queue as the pipe has room for into freshly allocated pages of
+ *  struct can_log_record_t, and hands the pages themselves to the pipe.
+ *  A logger then splices from the pipe to its file, and the frames are
+ *  never copied through user space at all.
+ *
+ *  Records never straddle pages, so every pipe buffer is a whole number
+ *  of records and the file ends up as a plain array of them.  The frames
+ *  stay allocated until splice_to_pipe() returns, and whatever the pipe
+ *  didn't take, full or interrupted, goes back at the head of the
+ *  receive queue for the next call.
+ *
+ ***************************************************************************/
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+
+#include "can_private.h"
+
+
+#define CAN_LOG_RECORDS_PER_PAGE    (PAGE_SIZE / sizeof(struct can_log_record_t))
+
+
+/*
+ *  The pages are ours alone, the generic ops just hold a reference.
+ */
+static const struct pipe_buf_operations can_splice_pipe_buf_ops = {
+    .can_merge =    0,
+    .map =          generic_pipe_buf_map,
+    .unmap =        generic_pipe_buf_unmap,
+    .confirm =      generic_pipe_buf_confirm,
+    .release =      generic_pipe_buf_release,
+    .steal =        generic_pipe_buf_steal,
+    .get =          generic_pipe_buf_get,
+};
+
+
+/**
+ *  splice_to_pipe() giving back a page the pipe didn't take.
+ */
+static void can_splice_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+    page_cache_release(spd->pages[i]);
+}
+
+
+static void can_log_record(struct can_log_record_t *record, const struct kcanbus_message *message)
+{
+    const CANBUS_MESSAGE *frame = &message->user_message;
+
+    memset(record, 0, sizeof(*record));
+
+    record->timestamp_ns = message->capture_ns;
+
+    if ((frame->Id & CANBUS_STATUS_CHANGE_FLAG) == CANBUS_STATUS_CHANGE_FLAG){
+        record->id = ((const CANBUS_STATUS_CHANGE *)frame)->Status1;
+        record->flags = CAN_LOG_STATUS;
+        return;
+    }
+
+    record->id = can_frame_id(frame);
+    if (frame->Type == CmtExtended){
+        record->flags = CAN_LOG_EXTENDED;
+    }
+    record->dlc = (unsigned char)min_t(unsigned int, frame->DataLength, 8);
+    memcpy(record->data, frame->Data, sizeof(record->data));
+}
+
+
+ssize_t can_splice_read(struct file *filp,
+                        loff_t *ppos,
+                        struct pipe_inode_info *pipe,
+                        size_t len,
+                        unsigned int flags)
+{
+    struct page *pages[PIPE_DEF_BUFFERS];
+    struct partial_page partial[PIPE_DEF_BUFFERS];
+    struct splice_pipe_desc spd = {
+        .pages =        pages,
+        .partial =      partial,
+        .nr_pages =     0,
+        .nr_pages_max = PIPE_DEF_BUFFERS,
+        .flags =        flags,
+        .ops =          &can_splice_pipe_buf_ops,
+        .spd_release =  can_splice_spd_release,
+    };
+    struct canbus_file_t *file;
+    struct canbus_device_t *dev;
+    struct kcanbus_message *message;
+    struct kcanbus_message *next;
+    struct kcanbus_message *status_message = NULL;
+    struct can_log_record_t *record = NULL;
+    LIST_HEAD(batch);
+    unsigned long irq_flags;
+    unsigned int max_records;
+    unsigned int num_records;
+    unsigned int num_pages;
+    unsigned int queued;
+    unsigned int room;
+    unsigned int records;
+    unsigned int taken;
+    u64 wakeup_ns;
+    u64 copy_ns;
+    ssize_t ret;
+    int i;
+
+    /*
+     *  Recover our per file and per device data structures.
+     *  Sanity check everything.
+     */
+    file = filp->private_data;
+    if (file->signature != CANBUS_FILE_SIGNATURE){
+        printk(KERN_ERR "Failed signature check! %s %d\n", __FILE__, __LINE__);
+        return -EBADFD;
+    }
+
+    dev = file->dev;
+    if (dev->signature != CANBUS_DEVICE_SIGNATURE){
+        printk(KERN_ERR "Failed signature check! %s %d\n", __FILE__, __LINE__);
+        return -EBADFD;
+    }
+
+    file->stats.splice_count++;
+
+    if (!file->accept_messages){
+        return -EBUSY;
+    }
+
+    max_records = len / sizeof(struct can_log_record_t);
+    if (!max_records){
+        return -EINVAL;
+    }
+
+    /*
+     *  Only take off the receive queue what the pipe can hold now, so
+     *  what it refuses is normally nothing.  Another writer can still
+     *  fill it first.
+     */
+    room = pipe->buffers - ACCESS_ONCE(pipe->nrbufs);
+    max_records = min_t(unsigned int, max_records, 
+                        max_t(unsigned int, room, 1) * CAN_LOG_RECORDS_PER_PAGE);
+
+WAIT_FOR_FRAMES:
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&file->rx_lock, irq_flags);
+
+    while (list_empty(&file->receive_queue)){
+
+        /*
+         *  UNLOCK --------------------------------------------------
+         */
+        can_unlock_irqrestore(&file->rx_lock, irq_flags);
+
+        if ((flags & SPLICE_F_NONBLOCK) || (filp->f_flags & O_NONBLOCK)){
+            return -EAGAIN;
+        }
+
+        if ( wait_event_interruptible(  file->receive_wq,
+                    !list_empty(&file->receive_queue))){
+            return -ERESTARTSYS;
+        }
+
+        /*
+         *  LOCK --------------------------------------------------------
+         */
+        can_lock_irqsave(&file->rx_lock, irq_flags);
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&file->rx_lock, irq_flags);
+
+    /*
+     *  Pages for what is queued now, anything arriving meanwhile waits
+     *  for the next call.
+     */
+    queued = max_t(unsigned int, ACCESS_ONCE(file->stats.cur_rx_queue_count), 1);
+    num_records = min_t(unsigned int, max_records, queued);
+    num_pages = DIV_ROUND_UP(num_records, CAN_LOG_RECORDS_PER_PAGE);
+    num_pages = min_t(unsigned int, num_pages, PIPE_DEF_BUFFERS);
+
+    for (i = 0; i<num_pages; i++){
+        pages[i] = alloc_page(GFP_KERNEL);
+        if (!pages[i]){
+            break;
+        }
+    }
+
+    num_pages = i;
+    if (!num_pages){
+        return -ENOMEM;
+    }
+
+    num_records = min_t(unsigned int, num_records, num_pages * CAN_LOG_RECORDS_PER_PAGE);
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&file->rx_lock, irq_flags);
+
+    records = 0;
+    while (records < num_records && !list_empty(&file->receive_queue)){
+
+        message = list_first_entry(&file->receive_queue, struct kcanbus_message, entry);
+        if (message == file->status_pending){
+            file->status_pending = NULL;
+            status_message = message;
+        }
+
+        list_move_tail(&message->entry, &batch);
+        records++;
+    }
+
+    file->stats.cur_rx_queue_count -= records;
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&file->rx_lock, irq_flags);
+
+    /*
+     *  Someone else reading the same file got there first.
+     */
+    if (!records){
+        for (i = 0; i<num_pages; i++){
+            page_cache_release(pages[i]);
+        }
+        goto WAIT_FOR_FRAMES;
+    }
+
+    wakeup_ns = can_clock_ns();
+
+    i = 0;
+    list_for_each_entry(message, &batch, entry){
+
+        if (!(i % CAN_LOG_RECORDS_PER_PAGE)){
+            record = page_address(pages[i / CAN_LOG_RECORDS_PER_PAGE]);
+        }
+
+        can_log_record(record++, message);
+        i++;
+    }
+
+    copy_ns = can_clock_ns();
+
+    /*
+     *  Hand over the pages we filled, and free any we didn't need.
+     */
+    spd.nr_pages = DIV_ROUND_UP(records, CAN_LOG_RECORDS_PER_PAGE);
+
+    for (i = 0; i<spd.nr_pages; i++){
+        unsigned int on_page = min_t(unsigned int, 
+                                     records - i * CAN_LOG_RECORDS_PER_PAGE, 
+                                     CAN_LOG_RECORDS_PER_PAGE);
+
+        partial[i].offset = 0;
+        partial[i].len = on_page * sizeof(struct can_log_record_t);
+        partial[i].private = 0;
+    }
+
+    for (i = spd.nr_pages; i<num_pages; i++){
+        page_cache_release(pages[i]);
+    }
+
+    ret = splice_to_pipe(pipe, &spd);
+
+    /*
+     *  It takes whole pages, so whole records, from the front.
+     */
+    taken = ret > 0 ? ret / sizeof(struct can_log_record_t) : 0;
+
+    list_for_each_entry_safe(message, next, &batch, entry){
+
+        if (!taken){
+            break;
+        }
+        taken--;
+
+        if (message == status_message){
+            status_message = NULL;
+        }
+
+        list_del(&message->entry);
+        can_record_delivery(file, message, wakeup_ns, copy_ns);
+        free_kcanbus_message(dev, message);
+
+        file->stats.splice_records++;
+        records--;
+    }
+
+    if (records){
+        /*
+         *  LOCK --------------------------------------------------------
+         */
+        can_lock_irqsave(&file->rx_lock, irq_flags);
+
+        list_splice_init(&batch, &file->receive_queue);
+        file->stats.cur_rx_queue_count += records;
+
+        /*
+         *  Unread again, unless the ISR has queued a newer one since.
+         */
+        if (status_message && !file->status_pending){
+            file->status_pending = status_message;
+        }
+
+        /*
+         *  UNLOCK ------------------------------------------------------
+         */
+        can_unlock_irqrestore(&file->rx_lock, irq_flags);
+
+        file->stats.splice_requeued += records;
+
+        /*
+         *  Another reader may have gone to sleep on the empty queue.
+         */
+        wake_up_interruptible(&file->receive_wq);
+    }
+
+    return ret;
+}
@@ -0,0 +1,117 @@
+/****************************************************************************
+ *  can_stats.c
+ *
+ *  Helpers for the statistics we keep in can_device_stats_t and
+ *  can_file_stats_t.  Recording samples is done inline from the hot
+ *  paths (see can_histogram_add()), everything here is for the slow
+ *  readers - /proc and the stats ioctls.
+ *
+ ***************************************************************************/
+#include <linux/math64.h>
+
+#include "can_private.h"
+
+
+bool can_lock_timing;
+module_param_named(lock_timing, can_lock_timing, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(lock_timing,
+                "Time lock waits and holds for the lock statistics (costs two clock reads per lock hold)");
+
+
+void can_histogram_reset(struct can_histogram_t *hist)
+{
+    memset(hist, 0, sizeof(struct can_histogram_t));
+}
+
+
+/**
+ *  Walk the buckets to find the given percentile, in parts per million
+ *  so we can ask for p99.9 (999000) without floating point.
+ *
+ *  Returns the top of the bucket the percentile lands in, so the answer
+ *  is never better than reality.  Returns 0 for an empty histogram.
+ */
+u64 can_histogram_percentile(   const struct can_histogram_t *hist,
+                                unsigned int per_million)
+{
+    u64 target;
+    u64 seen = 0;
+    u64 upper;
+    unsigned int i;
+
+    if (hist->count == 0){
+        return 0;
+    }
+
+    target = div_u64(hist->count * per_million + 999999, 1000000);
+    if (target == 0){
+        target = 1;
+    }
+
+    for (i = 0; i<CAN_HIST_NUM_BUCKETS; i++){
+
+        seen += hist->buckets[i];
+
+        if (seen >= target){
+
+            if (i == CAN_HIST_NUM_BUCKETS - 1){
+                return hist->max;
+            }
+
+            upper = CAN_HIST_BUCKET_LOWER(i + 1) - 1;
+
+            return (upper < hist->max) ? upper : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+
+/**
+ *  Clear all of the running device statistics.  The "cur" queue depth
+ *  and the CAN state are live state rather than history, so they
+ *  survive.  Caller holds
+ *  register_lock, reader_lock and tx_lock, so no lock's own statistics
+ *  are being written.
+ */
+void reset_can_device_stats(struct canbus_device_t *dev)
+{
+    unsigned int cur_tx_queue_count = dev->stats.cur_tx_queue_count;
+    unsigned int can_state = dev->stats.can_state;
+
+    memset(&dev->stats, 0, sizeof(struct can_device_stats_t));
+
+    dev->stats.cur_tx_queue_count = cur_tx_queue_count;
+    dev->stats.max_tx_queue_count = cur_tx_queue_count;
+
+    /*
+     *  Where we are stays, its time starts again.
+     */
+    dev->stats.can_state = can_state;
+    dev->state_entered_ns = can_clock_ns();
+
+    memset(&dev->register_lock.stats, 0, sizeof(struct can_lock_stats_t));
+    memset(&dev->reader_lock.stats, 0, sizeof(struct can_lock_stats_t));
+    memset(&dev->tx_lock.stats, 0, sizeof(struct can_lock_stats_t));
+}
+
+
+/**
+ *  Record the end to end latency of one received message handed to 
+ *  user space.  wakeup_ns is when the reader had the message in hand, 
+ *  copy_ns is when the copy to user space was done.
+ *  Caller serializes per file.
+ */
+void can_record_delivery(   struct canbus_file_t *file,
+                            const struct kcanbus_message *message,
+                            u64 wakeup_ns,
+                            u64 copy_ns)
+{
+    can_histogram_add(  &file->stats.isr_to_enqueue_hist, 
+                        message->enqueue_ns - message->capture_ns);
+    can_histogram_add(  &file->stats.enqueue_to_wakeup_hist, 
+                        wakeup_ns - message->enqueue_ns);
+    can_histogram_add(  &file->stats.enqueue_to_copy_hist, 
+                        copy_ns - message->enqueue_ns);
+}
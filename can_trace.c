@@ -0,0 +1,10 @@
+/****************************************************************************
+ *  can_trace.c
+ *
+ *  Instantiates the tracepoints declared in can_trace.h.
+ *
+ ***************************************************************************/
+#include "can_private.h"
+
+#define CREATE_TRACE_POINTS
+#include "can_trace.h"
@@ -0,0 +1,244 @@
+/****************************************************************************
+ *  can_trace.h
+ *
+ *  Kernel tracepoints for the receive, transmit and error paths, so
+ *  CANbus activity lines up with scheduler events in ftrace / perf.
+ *
+ *      echo 1 > /sys/kernel/debug/tracing/events/ta_canbus/enable
+ *
+ *  When the events are disabled each trace_*() call is a static key
+ *  no-op, and nothing inside TP_fast_assign() runs, including the
+ *  extra register reads in can_isr_entry.
+ *
+ *  Include this after can_private.h.  can_trace.c creates the events.
+ *
+ ***************************************************************************/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ta_canbus
+
+#if !defined(CAN_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define CAN_TRACE_H__
+
+#include <linux/tracepoint.h>
+
+
+TRACE_EVENT(can_isr_entry,
+
+    TP_PROTO(struct canbus_device_t *dev, unsigned int esr1),
+
+    TP_ARGS(dev, esr1),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(unsigned int, esr1)
+        __field(unsigned int, iflag1)
+        __field(unsigned int, iflag2)
+    ),
+
+    TP_fast_assign(
+        __entry->id = dev->id;
+        __entry->esr1 = esr1;
+        __entry->iflag1 = ioread32(&dev->registers->IFLAG1);
+        __entry->iflag2 = ioread32(&dev->registers->IFLAG2);
+    ),
+
+    TP_printk("id=%d esr1=0x%08x iflag1=0x%08x iflag2=0x%08x",
+        __entry->id, __entry->esr1, __entry->iflag1, __entry->iflag2)
+);
+
+
+TRACE_EVENT(can_isr_exit,
+
+    TP_PROTO(struct canbus_device_t *dev, unsigned int mb_count, u64 duration_ns),
+
+    TP_ARGS(dev, mb_count, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(unsigned int, mb_count)
+        __field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->id = dev->id;
+        __entry->mb_count = mb_count;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("id=%d mb_count=%u duration_ns=%llu",
+        __entry->id, __entry->mb_count, __entry->duration_ns)
+);
+
+
+TRACE_EVENT(can_rx_mailbox,
+
+    TP_PROTO(   struct canbus_device_t *dev, int mb_index,
+                const CANBUS_MESSAGE *message, unsigned int timestamp),
+
+    TP_ARGS(dev, mb_index, message, timestamp),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(int, mb_index)
+        __field(unsigned int, can_id)
+        __field(unsigned int, type)
+        __field(unsigned int, dlc)
+        __field(unsigned int, timestamp)
+    ),
+
+    TP_fast_assign(
+        __entry->id = dev->id;
+        __entry->mb_index = mb_index;
+        __entry->can_id = message->Id;
+        __entry->type = message->Type;
+        __entry->dlc = message->DataLength;
+        __entry->timestamp = timestamp;
+    ),
+
+    TP_printk("id=%d mb=%d can_id=0x%08x type=%u dlc=%u timestamp=%u",
+        __entry->id, __entry->mb_index, __entry->can_id,
+        __entry->type, __entry->dlc, __entry->timestamp)
+);
+
+
+TRACE_EVENT(can_rx_enqueue,
+
+    TP_PROTO(struct canbus_file_t *file, const CANBUS_MESSAGE *message),
+
+    TP_ARGS(file, message),
+
+    TP_STRUCT__entry(
+        __field(const void *, file)
+        __field(unsigned int, can_id)
+        __field(unsigned int, queue_depth)
+    ),
+
+    TP_fast_assign(
+        __entry->file = file;
+        __entry->can_id = message->Id;
+        __entry->queue_depth = file->stats.cur_rx_queue_count;
+    ),
+
+    TP_printk("file=%p can_id=0x%08x queue_depth=%u",
+        __entry->file, __entry->can_id, __entry->queue_depth)
+);
+
+
+DECLARE_EVENT_CLASS(can_file_io,
+
+    TP_PROTO(const void *file, long value),
+
+    TP_ARGS(file, value),
+
+    TP_STRUCT__entry(
+        __field(const void *, file)
+        __field(long, value)
+    ),
+
+    TP_fast_assign(
+        __entry->file = file;
+        __entry->value = value;
+    ),
+
+    TP_printk("file=%p value=%ld", __entry->file, __entry->value)
+);
+
+/*
+ *  value is the requested count on entry, the return value on exit.
+ */
+DEFINE_EVENT(can_file_io, can_read_entry,
+    TP_PROTO(const void *file, long value),
+    TP_ARGS(file, value));
+
+DEFINE_EVENT(can_file_io, can_read_exit,
+    TP_PROTO(const void *file, long value),
+    TP_ARGS(file, value));
+
+DEFINE_EVENT(can_file_io, can_write_entry,
+    TP_PROTO(const void *file, long value),
+    TP_ARGS(file, value));
+
+DEFINE_EVENT(can_file_io, can_write_exit,
+    TP_PROTO(const void *file, long value),
+    TP_ARGS(file, value));
+
+
+TRACE_EVENT(can_tx_load,
+
+    TP_PROTO(struct canbus_device_t *dev, const CANBUS_MESSAGE *message),
+
+    TP_ARGS(dev, message),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(unsigned int, can_id)
+        __field(unsigned int, type)
+        __field(unsigned int, dlc)
+    ),
+
+    TP_fast_assign(
+        __entry->id = dev->id;
+        __entry->can_id = message->Id;
+        __entry->type = message->Type;
+        __entry->dlc = message->DataLength;
+    ),
+
+    TP_printk("id=%d can_id=0x%08x type=%u dlc=%u",
+        __entry->id, __entry->can_id, __entry->type, __entry->dlc)
+);
+
+
+TRACE_EVENT(can_tx_complete,
+
+    TP_PROTO(struct canbus_device_t *dev, unsigned int queue_depth),
+
+    TP_ARGS(dev, queue_depth),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(unsigned int, queue_depth)
+    ),
+
+    TP_fast_assign(
+        __entry->id = dev->id;
+        __entry->queue_depth = queue_depth;
+    ),
+
+    TP_printk("id=%d queue_depth=%u", __entry->id, __entry->queue_depth)
+);
+
+
+TRACE_EVENT(can_tx_ack_abort,
+
+    TP_PROTO(struct canbus_device_t *dev, unsigned int esr1, unsigned int dropped),
+
+    TP_ARGS(dev, esr1, dropped),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(unsigned int, esr1)
+        __field(unsigned int, dropped)
+    ),
+
+    TP_fast_assign(
+        __entry->id = dev->id;
+        __entry->esr1 = esr1;
+        __entry->dropped = dropped;
+    ),
+
+    TP_printk("id=%d esr1=0x%08x dropped=%u",
+        __entry->id, __entry->esr1, __entry->dropped)
+);
+
+#endif /* CAN_TRACE_H__ */
+
+
+/*
+ *  This part must be outside the include guard.
+ *  We are an out of tree module, so Kbuild adds -I$(src) for can_trace.o.
+ */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE can_trace
+#include <trace/define_trace.h>
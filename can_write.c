@@ -3,22 +3,25 @@
  *
  *  The write() API is how we transmit a CANbus message.  Everything between
  *  this driver and user space is done in terms of the CANBUS_MESSAGE data
- *  structure.
+ *  structure.  A struct can_tx_write_t is a CANBUS_MESSAGE with a cookie
+ *  for its TX complete record, see tx_complete.c.
  *
  *  Future optimizations could include allowing writing multiples of a 
  *  message.
  ***************************************************************************/
 #include "can_private.h"
+#include "can_trace.h"
 
 
-ssize_t can_write ( struct file *filp, const char __user *buf, 
-                    size_t count, loff_t *f_pos)
+static ssize_t 
+do_can_write(   struct file *filp, const char __user *buf, 
+                size_t count, loff_t *f_pos)
 {
     struct kcanbus_message *message;
     struct canbus_file_t *file;
     struct canbus_device_t *dev;
     unsigned int real_data_size;
-    int message_sent;
+    size_t message_size = count;
     unsigned long flags;
 
     /*
@@ -39,12 +42,15 @@ ssize_t can_write ( struct file *filp, const char __user *buf,
 
     file->stats.write_count++;
 
-    if ( (count > sizeof(CANBUS_MESSAGE)) || 
+    if (count == sizeof(struct can_tx_write_t)){
+        message_size = sizeof(CANBUS_MESSAGE);
+    }
+    else if ( (count > sizeof(CANBUS_MESSAGE)) || 
             (count < (sizeof(CANBUS_MESSAGE) - 8))) {
         return -EPROTO;
     }
 
-    message = alloc_kcanbus_message();
+    message = alloc_kcanbus_message(dev);
     if (!message){
         return -ENOMEM;
     }
@@ -52,85 +58,87 @@ ssize_t can_write ( struct file *filp, const char __user *buf,
     memset(message, 0, sizeof(struct kcanbus_message));
     INIT_LIST_HEAD(&message->entry);
     message->signature = KCANBUS_SIGNATURE;
+    message->tx_file = file;
+
+    if (copy_from_user(&message->user_message, buf, message_size)){
+        printk(KERN_ERR "Bad user write buffer!\n");
+        free_kcanbus_message(dev, message);
+        return -EFAULT;
+    }
 
-    if (copy_from_user(&message->user_message, buf, count)){
+    if (message_size != count &&
+        copy_from_user( &message->tx_cookie, 
+                        buf + offsetof(struct can_tx_write_t, cookie), 
+                        sizeof(message->tx_cookie))){
         printk(KERN_ERR "Bad user write buffer!\n");
-        free_kcanbus_message(message);
+        free_kcanbus_message(dev, message);
         return -EFAULT;
     }
 
     if ((message->user_message.Type != CmtStandard) &&
         (message->user_message.Type != CmtExtended)){
         printk(KERN_ERR "Bad message type!\n");
-        free_kcanbus_message(message);
+        free_kcanbus_message(dev, message);
         return -EPROTO;
     }
 
     if (message->user_message.Id & 0xE0000000){
         printk(KERN_ERR "Invalid message id!\n");
-        free_kcanbus_message(message);
+        free_kcanbus_message(dev, message);
         return -EPROTO;
     }
 
     real_data_size = sizeof(CANBUS_MESSAGE) - 8 + message->user_message.DataLength;
-    if (real_data_size > count){
+    if (real_data_size > message_size){
         printk(KERN_ERR "Data length mismatch!\n");
-        free_kcanbus_message(message);
+        free_kcanbus_message(dev, message);
         return -EPROTO;
     }
 
     if(message->user_message.DataLength > 8){
         printk(KERN_ERR "Invalid Data length!\n");
-        free_kcanbus_message(message);
+        free_kcanbus_message(dev, message);
         return -EPROTO;
     }
 
     /*
      *  LOCK --------------------------------------------------------
      */
-    spin_lock_irqsave(&dev->register_lock, flags);
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    can_tx_complete_write(file, message);
 
     /*
      *  If the HW is busy, add this to the tx queue.  Otherwise 
-     *  send it out directly from here.
+     *  send it out directly from here.  Either way the driver has it
+     *  until it has gone out, see tx.c.
      */
-    if (dev->transmit_in_progress){
-
-        list_add_tail(&message->entry, &dev->transmit_queue);
-
-        file->stats.write_transmits_queued++;
-        message_sent = 0;
-
-        dev->stats.cur_tx_queue_count++;
-        if (dev->stats.cur_tx_queue_count > dev->stats.max_tx_queue_count){
-            dev->stats.max_tx_queue_count = dev->stats.cur_tx_queue_count;
-        }
+    if (can_tx_submit(dev, message)){
+        file->stats.write_transmits_directly_sent++;
     }
     else{
-        file->stats.write_transmits_directly_sent++;
-        message_sent = 1;
-
-        dev->transmit_in_progress = 1;
-
-        hw_transmit_message(dev, &message->user_message);
-        hw_enable_message_buffer_interrupt(dev, TX_MB);
+        file->stats.write_transmits_queued++;
     }
 
     /*
      *  UNLOCK --------------------------------------------------------
      */
-    spin_unlock_irqrestore(&dev->register_lock, flags);
-
-    /*
-     *  If we sent it right from here, the ISR can't free it
-     *  because it never gets dequeued from the isr.  We need to 
-     *  free it here.
-     */
-    if(message_sent){
-        free_kcanbus_message(message);
-    }
+    can_unlock_irqrestore(&dev->tx_lock, flags);
 
     return count;
 }
 
 
+ssize_t can_write ( struct file *filp, const char __user *buf, 
+                    size_t count, loff_t *f_pos)
+{
+    ssize_t ret;
+
+    trace_can_write_entry(filp->private_data, count);
+
+    ret = do_can_write(filp, buf, count, f_pos);
+
+    trace_can_write_exit(filp->private_data, ret);
+
+    return ret;
+}
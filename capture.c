@@ -0,0 +1,471 @@
+/****************************************************************************
+ *  capture.c
+ *
+ *  Oscilloscope style triggered capture.  While armed, the ISR writes
+ *  every frame (and status change) into a ring of 
+ *  pre_frames + post_frames + 1 entries.  When one matches the trigger
+ *  it writes post_frames more and stops, which leaves the ring holding
+ *  exactly the window around the trigger, however long user space
+ *  takes to come and get it.  Nothing is copied in the ISR beyond the
+ *  one entry per frame, and nothing at all when capture is off or
+ *  frozen.
+ *
+ *  The buffer is vmalloc_user() memory, so it can be mmap()ed as well
+ *  as copied out with CAN_IOCTL_GET_CAPTURE.  It is only replaced or 
+ *  freed under capture->mutex, and not while it is mapped.
+ *
+ ***************************************************************************/
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+
+#include "can_private.h"
+
+
+#define CAN_CAPTURE_TRIGGERS    (CAN_CAPTURE_ON_FRAME | CAN_CAPTURE_ON_STATUS)
+
+
+void init_can_capture(struct canbus_device_t *dev)
+{
+    struct can_capture *capture = &dev->capture;
+
+    memset(&capture->config, 0, sizeof(capture->config));
+    capture->buffer = NULL;
+    capture->slots = 0;
+    capture->buffer_size = 0;
+    capture->state = CAN_CAPTURE_OFF;
+    capture->triggers = 0;
+    mutex_init(&capture->mutex);
+    atomic_set(&capture->mapped, 0);
+    init_waitqueue_head(&capture->wq);
+}
+
+
+void destroy_can_capture(struct canbus_device_t *dev)
+{
+    struct can_capture *capture = &dev->capture;
+
+    capture->state = CAN_CAPTURE_OFF;
+
+    vfree(capture->buffer);
+    capture->buffer = NULL;
+}
+
+
+
+static int capture_triggers( const struct can_capture_config_t *config,
+                             const CANBUS_MESSAGE *message,
+                             int is_status)
+{
+    const CANBUS_STATUS_CHANGE *status;
+    unsigned int id;
+    int i;
+
+    if (is_status){
+        status = (const CANBUS_STATUS_CHANGE *)message;
+        return (config->trigger & CAN_CAPTURE_ON_STATUS) && 
+                (status->Status1 & config->status_mask);
+    }
+
+    if (!(config->trigger & CAN_CAPTURE_ON_FRAME)){
+        return 0;
+    }
+
+    if (config->match_type != CmtUndefined && config->match_type != message->Type){
+        return 0;
+    }
+
+    id = can_frame_id(message);
+    if ((id ^ config->match_id) & config->match_mask){
+        return 0;
+    }
+
+    for (i = 0; i<8; i++){
+        if ((message->Data[i] & config->data_mask[i]) != config->data_value[i]){
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/**
+ *  Write one entry, and fire or count down the trigger.  Only called 
+ *  through can_capture_add(), when ARMED or TRIGGERED.  register_lock 
+ *  held.
+ */
+void can_capture_record(struct canbus_device_t *dev,
+                        const CANBUS_MESSAGE *message,
+                        u64 ns,
+                        int is_status)
+{
+    struct can_capture *capture = &dev->capture;
+    struct can_history_entry_t *entry;
+
+    entry = &capture->buffer[capture->next_slot];
+    entry->seq = dev->history.head;
+    entry->timestamp_ns = ns;
+    memcpy(&entry->message, message, sizeof(CANBUS_MESSAGE));
+
+    if (capture->state == CAN_CAPTURE_ARMED){
+
+        if (capture_triggers(&capture->config, message, is_status)){
+            capture->state = CAN_CAPTURE_TRIGGERED;
+            capture->trigger_written = capture->written;
+            capture->trigger_seq = entry->seq;
+            capture->trigger_ns = ns;
+            capture->remaining = capture->config.post_frames;
+            capture->triggers++;
+        }
+    }
+    else{
+        capture->remaining--;
+    }
+
+    capture->written++;
+    if (++capture->next_slot == capture->slots){
+        capture->next_slot = 0;
+    }
+
+    if (capture->state == CAN_CAPTURE_TRIGGERED && capture->remaining == 0){
+        capture->state = CAN_CAPTURE_FROZEN;
+        wake_up_interruptible(&capture->wq);
+    }
+}
+
+
+
+/*
+ *  Start over with the current buffer and config.  register_lock held.
+ */
+static void capture_arm(struct can_capture *capture)
+{
+    capture->next_slot = 0;
+    capture->written = 0;
+    capture->remaining = 0;
+    capture->trigger_written = 0;
+    capture->trigger_seq = 0;
+    capture->trigger_ns = 0;
+    capture->state = CAN_CAPTURE_ARMED;
+}
+
+
+static int check_capture_config(const struct can_capture_config_t *config)
+{
+    if (config->trigger & ~CAN_CAPTURE_TRIGGERS){
+        return -EINVAL;
+    }
+
+    if (config->match_type != CmtUndefined && 
+        config->match_type != CmtStandard &&
+        config->match_type != CmtExtended){
+        return -EINVAL;
+    }
+
+    if (config->pre_frames >= CAN_CAPTURE_MAX_FRAMES ||
+        config->post_frames >= CAN_CAPTURE_MAX_FRAMES - config->pre_frames){
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+
+static long set_capture(struct canbus_device_t *dev, unsigned long arg)
+{
+    struct can_capture *capture = &dev->capture;
+    struct can_capture_config_t config;
+    struct can_history_entry_t *buffer = NULL;
+    struct can_history_entry_t *old_buffer = NULL;
+    unsigned long buffer_size = 0;
+    unsigned int slots = 0;
+    unsigned long flags;
+    long ret;
+
+    if (copy_from_user(&config, (void __user *)arg, sizeof(config))){
+        return -EFAULT;
+    }
+
+    ret = check_capture_config(&config);
+    if (ret){
+        return ret;
+    }
+
+    if (config.trigger){
+        slots = config.pre_frames + config.post_frames + 1;
+        buffer_size = PAGE_ALIGN(slots * sizeof(struct can_history_entry_t));
+    }
+
+    mutex_lock(&capture->mutex);
+
+    /*
+     *  Same size, same buffer, so a mapping of it stays good.
+     */
+    if (buffer_size != capture->buffer_size){
+
+        if (atomic_read(&capture->mapped)){
+            ret = -EBUSY;
+            goto EXIT;
+        }
+
+        if (buffer_size){
+            buffer = vmalloc_user(buffer_size);
+            if (!buffer){
+                ret = -ENOMEM;
+                goto EXIT;
+            }
+        }
+    }
+    else{
+        buffer = capture->buffer;
+    }
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->register_lock, flags);
+
+    old_buffer = capture->buffer;
+
+    capture->config = config;
+    capture->buffer = buffer;
+    capture->buffer_size = buffer_size;
+    capture->slots = slots;
+
+    if (buffer){
+        capture_arm(capture);
+    }
+    else{
+        capture->state = CAN_CAPTURE_OFF;
+    }
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->register_lock, flags);
+
+    if (old_buffer != buffer){
+        vfree(old_buffer);
+    }
+
+    /*
+     *  Anyone waiting on a capture that just went away.
+     */
+    wake_up_interruptible(&capture->wq);
+
+EXIT:
+    mutex_unlock(&capture->mutex);
+
+    return ret;
+}
+
+
+static long arm_capture(struct canbus_device_t *dev)
+{
+    struct can_capture *capture = &dev->capture;
+    unsigned long flags;
+    long ret = 0;
+
+    mutex_lock(&capture->mutex);
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->register_lock, flags);
+
+    if (capture->buffer){
+        capture_arm(capture);
+    }
+    else{
+        ret = -ENODEV;
+    }
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->register_lock, flags);
+
+    mutex_unlock(&capture->mutex);
+
+    return ret;
+}
+
+
+static long get_capture(struct canbus_device_t *dev, unsigned long arg)
+{
+    struct can_capture *capture = &dev->capture;
+    struct can_capture_request_t request;
+    struct can_history_entry_t __user *entries;
+    unsigned int count;
+    unsigned int first;
+    unsigned long flags;
+    long ret = 0;
+
+    if (copy_from_user(&request, (void __user *)arg, sizeof(request))){
+        return -EFAULT;
+    }
+
+    if (request.wait){
+        ret = wait_event_interruptible(capture->wq, 
+                    ACCESS_ONCE(capture->state) == CAN_CAPTURE_FROZEN ||
+                    ACCESS_ONCE(capture->state) == CAN_CAPTURE_OFF);
+        if (ret){
+            return ret;
+        }
+    }
+
+    mutex_lock(&capture->mutex);
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->register_lock, flags);
+
+    request.state = capture->state;
+    request.slots = capture->slots;
+    request.triggers = capture->triggers;
+    request.num_entries = 0;
+    request.window = 0;
+    request.first_slot = 0;
+    request.trigger_entry = 0;
+    request.trigger_seq = capture->trigger_seq;
+    request.trigger_ns = capture->trigger_ns;
+
+    if (capture->state == CAN_CAPTURE_FROZEN){
+        request.window = (unsigned int)min_t(u64, capture->written, capture->slots);
+        request.first_slot = (capture->next_slot + capture->slots - request.window) % capture->slots;
+        request.trigger_entry = (unsigned int)(capture->trigger_written - 
+                                                (capture->written - request.window));
+    }
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->register_lock, flags);
+
+    /*
+     *  Frozen, and the mutex keeps it that way, so copy straight out
+     *  of the buffer.  The window may wrap.
+     */
+    entries = (struct can_history_entry_t __user *)(unsigned long)request.entries;
+    count = min(request.window, request.max_entries);
+    first = min(count, capture->slots - request.first_slot);
+
+    if (count){
+        if (copy_to_user(   entries, &capture->buffer[request.first_slot],
+                            first * sizeof(struct can_history_entry_t)) ||
+            copy_to_user(   &entries[first], capture->buffer,
+                            (count - first) * sizeof(struct can_history_entry_t))){
+            ret = -EFAULT;
+        }
+        request.num_entries = count;
+    }
+
+    mutex_unlock(&capture->mutex);
+
+    if (!ret && copy_to_user((void __user *)arg, &request, sizeof(request))){
+        ret = -EFAULT;
+    }
+
+    return ret;
+}
+
+
+long can_capture_ioctl( struct canbus_device_t *dev, 
+                        unsigned int cmd, 
+                        unsigned long arg)
+{
+    switch(cmd){
+
+        case CAN_IOCTL_SET_CAPTURE:
+            return set_capture(dev, arg);
+
+        case CAN_IOCTL_ARM_CAPTURE:
+            return arm_capture(dev);
+
+        case CAN_IOCTL_GET_CAPTURE:
+            return get_capture(dev, arg);
+    }
+
+    return -EINVAL;
+}
+
+
+
+static void capture_vma_open(struct vm_area_struct *vma)
+{
+    struct canbus_device_t *dev = vma->vm_private_data;
+
+    atomic_inc(&dev->capture.mapped);
+}
+
+
+static void capture_vma_close(struct vm_area_struct *vma)
+{
+    struct canbus_device_t *dev = vma->vm_private_data;
+
+    atomic_dec(&dev->capture.mapped);
+}
+
+
+static const struct vm_operations_struct capture_vm_ops = {
+    .open =     capture_vma_open,
+    .close =    capture_vma_close,
+};
+
+
+/**
+ *  Map the capture buffer, read only.  See struct can_capture_request_t
+ *  for the layout.
+ */
+int can_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct canbus_file_t *file;
+    struct canbus_device_t *dev;
+    struct can_capture *capture;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    int ret;
+
+    file = filp->private_data;
+    if (file->signature != CANBUS_FILE_SIGNATURE){
+        printk(KERN_ERR "Failed signature check! %s %d\n", __FILE__, __LINE__);
+        return -EBADFD;
+    }
+
+    dev = file->dev;
+    if (dev->signature != CANBUS_DEVICE_SIGNATURE){
+        printk(KERN_ERR "Failed signature check! %s %d\n", __FILE__, __LINE__);
+        return -EBADFD;
+    }
+
+    if (vma->vm_flags & VM_WRITE){
+        return -EPERM;
+    }
+
+    capture = &dev->capture;
+
+    mutex_lock(&capture->mutex);
+
+    if (!capture->buffer){
+        ret = -ENODEV;
+    }
+    else if (vma->vm_pgoff > (capture->buffer_size >> PAGE_SHIFT) ||
+             size > capture->buffer_size - (vma->vm_pgoff << PAGE_SHIFT)){
+        ret = -EINVAL;
+    }
+    else{
+        ret = remap_vmalloc_range(vma, capture->buffer, vma->vm_pgoff);
+    }
+
+    if (!ret){
+        vma->vm_flags &= ~VM_MAYWRITE;
+        vma->vm_ops = &capture_vm_ops;
+        vma->vm_private_data = dev;
+        capture_vma_open(vma);
+    }
+
+    mutex_unlock(&capture->mutex);
+
+    return ret;
+}
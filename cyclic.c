@@ -0,0 +1,508 @@
+/****************************************************************************
+ *  cyclic.c
+ *
+ *  Frames the driver transmits by itself at a fixed period, for the
+ *  heartbeats and setpoints that a user space thread would otherwise
+ *  have to wake up for every few ms.  Each job has its own hrtimer, and
+ *  the callback queues a copy of the job's frame through can_tx_submit(),
+ *  as if its file had written it.  So a cyclic frame is dropped, held or
+ *  reported under the TX policy like any other.
+ *
+ *  The jobs and their frames are under the device's tx_lock, which the
+ *  timer callback takes to submit anyway.  That is what makes
+ *  CAN_IOCTL_UPDATE_CYCLIC atomic: the callback copies the frame either
+ *  before or after the new data goes in, never halfway.
+ *
+ *  A timer that fires too late for one or more periods sends one frame
+ *  and counts the rest as missed, rather than sending a burst to catch
+ *  up.  It stays on the original grid either way.
+ *
+ ***************************************************************************/
+#include <linux/hrtimer.h>
+#include <linux/seq_file.h>
+
+#include "can_private.h"
+
+
+/**
+ *  Queue one copy of job's frame.  tx_lock held.
+ */
+static void cyclic_send(struct canbus_device_t *dev, struct can_cyclic *job, u64 now_ns)
+{
+    struct kcanbus_message *message;
+    u64 period_ns;
+
+    if (dev->stats.cur_tx_queue_count >= CAN_CYCLIC_MAX_QUEUED){
+        job->skipped++;
+        return;
+    }
+
+    message = alloc_kcanbus_message(dev);
+    if (!message){
+        job->skipped++;
+        return;
+    }
+
+    memset(message, 0, sizeof(struct kcanbus_message));
+    INIT_LIST_HEAD(&message->entry);
+    message->signature = KCANBUS_SIGNATURE;
+    message->tx_file = job->owner;
+    message->user_message = job->config.message;
+
+    can_tx_submit(dev, message);
+
+    if (job->last_ns){
+        period_ns = now_ns - job->last_ns;
+
+        if (!job->min_period_ns || period_ns < job->min_period_ns){
+            job->min_period_ns = period_ns;
+        }
+        if (period_ns > job->max_period_ns){
+            job->max_period_ns = period_ns;
+        }
+
+        can_histogram_add(  &job->jitter_hist,
+                            period_ns > job->period_ns ?
+                                period_ns - job->period_ns : job->period_ns - period_ns);
+    }
+
+    job->last_ns = now_ns;
+    job->sent++;
+}
+
+
+static enum hrtimer_restart can_cyclic_timer_fn(struct hrtimer *timer)
+{
+    struct can_cyclic *job = container_of(timer, struct can_cyclic, timer);
+    struct canbus_device_t *dev = job->dev;
+    enum hrtimer_restart restart = HRTIMER_NORESTART;
+    unsigned long flags;
+    u64 overruns;
+    u64 due_ns;
+    u64 now_ns;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    /*
+     *  Deleted while we waited for the lock.
+     */
+    if (!job->active){
+        goto UNLOCK;
+    }
+
+    now_ns = can_clock_ns();
+    due_ns = ktime_to_ns(hrtimer_get_expires(timer));
+
+    can_histogram_add(&job->late_hist, now_ns > due_ns ? now_ns - due_ns : 0);
+
+    cyclic_send(dev, job, now_ns);
+
+    if (job->config.count && job->sent >= job->config.count){
+        job->active = 0;
+        goto UNLOCK;
+    }
+
+    overruns = hrtimer_forward(timer, ns_to_ktime(now_ns), ns_to_ktime(job->period_ns));
+    if (overruns > 1){
+        job->missed += overruns - 1;
+    }
+
+    restart = HRTIMER_RESTART;
+
+UNLOCK:
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+
+    return restart;
+}
+
+
+void init_can_cyclic(struct canbus_device_t *dev)
+{
+    INIT_LIST_HEAD(&dev->cyclic_jobs);
+    dev->num_cyclic = 0;
+    dev->next_cyclic_id = 1;
+}
+
+
+/**
+ *  Stop the jobs on dead and free them.  They are off the device's list
+ *  and inactive, so a callback already waiting for tx_lock does nothing.
+ *  Process context, no locks held.
+ */
+static void free_cyclic_jobs(struct list_head *dead)
+{
+    struct can_cyclic *job;
+    struct can_cyclic *next;
+
+    list_for_each_entry_safe(job, next, dead, entry){
+        hrtimer_cancel(&job->timer);
+        kfree(job);
+    }
+}
+
+
+/**
+ *  No more ioctls, stop and free every job.
+ */
+void destroy_can_cyclic(struct canbus_device_t *dev)
+{
+    struct can_cyclic *job;
+    unsigned long flags;
+    LIST_HEAD(dead);
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    list_for_each_entry(job, &dev->cyclic_jobs, entry){
+        job->active = 0;
+    }
+
+    list_splice_init(&dev->cyclic_jobs, &dead);
+    dev->num_cyclic = 0;
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+
+    free_cyclic_jobs(&dead);
+}
+
+
+/**
+ *  file is closing, its jobs stop with it.
+ */
+void can_cyclic_release(struct canbus_file_t *file)
+{
+    struct canbus_device_t *dev = file->dev;
+    struct can_cyclic *job;
+    struct can_cyclic *next;
+    unsigned long flags;
+    LIST_HEAD(dead);
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    list_for_each_entry_safe(job, next, &dev->cyclic_jobs, entry){
+        if (job->owner == file){
+            job->active = 0;
+            list_move_tail(&job->entry, &dead);
+            dev->num_cyclic--;
+        }
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+
+    free_cyclic_jobs(&dead);
+}
+
+
+
+static int check_cyclic(const struct can_cyclic_t *config)
+{
+    const CANBUS_MESSAGE *message = &config->message;
+
+    if (config->period_us < CAN_CYCLIC_MIN_PERIOD_US ||
+        config->period_us > CAN_CYCLIC_MAX_PERIOD_US){
+        return -EINVAL;
+    }
+
+    /*
+     *  The same as a write().
+     */
+    if (message->Type != CmtStandard && message->Type != CmtExtended){
+        return -EPROTO;
+    }
+
+    if (message->Id & 0xE0000000){
+        return -EPROTO;
+    }
+
+    if (message->DataLength > 8){
+        return -EPROTO;
+    }
+
+    return 0;
+}
+
+
+static long add_cyclic(struct canbus_file_t *file, unsigned long arg)
+{
+    struct canbus_device_t *dev = file->dev;
+    struct can_cyclic *job;
+    unsigned long flags;
+    u64 now_ns;
+    long ret = 0;
+
+    job = kzalloc(sizeof(struct can_cyclic), GFP_KERNEL);
+    if (!job){
+        return -ENOMEM;
+    }
+
+    if (copy_from_user(&job->config, (void __user *)arg, sizeof(struct can_cyclic_t))){
+        ret = -EFAULT;
+        goto FAILED;
+    }
+
+    ret = check_cyclic(&job->config);
+    if (ret){
+        goto FAILED;
+    }
+
+    job->dev = dev;
+    job->owner = file;
+    job->period_ns = (u64)job->config.period_us * NSEC_PER_USEC;
+    job->active = 1;
+
+    hrtimer_init(&job->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    job->timer.function = can_cyclic_timer_fn;
+
+    now_ns = can_clock_ns();
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    if (dev->num_cyclic >= CAN_MAX_CYCLIC){
+        ret = -ENOSPC;
+    }
+    else{
+        job->config.job_id = dev->next_cyclic_id++;
+        list_add_tail(&job->entry, &dev->cyclic_jobs);
+        dev->num_cyclic++;
+
+        hrtimer_start(  &job->timer,
+                        ns_to_ktime(max_t(u64, job->config.start_ns, now_ns)),
+                        HRTIMER_MODE_ABS);
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+
+    if (ret){
+        goto FAILED;
+    }
+
+    /*
+     *  The job is running, so a bad buffer here only loses the ID.
+     */
+    if (copy_to_user(   &((struct can_cyclic_t __user *)arg)->job_id,
+                        &job->config.job_id, sizeof(unsigned int))){
+        return -EFAULT;
+    }
+
+    return 0;
+
+FAILED:
+    kfree(job);
+    return ret;
+}
+
+
+static struct can_cyclic *find_cyclic(struct canbus_device_t *dev, unsigned int job_id)
+{
+    struct can_cyclic *job;
+
+    list_for_each_entry(job, &dev->cyclic_jobs, entry){
+        if (job->config.job_id == job_id){
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+
+static long update_cyclic(struct canbus_device_t *dev, unsigned long arg)
+{
+    struct can_cyclic_update_t update;
+    struct can_cyclic *job;
+    unsigned long flags;
+
+    if (copy_from_user(&update, (void __user *)arg, sizeof(struct can_cyclic_update_t))){
+        return -EFAULT;
+    }
+
+    if (update.data_length > 8){
+        return -EPROTO;
+    }
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    job = find_cyclic(dev, update.job_id);
+    if (job){
+        job->config.message.DataLength = update.data_length;
+        memcpy(job->config.message.Data, update.data, 8);
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+
+    return job ? 0 : -ENOENT;
+}
+
+
+static long delete_cyclic(struct canbus_device_t *dev, unsigned long arg)
+{
+    struct can_cyclic *job;
+    unsigned int job_id;
+    unsigned long flags;
+
+    if (copy_from_user(&job_id, (void __user *)arg, sizeof(unsigned int))){
+        return -EFAULT;
+    }
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    job = find_cyclic(dev, job_id);
+    if (job){
+        job->active = 0;
+        list_del(&job->entry);
+        dev->num_cyclic--;
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+
+    if (!job){
+        return -ENOENT;
+    }
+
+    /*
+     *  Its frames already queued don't point back here.
+     */
+    hrtimer_cancel(&job->timer);
+    kfree(job);
+
+    return 0;
+}
+
+
+static long get_cyclic_stats(struct canbus_device_t *dev, unsigned long arg)
+{
+    struct can_cyclic_stats_t *stats;
+    struct can_cyclic *job;
+    unsigned long flags;
+    long ret = 0;
+
+    /*
+     *  Two histograms, too big for the stack.
+     */
+    stats = kzalloc(sizeof(struct can_cyclic_stats_t), GFP_KERNEL);
+    if (!stats){
+        return -ENOMEM;
+    }
+
+    if (copy_from_user(&stats->job_id, (void __user *)arg, sizeof(unsigned int))){
+        ret = -EFAULT;
+        goto EXIT;
+    }
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    job = find_cyclic(dev, stats->job_id);
+    if (job){
+        stats->active = job->active;
+        stats->job = job->config;
+        stats->sent = job->sent;
+        stats->skipped = job->skipped;
+        stats->missed = job->missed;
+        stats->min_period_ns = job->min_period_ns;
+        stats->max_period_ns = job->max_period_ns;
+        stats->jitter_hist = job->jitter_hist;
+        stats->late_hist = job->late_hist;
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+
+    if (!job){
+        ret = -ENOENT;
+        goto EXIT;
+    }
+
+    if (copy_to_user((void __user *)arg, stats, sizeof(struct can_cyclic_stats_t))){
+        ret = -EFAULT;
+    }
+
+EXIT:
+    kfree(stats);
+    return ret;
+}
+
+
+long can_cyclic_ioctl(  struct canbus_file_t *file,
+                        unsigned int cmd,
+                        unsigned long arg)
+{
+    switch(cmd){
+
+        case CAN_IOCTL_ADD_CYCLIC:
+            return add_cyclic(file, arg);
+
+        case CAN_IOCTL_UPDATE_CYCLIC:
+            return update_cyclic(file->dev, arg);
+
+        case CAN_IOCTL_DELETE_CYCLIC:
+            return delete_cyclic(file->dev, arg);
+
+        case CAN_IOCTL_GET_CYCLIC_STATS:
+            return get_cyclic_stats(file->dev, arg);
+    }
+
+    return -EINVAL;
+}
+
+
+/**
+ *  One line per job in /proc, under the lock like the routes.
+ */
+void show_can_cyclic(struct canbus_device_t *dev, struct seq_file *m)
+{
+    struct can_cyclic *job;
+    unsigned long flags;
+
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    list_for_each_entry(job, &dev->cyclic_jobs, entry){
+        seq_printf( m, "Cyclic %u Id 0x%08x PeriodUs %u Active %d Sent %llu Skipped %llu Missed %llu "
+                    "MinPeriodNs %llu MaxPeriodNs %llu MaxJitterNs %llu MaxLateNs %llu\n",
+                    job->config.job_id, job->config.message.Id, job->config.period_us,
+                    job->active, job->sent, job->skipped, job->missed,
+                    job->min_period_ns, job->max_period_ns,
+                    job->jitter_hist.max, job->late_hist.max);
+    }
+
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+}
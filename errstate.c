@@ -0,0 +1,473 @@
+/****************************************************************************
+ *  errstate.c
+ *
+ *  The controller's fault confinement state, as a state machine:
+ *
+ *      ERROR_ACTIVE <-> WARNING <-> PASSIVE -> BUS_OFF -> RECOVERING
+ *            ^                                                |
+ *            +------------------------------------------------+
+ *
+ *  ESR1 FLT_CONF and TX_WRN / RX_WRN say where the controller is.  The
+ *  ISR reads ESR1 anyway, but the i.MX6 has no interrupt for things
+ *  getting better, so away from ERROR_ACTIVE an hrtimer reads it too.
+ *  Out of BUS OFF that poll comes first when the controller can have
+ *  counted its 128 x 11 recessive bits, then every eighth of that, so
+ *  TX_MB is in use again soon after the bus is.
+ *
+ *  How the recovery starts is the device's struct can_recovery_t.
+ *  Unless it is CAN_RECOVER_AUTO, CTRL1_BOFF_REC keeps the controller
+ *  in BUS OFF until we clear it, after delay_us or on CAN_IOCTL_RECOVER.
+ *
+ *  Going BUS OFF hands the transmit side to can_tx_bus_off(), which
+ *  takes our frame out of TX_MB and keeps or drops it and the queue.
+ *  Coming back, can_tx_bus_on() loads TX_MB again, so
+ *  transmit_in_progress is never left set with nothing to clear it.
+ *
+ *  The time in each state is in the device stats.  All of it is under
+ *  register_lock.
+ *
+ ***************************************************************************/
+#include <linux/hrtimer.h>
+#include <linux/seq_file.h>
+
+#include "can_private.h"
+
+
+#define RECOVERY_BITS       (128 * 11)
+
+/*
+ *  How often WARNING and PASSIVE look for ERROR_ACTIVE.
+ */
+#define STATE_POLL_MS       10
+
+
+static const char * const state_names[CAN_NUM_STATES] = {
+    "ErrorActive",
+    "Warning",
+    "Passive",
+    "BusOff",
+    "Recovering",
+};
+
+
+static unsigned int esr1_state(struct canbus_device_t *dev, unsigned int esr1)
+{
+    if (esr1 & ESR1_FLT_CONF_ERROR_BUS_OFF){
+        return dev->boff_recovering ? CAN_STATE_RECOVERING : CAN_STATE_BUS_OFF;
+    }
+
+    if ((esr1 & ESR1_FLT_CONF_MASK) == ESR1_FLT_CONF_ERROR_PASSIVE){
+        return CAN_STATE_PASSIVE;
+    }
+
+    if (esr1 & (ESR1_TX_WRN | ESR1_RX_WRN)){
+        return CAN_STATE_WARNING;
+    }
+
+    return CAN_STATE_ERROR_ACTIVE;
+}
+
+
+static void set_state(  struct canbus_device_t *dev,
+                        unsigned int state,
+                        u64 now_ns,
+                        CANBUS_STATUS_CHANGE *status_change)
+{
+    struct can_device_stats_t *stats = &dev->stats;
+    unsigned int old = stats->can_state;
+
+    if (state == old){
+        return;
+    }
+
+    stats->state_time_ns[old] += now_ns - dev->state_entered_ns;
+    stats->state_entries[state]++;
+    stats->can_state = state;
+    dev->state_entered_ns = now_ns;
+
+    if (state == CAN_STATE_PASSIVE && old < CAN_STATE_PASSIVE){
+        status_change->Status1 |= Csc1Passive;
+    }
+
+    if (state < CAN_STATE_BUS_OFF && old >= CAN_STATE_BUS_OFF){
+        status_change->Status1 |= Csc1BusOn;
+    }
+}
+
+
+static void start_recovery(struct canbus_device_t *dev, u64 now_ns, CANBUS_STATUS_CHANGE *status_change)
+{
+    dev->boff_recovering = 1;
+    dev->recover_start_ns = now_ns;
+
+    if (dev->recovery.mode != CAN_RECOVER_AUTO){
+        hw_set_bus_off_recovery(dev, 1);
+    }
+
+    set_state(dev, CAN_STATE_RECOVERING, now_ns, status_change);
+}
+
+
+/**
+ *  Arm the poll, or the recovery delay, for the state we're in.
+ */
+static void schedule_poll(struct canbus_device_t *dev, u64 now_ns)
+{
+    u64 recovery_ns = (u64)RECOVERY_BITS * dev->bit_time_ns;
+    u64 due_ns;
+
+    switch (dev->stats.can_state){
+
+        case CAN_STATE_WARNING:
+        case CAN_STATE_PASSIVE:
+            due_ns = now_ns + STATE_POLL_MS * NSEC_PER_MSEC;
+            break;
+
+        case CAN_STATE_BUS_OFF:
+            if (dev->recovery.mode != CAN_RECOVER_DELAYED){
+                return;
+            }
+            due_ns = dev->bus_off_ns + (u64)dev->recovery.delay_us * NSEC_PER_USEC;
+            break;
+
+        case CAN_STATE_RECOVERING:
+            due_ns = dev->recover_start_ns + recovery_ns;
+            if ((s64)(due_ns - now_ns) <= 0){
+                due_ns = now_ns + recovery_ns / 8;
+            }
+            break;
+
+        default:
+            return;
+    }
+
+    hrtimer_start(&dev->state_timer, ns_to_ktime(due_ns), HRTIMER_MODE_ABS);
+}
+
+
+/**
+ *  Update the state from esr1.  Changes go in status_change, and
+ *  Status4 gets the state.  From the ISR or the poll, register_lock held.
+ *  Returns 1 if the state changed.
+ */
+static int update_state(struct canbus_device_t *dev,
+                        unsigned int esr1,
+                        u64 now_ns,
+                        CANBUS_STATUS_CHANGE *status_change)
+{
+    struct can_device_stats_t *stats = &dev->stats;
+    unsigned int old = stats->can_state;
+    unsigned int state = esr1_state(dev, esr1);
+
+    status_change->Status4 = old;
+
+    if (state == old){
+        return 0;
+    }
+
+    if (state >= CAN_STATE_BUS_OFF && old < CAN_STATE_BUS_OFF){
+
+        dev->bus_off_ns = now_ns;
+        set_state(dev, CAN_STATE_BUS_OFF, now_ns, status_change);
+
+        /*
+         *  LOCK --------------------------------------------------------
+         */
+        can_lock(&dev->tx_lock);
+
+        can_tx_bus_off(dev, dev->recovery.tx == CAN_BOFF_TX_FLUSH);
+
+        /*
+         *  UNLOCK ------------------------------------------------------
+         */
+        can_unlock(&dev->tx_lock);
+
+        /*
+         *  The controller is already on its way back.
+         */
+        if (dev->recovery.mode == CAN_RECOVER_AUTO){
+            start_recovery(dev, now_ns, status_change);
+        }
+    }
+    else if (state < CAN_STATE_BUS_OFF && old >= CAN_STATE_BUS_OFF){
+
+        /*
+         *  Hold the next BUS OFF again.
+         */
+        dev->boff_recovering = 0;
+        if (dev->recovery.mode != CAN_RECOVER_AUTO){
+            hw_set_bus_off_recovery(dev, 0);
+        }
+
+        set_state(dev, state, now_ns, status_change);
+
+        /*
+         *  LOCK --------------------------------------------------------
+         */
+        can_lock(&dev->tx_lock);
+
+        can_tx_bus_on(dev);
+
+        /*
+         *  UNLOCK ------------------------------------------------------
+         */
+        can_unlock(&dev->tx_lock);
+
+        stats->recoveries++;
+        stats->last_bus_off_ns = now_ns - dev->bus_off_ns;
+        if (stats->last_bus_off_ns > stats->max_bus_off_ns){
+            stats->max_bus_off_ns = stats->last_bus_off_ns;
+        }
+    }
+    else{
+        set_state(dev, state, now_ns, status_change);
+    }
+
+    status_change->Status4 = stats->can_state;
+
+    return 1;
+}
+
+
+/**
+ *  From the ISR, with the ESR1 it read.  register_lock held.
+ */
+void can_errstate_update(   struct canbus_device_t *dev,
+                            unsigned int esr1,
+                            u64 now_ns,
+                            CANBUS_STATUS_CHANGE *status_change)
+{
+    if (update_state(dev, esr1, now_ns, status_change)){
+        schedule_poll(dev, now_ns);
+    }
+}
+
+
+static enum hrtimer_restart can_state_timer_fn(struct hrtimer *timer)
+{
+    struct canbus_device_t *dev = container_of(timer, struct canbus_device_t, state_timer);
+    CANBUS_STATUS_CHANGE status_change;
+    unsigned long flags;
+    unsigned int esr1;
+    u64 now_ns;
+
+    memset(&status_change, 0, sizeof(CANBUS_STATUS_CHANGE));
+    status_change.StatusChangeFlag = CANBUS_STATUS_CHANGE_FLAG;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->register_lock, flags);
+
+    now_ns = can_clock_ns();
+
+    if (dev->stats.can_state == CAN_STATE_BUS_OFF &&
+        dev->recovery.mode == CAN_RECOVER_DELAYED &&
+        now_ns - dev->bus_off_ns >= (u64)dev->recovery.delay_us * NSEC_PER_USEC){
+
+        start_recovery(dev, now_ns, &status_change);
+    }
+
+    /*
+     *  Reading ESR1 clears its error bits, the ISR still wants them.
+     */
+    esr1 = ioread32(&dev->registers->ESR1);
+    dev->esr1_stash |= esr1 & ESR1_ERROR_BITS;
+
+    update_state(dev, esr1, now_ns, &status_change);
+    schedule_poll(dev, now_ns);
+
+    if (status_change.Status1){
+        status_change.Status4 = dev->stats.can_state;
+        can_status_deliver(dev, &status_change, now_ns);
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->register_lock, flags);
+
+    return HRTIMER_NORESTART;
+}
+
+
+/**
+ *  Device stats for user space, with the time in the current state up
+ *  to now.  register_lock held.
+ */
+void can_errstate_fill(struct canbus_device_t *dev, struct can_device_stats_t *stats)
+{
+    stats->state_time_ns[dev->stats.can_state] += can_clock_ns() - dev->state_entered_ns;
+}
+
+
+static long set_recovery(struct canbus_device_t *dev, unsigned long arg)
+{
+    struct can_recovery_t recovery;
+    CANBUS_STATUS_CHANGE status_change;
+    unsigned long flags;
+    u64 now_ns;
+
+    if (copy_from_user(&recovery, (void __user *)arg, sizeof(struct can_recovery_t))){
+        return -EFAULT;
+    }
+
+    if (recovery.mode > CAN_RECOVER_MANUAL ||
+        recovery.tx > CAN_BOFF_TX_FLUSH ||
+        recovery.delay_us > CAN_RECOVERY_MAX_DELAY_US){
+        return -EINVAL;
+    }
+
+    memset(&status_change, 0, sizeof(CANBUS_STATUS_CHANGE));
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->register_lock, flags);
+
+    now_ns = can_clock_ns();
+
+    dev->recovery = recovery;
+
+    if (!dev->boff_recovering){
+        hw_set_bus_off_recovery(dev, recovery.mode == CAN_RECOVER_AUTO);
+    }
+
+    /*
+     *  Waiting in BUS OFF under the old mode.
+     */
+    if (dev->stats.can_state == CAN_STATE_BUS_OFF && recovery.mode == CAN_RECOVER_AUTO){
+        start_recovery(dev, now_ns, &status_change);
+    }
+
+    schedule_poll(dev, now_ns);
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->register_lock, flags);
+
+    return 0;
+}
+
+
+long can_errstate_ioctl(struct canbus_device_t *dev, unsigned int cmd, unsigned long arg)
+{
+    struct can_recovery_t recovery;
+    CANBUS_STATUS_CHANGE status_change;
+    unsigned long flags;
+    long ret = 0;
+
+    switch (cmd){
+
+        case CAN_IOCTL_SET_RECOVERY:
+            return set_recovery(dev, arg);
+
+        case CAN_IOCTL_GET_RECOVERY:
+            /*
+             *  LOCK --------------------------------------------------------
+             */
+            can_lock_irqsave(&dev->register_lock, flags);
+
+            recovery = dev->recovery;
+
+            /*
+             *  UNLOCK --------------------------------------------------------
+             */
+            can_unlock_irqrestore(&dev->register_lock, flags);
+
+            if (copy_to_user((void __user *)arg, &recovery, sizeof(struct can_recovery_t))){
+                return -EFAULT;
+            }
+            break;
+
+        case CAN_IOCTL_RECOVER:
+            memset(&status_change, 0, sizeof(CANBUS_STATUS_CHANGE));
+
+            /*
+             *  LOCK --------------------------------------------------------
+             */
+            can_lock_irqsave(&dev->register_lock, flags);
+
+            if (dev->stats.can_state == CAN_STATE_BUS_OFF){
+                start_recovery(dev, can_clock_ns(), &status_change);
+                schedule_poll(dev, dev->recover_start_ns);
+            }
+            else{
+                ret = -EALREADY;
+            }
+
+            /*
+             *  UNLOCK --------------------------------------------------------
+             */
+            can_unlock_irqrestore(&dev->register_lock, flags);
+            break;
+
+        default:
+            return -EINVAL;
+    }
+
+    return ret;
+}
+
+
+void show_can_errstate(struct canbus_device_t *dev, struct seq_file *m)
+{
+    struct can_device_stats_t stats;
+    unsigned long flags;
+    unsigned int i;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->register_lock, flags);
+
+    memcpy(&stats, &dev->stats, sizeof(struct can_device_stats_t));
+    can_errstate_fill(dev, &stats);
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->register_lock, flags);
+
+    seq_printf(m, "CanState %s\n", state_names[stats.can_state]);
+    seq_printf(m, "Recovery %u %u us tx %u\n", dev->recovery.mode, dev->recovery.delay_us, dev->recovery.tx);
+
+    for (i = 0; i<CAN_NUM_STATES; i++){
+        seq_printf(m, "%sEntries %u\n", state_names[i], stats.state_entries[i]);
+        seq_printf(m, "%sNs %llu\n", state_names[i], stats.state_time_ns[i]);
+    }
+
+    seq_printf(m, "Recoveries %llu\n", stats.recoveries);
+    seq_printf(m, "LastBusOffNs %llu\n", stats.last_bus_off_ns);
+    seq_printf(m, "MaxBusOffNs %llu\n", stats.max_bus_off_ns);
+}
+
+
+/**
+ *  Before hw_initialize_hardware(), which sets CTRL1_BOFF_REC from
+ *  the recovery mode.
+ */
+void init_can_errstate(struct canbus_device_t *dev)
+{
+    memset(&dev->recovery, 0, sizeof(struct can_recovery_t));
+    dev->recovery.mode = CAN_RECOVER_AUTO;
+    dev->recovery.tx = CAN_BOFF_TX_KEEP;
+
+    dev->stats.can_state = CAN_STATE_ERROR_ACTIVE;
+    dev->state_entered_ns = can_clock_ns();
+    dev->boff_recovering = 0;
+    dev->esr1_stash = 0;
+
+    hrtimer_init(&dev->state_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    dev->state_timer.function = can_state_timer_fn;
+}
+
+
+/**
+ *  After the interrupt is gone.
+ */
+void destroy_can_errstate(struct canbus_device_t *dev)
+{
+    hrtimer_cancel(&dev->state_timer);
+}
@@ -0,0 +1,262 @@
+/****************************************************************************
+ *  event_log.c
+ *
+ *  A printk from the ISR goes straight to the serial console with the
+ *  register lock held, which on our boards costs hundreds of
+ *  microseconds.  Instead, the hot paths call can_event(), which bumps
+ *  a per-cause counter and drops a small record into a lock-free ring.
+ *  A work item drains the ring to the kernel log later, from process
+ *  context, at a bounded rate.
+ *
+ *  Like the message pool, producers can be in any context, including
+ *  hard IRQ, and can_event() never blocks or spins.  Each device has
+ *  its own log, so the lines say which bus they came from.
+ *
+ ***************************************************************************/
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+#include <linux/seq_file.h>
+
+#include "can_private.h"
+
+
+#define EVENT_RING_SIZE     CAN_EVENT_RING_SIZE
+#define EVENT_RING_MASK     (EVENT_RING_SIZE - 1)
+
+/*
+ *  At most EVENT_LOG_BURST lines every EVENT_LOG_INTERVAL jiffies.
+ */
+#define EVENT_LOG_BURST     10
+#define EVENT_LOG_INTERVAL  (HZ / 10)
+
+
+/*
+ *  What each event says when it reaches the log.  Indexed by can_event_code.
+ *  The %u gets the event's arg.
+ */
+static const struct {
+    const char *level;
+    const char *name;
+    const char *format;
+
+} event_info[CAN_EVENT_COUNT] = {
+    [CAN_EVENT_TX_WARN]         = { KERN_ERR,       "TxWarn",       "ESR1_TWRN_INT\n" },
+    [CAN_EVENT_RX_WARN]         = { KERN_ERR,       "RxWarn",       "ESR1_RWRN_INT\n" },
+    [CAN_EVENT_BUS_OFF]         = { KERN_ERR,       "BusOff",       "ESR1_BOFF_INT\n" },
+    [CAN_EVENT_BIT1_ERR]        = { KERN_ERR,       "Bit1",         "ESR1_BIT1_ERR\n" },
+    [CAN_EVENT_BIT0_ERR]        = { KERN_ERR,       "Bit0",         "ESR1_BIT0_ERR\n" },
+    [CAN_EVENT_ACK_ERR]         = { KERN_NOTICE,    "Ack",          "ESR1_ACK_ERR\n" },
+    [CAN_EVENT_CRC_ERR]         = { KERN_ERR,       "Crc",          "ESR1_CRC_ERR\n" },
+    [CAN_EVENT_FORM_ERR]        = { KERN_ERR,       "Form",         "ESR1_FRM_ERR\n" },
+    [CAN_EVENT_STUFF_ERR]       = { KERN_ERR,       "Stuff",        "ESR1_STF_ERR\n" },
+    [CAN_EVENT_NO_ERR_BIT]      = { KERN_ERR,       "NoErrBit",
+                                    "Received ESR1_ERR_INT without finding an error bit!\n" },
+    [CAN_EVENT_DEV_SIGNATURE]   = { KERN_ERR,       "DevSignature",
+                                    "Device Failed signature check! line %u\n" },
+    [CAN_EVENT_FILE_SIGNATURE]  = { KERN_ERR,       "FileSignature",
+                                    "File Signature check Failed! line %u\n" },
+    [CAN_EVENT_MSG_SIGNATURE]   = { KERN_ERR,       "MsgSignature",
+                                    "Message Signature check Failed! line %u\n" },
+    [CAN_EVENT_NULL_FREE]       = { KERN_ERR,       "NullFree",
+                                    "free_kcanbus_message got a NULL\n" },
+    [CAN_EVENT_POOL_EMPTY]      = { KERN_ERR,       "PoolEmpty",
+                                    "alloc_kcanbus_message Failed!\n" },
+};
+
+
+/**
+ *  Count an event without logging it.  Any context.
+ */
+void can_event_count(struct canbus_device_t *dev, enum can_event_code code)
+{
+    atomic_inc(&dev->events.counts[code]);
+}
+
+
+
+/**
+ *  Count and log an event.  Any context, never blocks.
+ */
+void can_event(struct canbus_device_t *dev, enum can_event_code code, unsigned int arg)
+{
+    struct can_event_log *log = &dev->events;
+    struct can_event_record *record;
+    unsigned int index;
+
+    atomic_inc(&log->counts[code]);
+
+    index = (unsigned int)atomic_inc_return(&log->head) - 1;
+    record = &log->ring[index & EVENT_RING_MASK];
+
+    /*
+     *  Invalidate, fill, then publish.  The worker checks seq before
+     *  and after reading so it never prints a half written record.
+     */
+    record->seq = 0;
+    smp_wmb();
+
+    record->code = code;
+    record->arg = arg;
+    record->ns = can_clock_ns();
+
+    smp_wmb();
+    record->seq = index + 1;
+
+    /*
+     *  This only arms a timer if the work isn't already pending.
+     */
+    if (log->running){
+        schedule_delayed_work(&log->work, 1);
+    }
+}
+
+
+
+/**
+ *  Print up to max records from the ring.  Worker (or unload) only.
+ *  Returns how many were printed.
+ */
+static int drain_can_events(struct canbus_device_t *dev, int max)
+{
+    struct can_event_log *log = &dev->events;
+    struct can_event_record record;
+    struct can_event_record *slot;
+    char text[80];
+    unsigned int head;
+    unsigned int lost;
+    int printed = 0;
+
+    head = (unsigned int)atomic_read(&log->head);
+
+    /*
+     *  If the producers lapped us, skip ahead to the oldest record
+     *  that can still be in the ring.
+     */
+    if (head - log->tail > EVENT_RING_SIZE){
+        lost = head - log->tail - EVENT_RING_SIZE;
+        atomic_add(lost, &log->dropped);
+        log->tail = head - EVENT_RING_SIZE;
+        printk(KERN_ERR "%s: %u events dropped\n", dev->name, lost);
+    }
+
+    while (log->tail != head && printed < max){
+
+        slot = &log->ring[log->tail & EVENT_RING_MASK];
+
+        record.seq = slot->seq;
+        smp_rmb();
+
+        if (record.seq != log->tail + 1){
+            /*
+             *  Either still being written, or already overwritten.
+             *  Overwrites get counted on the next pass.
+             */
+            break;
+        }
+
+        record.code = slot->code;
+        record.arg = slot->arg;
+        record.ns = slot->ns;
+
+        smp_rmb();
+        if (slot->seq != record.seq){
+            break;
+        }
+
+        snprintf(text, sizeof(text), event_info[record.code].format, record.arg);
+        printk( "%s%s: [%llu ns] %s", 
+                event_info[record.code].level, dev->name, record.ns, text);
+
+        log->tail++;
+        printed++;
+    }
+
+    return printed;
+}
+
+
+
+static void can_event_work_fn(struct work_struct *work)
+{
+    struct can_event_log *log = container_of(work, struct can_event_log, work.work);
+    struct canbus_device_t *dev = container_of(log, struct canbus_device_t, events);
+
+    /*
+     *  Producers kick us a jiffy after every event, so hold off here
+     *  until the rate limit interval since the last burst has passed.
+     */
+    if (time_before(jiffies, log->next_burst)){
+        if (log->running){
+            schedule_delayed_work(&log->work, log->next_burst - jiffies);
+        }
+        return;
+    }
+
+    drain_can_events(dev, EVENT_LOG_BURST);
+    log->next_burst = jiffies + EVENT_LOG_INTERVAL;
+
+    /*
+     *  More to do, come back after the rate limit interval.
+     */
+    if (log->running && log->tail != (unsigned int)atomic_read(&log->head)){
+        schedule_delayed_work(&log->work, EVENT_LOG_INTERVAL);
+    }
+}
+
+
+
+/**
+ *  Show the per-cause counters in /proc.
+ */
+void show_can_events(struct canbus_device_t *dev, struct seq_file *m)
+{
+    struct can_event_log *log = &dev->events;
+    int i;
+
+    for (i = 0; i<CAN_EVENT_COUNT; i++){
+        seq_printf(m, "Event%s %d\n", event_info[i].name, atomic_read(&log->counts[i]));
+    }
+    seq_printf(m, "EventsDropped %d\n", atomic_read(&log->dropped));
+}
+
+
+
+int init_can_event_log(struct canbus_device_t *dev)
+{
+    struct can_event_log *log = &dev->events;
+    int i;
+
+    memset(log->ring, 0, sizeof(log->ring));
+    atomic_set(&log->head, 0);
+    log->tail = 0;
+    atomic_set(&log->dropped, 0);
+
+    for (i = 0; i<CAN_EVENT_COUNT; i++){
+        atomic_set(&log->counts[i], 0);
+    }
+
+    log->next_burst = jiffies;
+    INIT_DELAYED_WORK(&log->work, can_event_work_fn);
+    log->running = 1;
+
+    return 0;
+}
+
+
+
+/**
+ *  Stop the worker and flush anything left straight to the log,
+ *  we are unloading so the rate doesn't matter any more.
+ */
+void destroy_can_event_log(struct canbus_device_t *dev)
+{
+    struct can_event_log *log = &dev->events;
+
+    log->running = 0;
+    smp_mb();
+
+    cancel_delayed_work_sync(&log->work);
+
+    while (drain_can_events(dev, EVENT_RING_SIZE) > 0)
+        ;
+}
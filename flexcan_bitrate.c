@@ -130,3 +130,19 @@ can_update_bitrate( unsigned int can_clock_frequency,   /*  Can protocol engine
 }
 
 
+
+unsigned int
+can_bitrate_to_bps(enum can_bitrate bitrate)
+{
+    switch (bitrate){
+        case Mbps_1:        return 1000000;
+        case Kbps_800:      return 800000;
+        case Kbps_500:      return 500000;
+        case Kbps_250:      return 250000;
+        case Kbps_125:      return 125000;
+        case Kbps_62_5:     return 62500;
+        case Kbps_20:       return 20000;
+        case Kbps_10:       return 10000;
+        default:            return 0;
+    }
+}
@@ -29,5 +29,12 @@ can_update_bitrate( unsigned int can_clock_frequency,   /* Can protocol engine c
                     enum can_bitrate bitrate);          /* Requested Bitrate */
 
 
+/**
+ *  Bits per second for one of the bitrates above.
+ */
+unsigned int
+can_bitrate_to_bps(enum can_bitrate bitrate);
+
+
 #endif
 
@@ -7,6 +7,7 @@
  *
  ***************************************************************************/
 #include "can_private.h"
+#include "can_trace.h"
 
 
 /**
@@ -260,6 +261,8 @@ hw_initialize_hardware(struct canbus_device_t *dev)
      *  to revise this.
      */
     reg = can_update_bitrate(dev->clock_freq, Kbps_500);
+    dev->bitrate = can_bitrate_to_bps(Kbps_500);
+    dev->bit_time_ns = dev->bitrate ? (NSEC_PER_SEC / dev->bitrate) : 0;
 
     /*
      *  from the Flexcan example code...
@@ -276,6 +279,14 @@ hw_initialize_hardware(struct canbus_device_t *dev)
                 |    CTRL1_SMP 
                 |    CTRL1_LBUF);
 
+    /*
+     *  Unless the controller gets back on the bus by itself, see
+     *  errstate.c.
+     */
+    if (dev->recovery.mode != CAN_RECOVER_AUTO){
+        reg |= CTRL1_BOFF_REC;
+    }
+
     iowrite32(reg, &dev->registers->CTRL1);
 
     /*
@@ -319,6 +330,29 @@ hw_enable_loopback_mode(struct canbus_device_t *dev)
 
 
 
+/**
+ *  BOFF_REC can be written at any time, unlike most of CTRL1, so no
+ *  Freeze mode.  Clearing it in BUS OFF starts the recovery.
+ */
+void
+hw_set_bus_off_recovery(struct canbus_device_t *dev, int automatic)
+{
+    unsigned int reg;
+
+    reg = ioread32(&dev->registers->CTRL1);
+
+    if (automatic){
+        reg &= ~CTRL1_BOFF_REC;
+    }
+    else{
+        reg |= CTRL1_BOFF_REC;
+    }
+
+    iowrite32(reg, &dev->registers->CTRL1);
+}
+
+
+
 /**
  *  API to Disable Loopback mode on the chip.
  */
@@ -357,6 +391,8 @@ hw_enable_self_reception(struct canbus_device_t *dev)
     iowrite32(reg, &dev->registers->MCR);
 
     exit_freeze_mode(dev);
+
+    dev->self_reception = 1;
 }
 
 
@@ -378,6 +414,8 @@ hw_disable_self_reception(struct canbus_device_t *dev)
     iowrite32(reg, &dev->registers->MCR);
 
     exit_freeze_mode(dev);
+
+    dev->self_reception = 0;
 }
 
 
@@ -537,6 +575,15 @@ hw_transmit_message(    struct canbus_device_t *dev,
     }
 
     mb = &dev->registers->MB[TX_MB];
+
+    /*
+     *  With self reception, so the RX ISR can tell this one coming back
+     *  from someone else's.  Before the frame can go out.
+     */
+    if (dev->self_reception){
+        dev->tx_echo = *message;
+        dev->tx_echo_pending = 1;
+    }
     
     do {
         code_and_status = ioread32(&mb->code_and_status);
@@ -607,48 +654,69 @@ hw_transmit_message(    struct canbus_device_t *dev,
     code_and_status = MB_TX_CODE_INACTIVE;
     iowrite32(code_and_status, &dev->registers->MB[TX_ERRATA_MB].code_and_status);
     iowrite32(code_and_status, &dev->registers->MB[TX_ERRATA_MB].code_and_status);
+
+    /*
+     *  For the bus load, counted when the TX completes.
+     */
+    dev->tx_frame_bits = can_frame_bits(message);
+
+    trace_can_tx_load(dev, message);
 }
 
 
 
-void
+int
 hw_abort_transmit(struct canbus_device_t *dev)
 {
     MESSAGE_BUFFER *mb;
     unsigned int code_and_status;
-    unsigned int is_interrupting;
 
 
-    is_interrupting = hw_is_message_buffer_interrupting(dev, TX_MB);
-    if (is_interrupting){
-        hw_clear_message_buffer_interrupt(dev, TX_MB);
+    /*
+     *  Already transmitted, nothing to abort.  Its IFLAG stays for 
+     *  the ISR.
+     */
+    if (hw_is_message_buffer_interrupting(dev, TX_MB)){
+        return 0;
     }
 
     mb = &dev->registers->MB[TX_MB];
 
     /*  
-     *  Write ABORT
+     *  Write ABORT.  A frame already on the wire finishes first, and 
+     *  the IFLAG says which it was, see hw_tx_aborted().
      */
     code_and_status = MB_TX_CODE_ABORT;
     iowrite32(code_and_status, &mb->code_and_status);
 
-    /*
-     *  Wait for IFLAG indicating that the frame was either 
-     *  transmitted or aborted.
-     */
-    do {
-        is_interrupting = hw_is_message_buffer_interrupting(dev, TX_MB);
-    }while (!is_interrupting);
+    return 1;
+}
 
-    /*
-     *  Check for transmit or abort. 
-     */
-    code_and_status = ioread32(&mb->code_and_status);
 
-    /*
-     *  Clear the IFLAG so the TX MB can be reconfigured.
-     */
-    hw_clear_message_buffer_interrupt(dev, TX_MB);
+
+int
+hw_tx_aborted(struct canbus_device_t *dev)
+{
+    unsigned int code_and_status;
+
+    code_and_status = ioread32(&dev->registers->MB[TX_MB].code_and_status);
+
+    return (code_and_status & MB_CODE_MASK) == MB_TX_CODE_ABORT;
+}
+
+
+
+u64
+hw_get_tx_timestamp_ns(struct canbus_device_t *dev)
+{
+    unsigned int code_and_status;
+    unsigned int timer;
+
+    code_and_status = ioread32(&dev->registers->MB[TX_MB].code_and_status);
+    timer = ioread32(&dev->registers->TIMER);
+
+    return can_timestamp_to_ns( dev, can_clock_ns(), timer, 
+                                code_and_status & MB_TIMESTAMP_MASK);
 }
 
 
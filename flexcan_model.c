@@ -0,0 +1,662 @@
+/****************************************************************************
+ *  flexcan_model.c
+ *
+ *  Register level model of the Flexcan, see flexcan_model.h.
+ *
+ ***************************************************************************/
+#include <linux/rculist.h>
+
+#include "can_private.h"
+
+
+#define ESR1_W1C_BITS       (ESR1_TWRN_INT | ESR1_RWRN_INT | ESR1_BOFF_INT | \
+                             ESR1_ERR_INT | ESR1_WAK_INT)
+
+#define ESR1_READ_CLEAR_BITS (ESR1_BIT1_ERR | ESR1_BIT0_ERR | ESR1_ACK_ERR | \
+                              ESR1_CRC_ERR | ESR1_FRM_ERR | ESR1_STF_ERR)
+
+#define MB_CODE(c_s_)       ((c_s_) & MB_CODE_MASK)
+
+#define REG_OFFSET(reg_)    offsetof(struct FLEXCAN_HW_REGISTERS, reg_)
+
+
+static LIST_HEAD(flexcan_models);
+static DEFINE_SPINLOCK(flexcan_models_lock);    /* Writers, lookups are RCU */
+
+
+
+static unsigned int model_timer(struct flexcan_model *model)
+{
+    if (model->timer_held){
+        return model->held_timer;
+    }
+    if (!model->bit_time_ns){
+        return 0;
+    }
+    return (unsigned int)div_u64(can_clock_ns() - model->timer_start_ns, model->bit_time_ns) & TIMER_MASK;
+}
+
+
+/*
+ *  One bit time from the CTRL1 PRESDIV and segment fields:
+ *  (PRESDIV + 1) * (SYNC + PROPSEG + PSEG1 + PSEG2) clocks.
+ */
+static void model_update_bit_time(struct flexcan_model *model)
+{
+    unsigned int ctrl1 = model->regs.CTRL1;
+    unsigned int presdiv = ((ctrl1 & CTRL1_PRESDIV_MASK) >> 24) + 1;
+    unsigned int quanta = 1 +
+                        ((ctrl1 & CTRL1_PROP_SEG_MASK) + 1) +
+                        (((ctrl1 & CTRL1_PSEG1_MASK) >> 19) + 1) +
+                        (((ctrl1 & CTRL1_PSEG2_MASK) >> 16) + 1);
+    unsigned int timer = model_timer(model);
+
+    model->bit_time_ns = (unsigned int)div_u64((u64)presdiv * quanta * NSEC_PER_SEC, model->clock_freq);
+    if (!model->bit_time_ns){
+        model->bit_time_ns = 1;
+    }
+
+    /*
+     *  Keep TIMER continuous across the rate change.
+     */
+    model->timer_start_ns = can_clock_ns() - (u64)timer * model->bit_time_ns;
+}
+
+
+static void model_set_iflag(struct flexcan_model *model, int index)
+{
+    if (index > 31){
+        model->regs.IFLAG2 |= 0x1U << (index - 32);
+    }
+    else{
+        model->regs.IFLAG1 |= 0x1U << index;
+    }
+}
+
+
+static int model_iflag_set(struct flexcan_model *model, int index)
+{
+    if (index > 31){
+        return (model->regs.IFLAG2 >> (index - 32)) & 0x1;
+    }
+    return (model->regs.IFLAG1 >> index) & 0x1;
+}
+
+
+/*
+ *  Soft reset clears the module state, not the configuration
+ *  (CTRL1/2, masks) or the mailbox memory.  We come out of it frozen.
+ */
+static void model_soft_reset(struct flexcan_model *model)
+{
+    model->regs.MCR = (model->regs.MCR & MCR_MDIS) |
+                        MCR_FRZ | MCR_HALT | MCR_NOT_RDY | MCR_FRZ_ACK |
+                        MCR_SUPV | 0xF;
+    model->regs.ECR = 0;
+    model->regs.ESR1 = 0;
+    model->regs.ESR2 = 0;
+    model->regs.IMASK1 = 0;
+    model->regs.IMASK2 = 0;
+    model->regs.IFLAG1 = 0;
+    model->regs.IFLAG2 = 0;
+    model->regs.CRCR = 0;
+    model->tx_pending_mb = -1;
+    model->bus_off = 0;
+    model->recovering = 0;
+    model->bus_off_tx_mb = -1;
+    model->timer_start_ns = can_clock_ns();
+}
+
+
+static void model_write_mcr(struct flexcan_model *model, unsigned int value)
+{
+    if (value & MCR_SOFT_RST){
+        model_soft_reset(model);
+        return;
+    }
+
+    value &= ~(MCR_FRZ_ACK | MCR_NOT_RDY | MCR_LPM_ACK);
+
+    if (value & MCR_MDIS){
+        value |= MCR_LPM_ACK | MCR_NOT_RDY;
+    }
+    else if ((value & (MCR_FRZ | MCR_HALT)) == (MCR_FRZ | MCR_HALT)){
+        value |= MCR_FRZ_ACK | MCR_NOT_RDY;
+    }
+
+    model->regs.MCR = value;
+}
+
+
+/*
+ *  Fill RX mailbox index with a frame stamped with TIMER now.
+ */
+static void model_fill_rx_mb(struct flexcan_model *model, const CANBUS_MESSAGE *message, int index)
+{
+    MESSAGE_BUFFER *mb = &model->regs.MB[index];
+    unsigned int c_s;
+
+    c_s = MB_RX_CODE_FULL | SET_DLC(message->DataLength) | model_timer(model);
+    if (message->Type == CmtExtended){
+        c_s |= MB_IDE | MB_SRR;
+    }
+
+    mb->id = message->Id;
+    mb->data_0_3 =  ((unsigned int)message->Data[0] << 24) |
+                    ((unsigned int)message->Data[1] << 16) |
+                    ((unsigned int)message->Data[2] << 8) |
+                    (unsigned int)message->Data[3];
+    mb->Data4_7 =   ((unsigned int)message->Data[4] << 24) |
+                    ((unsigned int)message->Data[5] << 16) |
+                    ((unsigned int)message->Data[6] << 8) |
+                    (unsigned int)message->Data[7];
+    mb->code_and_status = c_s;
+
+    model_set_iflag(model, index);
+    model->rx_frames++;
+}
+
+
+/*
+ *  Put a frame in the first free RX mailbox.  Free means EMPTY, or a
+ *  FULL / OVERRUN mailbox the driver has already serviced.
+ */
+static int model_deliver(struct flexcan_model *model, const CANBUS_MESSAGE *message)
+{
+    unsigned int code;
+    int i;
+
+    for (i = FIRST_RX_MB; i<FLEXCAN_NUM_MESSAGE_BUFFERS; i++){
+
+        code = MB_CODE(model->regs.MB[i].code_and_status);
+
+        if (code == MB_RX_CODE_EMPTY){
+            break;
+        }
+        if ((code == MB_RX_CODE_FULL || code == MB_RX_CODE_OVERRUN) && !model_iflag_set(model, i)){
+            break;
+        }
+    }
+
+    if (i == FLEXCAN_NUM_MESSAGE_BUFFERS){
+        model->rx_lost++;
+        return -ENOSPC;
+    }
+
+    model_fill_rx_mb(model, message, i);
+
+    return 0;
+}
+
+
+/*
+ *  The frame in a TX mailbox made it onto the bus.
+ */
+static void model_complete_transmit(struct flexcan_model *model, int index)
+{
+    MESSAGE_BUFFER *mb = &model->regs.MB[index];
+    CANBUS_MESSAGE message;
+    unsigned int c_s = mb->code_and_status;
+    unsigned int timestamp;
+    int i;
+
+    memset(&message, 0, sizeof(message));
+    message.Id = mb->id;
+    message.Type = (c_s & MB_IDE) ? CmtExtended : CmtStandard;
+    message.DataLength = GET_DLC(c_s);
+
+    for (i = 0; i<4; i++){
+        message.Data[i] = (unsigned char)(mb->data_0_3 >> (24 - 8 * i));
+        message.Data[i + 4] = (unsigned char)(mb->Data4_7 >> (24 - 8 * i));
+    }
+
+    timestamp = (index == model->tx_pending_mb) ? model->tx_start_timer : model_timer(model);
+
+    mb->code_and_status = (c_s & ~(MB_CODE_MASK | MB_TIMESTAMP_MASK)) |
+                            MB_TX_CODE_INACTIVE | timestamp;
+    model_set_iflag(model, index);
+    model->tx_frames++;
+
+    if ((model->regs.CTRL1 & CTRL1_LPB) || !(model->regs.MCR & MCR_SRX_DIS)){
+        model_deliver(model, &message);
+    }
+}
+
+
+/*
+ *  Counting 128 x 11 recessive bits from now.
+ */
+static void model_start_recovery(struct flexcan_model *model)
+{
+    model->recovering = 1;
+    model->recover_done_ns = can_clock_ns() + 128ULL * 11 * model->bit_time_ns;
+}
+
+
+static void model_transmit(struct flexcan_model *model, int index, unsigned int c_s);
+
+/*
+ *  Back from BUS OFF if it's time, when anyone looks at ESR1.
+ */
+static void model_update_fault(struct flexcan_model *model)
+{
+    int index;
+
+    if (!model->bus_off || !model->recovering || can_clock_ns() < model->recover_done_ns){
+        return;
+    }
+
+    model->bus_off = 0;
+    model->recovering = 0;
+    model->regs.ESR1 &= ~(ESR1_FLT_CONF_MASK | ESR1_TX_WRN | ESR1_RX_WRN);
+
+    index = model->bus_off_tx_mb;
+    if (index >= 0){
+        model->bus_off_tx_mb = -1;
+        model_transmit(model, index, model->regs.MB[index].code_and_status);
+    }
+}
+
+
+/*
+ *  The driver wrote DATA to a TX mailbox.
+ */
+static void model_transmit(struct flexcan_model *model, int index, unsigned int c_s)
+{
+    MESSAGE_BUFFER *mb = &model->regs.MB[index];
+    CANBUS_MESSAGE message;
+
+    mb->code_and_status = c_s;
+
+    if (model->bus_off){
+        model->bus_off_tx_mb = index;
+        return;
+    }
+
+    if (!model->ack && !(model->regs.CTRL1 & CTRL1_LPB)){
+        model->regs.ESR1 |= ESR1_ERR_INT | ESR1_ACK_ERR;
+        return;
+    }
+
+    if (!model->timed_tx){
+        model_complete_transmit(model, index);
+        return;
+    }
+
+    /*
+     *  Only the size matters here.
+     */
+    memset(&message, 0, sizeof(message));
+    message.Type = (c_s & MB_IDE) ? CmtExtended : CmtStandard;
+    message.DataLength = GET_DLC(c_s);
+
+    model->tx_pending_mb = index;
+    model->tx_start_timer = model_timer(model);
+    model->tx_done_ns = can_clock_ns() + (u64)can_frame_bits(&message) * model->bit_time_ns;
+
+    if (model->tx_started){
+        model->tx_started(model, model->tx_done_ns);
+    }
+}
+
+
+static void model_write_mb_cs(struct flexcan_model *model, int index, unsigned int value)
+{
+    MESSAGE_BUFFER *mb = &model->regs.MB[index];
+
+    switch (MB_CODE(value)){
+
+        case MB_TX_CODE_DATA:
+            model_transmit(model, index, value);
+            break;
+
+        /*
+         *  A timed transmit is still on the wire, and anything else
+         *  already finished, so every abort "succeeds".
+         */
+        case MB_TX_CODE_ABORT:
+            if (model->tx_pending_mb == index){
+                model->tx_pending_mb = -1;
+            }
+            if (model->bus_off_tx_mb == index){
+                model->bus_off_tx_mb = -1;
+            }
+            mb->code_and_status = value;
+            model_set_iflag(model, index);
+            break;
+
+        default:
+            mb->code_and_status = value;
+            break;
+    }
+}
+
+
+/*
+ *  Every register access comes through here, so the lookup is RCU,
+ *  models on different CPUs don't serialize on flexcan_models_lock.
+ */
+static struct flexcan_model *find_model(const volatile void __iomem *addr, size_t *offset)
+{
+    struct flexcan_model *model;
+    struct flexcan_model *found = NULL;
+    const char *p = (const char __force *)addr;
+
+    rcu_read_lock();
+
+    list_for_each_entry_rcu(model, &flexcan_models, model_list_entry){
+        if (p >= (const char *)&model->regs &&
+            p < (const char *)&model->regs + sizeof(model->regs)){
+            *offset = (size_t)(p - (const char *)&model->regs);
+            found = model;
+            break;
+        }
+    }
+
+    rcu_read_unlock();
+
+    return found;
+}
+
+
+
+/****************************************************************************
+ *  ioread32 / iowrite32 for the driver, see flexcan_model.h.
+ */
+unsigned int flexcan_model_ioread32(const volatile void __iomem *addr)
+{
+    struct flexcan_model *model;
+    size_t offset;
+    unsigned int value;
+    unsigned long flags;
+
+    model = find_model(addr, &offset);
+    if (!model){
+        return readl(addr);
+    }
+
+    /* LOCK ---------------------------------------------------------------- */
+    spin_lock_irqsave(&model->lock, flags);
+
+    model->register_reads++;
+
+    if (offset == REG_OFFSET(TIMER)){
+        value = model_timer(model);
+    }
+    else if (offset == REG_OFFSET(ESR1)){
+        model_update_fault(model);
+        value = model->regs.ESR1;
+        model->regs.ESR1 &= ~ESR1_READ_CLEAR_BITS;
+    }
+    else{
+        value = *(const volatile unsigned int __force *)addr;
+    }
+
+    spin_unlock_irqrestore(&model->lock, flags);
+    /* UNLOCK -------------------------------------------------------------- */
+
+    return value;
+}
+
+
+void flexcan_model_iowrite32(unsigned int value, volatile void __iomem *addr)
+{
+    struct flexcan_model *model;
+    size_t offset;
+    size_t mb_offset;
+    unsigned long flags;
+
+    model = find_model(addr, &offset);
+    if (!model){
+        writel(value, addr);
+        return;
+    }
+
+    /* LOCK ---------------------------------------------------------------- */
+    spin_lock_irqsave(&model->lock, flags);
+
+    model->register_writes++;
+
+    mb_offset = offset - REG_OFFSET(MB);
+
+    if (offset == REG_OFFSET(MCR)){
+        model_write_mcr(model, value);
+    }
+    else if (offset == REG_OFFSET(CTRL1)){
+        model->regs.CTRL1 = value;
+        model_update_bit_time(model);
+
+        /*
+         *  Clearing BOFF_REC in BUS OFF starts the recovery.
+         */
+        if (model->bus_off && !model->recovering && !(value & CTRL1_BOFF_REC)){
+            model_start_recovery(model);
+        }
+    }
+    else if (offset == REG_OFFSET(TIMER)){
+        model->timer_start_ns = can_clock_ns() - (u64)(value & TIMER_MASK) * model->bit_time_ns;
+    }
+    else if (offset == REG_OFFSET(IFLAG1)){
+        model->regs.IFLAG1 &= ~value;
+    }
+    else if (offset == REG_OFFSET(IFLAG2)){
+        model->regs.IFLAG2 &= ~value;
+    }
+    else if (offset == REG_OFFSET(ESR1)){
+        model->regs.ESR1 &= ~(value & ESR1_W1C_BITS);
+    }
+    else if (offset >= REG_OFFSET(MB) &&
+             offset < REG_OFFSET(MB) + sizeof(model->regs.MB) &&
+             (mb_offset % sizeof(MESSAGE_BUFFER)) == offsetof(MESSAGE_BUFFER, code_and_status)){
+        model_write_mb_cs(model, (int)(mb_offset / sizeof(MESSAGE_BUFFER)), value);
+    }
+    else{
+        *(volatile unsigned int __force *)addr = value;
+    }
+
+    spin_unlock_irqrestore(&model->lock, flags);
+    /* UNLOCK -------------------------------------------------------------- */
+}
+
+
+
+/****************************************************************************
+ *  Bus side, for whoever owns the model.
+ */
+struct flexcan_model *flexcan_model_create(unsigned int clock_freq)
+{
+    struct flexcan_model *model;
+    unsigned long flags;
+
+    model = kzalloc(sizeof(struct flexcan_model), GFP_KERNEL);
+    if (!model){
+        return NULL;
+    }
+
+    spin_lock_init(&model->lock);
+    model->clock_freq = clock_freq;
+    model->ack = 1;
+    model->tx_pending_mb = -1;
+    model->bus_off_tx_mb = -1;
+
+    /*
+     *  Out of reset the module is disabled.
+     */
+    model->regs.MCR = MCR_MDIS | MCR_FRZ | MCR_HALT | MCR_NOT_RDY |
+                        MCR_LPM_ACK | MCR_SUPV | 0xF;
+    model_update_bit_time(model);
+
+    /* LOCK ---------------------------------------------------------------- */
+    spin_lock_irqsave(&flexcan_models_lock, flags);
+    list_add_tail_rcu(&model->model_list_entry, &flexcan_models);
+    spin_unlock_irqrestore(&flexcan_models_lock, flags);
+    /* UNLOCK -------------------------------------------------------------- */
+
+    return model;
+}
+
+
+void flexcan_model_destroy(struct flexcan_model *model)
+{
+    unsigned long flags;
+
+    /* LOCK ---------------------------------------------------------------- */
+    spin_lock_irqsave(&flexcan_models_lock, flags);
+    list_del_rcu(&model->model_list_entry);
+    spin_unlock_irqrestore(&flexcan_models_lock, flags);
+    /* UNLOCK -------------------------------------------------------------- */
+
+    synchronize_rcu();
+
+    kfree(model);
+}
+
+
+int flexcan_model_receive(struct flexcan_model *model, const CANBUS_MESSAGE *message)
+{
+    unsigned long flags;
+    int ret;
+
+    /* LOCK ---------------------------------------------------------------- */
+    spin_lock_irqsave(&model->lock, flags);
+
+    if (model->regs.MCR & (MCR_MDIS | MCR_FRZ_ACK)){
+        model->rx_lost++;
+        ret = -ENOSPC;
+    }
+    else{
+        ret = model_deliver(model, message);
+    }
+
+    spin_unlock_irqrestore(&model->lock, flags);
+    /* UNLOCK -------------------------------------------------------------- */
+
+    return ret;
+}
+
+
+void flexcan_model_receive_mb(struct flexcan_model *model, const CANBUS_MESSAGE *message, int index)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&model->lock, flags);
+    model_fill_rx_mb(model, message, index);
+    spin_unlock_irqrestore(&model->lock, flags);
+}
+
+
+void flexcan_model_hold_timer(struct flexcan_model *model, int hold, unsigned int value)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&model->lock, flags);
+
+    model->timer_held = hold;
+    model->held_timer = value & TIMER_MASK;
+    model->timer_start_ns = can_clock_ns() - (u64)model->held_timer * model->bit_time_ns;
+
+    spin_unlock_irqrestore(&model->lock, flags);
+}
+
+
+void flexcan_model_raise_esr1(struct flexcan_model *model, unsigned int bits)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&model->lock, flags);
+    model->regs.ESR1 |= bits;
+    spin_unlock_irqrestore(&model->lock, flags);
+}
+
+
+void flexcan_model_set_ack(struct flexcan_model *model, int ack)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&model->lock, flags);
+    model->ack = ack;
+    spin_unlock_irqrestore(&model->lock, flags);
+}
+
+
+void flexcan_model_set_fault(struct flexcan_model *model, unsigned int bits)
+{
+    unsigned int esr1;
+    unsigned long flags;
+
+    /* LOCK ---------------------------------------------------------------- */
+    spin_lock_irqsave(&model->lock, flags);
+
+    esr1 = model->regs.ESR1;
+
+    if ((bits & ESR1_FLT_CONF_ERROR_BUS_OFF) && !model->bus_off){
+        model->regs.ESR1 |= ESR1_BOFF_INT;
+        model->bus_off = 1;
+        model->recovering = 0;
+
+        if (!(model->regs.CTRL1 & CTRL1_BOFF_REC)){
+            model_start_recovery(model);
+        }
+    }
+    else if (!(bits & ESR1_FLT_CONF_ERROR_BUS_OFF)){
+        model->bus_off = 0;
+        model->recovering = 0;
+    }
+
+    if ((bits & ESR1_TX_WRN) && !(esr1 & ESR1_TX_WRN)){
+        model->regs.ESR1 |= ESR1_TWRN_INT;
+    }
+
+    if ((bits & ESR1_RX_WRN) && !(esr1 & ESR1_RX_WRN)){
+        model->regs.ESR1 |= ESR1_RWRN_INT;
+    }
+
+    model->regs.ESR1 = (model->regs.ESR1 & ~(ESR1_FLT_CONF_MASK | ESR1_TX_WRN | ESR1_RX_WRN)) |
+                        (bits & (ESR1_FLT_CONF_MASK | ESR1_TX_WRN | ESR1_RX_WRN));
+
+    spin_unlock_irqrestore(&model->lock, flags);
+    /* UNLOCK -------------------------------------------------------------- */
+}
+
+
+void flexcan_model_poll(struct flexcan_model *model, u64 now_ns)
+{
+    unsigned long flags;
+
+    /* LOCK ---------------------------------------------------------------- */
+    spin_lock_irqsave(&model->lock, flags);
+
+    if (model->tx_pending_mb >= 0 && now_ns >= model->tx_done_ns){
+        model_complete_transmit(model, model->tx_pending_mb);
+        model->tx_pending_mb = -1;
+    }
+
+    spin_unlock_irqrestore(&model->lock, flags);
+    /* UNLOCK -------------------------------------------------------------- */
+}
+
+
+int flexcan_model_irq_pending(struct flexcan_model *model)
+{
+    struct FLEXCAN_HW_REGISTERS *regs = &model->regs;
+    unsigned long flags;
+    unsigned int esr1;
+    unsigned int ctrl1;
+    int pending;
+
+    spin_lock_irqsave(&model->lock, flags);
+
+    esr1 = regs->ESR1;
+    ctrl1 = regs->CTRL1;
+
+    pending =   (regs->IFLAG1 & regs->IMASK1) ||
+                (regs->IFLAG2 & regs->IMASK2) ||
+                ((esr1 & ESR1_ERR_INT) && (ctrl1 & CTRL1_ERR_MSK)) ||
+                ((esr1 & ESR1_BOFF_INT) && (ctrl1 & CTRL1_BOFF_MSK)) ||
+                ((esr1 & ESR1_TWRN_INT) && (ctrl1 & CTRL1_TWRN_MSK)) ||
+                ((esr1 & ESR1_RWRN_INT) && (ctrl1 & CTRL1_RWRN_MSK));
+
+    spin_unlock_irqrestore(&model->lock, flags);
+
+    return pending;
+}
@@ -0,0 +1,149 @@
+/****************************************************************************
+ *  flexcan_model.h
+ *
+ *  An in-memory model of one i.MX6 Flexcan register block.  It backs the
+ *  "vflexcan" virtual controller (vflexcan.c) and the host build in sim/.
+ *  The driver gets a pointer to the model's struct FLEXCAN_HW_REGISTERS
+ *  and in TA_CANBUS_VIRTUAL builds every ioread32() / iowrite32() goes
+ *  through flexcan_model_ioread32() / flexcan_model_iowrite32(), which
+ *  apply the register side effects.  Addresses outside any model are
+ *  passed on to the real readl() / writel().
+ *
+ *  What is modeled:
+ *
+ *  - IFLAG1/2 and the interrupt bits of ESR1 are write-1-to-clear.
+ *  - ESR1 bits 15-10 clear when ESR1 is read.
+ *  - TIMER free runs at the bit rate programmed in CTRL1 and wraps at
+ *    16 bits, mailbox timestamps come from it.
+ *  - MCR soft reset, freeze and disable handshakes complete at once.
+ *  - Writing DATA to a TX mailbox sends the frame.  Normally that is
+ *    immediate, with timed_tx set the frame takes can_frame_bits() bit
+ *    times and completes in flexcan_model_poll().  On completion the code
+ *    goes to INACTIVE, the time stamp is TIMER as the frame started, and
+ *    the IFLAG sets.  With loopback or self
+ *    reception on, the frame also arrives in an RX mailbox.
+ *  - Writing ABORT to a TX mailbox sets the code to ABORT and the IFLAG,
+ *    and cancels a timed transmit still on the wire.
+ *  - Received frames go to the lowest numbered free RX mailbox.  There is
+ *    no acceptance filtering, the driver clears all masks anyway.
+ *
+ *  - flexcan_model_set_fault() sets the FLT_CONF and warning bits, with
+ *    their interrupts.  In BUS OFF transmits wait, and the controller
+ *    recovers 128 x 11 bit times after it may, at once or when
+ *    CTRL1_BOFF_REC is cleared.
+ *
+ *  What isn't:  arbitration (received and transmitted frames don't share
+ *  the bus), error counters, the RX FIFO and the mailbox lock / BUSY
+ *  protocol.
+ *
+ *  This is included from the end of can_private.h.
+ *
+ ***************************************************************************/
+#ifndef FLEXCAN_MODEL_H__
+#define FLEXCAN_MODEL_H__
+
+#include "can_private.h"
+
+
+struct flexcan_model {
+
+    struct FLEXCAN_HW_REGISTERS regs;   /* What the driver maps */
+    spinlock_t lock;                    /* Register accesses vs. frame injection */
+    struct list_head model_list_entry;  /* All models, for address lookup */
+    unsigned int clock_freq;            /* Protocol engine clock, for the TIMER rate */
+    unsigned int bit_time_ns;           /* From CTRL1 */
+    u64 timer_start_ns;                 /* When TIMER was last 0 */
+    int timer_held;                     /* TIMER stopped at held_timer */
+    unsigned int held_timer;
+    int ack;                            /* Someone on the bus acks our frames */
+
+    int bus_off;                        /* FLT_CONF is BUS OFF */
+    int recovering;                     /* BOFF_REC allowed it, done at recover_done_ns */
+    u64 recover_done_ns;
+    int bus_off_tx_mb;                  /* TX mailbox waiting for the bus, or -1 */
+
+    int timed_tx;                       /* Transmits take a frame time */
+    int tx_pending_mb;                  /* Timed transmit on the wire, or -1 */
+    u64 tx_done_ns;                     /* When it completes */
+    unsigned int tx_start_timer;        /* TIMER when it started */
+
+    /*
+     *  Called with the model locked when a timed transmit starts, so the
+     *  owner can arrange a flexcan_model_poll() at done_ns.
+     */
+    void (*tx_started)(struct flexcan_model *model, u64 done_ns);
+    void *owner;
+
+    unsigned long long rx_frames;       /* Frames placed in a mailbox */
+    unsigned long long rx_lost;         /* Frames with no free mailbox */
+    unsigned long long tx_frames;       /* Frames sent from a TX mailbox */
+    unsigned long long register_reads;
+    unsigned long long register_writes;
+};
+
+
+struct flexcan_model *flexcan_model_create(unsigned int clock_freq);
+void flexcan_model_destroy(struct flexcan_model *model);
+
+/*
+ *  A frame arrives from the bus.  Id is in mailbox register format,
+ *  like CANBUS_MESSAGE.  Returns 0, or -ENOSPC if no mailbox was free.
+ */
+int flexcan_model_receive(struct flexcan_model *model, const CANBUS_MESSAGE *message);
+
+/*
+ *  Put a frame in RX mailbox index, whatever state it is in.  With
+ *  flexcan_model_hold_timer() this gives exact control over which
+ *  mailbox gets which timestamp, for checking the ISR's ordering.
+ */
+void flexcan_model_receive_mb(struct flexcan_model *model, const CANBUS_MESSAGE *message, int index);
+
+/*
+ *  Stop TIMER at value, or with hold 0 let it run on from value.
+ */
+void flexcan_model_hold_timer(struct flexcan_model *model, int hold, unsigned int value);
+
+/*
+ *  Set ESR1 bits as if the protocol engine saw errors,
+ *  e.g. ESR1_ERR_INT | ESR1_CRC_ERR.
+ */
+void flexcan_model_raise_esr1(struct flexcan_model *model, unsigned int bits);
+
+/*
+ *  With ack off, transmits never complete, they raise ESR1_ACK_ERR
+ *  instead, like a node alone on the bus.
+ */
+void flexcan_model_set_ack(struct flexcan_model *model, int ack);
+
+/*
+ *  Set the fault confinement state, bits out of ESR1_FLT_CONF_MASK,
+ *  ESR1_TX_WRN and ESR1_RX_WRN.  Getting worse raises ESR1_BOFF_INT,
+ *  ESR1_TWRN_INT or ESR1_RWRN_INT.  Out of BUS OFF the model gets back
+ *  by itself.
+ */
+void flexcan_model_set_fault(struct flexcan_model *model, unsigned int bits);
+
+/*
+ *  Complete a timed transmit if it is due by now_ns.
+ */
+void flexcan_model_poll(struct flexcan_model *model, u64 now_ns);
+
+/*
+ *  Would the Flexcan be asserting its interrupt line?
+ */
+int flexcan_model_irq_pending(struct flexcan_model *model);
+
+
+/*
+ *  Register access for the driver.
+ */
+unsigned int flexcan_model_ioread32(const volatile void __iomem *addr);
+void flexcan_model_iowrite32(unsigned int value, volatile void __iomem *addr);
+
+#undef ioread32
+#undef iowrite32
+#define ioread32(addr_)             flexcan_model_ioread32(addr_)
+#define iowrite32(value_, addr_)    flexcan_model_iowrite32(value_, addr_)
+
+
+#endif
@@ -260,6 +260,12 @@ struct FLEXCAN_HW_REGISTERS {
 #define ESR1_ERR_INT            0x00000002
 #define ESR1_WAK_INT            0x00000001
 
+/*
+ *  The error bits, cleared by reading ESR1.
+ */
+#define ESR1_ERROR_BITS         (ESR1_BIT1_ERR | ESR1_BIT0_ERR | ESR1_ACK_ERR | \
+                                 ESR1_CRC_ERR | ESR1_FRM_ERR | ESR1_STF_ERR)
+
 
 /****************************************************************************
  *
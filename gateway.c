@@ -0,0 +1,479 @@
+/****************************************************************************
+ *  gateway.c
+ *
+ *  Forwards frames from one controller to another without a round trip
+ *  through user space.  Each device has a short list of routes, added
+ *  by ioctl on one of its files.  The RX ISR matches every received
+ *  frame against its device's routes, and a match is rewritten as the
+ *  route says and queued for transmit on the destination device.
+ *
+ *  Matching happens under the source's register_lock, but the frames
+ *  are only handed to the destination's tx_lock after the source lock
+ *  is dropped, so the source ISR never waits on another device.  In
+ *  between, the ISR is in an RCU read side section, which is what keeps
+ *  the destination device alive - see destroy_can_gateway().
+ *
+ ***************************************************************************/
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+
+#include "can_private.h"
+
+
+#define CAN_ROUTE_FLAGS     (CAN_ROUTE_REWRITE_ID | CAN_ROUTE_MASK_DATA)
+
+
+void init_can_gateway(struct canbus_device_t *dev)
+{
+    INIT_LIST_HEAD(&dev->routes);
+    dev->num_routes = 0;
+    dev->next_route_id = 1;
+}
+
+
+/**
+ *  Remove every route to or from dev and free them.  dev must already 
+ *  be unregistered, so no new routes can name it.  Process context.
+ */
+void destroy_can_gateway(struct canbus_device_t *dev)
+{
+    struct canbus_device_t *other;
+    struct can_route *route;
+    struct can_route *next;
+    unsigned long flags;
+    LIST_HEAD(dead);
+    int i;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    spin_lock_irqsave(&can_devices_lock, flags);
+
+    for (i = 0; i<CAN_MAX_DEVICES; i++){
+
+        other = can_device_lookup(i);
+        if (!other){
+            continue;
+        }
+
+        can_lock(&other->register_lock);
+
+        list_for_each_entry_safe(route, next, &other->routes, entry){
+            if (route->dest == dev){
+                list_move_tail(&route->entry, &dead);
+                other->num_routes--;
+            }
+        }
+
+        can_unlock(&other->register_lock);
+    }
+
+    can_lock(&dev->register_lock);
+
+    list_splice_init(&dev->routes, &dead);
+    dev->num_routes = 0;
+
+    can_unlock(&dev->register_lock);
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    spin_unlock_irqrestore(&can_devices_lock, flags);
+
+    /*
+     *  An ISR that matched one of these may still be handing frames to
+     *  dev.  Wait for it to finish.
+     */
+    synchronize_rcu();
+
+    list_for_each_entry_safe(route, next, &dead, entry){
+        kfree(route);
+    }
+}
+
+
+
+static inline int route_matches(const struct can_route_t *config,
+                                const CANBUS_MESSAGE *frame,
+                                unsigned int id)
+{
+    if (config->match_type != CmtUndefined && config->match_type != frame->Type){
+        return 0;
+    }
+
+    return ((id ^ config->match_id) & config->match_mask) == 0;
+}
+
+
+/**
+ *  Match one received frame against dev's routes, and put a rewritten
+ *  copy on forward_list for every route it matches.  ISR, with dev's
+ *  register_lock held and in an RCU read side section that lasts until
+ *  can_gateway_submit() is done with forward_list.
+ */
+void can_gateway_route( struct canbus_device_t *dev,
+                        const CANBUS_MESSAGE *frame,
+                        u64 capture_ns,
+                        struct list_head *forward_list)
+{
+    struct can_route *route;
+    struct kcanbus_message *message;
+    unsigned int id = can_frame_id(frame);
+    int i;
+
+    list_for_each_entry(route, &dev->routes, entry){
+
+        if (!route_matches(&route->config, frame, id)){
+            continue;
+        }
+
+        route->hits++;
+
+        /*
+         *  Only a hint, the destination's lock isn't ours to take here.
+         *  It keeps a dead or saturated bus from eating the pool.
+         */
+        if (ACCESS_ONCE(route->dest->stats.cur_tx_queue_count) >= CAN_ROUTE_MAX_QUEUED){
+            route->drops++;
+            continue;
+        }
+
+        message = alloc_kcanbus_message(route->dest);
+        if (!message){
+            route->drops++;
+            continue;
+        }
+
+        memcpy(&message->user_message, frame, sizeof(CANBUS_MESSAGE));
+        INIT_LIST_HEAD(&message->entry);
+        message->signature = KCANBUS_SIGNATURE;
+        message->capture_ns = capture_ns;
+        message->flags = KCANBUS_FORWARDED;
+        message->gateway_dest = route->dest;
+
+        if (route->config.flags & CAN_ROUTE_REWRITE_ID){
+            if (frame->Type == CmtStandard){
+                message->user_message.Id = (route->config.new_id & 0x7FF) << 18;
+            }
+            else{
+                message->user_message.Id = route->config.new_id & 0x1FFFFFFF;
+            }
+        }
+
+        if (route->config.flags & CAN_ROUTE_MASK_DATA){
+            for (i = 0; i<8; i++){
+                message->user_message.Data[i] = 
+                    (message->user_message.Data[i] & route->config.data_and[i]) |
+                    route->config.data_or[i];
+            }
+        }
+
+        list_add_tail(&message->entry, forward_list);
+        route->forwarded++;
+    }
+}
+
+
+/**
+ *  Hand the frames can_gateway_route() collected to their destinations'
+ *  transmit queues, the same way a write() would.  ISR, with no 
+ *  register_lock held, still in the RCU read side section.
+ */
+void can_gateway_submit(struct list_head *forward_list)
+{
+    struct canbus_device_t *dest;
+    struct kcanbus_message *message;
+    unsigned long flags;
+
+    while (!list_empty(forward_list)){
+
+        message = list_first_entry(forward_list, struct kcanbus_message, entry);
+        dest = message->gateway_dest;
+
+        /*
+         *  LOCK --------------------------------------------------------
+         */
+        can_lock_irqsave(&dest->tx_lock, flags);
+
+        /*
+         *  Everything in a row for the same destination goes under 
+         *  one lock hold.
+         */
+        while (!list_empty(forward_list)){
+
+            message = list_first_entry(forward_list, struct kcanbus_message, entry);
+            if (message->gateway_dest != dest){
+                break;
+            }
+
+            list_del_init(&message->entry);
+            message->gateway_dest = NULL;
+
+            can_tx_submit(dest, message);
+        }
+
+        /*
+         *  UNLOCK --------------------------------------------------------
+         */
+        can_unlock_irqrestore(&dest->tx_lock, flags);
+    }
+}
+
+
+/**
+ *  A message is going into dev's TX mailbox.  If the gateway queued it,
+ *  record how long it took from the source ISR.  dev's tx_lock held.
+ */
+void can_gateway_tx_started(struct canbus_device_t *dev,
+                            const struct kcanbus_message *message)
+{
+    if (message->flags & KCANBUS_FORWARDED){
+        dev->stats.gateway_tx_count++;
+        can_histogram_add(  &dev->stats.gateway_latency_hist, 
+                            can_clock_ns() - message->capture_ns);
+    }
+}
+
+
+
+static int check_route(struct canbus_device_t *dev, const struct can_route_t *config)
+{
+    unsigned int id_mask;
+
+    if (config->flags & ~CAN_ROUTE_FLAGS){
+        return -EINVAL;
+    }
+
+    if (config->match_type != CmtUndefined && 
+        config->match_type != CmtStandard &&
+        config->match_type != CmtExtended){
+        return -EINVAL;
+    }
+
+    /*
+     *  A rewrite keeps the frame type, so the new ID has to fit every
+     *  type the route can match.
+     */
+    id_mask = (config->match_type == CmtExtended) ? 0x1FFFFFFF : 0x7FF;
+
+    if ((config->flags & CAN_ROUTE_REWRITE_ID) && (config->new_id & ~id_mask)){
+        return -EINVAL;
+    }
+
+    if (config->dest_index == dev->index){
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+
+static long add_route(struct canbus_device_t *dev, unsigned long arg)
+{
+    struct can_route *route;
+    struct canbus_device_t *dest;
+    unsigned long flags;
+    long ret;
+
+    route = kzalloc(sizeof(struct can_route), GFP_KERNEL);
+    if (!route){
+        return -ENOMEM;
+    }
+
+    if (copy_from_user(&route->config, (void __user *)arg, sizeof(struct can_route_t))){
+        ret = -EFAULT;
+        goto FAILED;
+    }
+
+    ret = check_route(dev, &route->config);
+    if (ret){
+        goto FAILED;
+    }
+
+    /*
+     *  Holding can_devices_lock across the add means destroy_can_gateway()
+     *  either sees this route or we don't see the destination.
+     *
+     *  LOCK --------------------------------------------------------
+     */
+    spin_lock_irqsave(&can_devices_lock, flags);
+
+    dest = can_device_lookup(route->config.dest_index);
+
+    if (!dest){
+        ret = -ENODEV;
+    }
+    else{
+        can_lock(&dev->register_lock);
+
+        if (dev->num_routes >= CAN_MAX_ROUTES){
+            ret = -ENOSPC;
+        }
+        else{
+            route->dest = dest;
+            route->config.route_id = dev->next_route_id++;
+            list_add_tail(&route->entry, &dev->routes);
+            dev->num_routes++;
+        }
+
+        can_unlock(&dev->register_lock);
+    }
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    spin_unlock_irqrestore(&can_devices_lock, flags);
+
+    if (ret){
+        goto FAILED;
+    }
+
+    /*
+     *  The route is live, so a bad buffer here only loses the ID.
+     */
+    if (copy_to_user(   &((struct can_route_t __user *)arg)->route_id, 
+                        &route->config.route_id, sizeof(unsigned int))){
+        return -EFAULT;
+    }
+
+    return 0;
+
+FAILED:
+    kfree(route);
+    return ret;
+}
+
+
+static struct can_route *find_route(struct canbus_device_t *dev, unsigned int route_id)
+{
+    struct can_route *route;
+
+    list_for_each_entry(route, &dev->routes, entry){
+        if (route->config.route_id == route_id){
+            return route;
+        }
+    }
+
+    return NULL;
+}
+
+
+static long delete_route(struct canbus_device_t *dev, unsigned long arg)
+{
+    struct can_route *route;
+    unsigned int route_id;
+    unsigned long flags;
+
+    if (copy_from_user(&route_id, (void __user *)arg, sizeof(unsigned int))){
+        return -EFAULT;
+    }
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->register_lock, flags);
+
+    route = find_route(dev, route_id);
+    if (route){
+        list_del(&route->entry);
+        dev->num_routes--;
+    }
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->register_lock, flags);
+
+    if (!route){
+        return -ENOENT;
+    }
+
+    /*
+     *  The ISR only looks at routes under the lock, frames it already
+     *  matched don't point back here.
+     */
+    kfree(route);
+
+    return 0;
+}
+
+
+static long get_route_stats(struct canbus_device_t *dev, unsigned long arg)
+{
+    struct can_route_stats_t stats;
+    struct can_route *route;
+    unsigned long flags;
+
+    if (copy_from_user(&stats.route_id, (void __user *)arg, sizeof(unsigned int))){
+        return -EFAULT;
+    }
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->register_lock, flags);
+
+    route = find_route(dev, stats.route_id);
+    if (route){
+        stats.route = route->config;
+        stats.hits = route->hits;
+        stats.forwarded = route->forwarded;
+        stats.drops = route->drops;
+    }
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->register_lock, flags);
+
+    if (!route){
+        return -ENOENT;
+    }
+
+    if (copy_to_user((void __user *)arg, &stats, sizeof(struct can_route_stats_t))){
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+
+long can_gateway_ioctl( struct canbus_device_t *dev, 
+                        unsigned int cmd, 
+                        unsigned long arg)
+{
+    switch(cmd){
+
+        case CAN_IOCTL_ADD_ROUTE:
+            return add_route(dev, arg);
+
+        case CAN_IOCTL_DELETE_ROUTE:
+            return delete_route(dev, arg);
+
+        case CAN_IOCTL_GET_ROUTE_STATS:
+            return get_route_stats(dev, arg);
+    }
+
+    return -EINVAL;
+}
+
+
+/**
+ *  One line per route in /proc.  Unlike most of /proc this takes the
+ *  lock, the route and its destination can go away under us otherwise.
+ */
+void show_can_gateway(struct canbus_device_t *dev, struct seq_file *m)
+{
+    struct can_route *route;
+    unsigned long flags;
+
+    can_lock_irqsave(&dev->register_lock, flags);
+
+    list_for_each_entry(route, &dev->routes, entry){
+        seq_printf( m, "Route %u -> %s Hits %llu Forwarded %llu Drops %llu\n",
+                    route->config.route_id, route->dest->name,
+                    route->hits, route->forwarded, route->drops);
+    }
+
+    can_unlock_irqrestore(&dev->register_lock, flags);
+}
@@ -0,0 +1,506 @@
+/****************************************************************************
+ *  group.c
+ *
+ *  Consumer groups.  Normally every file accepting messages gets its own
+ *  copy of every received frame.  The files in a group instead share
+ *  them, each frame going to one member, round robin or by a hash of
+ *  its ID, so several threads can split the decoding between them.
+ *
+ *  Groups and their members are only changed under register_lock, the
+ *  same as the gateway routes, so the ISR always sees a whole group.
+ *  Changing a group also moves unread frames between the members'
+ *  receive queues, so nothing is lost or delivered twice.  With
+ *  CAN_GROUP_HASH_ID the ID hash picks one of CAN_GROUP_SLOTS slots,
+ *  and a member joining or leaving only moves the slots it takes or
+ *  gives up, along with their unread frames, which keeps each ID in
+ *  order on one member.
+ *
+ ***************************************************************************/
+#include <linux/seq_file.h>
+
+#include "can_private.h"
+
+
+#define CAN_GROUP_NO_MEMBER     0xFF
+
+
+void init_can_groups(struct canbus_device_t *dev)
+{
+    INIT_LIST_HEAD(&dev->groups);
+    dev->num_groups = 0;
+}
+
+
+static inline unsigned int message_slot(const struct kcanbus_message *message)
+{
+    return hash_32(can_frame_id(&message->user_message), CAN_GROUP_SLOT_BITS);
+}
+
+
+static struct can_group *find_group(struct canbus_device_t *dev, const char *name)
+{
+    struct can_group *group;
+
+    list_for_each_entry(group, &dev->groups, entry){
+        if (!strncmp(group->config.name, name, CAN_GROUP_NAME_LEN)){
+            return group;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ *  Move file's unread group frames onto taken, all of them if member is
+ *  CAN_GROUP_NO_MEMBER, otherwise those whose slot now belongs to
+ *  members[member].  Returns how many.  register_lock held.
+ */
+static unsigned int take_group_frames(  struct can_group *group,
+                                        struct canbus_file_t *file,
+                                        unsigned int member,
+                                        struct list_head *taken)
+{
+    struct kcanbus_message *message;
+    struct kcanbus_message *next;
+    unsigned int count = 0;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock(&file->rx_lock);
+
+    list_for_each_entry_safe(message, next, &file->receive_queue, entry){
+
+        if (!(message->flags & KCANBUS_GROUP)){
+            continue;
+        }
+
+        if (member != CAN_GROUP_NO_MEMBER && group->slots[message_slot(message)] != member){
+            continue;
+        }
+
+        list_move_tail(&message->entry, taken);
+        count++;
+    }
+
+    file->stats.cur_rx_queue_count -= count;
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock(&file->rx_lock);
+
+    return count;
+}
+
+
+/**
+ *  Append frames to file's receive queue.  register_lock held.
+ */
+static void give_group_frames(  struct canbus_file_t *file,
+                                struct list_head *frames,
+                                unsigned int count)
+{
+    if (!count){
+        return;
+    }
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock(&file->rx_lock);
+
+    list_splice_tail_init(frames, &file->receive_queue);
+
+    file->stats.cur_rx_queue_count += count;
+    if (file->stats.cur_rx_queue_count > file->stats.max_rx_queue_count){
+        file->stats.max_rx_queue_count = file->stats.cur_rx_queue_count;
+    }
+    file->stats.group_frames += count;
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock(&file->rx_lock);
+
+    wake_up_interruptible(&file->receive_wq);
+}
+
+
+/**
+ *  The last member joined.  Hand it an even share of the slots, taken
+ *  from whoever has most, along with their unread frames for those
+ *  slots.  register_lock held.
+ */
+static void group_share_slots(struct can_group *group)
+{
+    unsigned int counts[CAN_GROUP_MAX_MEMBERS];
+    unsigned int joiner = group->num_members - 1;
+    unsigned int target = CAN_GROUP_SLOTS / group->num_members;
+    unsigned int busiest;
+    unsigned int count = 0;
+    unsigned int i;
+    LIST_HEAD(taken);
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i<CAN_GROUP_SLOTS; i++){
+        counts[group->slots[i]]++;
+    }
+
+    while (counts[joiner] < target){
+
+        busiest = 0;
+        for (i = 1; i<joiner; i++){
+            if (counts[i] > counts[busiest]){
+                busiest = i;
+            }
+        }
+
+        for (i = 0; group->slots[i] != busiest; i++){
+        }
+
+        group->slots[i] = joiner;
+        counts[busiest]--;
+        counts[joiner]++;
+    }
+
+    for (i = 0; i<joiner; i++){
+        count += take_group_frames(group, group->members[i], joiner, &taken);
+    }
+
+    give_group_frames(group->members[joiner], &taken, count);
+    group->requeued += count;
+}
+
+
+static void group_add_member(struct can_group *group, struct canbus_file_t *file)
+{
+    group->members[group->num_members++] = file;
+    file->group = group;
+
+    if (group->num_members > 1 && group->config.policy == CAN_GROUP_HASH_ID){
+        group_share_slots(group);
+    }
+}
+
+
+/**
+ *  Take file out of its group and share its unread group frames among
+ *  the rest.  Returns the group if that was its last member, for the
+ *  caller to free after unlocking.  register_lock held.
+ */
+static struct can_group *group_remove_member(struct canbus_device_t *dev,
+                                             struct canbus_file_t *file)
+{
+    struct can_group *group = file->group;
+    struct list_head frames[CAN_GROUP_MAX_MEMBERS];
+    unsigned int counts[CAN_GROUP_MAX_MEMBERS];
+    struct kcanbus_message *message;
+    struct kcanbus_message *next;
+    struct canbus_file_t *member;
+    unsigned int leaver;
+    unsigned int fewest;
+    unsigned int i, j;
+    LIST_HEAD(taken);
+
+    file->group = NULL;
+
+    for (leaver = 0; group->members[leaver] != file; leaver++){
+    }
+
+    for (i = leaver + 1; i<group->num_members; i++){
+        group->members[i - 1] = group->members[i];
+    }
+    group->num_members--;
+
+    /*
+     *  Nobody to hand them to, so it keeps its unread frames, as its own.
+     */
+    if (!group->num_members){
+
+        can_lock(&file->rx_lock);
+
+        list_for_each_entry(message, &file->receive_queue, entry){
+            message->flags &= ~KCANBUS_GROUP;
+        }
+
+        can_unlock(&file->rx_lock);
+
+        list_del(&group->entry);
+        dev->num_groups--;
+        return group;
+    }
+
+    /*
+     *  The leaver's slots go to whoever has fewest, one at a time.
+     */
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i<CAN_GROUP_SLOTS; i++){
+        if (group->slots[i] == leaver){
+            group->slots[i] = CAN_GROUP_NO_MEMBER;
+            continue;
+        }
+        if (group->slots[i] > leaver){
+            group->slots[i]--;
+        }
+        counts[group->slots[i]]++;
+    }
+
+    for (i = 0; i<CAN_GROUP_SLOTS; i++){
+        if (group->slots[i] != CAN_GROUP_NO_MEMBER){
+            continue;
+        }
+
+        fewest = 0;
+        for (j = 1; j<group->num_members; j++){
+            if (counts[j] < counts[fewest]){
+                fewest = j;
+            }
+        }
+
+        group->slots[i] = fewest;
+        counts[fewest]++;
+    }
+
+    /*
+     *  Then its unread frames follow their slots, or go round robin.
+     */
+    if (!take_group_frames(group, file, CAN_GROUP_NO_MEMBER, &taken)){
+        return NULL;
+    }
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i<group->num_members; i++){
+        INIT_LIST_HEAD(&frames[i]);
+    }
+
+    list_for_each_entry_safe(message, next, &taken, entry){
+
+        member = can_group_member(group, &message->user_message);
+
+        for (i = 0; group->members[i] != member; i++){
+        }
+
+        list_move_tail(&message->entry, &frames[i]);
+        counts[i]++;
+        group->requeued++;
+    }
+
+    for (i = 0; i<group->num_members; i++){
+        give_group_frames(group->members[i], &frames[i], counts[i]);
+    }
+
+    return NULL;
+}
+
+
+static long join_group(struct canbus_file_t *file, unsigned long arg)
+{
+    struct canbus_device_t *dev = file->dev;
+    struct can_group_config_t config;
+    struct can_group *group;
+    struct can_group *new_group;
+    unsigned long flags;
+    long ret = 0;
+
+    if (copy_from_user(&config, (void __user *)arg, sizeof(struct can_group_config_t))){
+        return -EFAULT;
+    }
+
+    config.name[CAN_GROUP_NAME_LEN - 1] = '\0';
+
+    if (!config.name[0] ||
+        (config.policy != CAN_GROUP_ROUND_ROBIN && config.policy != CAN_GROUP_HASH_ID)){
+        return -EINVAL;
+    }
+
+    if (!file->accept_messages){
+        return -EBUSY;
+    }
+
+    /*
+     *  In case this is the first member.
+     */
+    new_group = kzalloc(sizeof(struct can_group), GFP_KERNEL);
+    if (!new_group){
+        return -ENOMEM;
+    }
+    new_group->config = config;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->register_lock, flags);
+
+    group = find_group(dev, config.name);
+
+    if (file->group){
+        ret = -EBUSY;
+    }
+    else if (group && group->config.policy != config.policy){
+        ret = -EINVAL;
+    }
+    else if (group && group->num_members >= CAN_GROUP_MAX_MEMBERS){
+        ret = -ENOSPC;
+    }
+    else if (!group && dev->num_groups >= CAN_MAX_GROUPS){
+        ret = -ENOSPC;
+    }
+    else{
+        if (!group){
+            group = new_group;
+            new_group = NULL;
+            list_add_tail(&group->entry, &dev->groups);
+            dev->num_groups++;
+        }
+
+        group_add_member(group, file);
+    }
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->register_lock, flags);
+
+    kfree(new_group);
+
+    return ret;
+}
+
+
+static long leave_group(struct canbus_file_t *file)
+{
+    struct canbus_device_t *dev = file->dev;
+    struct can_group *dead = NULL;
+    unsigned long flags;
+    long ret = 0;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->register_lock, flags);
+
+    if (file->group){
+        dead = group_remove_member(dev, file);
+    }
+    else{
+        ret = -ENOENT;
+    }
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->register_lock, flags);
+
+    /*
+     *  The ISR only looks at groups under the lock.
+     */
+    kfree(dead);
+
+    return ret;
+}
+
+
+/**
+ *  file is closing, leave its group if it's in one.
+ */
+void can_group_release(struct canbus_file_t *file)
+{
+    /*
+     *  Only file's own ioctls change file->group, so no lock to look.
+     */
+    if (file->group){
+        leave_group(file);
+    }
+}
+
+
+static long get_group_stats(struct canbus_device_t *dev, unsigned long arg)
+{
+    struct can_group_stats_t stats;
+    struct can_group *group;
+    unsigned long flags;
+    unsigned int i;
+
+    if (copy_from_user(stats.name, (void __user *)arg, CAN_GROUP_NAME_LEN)){
+        return -EFAULT;
+    }
+
+    stats.name[CAN_GROUP_NAME_LEN - 1] = '\0';
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->register_lock, flags);
+
+    group = find_group(dev, stats.name);
+    if (group){
+        memset(stats.member_frames, 0, sizeof(stats.member_frames));
+
+        stats.policy = group->config.policy;
+        stats.num_members = group->num_members;
+        stats.frames = group->frames;
+        stats.requeued = group->requeued;
+
+        for (i = 0; i<group->num_members; i++){
+            stats.member_frames[i] = group->members[i]->stats.group_frames;
+        }
+    }
+
+    /*
+     *  UNLOCK --------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->register_lock, flags);
+
+    if (!group){
+        return -ENOENT;
+    }
+
+    if (copy_to_user((void __user *)arg, &stats, sizeof(struct can_group_stats_t))){
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+
+long can_group_ioctl(   struct canbus_file_t *file,
+                        unsigned int cmd,
+                        unsigned long arg)
+{
+    switch(cmd){
+
+        case CAN_IOCTL_JOIN_GROUP:
+            return join_group(file, arg);
+
+        case CAN_IOCTL_LEAVE_GROUP:
+            return leave_group(file);
+
+        case CAN_IOCTL_GET_GROUP_STATS:
+            return get_group_stats(file->dev, arg);
+    }
+
+    return -EINVAL;
+}
+
+
+/**
+ *  One line per group in /proc, under the lock like the routes.
+ */
+void show_can_groups(struct canbus_device_t *dev, struct seq_file *m)
+{
+    struct can_group *group;
+    unsigned long flags;
+
+    can_lock_irqsave(&dev->register_lock, flags);
+
+    list_for_each_entry(group, &dev->groups, entry){
+        seq_printf( m, "Group %s %s Members %u Frames %llu Requeued %llu\n",
+                    group->config.name,
+                    group->config.policy == CAN_GROUP_HASH_ID ? "HashId" : "RoundRobin",
+                    group->num_members, group->frames, group->requeued);
+    }
+
+    can_unlock_irqrestore(&dev->register_lock, flags);
+}
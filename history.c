@@ -0,0 +1,208 @@
+/****************************************************************************
+ *  history.c
+ *
+ *  A device wide ring of the last frames received, so a diagnostics
+ *  tool that opens the device after a fault can still see what led up
+ *  to it.  The ISR writes one record per frame, whether there are no
+ *  readers or a hundred (see can_history_add()), and
+ *  CAN_IOCTL_GET_HISTORY copies them out.
+ *
+ *  The ring is allocated at probe time and never grows.  Every frame
+ *  gets the next sequence number, so a reader can tell exactly how many
+ *  it missed if the ring lapped it.
+ *
+ ***************************************************************************/
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+
+#include "can_private.h"
+
+
+static unsigned int history_size = 4096;
+module_param(history_size, uint, S_IRUGO);
+MODULE_PARM_DESC(history_size,
+                "Frames each device keeps for CAN_IOCTL_GET_HISTORY (rounded up to a power of 2, 0 = off)");
+
+/*
+ *  How many entries we copy per lock hold.
+ */
+#define HISTORY_CHUNK       32
+
+
+int init_can_history(struct canbus_device_t *dev)
+{
+    struct can_history_ring *history = &dev->history;
+
+    history->head = 0;
+    history->size = 0;
+    history->ring = NULL;
+
+    if (!history_size){
+        return 0;
+    }
+
+    history->ring = vzalloc(roundup_pow_of_two(history_size) * sizeof(struct can_history_entry_t));
+    if (!history->ring){
+        return -ENOMEM;
+    }
+
+    history->size = roundup_pow_of_two(history_size);
+
+    return 0;
+}
+
+
+void destroy_can_history(struct canbus_device_t *dev)
+{
+    struct can_history_ring *history = &dev->history;
+
+    history->size = 0;
+
+    vfree(history->ring);
+    history->ring = NULL;
+}
+
+
+static inline u64 history_first_seq(struct can_history_ring *history)
+{
+    return (history->head > history->size) ? history->head - history->size : 0;
+}
+
+
+static inline struct can_history_entry_t *
+history_entry(struct can_history_ring *history, u64 seq)
+{
+    return &history->ring[seq & (history->size - 1)];
+}
+
+
+/*
+ *  The first frame held at or after ns.  Timestamps only go backwards
+ *  within the jitter of the ISR's clock reference, so a binary search
+ *  is close enough.  register_lock held.
+ */
+static u64 history_find_time(struct can_history_ring *history, u64 ns)
+{
+    u64 low = history_first_seq(history);
+    u64 high = history->head;
+    u64 mid;
+
+    while (low < high){
+
+        mid = low + (high - low) / 2;
+
+        if (history_entry(history, mid)->timestamp_ns < ns){
+            low = mid + 1;
+        }
+        else{
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+
+long can_history_ioctl(struct canbus_device_t *dev, unsigned long arg)
+{
+    struct can_history_ring *history = &dev->history;
+    struct can_history_request_t request;
+    struct can_history_entry_t *chunk;
+    struct can_history_entry_t __user *entries;
+    unsigned long flags;
+    unsigned int found;
+    u64 first;
+    u64 next = 0;
+    int started = 0;
+    long ret = 0;
+
+    if (copy_from_user(&request, (void __user *)arg, sizeof(request))){
+        return -EFAULT;
+    }
+
+    if (request.start > CAN_HISTORY_FROM_TIME){
+        return -EINVAL;
+    }
+
+    if (!history->size){
+        return -ENODEV;
+    }
+
+    chunk = kmalloc(HISTORY_CHUNK * sizeof(struct can_history_entry_t), GFP_KERNEL);
+    if (!chunk){
+        return -ENOMEM;
+    }
+
+    entries = (struct can_history_entry_t __user *)(unsigned long)request.entries;
+    request.num_entries = 0;
+    request.size = history->size;
+    request.lost = 0;
+
+    do{
+        found = 0;
+
+        /*
+         *  LOCK --------------------------------------------------------
+         */
+        can_lock_irqsave(&dev->register_lock, flags);
+
+        first = history_first_seq(history);
+
+        if (!started){
+
+            started = 1;
+            request.first_seq = first;
+
+            if (request.start == CAN_HISTORY_FROM_SEQ){
+                next = request.from;
+            }
+            else if (request.start == CAN_HISTORY_FROM_TIME){
+                next = history_find_time(history, request.from);
+            }
+            else{
+                next = first;
+            }
+        }
+
+        /*
+         *  Lapped, either before we started or while we were copying
+         *  the last chunk out.
+         */
+        if (next < first){
+            request.lost += first - next;
+            next = first;
+        }
+
+        while ( next < history->head &&
+                found < HISTORY_CHUNK &&
+                request.num_entries + found < request.max_entries){
+
+            chunk[found++] = *history_entry(history, next);
+            next++;
+        }
+
+        /*
+         *  UNLOCK --------------------------------------------------------
+         */
+        can_unlock_irqrestore(&dev->register_lock, flags);
+
+        if (found && copy_to_user( &entries[request.num_entries], chunk,
+                                    found * sizeof(struct can_history_entry_t))){
+            ret = -EFAULT;
+            break;
+        }
+
+        request.num_entries += found;
+
+    }while (found == HISTORY_CHUNK);
+
+    kfree(chunk);
+
+    request.next_seq = next;
+
+    if (!ret && copy_to_user((void __user *)arg, &request, sizeof(request))){
+        ret = -EFAULT;
+    }
+
+    return ret;
+}
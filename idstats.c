@@ -0,0 +1,376 @@
+/****************************************************************************
+ *  idstats.c
+ *
+ *  Per CAN ID traffic statistics, so "is node X still sending 0x3A1 at
+ *  100 Hz?" can be answered without a sniffer reading every frame.
+ *
+ *  Standard IDs are directly indexed.  Extended IDs go in a fixed size,
+ *  open addressed hash table; if an ID can't be placed within a few
+ *  probes it is only counted in overflow_count.  Both tables are
+ *  allocated at probe time, so the ISR never allocates and the memory
+ *  is bounded no matter what shows up on the bus.
+ *
+ ***************************************************************************/
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+
+#include "can_private.h"
+
+
+static unsigned int idstats_extended_slots = 1024;
+module_param(idstats_extended_slots, uint, S_IRUGO);
+MODULE_PARM_DESC(idstats_extended_slots,
+                "Extended IDs tracked in the per ID statistics (rounded up to a power of 2)");
+
+/*
+ *  How far we look for a free extended slot before giving up.
+ */
+#define IDSTATS_MAX_PROBE   16
+
+/*
+ *  How many entries we copy, or clear, per lock hold.
+ */
+#define IDSTATS_CHUNK       32
+
+
+static inline unsigned int idstats_total_slots(struct can_idstats_table *table)
+{
+    return IDSTATS_NUM_STANDARD + table->extended_slots;
+}
+
+
+static inline struct can_id_stats_t *
+idstats_slot(struct can_idstats_table *table, unsigned int index)
+{
+    if (index < IDSTATS_NUM_STANDARD){
+        return &table->standard[index];
+    }
+    return &table->extended[index - IDSTATS_NUM_STANDARD];
+}
+
+
+/*
+ *  Find, or claim, the entry for an extended ID.
+ */
+static struct can_id_stats_t *
+find_extended(struct can_idstats_table *table, unsigned int id)
+{
+    struct can_id_stats_t *entry;
+    unsigned int index;
+    int i;
+
+    index = hash_32(id, table->extended_bits);
+
+    for (i = 0; i<IDSTATS_MAX_PROBE; i++){
+
+        entry = &table->extended[index];
+
+        if (entry->count == 0 || entry->id == id){
+            return entry;
+        }
+
+        index = (index + 1) & (table->extended_slots - 1);
+    }
+
+    return NULL;
+}
+
+
+/**
+ *  Account for one received frame.  ISR, with the register lock held.
+ *  frame_ns is our best estimate of when the frame was on the bus.
+ */
+void can_idstats_update(struct canbus_device_t *dev,
+                        const CANBUS_MESSAGE *message,
+                        u64 frame_ns)
+{
+    struct can_idstats_table *table = &dev->idstats;
+    struct can_id_stats_t *entry;
+    unsigned int id;
+    u64 period;
+
+    if (!table->standard){
+        return;
+    }
+
+    if (message->Type == CmtExtended){
+        id = message->Id & 0x1FFFFFFF;
+        entry = find_extended(table, id);
+        if (!entry){
+            table->overflow_count++;
+            return;
+        }
+    }
+    else{
+        id = (message->Id & MB_ID_STANDARD_MASK) >> 18;
+        entry = &table->standard[id];
+    }
+
+    if (entry->count == 0){
+        entry->id = id;
+        entry->type = message->Type;
+        entry->last_dlc = message->DataLength;
+    }
+    else{
+        /*
+         *  The estimates from two different ISRs can cross by a
+         *  few microseconds.  Don't let that wrap.
+         */
+        period = (frame_ns > entry->last_ns) ? (frame_ns - entry->last_ns) : 0;
+
+        if (entry->count == 1 || period < entry->min_period_ns){
+            entry->min_period_ns = period;
+        }
+        if (period > entry->max_period_ns){
+            entry->max_period_ns = period;
+        }
+        entry->last_period_ns = period;
+        entry->total_period_ns += period;
+
+        if (entry->last_dlc != message->DataLength){
+            entry->dlc_changes++;
+            entry->last_dlc = message->DataLength;
+        }
+    }
+
+    entry->count++;
+    entry->last_ns = frame_ns;
+}
+
+
+/**
+ *  Clear the table a chunk at a time, so we never hold the lock long.
+ */
+void reset_can_idstats(struct canbus_device_t *dev)
+{
+    struct can_idstats_table *table = &dev->idstats;
+    unsigned long flags;
+    unsigned int index;
+    unsigned int i;
+
+    if (!table->standard){
+        return;
+    }
+
+    for (index = 0; index < idstats_total_slots(table); index += IDSTATS_CHUNK){
+
+        /*
+         *  LOCK --------------------------------------------------------
+         */
+        can_lock_irqsave(&dev->register_lock, flags);
+
+        for (i = index; i < index + IDSTATS_CHUNK && i < idstats_total_slots(table); i++){
+            memset(idstats_slot(table, i), 0, sizeof(struct can_id_stats_t));
+        }
+
+        if (index == 0){
+            table->overflow_count = 0;
+        }
+
+        /*
+         *  UNLOCK --------------------------------------------------------
+         */
+        can_unlock_irqrestore(&dev->register_lock, flags);
+    }
+}
+
+
+/**
+ *  CAN_IOCTL_GET_ID_STATS
+ */
+long can_idstats_ioctl(struct canbus_device_t *dev, unsigned long arg)
+{
+    struct can_idstats_table *table = &dev->idstats;
+    struct can_id_stats_request_t request;
+    struct can_id_stats_t *chunk;
+    struct can_id_stats_t __user *entries;
+    struct can_id_stats_t *entry;
+    unsigned long flags;
+    unsigned int index;
+    unsigned int found;
+    long ret = 0;
+
+    if (copy_from_user(&request, (void __user *)arg, sizeof(request))){
+        return -EFAULT;
+    }
+
+    if (!table->standard){
+        return -ENODEV;
+    }
+
+    chunk = kmalloc(IDSTATS_CHUNK * sizeof(struct can_id_stats_t), GFP_KERNEL);
+    if (!chunk){
+        return -ENOMEM;
+    }
+
+    entries = (struct can_id_stats_t __user *)(unsigned long)request.entries;
+    index = request.start_index;
+    request.num_entries = 0;
+
+    while (index < idstats_total_slots(table) && request.num_entries < request.max_entries){
+
+        found = 0;
+
+        /*
+         *  LOCK --------------------------------------------------------
+         */
+        can_lock_irqsave(&dev->register_lock, flags);
+
+        while ( index < idstats_total_slots(table) &&
+                found < IDSTATS_CHUNK &&
+                request.num_entries + found < request.max_entries){
+
+            entry = idstats_slot(table, index);
+            if (entry->count){
+                chunk[found++] = *entry;
+            }
+            index++;
+        }
+
+        request.overflow_count = table->overflow_count;
+
+        /*
+         *  UNLOCK --------------------------------------------------------
+         */
+        can_unlock_irqrestore(&dev->register_lock, flags);
+
+        if (found && copy_to_user( &entries[request.num_entries], chunk,
+                                    found * sizeof(struct can_id_stats_t))){
+            ret = -EFAULT;
+            break;
+        }
+
+        request.num_entries += found;
+    }
+
+    request.next_index = index;
+    request.overflow_count = table->overflow_count;
+
+    kfree(chunk);
+
+    if (!ret && copy_to_user((void __user *)arg, &request, sizeof(request))){
+        ret = -EFAULT;
+    }
+
+    return ret;
+}
+
+
+/*
+ *  /proc/ta_canbusN_ids
+ *
+ *  Like the main /proc file, this reads without the lock.  An entry
+ *  being updated while we print it may be slightly off.
+ */
+static int ta_canbus_ids_proc_show(struct seq_file *m, void *v)
+{
+    struct canbus_device_t *dev = m->private;
+    struct can_idstats_table *table = &dev->idstats;
+    struct can_id_stats_t entry;
+    u64 mean;
+    u64 rate_x100;
+    unsigned int index;
+
+    seq_printf(m, "Overflow %u\n", table->overflow_count);
+    seq_printf(m, "Id Type Count Dlc RateHz MeanPeriodUs MinPeriodUs MaxPeriodUs LastNs\n");
+
+    for (index = 0; index < idstats_total_slots(table); index++){
+
+        entry = *idstats_slot(table, index);
+        if (!entry.count){
+            continue;
+        }
+
+        mean = 0;
+        rate_x100 = 0;
+        if (entry.count > 1){
+            mean = div64_u64(entry.total_period_ns, entry.count - 1);
+        }
+        if (mean){
+            rate_x100 = div64_u64(100ULL * NSEC_PER_SEC, mean);
+        }
+
+        seq_printf( m, "%08x %s %llu %u %llu.%02llu %llu %llu %llu %llu\n",
+                    entry.id,
+                    (entry.type == CmtExtended) ? "ext" : "std",
+                    entry.count,
+                    entry.last_dlc,
+                    div_u64(rate_x100, 100),
+                    rate_x100 - div_u64(rate_x100, 100) * 100,
+                    div_u64(mean, NSEC_PER_USEC),
+                    div_u64(entry.min_period_ns, NSEC_PER_USEC),
+                    div_u64(entry.max_period_ns, NSEC_PER_USEC),
+                    entry.last_ns);
+    }
+
+    return 0;
+}
+
+
+static int ta_canbus_ids_proc_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, ta_canbus_ids_proc_show, PDE_DATA(inode));
+}
+
+
+static const struct file_operations ta_canbus_ids_proc_fops = {
+    .owner      = THIS_MODULE,
+    .open       = ta_canbus_ids_proc_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+
+int init_can_idstats(struct canbus_device_t *dev)
+{
+    struct can_idstats_table *table = &dev->idstats;
+    char name[32];
+
+    table->extended_slots = roundup_pow_of_two(max(idstats_extended_slots, 16U));
+    table->extended_bits = ilog2(table->extended_slots);
+    table->overflow_count = 0;
+
+    table->standard = vzalloc(IDSTATS_NUM_STANDARD * sizeof(struct can_id_stats_t));
+    table->extended = vzalloc(table->extended_slots * sizeof(struct can_id_stats_t));
+
+    if (!table->standard || !table->extended){
+        goto FAILED;
+    }
+
+    snprintf(name, sizeof(name), "%s_ids", dev->name);
+    if (!proc_create_data(name, S_IRUGO, NULL, &ta_canbus_ids_proc_fops, dev)){
+        goto FAILED;
+    }
+
+    return 0;
+
+FAILED:
+    vfree(table->standard);
+    vfree(table->extended);
+    table->standard = NULL;
+    table->extended = NULL;
+    return -ENOMEM;
+}
+
+
+void destroy_can_idstats(struct canbus_device_t *dev)
+{
+    struct can_idstats_table *table = &dev->idstats;
+    char name[32];
+
+    if (table->standard){
+        snprintf(name, sizeof(name), "%s_ids", dev->name);
+        remove_proc_entry(name, NULL);
+    }
+
+    vfree(table->standard);
+    vfree(table->extended);
+
+    table->standard = NULL;
+    table->extended = NULL;
+}
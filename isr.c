@@ -4,15 +4,40 @@
  *  This is the top half ISR for CANbus for the i.MX6.
  *
  ***************************************************************************/
+#include <linux/rcupdate.h>
+
 #include "can_private.h"
+#include "can_trace.h"
 
 
 /**
- *  Keep the larger data struct off the stack, we have 1 - 2 page limit.
+ *  Put a received frame or status change on file's receive queue and
+ *  wake its reader.  Under rcu_read_lock(), file isn't freed until
+ *  we're done.
  */
-static CANBUS_MESSAGE message_buffers[FLEXCAN_NUM_MESSAGE_BUFFERS - FIRST_RX_MB];
-static unsigned int message_timestamps[FLEXCAN_NUM_MESSAGE_BUFFERS - FIRST_RX_MB];
-static CANBUS_MESSAGE *msg_ptrs[FLEXCAN_NUM_MESSAGE_BUFFERS - FIRST_RX_MB];
+static void can_enqueue_received(struct canbus_file_t *file, struct kcanbus_message *message)
+{
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock(&file->rx_lock);
+
+    list_add_tail(&message->entry, &file->receive_queue);
+
+    file->stats.cur_rx_queue_count++;
+    if (file->stats.cur_rx_queue_count > file->stats.max_rx_queue_count){
+        file->stats.max_rx_queue_count = file->stats.cur_rx_queue_count;
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock(&file->rx_lock);
+
+    trace_can_rx_enqueue(file, &message->user_message);
+
+    wake_up_interruptible(&file->receive_wq);
+}
 
 
 /**
@@ -23,35 +48,54 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
 {
     unsigned long flags;
     struct canbus_device_t *dev = (struct canbus_device_t *)dev_id;
-    struct list_head *element;
     struct canbus_file_t *file;
+    struct can_group *group;
+    unsigned int frame_class;
     struct kcanbus_message *message;
     CANBUS_STATUS_CHANGE status_change;
+    CANBUS_MESSAGE *message_buffers = dev->rx_messages;
+    unsigned int *message_timestamps = dev->rx_timestamps;
+    CANBUS_MESSAGE **msg_ptrs = dev->rx_msg_ptrs;
     unsigned int reg;
     unsigned int now;
+    u64 now_ns;
+    u64 frame_ns;
     unsigned int iflag1, iflag2;
-    unsigned int count;
+    unsigned int count = 0;
     unsigned int i;
     unsigned int iBit;
-    struct timespec tv_start;
-    struct timespec tv_end;
+    u64 start_ns;
+    u64 end_ns;
+    u64 enqueue_ns;
     int errors_found = 0;
     int err_bit_found;
+    struct list_head forward_list;
+    int routing = 0;
+
+    start_ns = can_clock_ns();
 
-    getnstimeofday(&tv_start);
+    INIT_LIST_HEAD(&forward_list);
 
     if (dev->signature != CANBUS_DEVICE_SIGNATURE){
-        printk(KERN_ERR "Device Failed signature check! %s %d\n", __FILE__, __LINE__);
+        /*
+         *  No device, so no event log to put it in.
+         */
+        printk(KERN_ERR PRINTK_DEV_NAME "Failed signature check! %s %d\n", __FILE__, __LINE__);
         return IRQ_HANDLED;
     }
 
     /*
      *  LOCK --------------------------------------------------------
      */
-    spin_lock_irqsave(&dev->register_lock, flags);
+    can_lock_irqsave(&dev->register_lock, flags);
 
     dev->stats.isr_count++;
 
+    if (dev->last_isr_ns){
+        can_histogram_add(&dev->stats.isr_interval_hist, start_ns - dev->last_isr_ns);
+    }
+    dev->last_isr_ns = start_ns;
+
     /*
      *  Always prep this in case we need it.
      */
@@ -64,6 +108,14 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
      */
     reg = ioread32(&dev->registers->ESR1);
 
+    /*
+     *  Error bits the state poll read before us, see errstate.c.
+     */
+    reg |= dev->esr1_stash;
+    dev->esr1_stash = 0;
+
+    trace_can_isr_entry(dev, reg);
+
     /*
      *  Transmit warning interrupt triggered.
      */
@@ -74,7 +126,7 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
         iowrite32(ESR1_TWRN_INT, &dev->registers->ESR1);
 
         if (!dev->prior_errors_found)
-            printk(KERN_ERR "ESR1_TWRN_INT\n");
+            can_event(dev, CAN_EVENT_TX_WARN, 0);
     }
 
     /*
@@ -87,7 +139,7 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
         iowrite32(ESR1_RWRN_INT, &dev->registers->ESR1);
 
         if (!dev->prior_errors_found)
-            printk(KERN_ERR "ESR1_RWRN_INT\n");
+            can_event(dev, CAN_EVENT_RX_WARN, 0);
     }
 
     /*
@@ -100,7 +152,7 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
         iowrite32(ESR1_BOFF_INT, &dev->registers->ESR1);
 
         if (!dev->prior_errors_found)
-            printk(KERN_ERR "ESR1_BOFF_INT\n");
+            can_event(dev, CAN_EVENT_BUS_OFF, 0);
     }
 
     /*
@@ -122,7 +174,7 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
             status_change.Status1 |= Csc1Bit1Err;
 
             if (!dev->prior_errors_found)
-                printk(KERN_ERR "ESR1_BIT1_ERR\n");
+                can_event(dev, CAN_EVENT_BIT1_ERR, 0);
         }
 
         if (reg & ESR1_BIT0_ERR){
@@ -131,7 +183,7 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
             status_change.Status1 |= Csc1Bit0Err;
 
             if (!dev->prior_errors_found)
-                printk(KERN_ERR "ESR1_BIT0_ERR\n");
+                can_event(dev, CAN_EVENT_BIT0_ERR, 0);
         }
 
         /*
@@ -146,35 +198,23 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
             status_change.Status1 |= Csc1AckErr; 
 
             if (!dev->prior_errors_found)
-                printk(KERN_NOTICE "ESR1_ACK_ERR\n");
+                can_event(dev, CAN_EVENT_ACK_ERR, 0);
 
             /*
-             *  Abort the HW transmission, because we have to.
+             *  LOCK ----------------------------------------------------
              */
-            hw_abort_transmit(dev);
-
-            while ( !list_empty(&dev->transmit_queue) ){
-
-                element = dev->transmit_queue.next;
-                list_del(element);
-                message = list_entry(element, struct kcanbus_message, entry);
-                
-                dev->stats.cur_tx_queue_count--;
- 
-                if (message->signature != KCANBUS_SIGNATURE){
-                    printk(KERN_ERR "Message Signature check Failed! %s %d\n", __FILE__, __LINE__);
-                    goto EXIT;
-                }
+            can_lock(&dev->tx_lock);
 
-                free_kcanbus_message(message);
-            }
+            /*
+             *  Abort our frame, then keep it, retry it or drop it, 
+             *  see tx.c.
+             */
+            can_tx_ack_error(dev, reg);
 
             /*
-             *  And we are effectively not transmitting, so clean up to 
-             *  try again some time in the future.
+             *  UNLOCK --------------------------------------------------
              */
-            dev->transmit_in_progress = 0;
-            hw_disable_message_buffer_interrupt(dev, TX_MB);
+            can_unlock(&dev->tx_lock);
         }
 
         if (reg & ESR1_CRC_ERR){
@@ -183,7 +223,7 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
             status_change.Status1 |= Csc1CrcErr;
 
             if (!dev->prior_errors_found)
-                printk(KERN_ERR "ESR1_CRC_ERR\n");
+                can_event(dev, CAN_EVENT_CRC_ERR, 0);
         }
 
         if (reg & ESR1_FRM_ERR){
@@ -192,7 +232,7 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
             status_change.Status1 |= Csc1FormErr;
 
             if (!dev->prior_errors_found)
-                printk(KERN_ERR "ESR1_FRM_ERR\n");
+                can_event(dev, CAN_EVENT_FORM_ERR, 0);
         }
 
         if (reg & ESR1_STF_ERR){
@@ -201,11 +241,11 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
             status_change.Status1 |= Csc1StuffErr;
 
             if (!dev->prior_errors_found)
-                printk(KERN_ERR "ESR1_STF_ERR\n");
+                can_event(dev, CAN_EVENT_STUFF_ERR, 0);
         }
 
         if (!err_bit_found && !dev->prior_errors_found){
-            printk(KERN_ERR "Received ESR1_ERR_INT without finding an error bit!\n");
+            can_event(dev, CAN_EVENT_NO_ERR_BIT, 0);
         }
     }
 
@@ -223,72 +263,22 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
     }
 #endif
 
+    /*
+     *  Fault confinement state, and getting back on the bus after
+     *  BUS OFF, see errstate.c.
+     */
+    can_errstate_update(dev, reg, start_ns, &status_change);
+
     /*
      *  If there are HW errors or state changes, let someone know.
      *  We are piggybacking on the Read path.
      */
     if (status_change.Status1 != 0){
-
-        list_for_each(element, &dev->reader_list){
-
-            file = list_entry(element, struct canbus_file_t, reader_list_entry);
-            
-            if (file->signature != CANBUS_FILE_SIGNATURE){
-                printk(KERN_ERR "File Signature check Failed! %s %d\n", __FILE__, __LINE__);
-                goto EXIT;
-            }
-
-            if (!file->accept_messages){
-                continue;
-            }
-            
-            message = alloc_kcanbus_message();
-            if (!message){
-                goto EXIT;
-            }
-            
-            memcpy(&message->user_message, &status_change, sizeof(status_change));
-            INIT_LIST_HEAD(&message->entry);
-            message->signature = KCANBUS_SIGNATURE;
-
-            list_add_tail(&message->entry, &file->receive_queue);
- 
-            file->stats.cur_rx_queue_count++;
-            if (file->stats.cur_rx_queue_count > file->stats.max_rx_queue_count){
-                file->stats.max_rx_queue_count = file->stats.cur_rx_queue_count;
-            }
-
-            wake_up_interruptible(&file->receive_wq);
+        if (can_status_deliver(dev, &status_change, start_ns)){
+            goto EXIT;
         }
     }
 
-#if 0
-/*
- *  Not currently used ...
- */    
-    /*
-     *  Current HW state...
-     */
-    if (reg & ESR1_TX_WRN){
-        /*printk(KERN_ERR "ESR1_TX_WRN\n");*/
-    }
-    if (reg & ESR1_RX_WRN){
-        /*printk(KERN_ERR "ESR1_RX_WRN\n");*/
-    }
-    if (reg & ESR1_IDLE){
-        /*printk(KERN_ERR "ESR1_IDLE\n");*/
-    }
-    if ((reg & ESR1_FLT_CONF_MASK) == ESR1_FLT_CONF_ERROR_ACTIVE){
-        /*printk(KERN_ERR "Error Active\n");*/
-    }
-    else if ((reg & ESR1_FLT_CONF_MASK) == ESR1_FLT_CONF_ERROR_PASSIVE){
-        /*printk(KERN_ERR "Error Passive\n");*/
-    }
-    else /* BUS OFF */ {
-        /*printk(KERN_ERR "Error BUS OFF\n");*/
-    }
-#endif
-
     /*
      *  Optimized HW read algorithm to get the data out asap!
      */
@@ -299,6 +289,7 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
      *  the Iflags.
      */
     now = ioread32(&dev->registers->TIMER);
+    now_ns = can_clock_ns();
 
     count = 0;
     iBit = 0x1 << FIRST_RX_MB;
@@ -310,14 +301,20 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
             message_timestamps[count] = hw_receive_message(dev, &message_buffers[count], i);
             msg_ptrs[count] = &message_buffers[count];
 
+            trace_can_rx_mailbox(dev, i, msg_ptrs[count], message_timestamps[count]);
+
+            can_busload_add(dev, can_frame_bits(msg_ptrs[count]), start_ns);
+
             /*
              *  Fix up the timestamps, if the message occurred "before" now,
              *  add a higher order bit because we wrapped.  
              *  What we really want to do is subtract from 
              *  messages > Now, but we are using 16 bit unsigned int math, so
              *  adding to the ones < Now effectively does the same thing.
+             *  A message stamped in the same bit time as now is the newest,
+             *  not one that is 65536 bit times old.
              */
-            if (message_timestamps[count] < now){
+            if (message_timestamps[count] <= now){
                 message_timestamps[count] += 0x10000;
             }
 
@@ -336,14 +333,20 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
             message_timestamps[count] = hw_receive_message(dev, &message_buffers[count], i);
             msg_ptrs[count] = &message_buffers[count];
 
+            trace_can_rx_mailbox(dev, i, msg_ptrs[count], message_timestamps[count]);
+
+            can_busload_add(dev, can_frame_bits(msg_ptrs[count]), start_ns);
+
             /*
              *  Fix up the timestamps, if the message occurred "before" now,
              *  add a higher order bit because we wrapped.  
              *  What we really want to do is subtract from 
              *  messages > Now, but we are using 16 bit unsigned int math, so
              *  adding to the ones < Now effectively does the same thing.
+             *  A message stamped in the same bit time as now is the newest,
+             *  not one that is 65536 bit times old.
              */
-            if (message_timestamps[count] < now){
+            if (message_timestamps[count] <= now){
                 message_timestamps[count] += 0x10000;
             }
 
@@ -353,6 +356,13 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
         iBit <<= 1;
     }
 
+    /*
+     *  Someone is out there to ack a held frame.
+     */
+    if (count){
+        can_tx_bus_alive(dev);
+    }
+
     /*
      *  Sort this using an Insertion sort for now.
      *  We sort the Timestamps because they are what's sortable,
@@ -382,11 +392,41 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
     if (count > dev->stats.max_mb_used){
         dev->stats.max_mb_used = count;
     }
+    can_histogram_add(&dev->stats.mb_per_isr_hist, count);
+
+    /*
+     *  Per ID statistics, the capture and the history ring want them
+     *  in order, so do this after the sort.
+     */
+    for (i = 0; i<count; i++){
+        frame_ns = can_timestamp_to_ns(dev, now_ns, now, message_timestamps[i]);
+        can_idstats_update(dev, msg_ptrs[i], frame_ns);
+        can_capture_add(dev, msg_ptrs[i], frame_ns, 0);
+        can_history_add(dev, msg_ptrs[i], frame_ns);
+    }
+
+    /*
+     *  Gateway routes, also in order.  The copies go to the other 
+     *  controllers after we unlock, see gateway.c.
+     */
+    if (count && !list_empty(&dev->routes)){
+
+        rcu_read_lock();
+        routing = 1;
+
+        for (i = 0; i<count; i++){
+            can_gateway_route(dev, msg_ptrs[i], start_ns, &forward_list);
+        }
+    }
 
 
     /*
      *  Now send it on it's way...
      */
+    if (count){
+        rcu_read_lock();
+    }
+
     for (i = 0; i<count; i++){
 
         /*
@@ -396,37 +436,86 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
          */
         /* real_data_size = sizeof(CANBUS_MESSAGE) - 8 + msg_ptrs[i]->DataLength; */
 
-        list_for_each(element, &dev->reader_list){
+        enqueue_ns = can_clock_ns();
+
+        /*
+         *  Our own frame coming back is CAN_CLASS_TX_ECHO.  With self
+         *  reception off there are none to look for.
+         */
+        frame_class = CAN_CLASS_DATA;
+        if (dev->self_reception && can_is_tx_echo(dev, msg_ptrs[i])){
+            frame_class = CAN_CLASS_TX_ECHO;
+        }
+
+        list_for_each_entry_rcu(file, &dev->reader_list, reader_list_entry){
 
-            file = list_entry(element, struct canbus_file_t, reader_list_entry);
-            
             if (file->signature != CANBUS_FILE_SIGNATURE){
-                printk(KERN_ERR "File Signature check Failed! %s %d\n", __FILE__, __LINE__);
+                can_event(dev, CAN_EVENT_FILE_SIGNATURE, __LINE__);
+                rcu_read_unlock();
                 goto EXIT;
             }
 
-            if (!file->accept_messages){
+            if (!(file->rx_classes & frame_class) || file->group){
                 continue;
             }
             
-            message = alloc_kcanbus_message();
+            message = alloc_kcanbus_message(dev);
             if (!message){
+                rcu_read_unlock();
                 goto EXIT;
             }
             
             memcpy(&message->user_message, msg_ptrs[i], sizeof(CANBUS_MESSAGE));
             INIT_LIST_HEAD(&message->entry);
             message->signature = KCANBUS_SIGNATURE;
-    
-            list_add_tail(&message->entry, &file->receive_queue);
+            message->capture_ns = start_ns;
+            message->enqueue_ns = enqueue_ns;
+            message->flags = 0;
 
-            file->stats.cur_rx_queue_count++;
-            if (file->stats.cur_rx_queue_count > file->stats.max_rx_queue_count){
-                file->stats.max_rx_queue_count = file->stats.cur_rx_queue_count;
+            if (frame_class == CAN_CLASS_DATA){
+                file->stats.rx_data++;
+            }
+            else{
+                file->stats.rx_tx_echo++;
             }
 
-            wake_up_interruptible(&file->receive_wq);
+            can_enqueue_received(file, message);
+        }
+
+        if (frame_class != CAN_CLASS_DATA){
+            continue;
         }
+
+        /*
+         *  And one copy to each consumer group, see group.c.
+         */
+        list_for_each_entry(group, &dev->groups, entry){
+
+            file = can_group_member(group, msg_ptrs[i]);
+
+            message = alloc_kcanbus_message(dev);
+            if (!message){
+                rcu_read_unlock();
+                goto EXIT;
+            }
+            
+            memcpy(&message->user_message, msg_ptrs[i], sizeof(CANBUS_MESSAGE));
+            INIT_LIST_HEAD(&message->entry);
+            message->signature = KCANBUS_SIGNATURE;
+            message->capture_ns = start_ns;
+            message->enqueue_ns = enqueue_ns;
+            message->flags = KCANBUS_GROUP;
+
+            group->frames++;
+            file->stats.group_frames++;
+            file->stats.rx_data++;
+
+            can_enqueue_received(file, message);
+        }
+    }
+
+    if (count){
+        rcu_read_unlock();
     }
 
     /*
@@ -434,52 +523,61 @@ irqreturn_t can_irq_fn(int irq, void *dev_id)
      */
     if (hw_is_message_buffer_interrupting(dev, TX_MB)){
             
-        hw_clear_message_buffer_interrupt(dev, TX_MB);
+        /*
+         *  LOCK --------------------------------------------------------
+         */
+        can_lock(&dev->tx_lock);
 
-        if (list_empty(&dev->transmit_queue)){
+        hw_clear_message_buffer_interrupt(dev, TX_MB);
 
-            dev->transmit_in_progress = 0;
-            hw_disable_message_buffer_interrupt(dev, TX_MB);
+        /*
+         *  An ACK error or BUS OFF wrote ABORT, and it took.
+         */
+        if (dev->tx_aborting && hw_tx_aborted(dev)){
+            can_tx_aborted(dev);
         }
         else{
+            trace_can_tx_complete(dev, dev->stats.cur_tx_queue_count);
 
-            element = dev->transmit_queue.next;
-            list_del(element);
-            message = list_entry(element, struct kcanbus_message, entry);
-
-            dev->stats.cur_tx_queue_count--;
-        
-            if (message->signature != KCANBUS_SIGNATURE){
-                printk(KERN_ERR "Message Signature check Failed! %s %d\n", __FILE__, __LINE__);
-                goto EXIT;
+            /*
+             *  With self reception on, the RX path already counted it.
+             */
+            if (!dev->self_reception){
+                can_busload_add(dev, dev->tx_frame_bits, start_ns);
             }
-        
-            hw_transmit_message(dev, &message->user_message);
-            
-            free_kcanbus_message(message);
+
+            can_tx_complete(dev);
         }
+
+        /*
+         *  UNLOCK ------------------------------------------------------
+         */
+        can_unlock(&dev->tx_lock);
     }
 
 EXIT:
 
-    getnstimeofday(&tv_end);
+    end_ns = can_clock_ns();
 
-    dev->stats.cur_isr_time = timespec_sub(tv_end, tv_start);
-    dev->stats.total_isr_time = timespec_add( dev->stats.cur_isr_time, 
-                                            dev->stats.total_isr_time);
+    dev->stats.cur_isr_time_ns = end_ns - start_ns;
+    dev->stats.total_isr_time_ns += dev->stats.cur_isr_time_ns;
 
-    if (dev->stats.cur_isr_time.tv_sec > dev->stats.max_isr_time.tv_sec){
-        dev->stats.max_isr_time = dev->stats.cur_isr_time;
-    }
-    else if ((dev->stats.cur_isr_time.tv_sec == dev->stats.max_isr_time.tv_sec) &&
-        (dev->stats.cur_isr_time.tv_nsec > dev->stats.max_isr_time.tv_nsec)){
-        dev->stats.max_isr_time = dev->stats.cur_isr_time;
+    if (dev->stats.cur_isr_time_ns > dev->stats.max_isr_time_ns){
+        dev->stats.max_isr_time_ns = dev->stats.cur_isr_time_ns;
     }
+    can_histogram_add(&dev->stats.isr_time_hist, dev->stats.cur_isr_time_ns);
+
+    trace_can_isr_exit(dev, count, dev->stats.cur_isr_time_ns);
 
     /*
      *  UNLOCK --------------------------------------------------------
      */
-    spin_unlock_irqrestore(&dev->register_lock, flags);
+    can_unlock_irqrestore(&dev->register_lock, flags);
+
+    if (routing){
+        can_gateway_submit(&forward_list);
+        rcu_read_unlock();
+    }
 
     return IRQ_HANDLED;
 }
@@ -0,0 +1,838 @@
+/****************************************************************************
+ *  kernel_shim.c
+ *
+ *  The out of line parts of kernel_shim.h.
+ *
+ ***************************************************************************/
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kernel_shim.h"
+
+
+int kernel_shim_loglevel = 5;      /* KERN_NOTICE and more important */
+
+static int signal_all;
+
+#define MAX_DELAYED_WORK    16
+#define MAX_HRTIMERS        64
+#define MAX_PROC_ENTRIES    16
+
+static struct delayed_work *delayed_works[MAX_DELAYED_WORK];
+static pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct hrtimer *hrtimers[MAX_HRTIMERS];
+static pthread_mutex_t hrtimer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_rwlock_t kernel_shim_rcu_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static struct {
+    char name[64];
+    const struct file_operations *fops;
+    void *data;
+} proc_entries[MAX_PROC_ENTRIES];
+
+
+
+/****************************************************************************
+ *  printk
+ */
+int printk(const char *fmt, ...)
+{
+    char text[512];
+    const char *p = text;
+    int level = 4;          /* default_message_loglevel */
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+
+    /*
+     *  The level may have come in through a %s, so look at the result.
+     */
+    if (p[0] == KERN_SOH[0] && p[1] >= '0' && p[1] <= '7'){
+        level = p[1] - '0';
+        p += 2;
+    }
+
+    if (level <= kernel_shim_loglevel){
+        fprintf(stderr, "<%d>%s", level, p);
+    }
+
+    return len;
+}
+
+
+
+/****************************************************************************
+ *  Time
+ */
+ktime_t ktime_get(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ktime_set(ts.tv_sec, ts.tv_nsec);
+}
+
+
+unsigned long kernel_shim_jiffies(void)
+{
+    return (unsigned long)(ktime_to_ns(ktime_get()) / (NSEC_PER_SEC / HZ));
+}
+
+
+
+/****************************************************************************
+ *  Wait queues and "signals"
+ */
+void init_waitqueue_head(wait_queue_head_t *wq)
+{
+    pthread_mutex_init(&wq->mutex, NULL);
+    pthread_cond_init(&wq->cond, NULL);
+}
+
+
+void wake_up_interruptible(wait_queue_head_t *wq)
+{
+    pthread_mutex_lock(&wq->mutex);
+    pthread_cond_broadcast(&wq->cond);
+    pthread_mutex_unlock(&wq->mutex);
+}
+
+
+/*
+ *  Called with wq->mutex held, from wait_event_interruptible().
+ */
+void kernel_shim_wait(wait_queue_head_t *wq)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 10 * NSEC_PER_MSEC;
+    if (ts.tv_nsec >= NSEC_PER_SEC){
+        ts.tv_nsec -= NSEC_PER_SEC;
+        ts.tv_sec++;
+    }
+
+    pthread_cond_timedwait(&wq->cond, &wq->mutex, &ts);
+}
+
+
+void kernel_shim_signal_all(void)
+{
+    __atomic_store_n(&signal_all, 1, __ATOMIC_SEQ_CST);
+}
+
+
+void kernel_shim_signal_clear(void)
+{
+    __atomic_store_n(&signal_all, 0, __ATOMIC_SEQ_CST);
+}
+
+
+int kernel_shim_signal_pending(void)
+{
+    return __atomic_load_n(&signal_all, __ATOMIC_SEQ_CST);
+}
+
+
+
+/****************************************************************************
+ *  eventfd
+ */
+struct eventfd_ctx *eventfd_ctx_fdget(int fd)
+{
+    struct eventfd_ctx *ctx;
+
+    ctx = malloc(sizeof(struct eventfd_ctx));
+    if (!ctx){
+        return ERR_PTR(-ENOMEM);
+    }
+
+    ctx->fd = dup(fd);
+    if (ctx->fd < 0){
+        free(ctx);
+        return ERR_PTR(-EBADF);
+    }
+
+    return ctx;
+}
+
+
+__u64 eventfd_signal(struct eventfd_ctx *ctx, __u64 n)
+{
+    __u64 value = n;
+
+    if (write(ctx->fd, &value, sizeof(value)) != sizeof(value)){
+        return 0;
+    }
+    return n;
+}
+
+
+void eventfd_ctx_put(struct eventfd_ctx *ctx)
+{
+    close(ctx->fd);
+    free(ctx);
+}
+
+
+
+/****************************************************************************
+ *  RCU
+ */
+void synchronize_rcu(void)
+{
+    pthread_rwlock_wrlock(&kernel_shim_rcu_lock);
+    pthread_rwlock_unlock(&kernel_shim_rcu_lock);
+}
+
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *))
+{
+    head->func = func;
+    synchronize_rcu();
+    head->func(head);
+}
+
+
+
+/****************************************************************************
+ *  Deferred work
+ */
+struct workqueue_struct *system_wq;
+
+/*
+ *  Work is in the table while it may be scheduled, so it can live in
+ *  memory that is freed after cancel_delayed_work_sync().
+ *  Call with work_mutex held.
+ */
+static void add_delayed_work(struct delayed_work *dwork)
+{
+    int i;
+
+    for (i = 0; i<MAX_DELAYED_WORK; i++){
+        if (delayed_works[i] == dwork){
+            return;
+        }
+    }
+
+    for (i = 0; i<MAX_DELAYED_WORK; i++){
+        if (!delayed_works[i]){
+            delayed_works[i] = dwork;
+            return;
+        }
+    }
+}
+
+
+void kernel_shim_init_delayed_work(struct delayed_work *dwork, work_func_t func)
+{
+    dwork->work.func = func;
+    dwork->pending = 0;
+
+    pthread_mutex_lock(&work_mutex);
+    add_delayed_work(dwork);
+    pthread_mutex_unlock(&work_mutex);
+}
+
+
+int schedule_delayed_work(struct delayed_work *dwork, unsigned long delay)
+{
+    int queued = 0;
+
+    pthread_mutex_lock(&work_mutex);
+
+    if (!dwork->pending){
+        add_delayed_work(dwork);
+        dwork->pending = 1;
+        dwork->expires = jiffies + delay;
+        queued = 1;
+    }
+
+    pthread_mutex_unlock(&work_mutex);
+
+    return queued;
+}
+
+
+/**
+ *  As schedule_delayed_work(), but a pending dwork is due in delay from
+ *  now instead.  Returns 1 if it was pending.
+ */
+int mod_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork, unsigned long delay)
+{
+    int was_pending;
+
+    (void)wq;
+
+    pthread_mutex_lock(&work_mutex);
+
+    add_delayed_work(dwork);
+    was_pending = dwork->pending;
+    dwork->pending = 1;
+    dwork->expires = jiffies + delay;
+
+    pthread_mutex_unlock(&work_mutex);
+
+    return was_pending;
+}
+
+
+int cancel_delayed_work_sync(struct delayed_work *dwork)
+{
+    int was_pending;
+    int i;
+
+    pthread_mutex_lock(&work_mutex);
+
+    was_pending = dwork->pending;
+    dwork->pending = 0;
+
+    for (i = 0; i<MAX_DELAYED_WORK; i++){
+        if (delayed_works[i] == dwork){
+            delayed_works[i] = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&work_mutex);
+
+    return was_pending;
+}
+
+
+/****************************************************************************
+ *  hrtimers
+ */
+void hrtimer_init(struct hrtimer *timer, clockid_t clock_id, enum hrtimer_mode mode)
+{
+    (void)clock_id;
+    (void)mode;
+
+    memset(timer, 0, sizeof(*timer));
+}
+
+
+/*
+ *  Call with hrtimer_mutex held.
+ */
+static void remove_hrtimer(struct hrtimer *timer)
+{
+    int i;
+
+    for (i = 0; i<MAX_HRTIMERS; i++){
+        if (hrtimers[i] == timer){
+            hrtimers[i] = NULL;
+        }
+    }
+    timer->queued = 0;
+}
+
+
+static void enqueue_hrtimer(struct hrtimer *timer)
+{
+    int i;
+
+    if (timer->queued){
+        return;
+    }
+
+    for (i = 0; i<MAX_HRTIMERS; i++){
+        if (!hrtimers[i]){
+            hrtimers[i] = timer;
+            timer->queued = 1;
+            return;
+        }
+    }
+
+    fprintf(stderr, "kernel_shim: more than %d hrtimers queued\n", MAX_HRTIMERS);
+    abort();
+}
+
+
+int hrtimer_start(struct hrtimer *timer, ktime_t tim, const enum hrtimer_mode mode)
+{
+    int was_queued;
+
+    if (mode == HRTIMER_MODE_REL){
+        tim = ktime_add_ns(ktime_get(), ktime_to_ns(tim));
+    }
+
+    pthread_mutex_lock(&hrtimer_mutex);
+
+    was_queued = timer->queued;
+    timer->expires = tim;
+    enqueue_hrtimer(timer);
+
+    pthread_mutex_unlock(&hrtimer_mutex);
+
+    return was_queued;
+}
+
+
+int hrtimer_try_to_cancel(struct hrtimer *timer)
+{
+    int ret;
+
+    pthread_mutex_lock(&hrtimer_mutex);
+
+    if (timer->running){
+        ret = -1;
+    }
+    else{
+        ret = timer->queued;
+        remove_hrtimer(timer);
+    }
+
+    pthread_mutex_unlock(&hrtimer_mutex);
+
+    return ret;
+}
+
+
+/*
+ *  Waits for a callback running on another thread.
+ */
+int hrtimer_cancel(struct hrtimer *timer)
+{
+    int ret;
+
+    while ((ret = hrtimer_try_to_cancel(timer)) < 0){
+        sched_yield();
+    }
+
+    return ret;
+}
+
+
+u64 hrtimer_forward(struct hrtimer *timer, ktime_t now, ktime_t interval)
+{
+    s64 delta = ktime_to_ns(now) - ktime_to_ns(timer->expires);
+    u64 overruns;
+
+    if (delta < 0){
+        return 0;
+    }
+
+    overruns = (u64)delta / (u64)ktime_to_ns(interval) + 1;
+    timer->expires = ktime_add_ns(timer->expires, overruns * ktime_to_ns(interval));
+
+    return overruns;
+}
+
+
+int hrtimer_active(const struct hrtimer *timer)
+{
+    return ACCESS_ONCE(timer->queued) || ACCESS_ONCE(timer->running);
+}
+
+
+/*
+ *  Run every hrtimer that is due, earliest first.
+ */
+static void run_hrtimers(void)
+{
+    struct hrtimer *timer;
+    enum hrtimer_restart restart;
+    s64 now_ns;
+    int i;
+
+    for (;;){
+
+        now_ns = ktime_to_ns(ktime_get());
+        timer = NULL;
+
+        pthread_mutex_lock(&hrtimer_mutex);
+
+        for (i = 0; i<MAX_HRTIMERS; i++){
+            if (hrtimers[i] && ktime_to_ns(hrtimers[i]->expires) <= now_ns &&
+                (!timer || ktime_to_ns(hrtimers[i]->expires) < ktime_to_ns(timer->expires))){
+                timer = hrtimers[i];
+            }
+        }
+
+        if (timer){
+            remove_hrtimer(timer);
+            timer->running = 1;
+        }
+
+        pthread_mutex_unlock(&hrtimer_mutex);
+
+        if (!timer){
+            return;
+        }
+
+        restart = timer->function(timer);
+
+        pthread_mutex_lock(&hrtimer_mutex);
+
+        timer->running = 0;
+        if (restart == HRTIMER_RESTART){
+            enqueue_hrtimer(timer);
+        }
+
+        pthread_mutex_unlock(&hrtimer_mutex);
+    }
+}
+
+
+void kernel_shim_run_work(void)
+{
+    struct delayed_work *dwork;
+    int i;
+
+    run_hrtimers();
+
+    for (i = 0; i<MAX_DELAYED_WORK; i++){
+
+        pthread_mutex_lock(&work_mutex);
+
+        dwork = delayed_works[i];
+        if (dwork && dwork->pending && !time_before(jiffies, dwork->expires)){
+            dwork->pending = 0;
+        }
+        else{
+            dwork = NULL;
+        }
+
+        pthread_mutex_unlock(&work_mutex);
+
+        if (dwork){
+            dwork->work.func(&dwork->work);
+        }
+    }
+}
+
+
+
+/****************************************************************************
+ *  seq_file and /proc
+ */
+int seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vfprintf(m->out, fmt, args);
+    va_end(args);
+
+    return 0;
+}
+
+
+int seq_puts(struct seq_file *m, const char *s)
+{
+    fputs(s, m->out);
+    return 0;
+}
+
+
+int single_open(struct file *file, int (*show)(struct seq_file *, void *), void *data)
+{
+    struct seq_file *m;
+
+    m = calloc(1, sizeof(struct seq_file));
+    if (!m){
+        return -ENOMEM;
+    }
+
+    m->show = show;
+    m->private = data;
+    file->private_data = m;
+
+    return 0;
+}
+
+
+int single_release(struct inode *inode, struct file *file)
+{
+    (void)inode;
+
+    free(file->private_data);
+    file->private_data = NULL;
+
+    return 0;
+}
+
+
+/*
+ *  Never called, kernel_shim_proc_show() runs the show function directly.
+ */
+ssize_t seq_read(struct file *file, char __user *buf, size_t size, loff_t *ppos)
+{
+    (void)file;
+    (void)buf;
+    (void)size;
+    (void)ppos;
+    return -EINVAL;
+}
+
+
+loff_t seq_lseek(struct file *file, loff_t offset, int whence)
+{
+    (void)file;
+    (void)offset;
+    (void)whence;
+    return -EINVAL;
+}
+
+
+struct proc_dir_entry *proc_create_data(const char *name, umode_t mode,
+                                        struct proc_dir_entry *parent,
+                                        const struct file_operations *fops,
+                                        void *data)
+{
+    int i;
+
+    (void)mode;
+    (void)parent;
+
+    for (i = 0; i<MAX_PROC_ENTRIES; i++){
+        if (!proc_entries[i].fops){
+            snprintf(proc_entries[i].name, sizeof(proc_entries[i].name), "%s", name);
+            proc_entries[i].fops = fops;
+            proc_entries[i].data = data;
+            return (struct proc_dir_entry *)&proc_entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+void remove_proc_entry(const char *name, struct proc_dir_entry *parent)
+{
+    int i;
+
+    (void)parent;
+
+    for (i = 0; i<MAX_PROC_ENTRIES; i++){
+        if (proc_entries[i].fops && !strcmp(proc_entries[i].name, name)){
+            proc_entries[i].fops = NULL;
+            return;
+        }
+    }
+}
+
+
+static int find_proc_entry(const char *name, struct inode *inode)
+{
+    int i;
+
+    for (i = 0; i<MAX_PROC_ENTRIES; i++){
+        if (proc_entries[i].fops && !strcmp(proc_entries[i].name, name)){
+            memset(inode, 0, sizeof(struct inode));
+            inode->i_private = proc_entries[i].data;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+/**
+ *  cat /proc/<name>
+ */
+int kernel_shim_proc_show(const char *name, FILE *out)
+{
+    const struct file_operations *fops;
+    struct inode inode;
+    struct file file;
+    struct seq_file *m;
+    int i;
+    int ret;
+
+    i = find_proc_entry(name, &inode);
+    if (i < 0){
+        return -ENOENT;
+    }
+
+    fops = proc_entries[i].fops;
+    memset(&file, 0, sizeof(file));
+
+    ret = fops->open(&inode, &file);
+    if (ret){
+        return ret;
+    }
+
+    m = file.private_data;
+    m->out = out;
+    ret = m->show(m, NULL);
+
+    fops->release(&inode, &file);
+
+    return ret;
+}
+
+
+/**
+ *  echo text > /proc/<name>
+ */
+int kernel_shim_proc_write(const char *name, const char *text)
+{
+    const struct file_operations *fops;
+    struct inode inode;
+    struct file file;
+    loff_t pos = 0;
+    int i;
+    int ret;
+
+    i = find_proc_entry(name, &inode);
+    if (i < 0){
+        return -ENOENT;
+    }
+
+    fops = proc_entries[i].fops;
+    if (!fops->write){
+        return -EIO;
+    }
+
+    memset(&file, 0, sizeof(file));
+
+    ret = fops->open(&inode, &file);
+    if (ret){
+        return ret;
+    }
+
+    ret = (int)fops->write(&file, text, strlen(text), &pos);
+
+    fops->release(&inode, &file);
+
+    return ret;
+}
+
+
+
+/****************************************************************************
+ *  Pipes
+ */
+void *generic_pipe_buf_map(struct pipe_inode_info *pipe, struct pipe_buffer *buf, int atomic)
+{
+    (void)pipe;
+    (void)atomic;
+    return page_address(buf->page);
+}
+
+
+void generic_pipe_buf_unmap(struct pipe_inode_info *pipe, struct pipe_buffer *buf, void *addr)
+{
+    (void)pipe;
+    (void)buf;
+    (void)addr;
+}
+
+
+int generic_pipe_buf_confirm(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+    (void)pipe;
+    (void)buf;
+    return 0;
+}
+
+
+void generic_pipe_buf_release(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+    (void)pipe;
+    page_cache_release(buf->page);
+}
+
+
+int generic_pipe_buf_steal(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+    (void)pipe;
+    return buf->page->count == 1 ? 0 : 1;
+}
+
+
+void generic_pipe_buf_get(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+    (void)pipe;
+    get_page(buf->page);
+}
+
+
+void kernel_shim_pipe_init(struct pipe_inode_info *pipe)
+{
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->buffers = PIPE_DEF_BUFFERS;
+}
+
+
+/**
+ *  As the kernel's, except a full pipe never waits: it is -EAGAIN if
+ *  nothing fit, as with SPLICE_F_NONBLOCK.
+ */
+ssize_t splice_to_pipe(struct pipe_inode_info *pipe, struct splice_pipe_desc *spd)
+{
+    unsigned int spd_pages = spd->nr_pages;
+    unsigned int page_nr = 0;
+    ssize_t ret = 0;
+
+    while (spd->nr_pages && pipe->nrbufs < pipe->buffers){
+
+        struct pipe_buffer *buf;
+
+        buf = &pipe->bufs[(pipe->curbuf + pipe->nrbufs) & (pipe->buffers - 1)];
+        buf->page = spd->pages[page_nr];
+        buf->offset = spd->partial[page_nr].offset;
+        buf->len = spd->partial[page_nr].len;
+        buf->private = spd->partial[page_nr].private;
+        buf->ops = spd->ops;
+        buf->flags = 0;
+
+        pipe->nrbufs++;
+        page_nr++;
+        ret += buf->len;
+        spd->nr_pages--;
+    }
+
+    if (!ret){
+        ret = -EAGAIN;
+    }
+
+    while (page_nr < spd_pages){
+        spd->spd_release(spd, page_nr++);
+    }
+
+    return ret;
+}
+
+
+/**
+ *  Empty the pipe into fd, or just empty it if fd is -1.  Returns the
+ *  bytes taken out, or -errno from write().
+ */
+ssize_t kernel_shim_pipe_drain(struct pipe_inode_info *pipe, int fd)
+{
+    ssize_t total = 0;
+
+    while (pipe->nrbufs){
+
+        struct pipe_buffer *buf = &pipe->bufs[pipe->curbuf];
+
+        if (fd >= 0){
+            char *addr = (char *)buf->ops->map(pipe, buf, 0) + buf->offset;
+            ssize_t n = write(fd, addr, buf->len);
+
+            buf->ops->unmap(pipe, buf, addr);
+            if (n < 0){
+                return -errno;
+            }
+        }
+
+        total += buf->len;
+        buf->ops->release(pipe, buf);
+        buf->ops = NULL;
+
+        pipe->curbuf = (pipe->curbuf + 1) & (pipe->buffers - 1);
+        pipe->nrbufs--;
+    }
+
+    return total;
+}
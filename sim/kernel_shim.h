@@ -0,0 +1,903 @@
+/****************************************************************************
+ *  kernel_shim.h
+ *
+ *  Just enough of the kernel API to build the driver core as a normal
+ *  user space program.  Every <linux/...> header the driver includes is
+ *  generated by the makefile as a one line include of this file.
+ *
+ *  Locks are pthread mutexes and wait queues are condition variables.
+ *  The driver is built with TA_CANBUS_VIRTUAL, so its ioread32() /
+ *  iowrite32() calls go to the register model in ../flexcan_model.c.
+ *  Anything the driver doesn't use isn't here.  Where the kernel API
+ *  changed after 3.10, this follows 3.10, so the host build also catches
+ *  us using something our boards don't have.
+ *
+ ***************************************************************************/
+#ifndef KERNEL_SHIM_H__
+#define KERNEL_SHIM_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <asm/ioctl.h>
+
+
+/****************************************************************************
+ *  Types and compiler bits
+ */
+typedef unsigned char       u8;
+typedef unsigned short      u16;
+typedef unsigned int        u32;
+typedef unsigned long long  u64;
+typedef signed char         s8;
+typedef short               s16;
+typedef int                 s32;
+typedef long long           s64;
+
+typedef u32 resource_size_t;
+typedef unsigned short umode_t;
+typedef unsigned int gfp_t;
+
+#define __iomem
+#define __force
+#define __user
+#define __init
+#define __exit
+#define __read_mostly
+#define __always_unused     __attribute__((unused))
+
+#define likely(x_)          __builtin_expect(!!(x_), 1)
+#define unlikely(x_)        __builtin_expect(!!(x_), 0)
+
+#define ACCESS_ONCE(x_)     (*(volatile __typeof__(x_) *)&(x_))
+
+#define barrier()           __asm__ __volatile__("" ::: "memory")
+#define smp_mb()            __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb()           __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb()           __atomic_thread_fence(__ATOMIC_RELEASE)
+
+#ifndef offsetof
+#define offsetof(type_, member_)    __builtin_offsetof(type_, member_)
+#endif
+
+#define container_of(ptr_, type_, member_) \
+    ((type_ *)((char *)(ptr_) - offsetof(type_, member_)))
+
+#define ARRAY_SIZE(a_)      (sizeof(a_) / sizeof((a_)[0]))
+
+#define min(a_, b_)         ((a_) < (b_) ? (a_) : (b_))
+#define max(a_, b_)         ((a_) > (b_) ? (a_) : (b_))
+#define min_t(t_, a_, b_)   ((t_)(a_) < (t_)(b_) ? (t_)(a_) : (t_)(b_))
+#define max_t(t_, a_, b_)   ((t_)(a_) > (t_)(b_) ? (t_)(a_) : (t_)(b_))
+
+#define DIV_ROUND_UP(n_, d_)    (((n_) + (d_) - 1) / (d_))
+
+#define swap(a_, b_)        do { __typeof__(a_) t_ = (a_); (a_) = (b_); (b_) = t_; } while (0)
+
+#define MAX_ERRNO           4095
+#define IS_ERR(p_)          ((unsigned long)(p_) >= (unsigned long)-MAX_ERRNO)
+#define PTR_ERR(p_)         ((long)(p_))
+#define ERR_PTR(e_)         ((void *)(long)(e_))
+
+#define ERESTARTSYS         512
+
+
+/****************************************************************************
+ *  Modules, parameters and exports.  All of it is ignored.
+ */
+struct module;
+
+#define THIS_MODULE                         ((struct module *)0)
+#define module_param(name_, type_, perm_)   extern int kernel_shim_ignored
+#define module_param_named(name_, value_, type_, perm_) extern int kernel_shim_ignored
+#define MODULE_PARM_DESC(name_, desc_)      extern int kernel_shim_ignored
+#define MODULE_AUTHOR(a_)                   extern int kernel_shim_ignored
+#define MODULE_LICENSE(l_)                  extern int kernel_shim_ignored
+#define MODULE_DESCRIPTION(d_)              extern int kernel_shim_ignored
+#define MODULE_VERSION(v_)                  extern int kernel_shim_ignored
+#define EXPORT_SYMBOL(s_)                   extern int kernel_shim_ignored
+#define EXPORT_SYMBOL_GPL(s_)               extern int kernel_shim_ignored
+
+#define S_IRUGO             (S_IRUSR | S_IRGRP | S_IROTH)
+#define S_IWUGO             (S_IWUSR | S_IWGRP | S_IWOTH)
+
+
+/****************************************************************************
+ *  printk
+ *
+ *  Levels work like 3.10, an SOH character and a digit in front of the
+ *  text.  Anything less important than kernel_shim_loglevel is dropped.
+ */
+#define KERN_SOH            "\001"
+#define KERN_EMERG          KERN_SOH "0"
+#define KERN_ALERT          KERN_SOH "1"
+#define KERN_CRIT           KERN_SOH "2"
+#define KERN_ERR            KERN_SOH "3"
+#define KERN_WARNING        KERN_SOH "4"
+#define KERN_NOTICE         KERN_SOH "5"
+#define KERN_INFO           KERN_SOH "6"
+#define KERN_DEBUG          KERN_SOH "7"
+#define KERN_CONT           ""
+
+extern int kernel_shim_loglevel;
+
+int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+
+/****************************************************************************
+ *  Time
+ */
+#define HZ                  100
+
+#define NSEC_PER_USEC       1000L
+#define NSEC_PER_MSEC       1000000L
+#define NSEC_PER_SEC        1000000000L
+#define USEC_PER_SEC        1000000L
+#define MSEC_PER_SEC        1000L
+
+typedef union {
+    s64 tv64;
+} ktime_t;
+
+ktime_t ktime_get(void);
+unsigned long kernel_shim_jiffies(void);
+
+#define jiffies                     kernel_shim_jiffies()
+#define ktime_to_ns(kt_)            ((kt_).tv64)
+#define ns_to_ktime(ns_)            ((ktime_t){ .tv64 = (ns_) })
+#define ktime_set(s_, ns_)          ((ktime_t){ .tv64 = (s64)(s_) * NSEC_PER_SEC + (ns_) })
+#define ktime_add_ns(kt_, ns_)      ((ktime_t){ .tv64 = (kt_).tv64 + (ns_) })
+#define ktime_sub(a_, b_)           ((ktime_t){ .tv64 = (a_).tv64 - (b_).tv64 })
+
+#define time_after(a_, b_)          ((long)((b_) - (a_)) < 0)
+#define time_before(a_, b_)         time_after(b_, a_)
+#define msecs_to_jiffies(ms_)       ((unsigned long)(ms_) * HZ / MSEC_PER_SEC)
+
+#define udelay(us_)                 do { } while (0)
+#define ndelay(ns_)                 do { } while (0)
+#define mdelay(ms_)                 do { } while (0)
+
+
+/****************************************************************************
+ *  Bits and arithmetic
+ */
+static inline int fls(unsigned int x)
+{
+    return x ? 32 - __builtin_clz(x) : 0;
+}
+
+static inline int fls64(u64 x)
+{
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+#define BIT(n_)                     (1UL << (n_))
+#define ilog2(n_)                   (fls64((u64)(n_)) - 1)
+#define is_power_of_2(n_)           ((n_) != 0 && (((n_) & ((n_) - 1)) == 0))
+#define roundup_pow_of_two(n_)      (1UL << fls64((u64)(n_) - 1))
+
+static inline u64 div_u64_rem(u64 dividend, u32 divisor, u32 *remainder)
+{
+    *remainder = (u32)(dividend % divisor);
+    return dividend / divisor;
+}
+
+static inline u64 div_u64(u64 dividend, u32 divisor)
+{
+    return dividend / divisor;
+}
+
+static inline u64 div64_u64(u64 dividend, u64 divisor)
+{
+    return dividend / divisor;
+}
+
+static inline s64 div_s64(s64 dividend, s32 divisor)
+{
+    return dividend / divisor;
+}
+
+#define GOLDEN_RATIO_PRIME_32       0x9e370001UL
+
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+    return (u32)(val * GOLDEN_RATIO_PRIME_32) >> (32 - bits);
+}
+
+
+/****************************************************************************
+ *  Atomics
+ */
+typedef struct {
+    int counter;
+} atomic_t;
+
+#define ATOMIC_INIT(i_)             { (i_) }
+
+#define atomic_read(v_)             __atomic_load_n(&(v_)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v_, i_)          __atomic_store_n(&(v_)->counter, (i_), __ATOMIC_RELAXED)
+#define atomic_add(i_, v_)          ((void)__atomic_add_fetch(&(v_)->counter, (i_), __ATOMIC_SEQ_CST))
+#define atomic_sub(i_, v_)          ((void)__atomic_sub_fetch(&(v_)->counter, (i_), __ATOMIC_SEQ_CST))
+#define atomic_inc(v_)              atomic_add(1, v_)
+#define atomic_dec(v_)              atomic_sub(1, v_)
+#define atomic_add_return(i_, v_)   __atomic_add_fetch(&(v_)->counter, (i_), __ATOMIC_SEQ_CST)
+#define atomic_sub_return(i_, v_)   __atomic_sub_fetch(&(v_)->counter, (i_), __ATOMIC_SEQ_CST)
+#define atomic_inc_return(v_)       atomic_add_return(1, v_)
+#define atomic_dec_return(v_)       atomic_sub_return(1, v_)
+#define atomic_dec_and_test(v_)     (atomic_dec_return(v_) == 0)
+#define atomic_cmpxchg(v_, o_, n_)  kernel_shim_cmpxchg(&(v_)->counter, (o_), (n_))
+#define cmpxchg(p_, o_, n_)         __sync_val_compare_and_swap((p_), (o_), (n_))
+
+static inline int kernel_shim_cmpxchg(int *p, int old, int new_value)
+{
+    __atomic_compare_exchange_n(p, &old, new_value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return old;
+}
+
+
+/****************************************************************************
+ *  Lists, a straight copy of the parts of <linux/list.h> we use.
+ */
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name_)       { &(name_), &(name_) }
+#define LIST_HEAD(name_)            struct list_head name_ = LIST_HEAD_INIT(name_)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void __list_add(  struct list_head *entry,
+                                struct list_head *prev,
+                                struct list_head *next)
+{
+    next->prev = entry;
+    entry->next = next;
+    entry->prev = prev;
+    prev->next = entry;
+}
+
+static inline void list_add(struct list_head *entry, struct list_head *head)
+{
+    __list_add(entry, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+    __list_add(entry, head->prev, head);
+}
+
+static inline void __list_del(struct list_head *prev, struct list_head *next)
+{
+    next->prev = prev;
+    prev->next = next;
+}
+
+/*
+ *  NULL rather than the kernel's poison values, it still faults.
+ */
+static inline void list_del(struct list_head *entry)
+{
+    __list_del(entry->prev, entry->next);
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+    __list_del(entry->prev, entry->next);
+    INIT_LIST_HEAD(entry);
+}
+
+static inline void list_move_tail(struct list_head *entry, struct list_head *head)
+{
+    __list_del(entry->prev, entry->next);
+    list_add_tail(entry, head);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+static inline int list_is_singular(const struct list_head *head)
+{
+    return !list_empty(head) && (head->next == head->prev);
+}
+
+static inline void __list_splice(   const struct list_head *list,
+                                    struct list_head *prev,
+                                    struct list_head *next)
+{
+    struct list_head *first = list->next;
+    struct list_head *last = list->prev;
+
+    first->prev = prev;
+    prev->next = first;
+
+    last->next = next;
+    next->prev = last;
+}
+
+static inline void list_splice_init(struct list_head *list, struct list_head *head)
+{
+    if (!list_empty(list)){
+        __list_splice(list, head, head->next);
+        INIT_LIST_HEAD(list);
+    }
+}
+
+static inline void list_splice_tail_init(struct list_head *list, struct list_head *head)
+{
+    if (!list_empty(list)){
+        __list_splice(list, head->prev, head);
+        INIT_LIST_HEAD(list);
+    }
+}
+
+#define list_entry(ptr_, type_, member_)        container_of(ptr_, type_, member_)
+#define list_first_entry(ptr_, type_, member_)  list_entry((ptr_)->next, type_, member_)
+
+#define list_for_each(pos_, head_) \
+    for (pos_ = (head_)->next; pos_ != (head_); pos_ = pos_->next)
+
+#define list_for_each_safe(pos_, n_, head_) \
+    for (pos_ = (head_)->next, n_ = pos_->next; pos_ != (head_); pos_ = n_, n_ = pos_->next)
+
+#define list_for_each_entry(pos_, head_, member_)                               \
+    for (pos_ = list_entry((head_)->next, __typeof__(*pos_), member_);          \
+         &pos_->member_ != (head_);                                             \
+         pos_ = list_entry(pos_->member_.next, __typeof__(*pos_), member_))
+
+#define list_for_each_entry_safe(pos_, n_, head_, member_)                      \
+    for (pos_ = list_entry((head_)->next, __typeof__(*pos_), member_),          \
+         n_ = list_entry(pos_->member_.next, __typeof__(*pos_), member_);       \
+         &pos_->member_ != (head_);                                             \
+         pos_ = n_, n_ = list_entry(n_->member_.next, __typeof__(*n_), member_))
+
+
+/****************************************************************************
+ *  Locks.  Interrupts are just another thread here, so irqsave is
+ *  simply the lock.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+} spinlock_t;
+
+#define DEFINE_SPINLOCK(name_)      spinlock_t name_ = { PTHREAD_MUTEX_INITIALIZER }
+
+#define spin_lock_init(l_)          pthread_mutex_init(&(l_)->mutex, NULL)
+#define spin_lock(l_)               pthread_mutex_lock(&(l_)->mutex)
+#define spin_unlock(l_)             pthread_mutex_unlock(&(l_)->mutex)
+#define spin_trylock(l_)            (pthread_mutex_trylock(&(l_)->mutex) == 0)
+#define spin_lock_irqsave(l_, f_)   do { (f_) = 0; spin_lock(l_); } while (0)
+#define spin_unlock_irqrestore(l_, f_) do { (void)(f_); spin_unlock(l_); } while (0)
+#define spin_lock_irq(l_)           spin_lock(l_)
+#define spin_unlock_irq(l_)         spin_unlock(l_)
+#define spin_lock_bh(l_)            spin_lock(l_)
+#define spin_unlock_bh(l_)          spin_unlock(l_)
+
+#define local_irq_save(f_)          do { (f_) = 0; } while (0)
+#define local_irq_restore(f_)       do { (void)(f_); } while (0)
+
+
+
+/****************************************************************************
+ *  Mutexes, for process context only, like the kernel's.
+ */
+struct mutex {
+    pthread_mutex_t mutex;
+};
+
+#define DEFINE_MUTEX(name_)         struct mutex name_ = { PTHREAD_MUTEX_INITIALIZER }
+
+#define mutex_init(m_)              pthread_mutex_init(&(m_)->mutex, NULL)
+#define mutex_lock(m_)              pthread_mutex_lock(&(m_)->mutex)
+#define mutex_unlock(m_)            pthread_mutex_unlock(&(m_)->mutex)
+#define mutex_lock_interruptible(m_) (pthread_mutex_lock(&(m_)->mutex), 0)
+
+
+
+/****************************************************************************
+ *  RCU.  Readers hold a process wide rwlock for reading, so
+ *  synchronize_rcu() taking it for writing waits out every reader.
+ *  call_rcu() does the same and then calls back straight away, so
+ *  rcu_barrier() has nothing to wait for.
+ */
+extern pthread_rwlock_t kernel_shim_rcu_lock;
+
+#define rcu_read_lock()             pthread_rwlock_rdlock(&kernel_shim_rcu_lock)
+#define rcu_read_unlock()           pthread_rwlock_unlock(&kernel_shim_rcu_lock)
+
+struct rcu_head {
+    void (*func)(struct rcu_head *);
+};
+
+void synchronize_rcu(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *));
+
+#define rcu_barrier()               do { } while (0)
+
+#define rcu_dereference(p_)         __atomic_load_n(&(p_), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p_, v_)  __atomic_store_n(&(p_), (v_), __ATOMIC_RELEASE)
+
+static inline void list_add_tail_rcu(struct list_head *entry, struct list_head *head)
+{
+    entry->next = head;
+    entry->prev = head->prev;
+    rcu_assign_pointer(head->prev->next, entry);
+    head->prev = entry;
+}
+
+static inline void list_add_rcu(struct list_head *entry, struct list_head *head)
+{
+    entry->next = head->next;
+    entry->prev = head;
+    rcu_assign_pointer(head->next, entry);
+    entry->next->prev = entry;
+}
+
+static inline void list_del_rcu(struct list_head *entry)
+{
+    entry->next->prev = entry->prev;
+    rcu_assign_pointer(entry->prev->next, entry->next);
+}
+
+#define list_for_each_entry_rcu(pos_, head_, member_)                           \
+    for (pos_ = list_entry(rcu_dereference((head_)->next), __typeof__(*pos_), member_); \
+         &pos_->member_ != (head_);                                             \
+         pos_ = list_entry(rcu_dereference(pos_->member_.next), __typeof__(*pos_), member_))
+
+
+/****************************************************************************
+ *  Wait queues
+ *
+ *  Sleepers re-check their condition every few milliseconds as well as
+ *  on a wake up, so kernel_shim_signal_all() can interrupt them.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} wait_queue_head_t;
+
+void init_waitqueue_head(wait_queue_head_t *wq);
+void wake_up_interruptible(wait_queue_head_t *wq);
+void kernel_shim_wait(wait_queue_head_t *wq);
+
+#define wake_up(wq_)                wake_up_interruptible(wq_)
+#define wake_up_interruptible_all(wq_) wake_up_interruptible(wq_)
+
+/*
+ *  Make every interruptible sleep return -ERESTARTSYS, as if the
+ *  process got a signal.  Used to stop reader threads.
+ */
+void kernel_shim_signal_all(void);
+void kernel_shim_signal_clear(void);
+int kernel_shim_signal_pending(void);
+
+#define wait_event_interruptible(wq_, condition_)                           \
+({                                                                          \
+    int ret__ = 0;                                                          \
+    pthread_mutex_lock(&(wq_).mutex);                                       \
+    while (!(condition_)){                                                  \
+        if (kernel_shim_signal_pending()){                                  \
+            ret__ = -ERESTARTSYS;                                           \
+            break;                                                          \
+        }                                                                   \
+        kernel_shim_wait(&(wq_));                                           \
+    }                                                                       \
+    pthread_mutex_unlock(&(wq_).mutex);                                     \
+    ret__;                                                                  \
+})
+
+
+/****************************************************************************
+ *  Memory
+ */
+#define GFP_KERNEL                  0x10u
+#define GFP_ATOMIC                  0x20u
+
+static inline void *kmalloc(size_t size, gfp_t flags)
+{
+    (void)flags;
+    return malloc(size);
+}
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+    (void)flags;
+    return calloc(1, size);
+}
+
+static inline void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+    (void)flags;
+    return calloc(n, size);
+}
+
+#define kfree(p_)                   free((void *)(p_))
+#define vmalloc(size_)              malloc(size_)
+#define vzalloc(size_)              calloc(1, size_)
+#define vfree(p_)                   free((void *)(p_))
+
+#define PAGE_SHIFT                  12
+#define PAGE_SIZE                   (1UL << PAGE_SHIFT)
+#define PAGE_ALIGN(n_)              (((n_) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+#define vmalloc_user(size_)         calloc(1, size_)
+
+#define copy_to_user(to_, from_, n_)    (memcpy((to_), (from_), (n_)), 0UL)
+#define copy_from_user(to_, from_, n_)  (memcpy((to_), (from_), (n_)), 0UL)
+
+
+/****************************************************************************
+ *  Register access.  Plain memory, flexcan_model.h redirects the
+ *  driver's accesses to the model.
+ */
+static inline unsigned int readl(const volatile void __iomem *addr)
+{
+    return *(const volatile unsigned int *)addr;
+}
+
+static inline void writel(unsigned int value, volatile void __iomem *addr)
+{
+    *(volatile unsigned int *)addr = value;
+}
+
+#define ioread32(addr_)             readl(addr_)
+#define iowrite32(value_, addr_)    writel(value_, addr_)
+
+
+/****************************************************************************
+ *  Interrupts
+ */
+typedef enum {
+    IRQ_NONE,
+    IRQ_HANDLED
+} irqreturn_t;
+
+
+/****************************************************************************
+ *  eventfd.  The context holds its own dup() of a real eventfd(2), so
+ *  signalling it wakes a poll() or read() in the sim.
+ */
+struct eventfd_ctx {
+    int fd;
+};
+
+struct eventfd_ctx *eventfd_ctx_fdget(int fd);
+__u64 eventfd_signal(struct eventfd_ctx *ctx, __u64 n);
+void eventfd_ctx_put(struct eventfd_ctx *ctx);
+
+
+/****************************************************************************
+ *  Deferred work and hrtimers
+ *
+ *  Nothing runs by itself.  kernel_shim_run_work() runs the hrtimers
+ *  and then the work whose time has come, from the caller's thread.
+ */
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+
+struct work_struct {
+    work_func_t func;
+};
+
+struct delayed_work {
+    struct work_struct work;
+    int pending;
+    unsigned long expires;
+};
+
+/*
+ *  There is one queue, system_wq is only there for mod_delayed_work().
+ */
+struct workqueue_struct;
+extern struct workqueue_struct *system_wq;
+
+void kernel_shim_init_delayed_work(struct delayed_work *dwork, work_func_t func);
+int schedule_delayed_work(struct delayed_work *dwork, unsigned long delay);
+int mod_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork, unsigned long delay);
+int cancel_delayed_work_sync(struct delayed_work *dwork);
+void kernel_shim_run_work(void);
+
+#define INIT_DELAYED_WORK(dw_, fn_)     kernel_shim_init_delayed_work(dw_, fn_)
+#define to_delayed_work(w_)             container_of(w_, struct delayed_work, work)
+
+enum hrtimer_mode {
+    HRTIMER_MODE_ABS,
+    HRTIMER_MODE_REL
+};
+
+enum hrtimer_restart {
+    HRTIMER_NORESTART,
+    HRTIMER_RESTART
+};
+
+/*
+ *  A timer is in the shim's table only while queued, so like delayed
+ *  work it can live in memory that is freed after hrtimer_cancel().
+ */
+struct hrtimer {
+    enum hrtimer_restart (*function)(struct hrtimer *);
+    ktime_t expires;
+    int queued;
+    int running;                    /* Its callback is running now */
+};
+
+void hrtimer_init(struct hrtimer *timer, clockid_t clock_id, enum hrtimer_mode mode);
+int hrtimer_start(struct hrtimer *timer, ktime_t tim, const enum hrtimer_mode mode);
+int hrtimer_cancel(struct hrtimer *timer);
+int hrtimer_try_to_cancel(struct hrtimer *timer);
+u64 hrtimer_forward(struct hrtimer *timer, ktime_t now, ktime_t interval);
+int hrtimer_active(const struct hrtimer *timer);
+
+#define hrtimer_forward_now(t_, i_)     hrtimer_forward(t_, ktime_get(), i_)
+#define hrtimer_get_expires(t_)         ((t_)->expires)
+#define hrtimer_set_expires(t_, e_)     do { (t_)->expires = (e_); } while (0)
+#define hrtimer_cb_get_time(t_)         ktime_get()
+#define hrtimer_is_queued(t_)           (ACCESS_ONCE((t_)->queued))
+
+
+/****************************************************************************
+ *  Files, char devices and the platform bits can_private.h mentions.
+ */
+struct inode;
+struct file;
+struct poll_table_struct;
+struct vm_area_struct;
+struct pipe_inode_info;
+
+#define VM_WRITE                    0x00000002UL
+#define VM_MAYWRITE                 0x00000020UL
+
+struct vm_operations_struct {
+    void (*open)(struct vm_area_struct *);
+    void (*close)(struct vm_area_struct *);
+};
+
+struct vm_area_struct {
+    unsigned long vm_start;
+    unsigned long vm_end;
+    unsigned long vm_pgoff;
+    unsigned long vm_flags;
+    const struct vm_operations_struct *vm_ops;
+    void *vm_private_data;
+};
+
+/*
+ *  There is only one address space, so the "mapping" is the buffer
+ *  itself: vm_start moves to it, keeping the length.
+ */
+static inline int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff)
+{
+    unsigned long size = vma->vm_end - vma->vm_start;
+
+    vma->vm_start = (unsigned long)addr + (pgoff << PAGE_SHIFT);
+    vma->vm_end = vma->vm_start + size;
+
+    return 0;
+}
+
+struct file_operations {
+    struct module *owner;
+    loff_t (*llseek)(struct file *, loff_t, int);
+    ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+    ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+    unsigned int (*poll)(struct file *, struct poll_table_struct *);
+    long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+    int (*mmap)(struct file *, struct vm_area_struct *);
+    int (*open)(struct inode *, struct file *);
+    int (*release)(struct inode *, struct file *);
+    ssize_t (*splice_read)(struct file *, loff_t *, struct pipe_inode_info *, size_t, unsigned int);
+};
+
+struct cdev {
+    struct module *owner;
+    const struct file_operations *ops;
+};
+
+struct inode {
+    struct cdev *i_cdev;
+    void *i_private;
+};
+
+struct file {
+    void *private_data;
+    unsigned int f_flags;
+    loff_t f_pos;
+    const struct file_operations *f_op;
+};
+
+static inline int nonseekable_open(struct inode *inode, struct file *filp)
+{
+    (void)inode;
+    (void)filp;
+    return 0;
+}
+
+struct clk;
+struct regmap;
+struct resource;
+struct platform_device;
+
+enum of_gpio_flags {
+    OF_GPIO_ACTIVE_LOW = 0x1,
+};
+
+
+/****************************************************************************
+ *  Pages and pipes
+ *
+ *  A pipe is a ring of page buffers as in the kernel, but nobody sleeps
+ *  on it.  splice_to_pipe() takes what fits and kernel_shim_pipe_drain()
+ *  plays the reading end, writing the buffers to a real file descriptor
+ *  the way splice() from the pipe to a file would.
+ */
+struct page {
+    void *virtual;
+    int count;
+};
+
+static inline struct page *alloc_page(gfp_t flags)
+{
+    struct page *page = malloc(sizeof(*page));
+
+    (void)flags;
+    if (page){
+        page->virtual = malloc(PAGE_SIZE);
+        page->count = 1;
+        if (!page->virtual){
+            free(page);
+            page = NULL;
+        }
+    }
+
+    return page;
+}
+
+static inline void get_page(struct page *page)
+{
+    __atomic_add_fetch(&page->count, 1, __ATOMIC_RELAXED);
+}
+
+static inline void put_page(struct page *page)
+{
+    if (!__atomic_sub_fetch(&page->count, 1, __ATOMIC_ACQ_REL)){
+        free(page->virtual);
+        free(page);
+    }
+}
+
+#define __free_page(page_)          put_page(page_)
+#define page_cache_release(page_)   put_page(page_)
+#define page_address(page_)         ((page_)->virtual)
+
+#define PIPE_DEF_BUFFERS            16
+#ifndef SPLICE_F_NONBLOCK                   /* <fcntl.h> has it with _GNU_SOURCE */
+#define SPLICE_F_NONBLOCK           0x02
+#endif
+
+struct pipe_buf_operations;
+
+struct pipe_buffer {
+    struct page *page;
+    unsigned int offset;
+    unsigned int len;
+    const struct pipe_buf_operations *ops;
+    unsigned int flags;
+    unsigned long private;
+};
+
+struct pipe_inode_info {
+    unsigned int nrbufs;
+    unsigned int curbuf;
+    unsigned int buffers;
+    struct pipe_buffer bufs[PIPE_DEF_BUFFERS];
+};
+
+struct pipe_buf_operations {
+    int can_merge;
+    void *(*map)(struct pipe_inode_info *, struct pipe_buffer *, int);
+    void (*unmap)(struct pipe_inode_info *, struct pipe_buffer *, void *);
+    int (*confirm)(struct pipe_inode_info *, struct pipe_buffer *);
+    void (*release)(struct pipe_inode_info *, struct pipe_buffer *);
+    int (*steal)(struct pipe_inode_info *, struct pipe_buffer *);
+    void (*get)(struct pipe_inode_info *, struct pipe_buffer *);
+};
+
+void *generic_pipe_buf_map(struct pipe_inode_info *pipe, struct pipe_buffer *buf, int atomic);
+void generic_pipe_buf_unmap(struct pipe_inode_info *pipe, struct pipe_buffer *buf, void *addr);
+int generic_pipe_buf_confirm(struct pipe_inode_info *pipe, struct pipe_buffer *buf);
+void generic_pipe_buf_release(struct pipe_inode_info *pipe, struct pipe_buffer *buf);
+int generic_pipe_buf_steal(struct pipe_inode_info *pipe, struct pipe_buffer *buf);
+void generic_pipe_buf_get(struct pipe_inode_info *pipe, struct pipe_buffer *buf);
+
+struct partial_page {
+    unsigned int offset;
+    unsigned int len;
+    unsigned long private;
+};
+
+struct splice_pipe_desc {
+    struct page **pages;
+    struct partial_page *partial;
+    int nr_pages;
+    unsigned int nr_pages_max;
+    unsigned int flags;
+    const struct pipe_buf_operations *ops;
+    void (*spd_release)(struct splice_pipe_desc *, unsigned int);
+};
+
+ssize_t splice_to_pipe(struct pipe_inode_info *pipe, struct splice_pipe_desc *spd);
+
+void kernel_shim_pipe_init(struct pipe_inode_info *pipe);
+ssize_t kernel_shim_pipe_drain(struct pipe_inode_info *pipe, int fd);
+
+
+/****************************************************************************
+ *  seq_file and /proc
+ *
+ *  proc_create() entries are kept in a table, kernel_shim_proc_show() and
+ *  kernel_shim_proc_write() stand in for cat and echo.
+ */
+struct seq_file {
+    FILE *out;
+    void *private;
+    int (*show)(struct seq_file *, void *);
+};
+
+struct proc_dir_entry;
+
+int seq_printf(struct seq_file *m, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int seq_puts(struct seq_file *m, const char *s);
+int single_open(struct file *file, int (*show)(struct seq_file *, void *), void *data);
+int single_release(struct inode *inode, struct file *file);
+ssize_t seq_read(struct file *file, char __user *buf, size_t size, loff_t *ppos);
+loff_t seq_lseek(struct file *file, loff_t offset, int whence);
+
+struct proc_dir_entry *proc_create_data(const char *name, umode_t mode,
+                                        struct proc_dir_entry *parent,
+                                        const struct file_operations *fops,
+                                        void *data);
+void remove_proc_entry(const char *name, struct proc_dir_entry *parent);
+
+#define proc_create(name_, mode_, parent_, fops_) \
+    proc_create_data(name_, mode_, parent_, fops_, NULL)
+
+#define PDE_DATA(inode_)            ((inode_)->i_private)
+
+int kernel_shim_proc_show(const char *name, FILE *out);
+int kernel_shim_proc_write(const char *name, const char *text);
+
+
+/****************************************************************************
+ *  Tracepoints compile away to nothing.
+ */
+#define TP_PROTO(args_...)          args_
+#define TP_ARGS(args_...)           args_
+#define PARAMS(args_...)            args_
+
+#define TRACE_EVENT(name_, proto_, args_, struct_, assign_, print_) \
+    static inline void trace_##name_(proto_) { }
+
+#define DECLARE_EVENT_CLASS(name_, proto_, args_, struct_, assign_, print_)
+
+#define DEFINE_EVENT(template_, name_, proto_, args_) \
+    static inline void trace_##name_(proto_) { }
+
+
+#endif
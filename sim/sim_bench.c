@@ -0,0 +1,493 @@
+/****************************************************************************
+ *  sim_bench.c
+ *
+ *  Synthetic load for the driver core running against the register
+ *  model.  Numbers come from the driver's own statistics where it keeps
+ *  them, so they line up with /proc/ta_canbus on a board.
+ *
+ *  Modes:
+ *
+ *      isr     One thread injects bursts of frames, runs the ISR and
+ *              drains every reader with read().  Measures the ISR and
+ *              the read path with no scheduling noise.
+ *
+ *      threads A bus thread injects frames (optionally at a fixed rate)
+ *              and runs the ISR, each reader is its own thread blocked
+ *              in read().  Measures wakeup latency and lost frames.
+ *
+ *      tx      write() with self reception on, so every frame comes
+ *              back through the ISR.
+ *
+ *      pool, drain, fanout, churn, group, classes, storm, multi, 
+ *      gateway, history, capture, splice, txerr, busoff, cyclic,
+ *      timed, txcomplete
+ *              Microbenchmarks of the message pool, the ISR's mailbox
+ *              drain and sort, delivery to many readers, with files
+ *              opening and closing, to a consumer group and by class,
+ *              status coalescing in an error storm, several devices at
+ *              once, forwarding between them, the history ring,
+ *              triggered capture, logging through splice(), the ACK
+ *              error policies, bus off recovery, cyclic and timed
+ *              transmit and TX complete records, each with a
+ *              consistency check.  See sim_micro.c.
+ *
+ ***************************************************************************/
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim_bench.h"
+
+
+struct reader_thread {
+
+    pthread_t thread;
+    struct file *filp;
+    unsigned long long received;
+};
+
+
+static unsigned int rand_state = 0x12345678;
+
+unsigned int bench_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 1;
+}
+
+
+u64 bench_ns(void)
+{
+    return (u64)ktime_to_ns(ktime_get());
+}
+
+
+void make_frame(const struct bench_config *cfg, CANBUS_MESSAGE *message)
+{
+    unsigned int i;
+
+    memset(message, 0, sizeof(CANBUS_MESSAGE));
+
+    if (bench_rand() % 100 < cfg->ext_percent){
+        message->Type = CmtExtended;
+        message->Id = bench_rand() & 0x1FFFFFFF;
+    }
+    else{
+        message->Type = CmtStandard;
+        message->Id = (bench_rand() & 0x7FF) << 18;
+    }
+
+    message->DataLength = bench_rand() % 9;
+    for (i = 0; i<message->DataLength; i++){
+        message->Data[i] = (unsigned char)bench_rand();
+    }
+}
+
+
+void show_hist(const char *name, const struct can_histogram_t *hist)
+{
+    printf( "%-20s p50 %8llu  p99 %8llu  p99.9 %8llu  max %8llu  count %llu\n",
+            name,
+            can_histogram_percentile(hist, 500000),
+            can_histogram_percentile(hist, 990000),
+            can_histogram_percentile(hist, 999000),
+            hist->max,
+            hist->count);
+}
+
+
+static void show_lock(const char *name, const struct can_lock_stats_t *stats)
+{
+    char hist_name[32];
+
+    printf("%-20s acquired %llu, contended %llu\n", name, stats->acquired, stats->contended);
+
+    if (can_lock_timing){
+        snprintf(hist_name, sizeof(hist_name), "%sWaitNs", name);
+        show_hist(hist_name, &stats->wait_hist);
+        snprintf(hist_name, sizeof(hist_name), "%sHoldNs", name);
+        show_hist(hist_name, &stats->hold_hist);
+    }
+}
+
+
+static void show_device(struct sim_device *sim, u64 elapsed_ns, unsigned long long frames)
+{
+    struct canbus_device_t *dev = sim->dev;
+
+    printf("frames               %llu in %llu ms, %llu frames/sec\n",
+            frames, elapsed_ns / NSEC_PER_MSEC,
+            elapsed_ns ? frames * NSEC_PER_SEC / elapsed_ns : 0);
+    printf("isr count            %llu\n", dev->stats.isr_count);
+    printf("model rx / lost / tx %llu / %llu / %llu\n",
+            sim->model->rx_frames, sim->model->rx_lost, sim->model->tx_frames);
+    printf("register reads       %llu, writes %llu\n",
+            sim->model->register_reads, sim->model->register_writes);
+
+    show_hist("IsrTimeNs", &dev->stats.isr_time_hist);
+    show_hist("MbPerIsr", &dev->stats.mb_per_isr_hist);
+
+    show_lock("RegisterLock", &dev->register_lock.stats);
+    show_lock("ReaderLock", &dev->reader_lock.stats);
+    show_lock("TxLock", &dev->tx_lock.stats);
+}
+
+
+void drain_reader(struct file *filp)
+{
+    struct canbus_file_t *file = filp->private_data;
+    CANBUS_MESSAGE message;
+
+    while (file->stats.cur_rx_queue_count){
+        can_read(filp, (char *)&message, sizeof(message), NULL);
+    }
+}
+
+
+
+/****************************************************************************
+ *  isr mode
+ */
+static int bench_isr(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct file **files;
+    CANBUS_MESSAGE message;
+    unsigned long long injected = 0;
+    u64 start_ns;
+    u64 read_ns = 0;
+    u64 t;
+    unsigned int i;
+
+    files = calloc(cfg->readers, sizeof(struct file *));
+    for (i = 0; i<cfg->readers; i++){
+        files[i] = sim_open(sim);
+    }
+
+    start_ns = bench_ns();
+
+    while (injected < cfg->frames){
+
+        for (i = 0; i<cfg->burst && injected < cfg->frames; i++){
+            make_frame(cfg, &message);
+            flexcan_model_receive(sim->model, &message);
+            injected++;
+        }
+
+        sim_device_service(sim);
+
+        t = bench_ns();
+        for (i = 0; i<cfg->readers; i++){
+            drain_reader(files[i]);
+        }
+        read_ns += bench_ns() - t;
+    }
+
+    show_device(sim, bench_ns() - start_ns, injected);
+
+    if (cfg->readers){
+        printf("read                 %llu ns per frame per reader\n",
+                read_ns / (injected * cfg->readers));
+        show_hist("IsrToEnqueueNs",
+                &((struct canbus_file_t *)files[0]->private_data)->stats.isr_to_enqueue_hist);
+    }
+
+    if (cfg->show_proc){
+        kernel_shim_proc_show(sim->dev->name, stdout);
+    }
+
+    for (i = 0; i<cfg->readers; i++){
+        sim_close(sim, files[i]);
+    }
+    free(files);
+
+    return 0;
+}
+
+
+
+/****************************************************************************
+ *  threads mode
+ */
+static void *reader_fn(void *arg)
+{
+    struct reader_thread *reader = arg;
+    CANBUS_MESSAGE message;
+
+    while (can_read(reader->filp, (char *)&message, sizeof(message), NULL) > 0){
+        reader->received++;
+    }
+
+    return NULL;
+}
+
+
+static int bench_threads(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct reader_thread *readers;
+    struct canbus_file_t *file;
+    CANBUS_MESSAGE message;
+    unsigned long long injected = 0;
+    u64 start_ns;
+    u64 elapsed_ns;
+    u64 due_ns;
+    unsigned int i;
+
+    readers = calloc(cfg->readers, sizeof(struct reader_thread));
+    for (i = 0; i<cfg->readers; i++){
+        readers[i].filp = sim_open(sim);
+        pthread_create(&readers[i].thread, NULL, reader_fn, &readers[i]);
+    }
+
+    start_ns = bench_ns();
+
+    while (injected < cfg->frames){
+
+        if (cfg->rate){
+            due_ns = start_ns + injected * NSEC_PER_SEC / cfg->rate;
+            while (bench_ns() < due_ns){
+                sched_yield();
+            }
+        }
+
+        for (i = 0; i<cfg->burst && injected < cfg->frames; i++){
+            make_frame(cfg, &message);
+            flexcan_model_receive(sim->model, &message);
+            injected++;
+        }
+
+        sim_device_service(sim);
+        kernel_shim_run_work();
+    }
+
+    /*
+     *  Give the readers a moment to empty their queues, then stop them.
+     */
+    for (i = 0; i<cfg->readers; i++){
+        file = readers[i].filp->private_data;
+        while (file->stats.cur_rx_queue_count){
+            usleep(1000);
+        }
+    }
+    elapsed_ns = bench_ns() - start_ns;
+
+    kernel_shim_signal_all();
+    for (i = 0; i<cfg->readers; i++){
+        pthread_join(readers[i].thread, NULL);
+    }
+    kernel_shim_signal_clear();
+
+    show_device(sim, elapsed_ns, injected);
+
+    for (i = 0; i<cfg->readers; i++){
+        file = readers[i].filp->private_data;
+        printf("reader %-3u           received %llu, max queued %u\n",
+                i, readers[i].received, file->stats.max_rx_queue_count);
+        show_hist("  EnqueueToWakeupNs", &file->stats.enqueue_to_wakeup_hist);
+    }
+
+    if (cfg->show_proc){
+        kernel_shim_proc_show(sim->dev->name, stdout);
+    }
+
+    for (i = 0; i<cfg->readers; i++){
+        sim_close(sim, readers[i].filp);
+    }
+    free(readers);
+
+    return 0;
+}
+
+
+
+/****************************************************************************
+ *  tx mode
+ */
+static int bench_tx(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct file *filp;
+    CANBUS_MESSAGE message;
+    unsigned long long written = 0;
+    u64 start_ns;
+    u64 write_ns = 0;
+    u64 t;
+
+    filp = sim_open(sim);
+
+    can_ioctl(filp, CAN_IOCTL_ENABLE_SELF_RECEPTION, 0);
+
+    start_ns = bench_ns();
+
+    while (written < cfg->frames){
+
+        make_frame(cfg, &message);
+
+        t = bench_ns();
+        can_write(filp, (const char *)&message, sizeof(message), NULL);
+        write_ns += bench_ns() - t;
+        written++;
+
+        /*
+         *  TX complete and the self received copy.
+         */
+        while (sim_device_service(sim))
+            ;
+
+        drain_reader(filp);
+    }
+
+    show_device(sim, bench_ns() - start_ns, written);
+    printf("write                %llu ns per frame\n", write_ns / written);
+
+    if (cfg->show_proc){
+        kernel_shim_proc_show(sim->dev->name, stdout);
+    }
+
+    sim_close(sim, filp);
+
+    return 0;
+}
+
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -m mode      isr, threads, tx, pool, drain, fanout, churn, group,\n"
+        "               classes, storm, multi, gateway, history, capture, splice\n"
+        "               txerr, busoff, cyclic, timed or txcomplete\n"
+        "               (default isr)\n"
+        "  -n frames    frames to inject or write (default 1000000)\n"
+        "  -b burst     frames per ISR, 1-62 (default 4)\n"
+        "  -r readers   open files reading, fanout goes up to this (default 1)\n"
+        "  -t threads   threads in pool mode (default 4)\n"
+        "  -x percent   extended frames (default 0)\n"
+        "  -R rate      frames/sec in threads mode, 0 = flat out (default 0)\n"
+        "  -P size      message pool size (default 10000)\n"
+        "  -D devices   devices in multi mode (default 2)\n"
+        "  -L           time lock waits and holds, as lock_timing=1\n"
+        "  -p           dump /proc/ta_canbus0 at the end\n"
+        "  -v           show KERN_DEBUG printks\n",
+        name);
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct bench_config cfg = {
+        .mode = "isr",
+        .frames = 1000000,
+        .burst = 4,
+        .readers = 1,
+        .threads = 4,
+        .devices = 2,
+        .pool_size = 10000,
+    };
+    struct sim_device *sim;
+    int ret;
+    int c;
+
+    while ((c = getopt(argc, argv, "m:n:b:r:t:D:x:R:P:Lpvh")) != -1){
+
+        switch (c){
+            case 'm': cfg.mode = optarg; break;
+            case 'n': cfg.frames = strtoull(optarg, NULL, 0); break;
+            case 'b': cfg.burst = strtoul(optarg, NULL, 0); break;
+            case 'r': cfg.readers = strtoul(optarg, NULL, 0); break;
+            case 't': cfg.threads = strtoul(optarg, NULL, 0); break;
+            case 'D': cfg.devices = strtoul(optarg, NULL, 0); break;
+            case 'x': cfg.ext_percent = strtoul(optarg, NULL, 0); break;
+            case 'R': cfg.rate = strtoul(optarg, NULL, 0); break;
+            case 'P': cfg.pool_size = strtoul(optarg, NULL, 0); break;
+            case 'L': can_lock_timing = 1; break;
+            case 'p': cfg.show_proc = 1; break;
+            case 'v': kernel_shim_loglevel = 7; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (cfg.burst < 1 || cfg.burst > FLEXCAN_NUM_MESSAGE_BUFFERS - FIRST_RX_MB){
+        fprintf(stderr, "burst must be 1-%d\n", FLEXCAN_NUM_MESSAGE_BUFFERS - FIRST_RX_MB);
+        return 2;
+    }
+
+    sim = sim_device_create(cfg.pool_size);
+    if (!sim){
+        fprintf(stderr, "sim_device_create failed\n");
+        return 1;
+    }
+
+    printf("mode %s, %llu frames, burst %u, %u readers, %u%% extended\n",
+            cfg.mode, cfg.frames, cfg.burst, cfg.readers, cfg.ext_percent);
+
+    if (!strcmp(cfg.mode, "isr")){
+        ret = bench_isr(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "threads")){
+        ret = bench_threads(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "tx")){
+        ret = bench_tx(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "pool")){
+        ret = bench_pool(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "drain")){
+        ret = bench_drain(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "fanout")){
+        ret = bench_fanout(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "churn")){
+        ret = bench_churn(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "group")){
+        ret = bench_group(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "classes")){
+        ret = bench_classes(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "storm")){
+        ret = bench_storm(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "multi")){
+        ret = bench_multi(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "gateway")){
+        ret = bench_gateway(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "history")){
+        ret = bench_history(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "capture")){
+        ret = bench_capture(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "splice")){
+        ret = bench_splice(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "txerr")){
+        ret = bench_txerr(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "busoff")){
+        ret = bench_busoff(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "cyclic")){
+        ret = bench_cyclic(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "timed")){
+        ret = bench_timed(&cfg, sim);
+    }
+    else if (!strcmp(cfg.mode, "txcomplete")){
+        ret = bench_txcomplete(&cfg, sim);
+    }
+    else{
+        usage(argv[0]);
+        ret = 2;
+    }
+
+    sim_device_destroy(sim);
+
+    return ret;
+}
@@ -0,0 +1,57 @@
+/****************************************************************************
+ *  sim_bench.h
+ *
+ *  Shared between the ta_canbus_sim modes in sim_bench.c and the
+ *  microbenchmarks in sim_micro.c.
+ *
+ ***************************************************************************/
+#ifndef SIM_BENCH_H__
+#define SIM_BENCH_H__
+
+#include "sim_device.h"
+
+
+struct bench_config {
+
+    const char *mode;
+    unsigned long long frames;      /* Frames to inject / write */
+    unsigned int burst;             /* Frames per ISR */
+    unsigned int readers;           /* Open files reading */
+    unsigned int threads;           /* Threads in pool mode */
+    unsigned int devices;           /* Devices in multi mode */
+    unsigned int ext_percent;       /* Share of extended frames */
+    unsigned int rate;              /* Frames/sec for threads mode, 0 = flat out */
+    unsigned int pool_size;
+    int show_proc;
+};
+
+
+unsigned int bench_rand(void);
+u64 bench_ns(void);
+void make_frame(const struct bench_config *cfg, CANBUS_MESSAGE *message);
+void show_hist(const char *name, const struct can_histogram_t *hist);
+void drain_reader(struct file *filp);
+
+/*
+ *  sim_micro.c.  These return 0, or 1 if the consistency check failed.
+ */
+int bench_pool(const struct bench_config *cfg, struct sim_device *sim);
+int bench_drain(const struct bench_config *cfg, struct sim_device *sim);
+int bench_fanout(const struct bench_config *cfg, struct sim_device *sim);
+int bench_churn(const struct bench_config *cfg, struct sim_device *sim);
+int bench_group(const struct bench_config *cfg, struct sim_device *sim);
+int bench_classes(const struct bench_config *cfg, struct sim_device *sim);
+int bench_storm(const struct bench_config *cfg, struct sim_device *sim);
+int bench_multi(const struct bench_config *cfg, struct sim_device *sim);
+int bench_gateway(const struct bench_config *cfg, struct sim_device *sim);
+int bench_history(const struct bench_config *cfg, struct sim_device *sim);
+int bench_capture(const struct bench_config *cfg, struct sim_device *sim);
+int bench_splice(const struct bench_config *cfg, struct sim_device *sim);
+int bench_txerr(const struct bench_config *cfg, struct sim_device *sim);
+int bench_busoff(const struct bench_config *cfg, struct sim_device *sim);
+int bench_cyclic(const struct bench_config *cfg, struct sim_device *sim);
+int bench_timed(const struct bench_config *cfg, struct sim_device *sim);
+int bench_txcomplete(const struct bench_config *cfg, struct sim_device *sim);
+
+
+#endif
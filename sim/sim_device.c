@@ -0,0 +1,163 @@
+/****************************************************************************
+ *  sim_device.c
+ *
+ *  See sim_device.h.
+ *
+ ***************************************************************************/
+#include "sim_device.h"
+
+
+/*
+ *  What the i.MX6 PER clock runs the Flexcan at.
+ */
+#define SIM_CLOCK_FREQ      30000000
+
+
+
+struct sim_device *sim_device_create(int pool_size)
+{
+    struct sim_device *sim;
+    struct canbus_device_t *dev;
+
+    sim = calloc(1, sizeof(struct sim_device));
+    dev = calloc(1, sizeof(struct canbus_device_t));
+    if (!sim || !dev){
+        goto FAILED_ALLOC;
+    }
+
+    sim->model = flexcan_model_create(SIM_CLOCK_FREQ);
+    if (!sim->model){
+        goto FAILED_ALLOC;
+    }
+
+    dev->signature = CANBUS_DEVICE_SIGNATURE;
+    can_lock_init(&dev->register_lock);
+    can_lock_init(&dev->tx_lock);
+    can_lock_init(&dev->reader_lock);
+    INIT_LIST_HEAD(&dev->reader_list);
+    init_can_tx(dev);
+    init_can_cyclic(dev);
+    init_can_timed(dev);
+    init_can_errstate(dev);
+    init_can_gateway(dev);
+    init_can_groups(dev);
+    init_can_capture(dev);
+    dev->registers = &sim->model->regs;
+    dev->clock_freq = SIM_CLOCK_FREQ;
+
+    if (can_device_reserve(dev)){
+        goto FAILED_REGISTER;
+    }
+
+    init_can_event_log(dev);
+    init_can_status(dev);
+
+    if (init_kcanbus_message_pool(dev, pool_size)){
+        goto FAILED_POOL;
+    }
+
+    if (init_can_idstats(dev)){
+        goto FAILED_IDSTATS;
+    }
+
+    if (init_can_history(dev)){
+        goto FAILED_HISTORY;
+    }
+
+    hw_initialize_hardware(dev);
+
+    can_device_register(dev);
+
+    add_can_proc_files(dev);
+
+    sim->dev = dev;
+    sim->inode.i_cdev = &dev->cdev;
+
+    return sim;
+
+
+FAILED_HISTORY:
+    destroy_can_idstats(dev);
+
+FAILED_IDSTATS:
+    destroy_kcanbus_message_pool(dev);
+
+FAILED_POOL:
+    destroy_can_errstate(dev);
+    destroy_can_cyclic(dev);
+    destroy_can_timed(dev);
+    destroy_can_tx(dev);
+    destroy_can_status(dev);
+    destroy_can_event_log(dev);
+    can_device_release(dev);
+
+FAILED_REGISTER:
+    flexcan_model_destroy(sim->model);
+
+FAILED_ALLOC:
+    free(dev);
+    free(sim);
+    return NULL;
+}
+
+
+void sim_device_destroy(struct sim_device *sim)
+{
+    can_device_unregister(sim->dev);
+    destroy_can_gateway(sim->dev);
+    remove_can_proc_files(sim->dev);
+    destroy_can_capture(sim->dev);
+    destroy_can_history(sim->dev);
+    destroy_can_idstats(sim->dev);
+    destroy_can_status(sim->dev);
+    destroy_can_errstate(sim->dev);
+    destroy_can_cyclic(sim->dev);
+    destroy_can_timed(sim->dev);
+    destroy_can_tx(sim->dev);
+    destroy_kcanbus_message_pool(sim->dev);
+    destroy_can_event_log(sim->dev);
+    can_device_release(sim->dev);
+    flexcan_model_destroy(sim->model);
+
+    free(sim->dev);
+    free(sim);
+}
+
+
+int sim_device_service(struct sim_device *sim)
+{
+    if (!flexcan_model_irq_pending(sim->model)){
+        return 0;
+    }
+
+    can_irq_fn(0, sim->dev);
+
+    return 1;
+}
+
+
+struct file *sim_open(struct sim_device *sim)
+{
+    struct file *filp;
+
+    filp = calloc(1, sizeof(struct file));
+    if (!filp){
+        return NULL;
+    }
+
+    if (can_open(&sim->inode, filp)){
+        free(filp);
+        return NULL;
+    }
+
+    can_ioctl(filp, CAN_IOCTL_ENABLE_MESSAGE_ACCEPT, 0);
+
+    return filp;
+}
+
+
+void sim_close(struct sim_device *sim, struct file *filp)
+{
+    can_release(&sim->inode, filp);
+    free(filp);
+}
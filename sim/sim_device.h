@@ -0,0 +1,45 @@
+/****************************************************************************
+ *  sim_device.h
+ *
+ *  A canbus_device_t wired to a flexcan_model instead of real hardware,
+ *  plus stand-ins for open() / read() / write() / ioctl() on it.
+ *
+ *  Interrupts don't happen on their own.  Whoever plays the CPU calls
+ *  sim_device_service(), which runs can_irq_fn() if the model would be
+ *  asserting its IRQ line.
+ *
+ ***************************************************************************/
+#ifndef SIM_DEVICE_H__
+#define SIM_DEVICE_H__
+
+#include "flexcan_model.h"
+
+
+struct sim_device {
+
+    struct canbus_device_t *dev;
+    struct flexcan_model *model;
+    struct inode inode;             /* What can_open() is handed */
+};
+
+
+/*
+ *  The software half of flexcan_probe() / flexcan_remove().  Each
+ *  device is independent, the first is ta_canbus0, the next ta_canbus1.
+ */
+struct sim_device *sim_device_create(int pool_size);
+void sim_device_destroy(struct sim_device *sim);
+
+/*
+ *  Run the ISR if the IRQ line is asserted.  Returns 1 if it ran.
+ */
+int sim_device_service(struct sim_device *sim);
+
+/*
+ *  File handles.  sim_open() also turns on message accept.
+ */
+struct file *sim_open(struct sim_device *sim);
+void sim_close(struct sim_device *sim, struct file *filp);
+
+
+#endif
@@ -0,0 +1,177 @@
+/****************************************************************************
+ *  sim_io.c
+ *
+ *  ta_canbus_bench backend for the host build:  the bench's read() /
+ *  write() / ioctl() go straight to the driver's file operations on a
+ *  sim_device, and a service thread plays the interrupt line.
+ *
+ *  Set TA_CANBUS_SIM_POOL to change the message pool size.
+ *
+ ***************************************************************************/
+#include <sched.h>
+
+#include "sim_device.h"
+#include "../bench/bench_io.h"
+
+
+#define SIM_IO_MAX_FILES    64
+
+
+static struct sim_device *sim;
+static struct file *files[SIM_IO_MAX_FILES];
+static pthread_t service_thread;
+static int service_stop;
+
+
+
+/*
+ *  Run the ISR whenever the model asserts its interrupt, and the
+ *  deferred work (event log) when there is nothing else to do.
+ */
+static void *service_fn(void *arg)
+{
+    (void)arg;
+
+    while (!__atomic_load_n(&service_stop, __ATOMIC_ACQUIRE)){
+        if (!sim_device_service(sim)){
+            kernel_shim_run_work();
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+
+static struct file *sim_io_file(int handle)
+{
+    if (handle < 0 || handle >= SIM_IO_MAX_FILES){
+        return NULL;
+    }
+    return files[handle];
+}
+
+
+/*
+ *  Like sim_open(), without turning on message accept,
+ *  the bench does that itself.
+ */
+static int sim_io_open(void)
+{
+    struct file *filp;
+    int handle;
+    int ret;
+
+    for (handle = 0; handle<SIM_IO_MAX_FILES; handle++){
+        if (!files[handle]){
+            break;
+        }
+    }
+    if (handle == SIM_IO_MAX_FILES){
+        return -EMFILE;
+    }
+
+    filp = calloc(1, sizeof(struct file));
+    if (!filp){
+        return -ENOMEM;
+    }
+
+    ret = can_open(&sim->inode, filp);
+    if (ret){
+        free(filp);
+        return ret;
+    }
+
+    files[handle] = filp;
+
+    return handle;
+}
+
+
+static void sim_io_close(int handle)
+{
+    struct file *filp = sim_io_file(handle);
+
+    if (filp){
+        files[handle] = NULL;
+        sim_close(sim, filp);
+    }
+}
+
+
+static ssize_t sim_io_read(int handle, CANBUS_MESSAGE *message)
+{
+    ssize_t ret;
+
+    ret = can_read(sim_io_file(handle), (char *)message, sizeof(CANBUS_MESSAGE), NULL);
+
+    return (ret == -ERESTARTSYS) ? -EINTR : ret;
+}
+
+
+static ssize_t sim_io_write(int handle, const CANBUS_MESSAGE *message)
+{
+    return can_write(sim_io_file(handle), (const char *)message, sizeof(CANBUS_MESSAGE), NULL);
+}
+
+
+static int sim_io_ioctl(int handle, unsigned long request, void *arg)
+{
+    return (int)can_ioctl(sim_io_file(handle), (unsigned int)request, (unsigned long)arg);
+}
+
+
+/*
+ *  There is only the one "signal", every blocked reader sees it.
+ */
+static void sim_io_interrupt(pthread_t thread)
+{
+    (void)thread;
+    kernel_shim_signal_all();
+}
+
+
+static void sim_io_resume(void)
+{
+    kernel_shim_signal_clear();
+}
+
+
+static void sim_io_shutdown(void)
+{
+    __atomic_store_n(&service_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(service_thread, NULL);
+
+    sim_device_destroy(sim);
+}
+
+
+static const struct bench_io sim_io = {
+    .name =         "sim",
+    .open =         sim_io_open,
+    .close =        sim_io_close,
+    .read =         sim_io_read,
+    .write =        sim_io_write,
+    .ioctl =        sim_io_ioctl,
+    .interrupt =    sim_io_interrupt,
+    .resume =       sim_io_resume,
+    .shutdown =     sim_io_shutdown,
+};
+
+
+const struct bench_io *bench_io_start(const char *device)
+{
+    const char *pool = getenv("TA_CANBUS_SIM_POOL");
+
+    (void)device;
+
+    sim = sim_device_create(pool ? atoi(pool) : 10000);
+    if (!sim){
+        fprintf(stderr, "sim_device_create failed\n");
+        return NULL;
+    }
+
+    pthread_create(&service_thread, NULL, service_fn, NULL);
+
+    return &sim_io;
+}
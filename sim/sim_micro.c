@@ -0,0 +1,3974 @@
+/****************************************************************************
+ *  sim_micro.c
+ *
+ *  Microbenchmarks of the pieces under the hot paths, as a baseline for
+ *  reworking them.  Each also checks that the piece did its job, and
+ *  the mode fails (exit status 1) if it didn't.
+ *
+ *      pool    alloc_kcanbus_message() / free_kcanbus_message() ns/op,
+ *              alone and from several threads at once.  Checks that the
+ *              pool holds exactly -P messages, that no message is handed
+ *              out twice, and that they all come back.
+ *
+ *      drain   The ISR's mailbox drain and timestamp sort.  First places
+ *              frames in random mailboxes with exact timestamps, across
+ *              the 16 bit TIMER wrap, and checks they are read back in
+ *              arrival order.  Then times the ISR against the number of
+ *              full mailboxes.
+ *
+ *      fanout  Delivery of every frame to 1, 2, 4 .. -r readers.  Times
+ *              the ISR and checks each reader gets every frame, in order.
+ *
+ *      churn   Delivery to one reader while another thread opens and
+ *              closes files as fast as it can, each closed with frames
+ *              still queued.  Times the ISR with and without the churn,
+ *              and checks the reader gets every frame in order and that
+ *              every closed file's frames go back to the pool.
+ *
+ *      group   A consumer group of -r members (at least 4), round robin
+ *              and then by ID hash.  Partway through one member leaves,
+ *              one closes with frames unread and a new one joins.
+ *              Checks every frame is read by exactly one member, and
+ *              with the hash that each ID stays in order.  Reports the
+ *              ISR with -r plain readers and with the group.
+ *
+ *      classes Files choosing what they receive, during an error storm
+ *              with self reception on.  Checks a data only file gets no
+ *              status changes or echoes, an echo only file gets exactly
+ *              what was written, and a status event file nothing queued
+ *              but its eventfd and latest status.  Reports the ISR with
+ *              -r files opted out of everything against none at all.
+ *
+ *      storm   An error interrupt per ISR, as with the bus unplugged.
+ *              Checks -r readers (at least 4) that don't read hold one
+ *              pool message each with every change ORed in and counted,
+ *              and that a reader with a 20 ms interval gets no more 
+ *              records than that allows, with nothing missing.  Reports
+ *              the ISR and the storm statistics.
+ *
+ *      multi   -D devices, each with its own thread running its ISR and
+ *              a reader, first one alone and then all at once.  Checks
+ *              each reader gets all of its own device's frames, in order,
+ *              and none of another's.
+ *
+ *      gateway A route from the first device to a second one that
+ *              rewrites the ID and one data byte.  Checks the second
+ *              device transmits every matching frame, rewritten and in
+ *              order, and nothing else, and that the route goes away
+ *              with its destination.  Reports the forwarding latency.
+ *
+ *      history Frames with nobody reading, then CAN_IOCTL_GET_HISTORY
+ *              from a late opener: everything, from a sequence number
+ *              and from a timestamp.  Checks the frames come back in
+ *              order with nothing missing and the lapped ones counted.
+ *              Reports the ISR with the ring off and on.
+ *
+ *      capture Triggered capture on a frame, with a decoy that only
+ *              half matches, then on a bus off.  Checks the frozen
+ *              window is exactly pre + trigger + post, through the
+ *              ioctl and mmap(), that it stays frozen until re-armed,
+ *              and that a mapped buffer can't be resized.  Reports the
+ *              ISR with capture off and armed.
+ *
+ *      splice  Logging every frame to a file as struct can_log_record_t,
+ *              with read() and write() per frame, with read() per frame
+ *              and write() per page, and with splice() through a pipe.
+ *              Checks the file holds every frame once, in order, and
+ *              reports each logger's CPU time per frame over the ISR's,
+ *              and what that comes to on a fully loaded 1 Mbps bus.
+ *              Driver calls are plain function calls here, on a board
+ *              each read() and splice() is a system call as well.
+ *
+ ***************************************************************************/
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "sim_bench.h"
+
+
+#define NUM_RX_MB           (FLEXCAN_NUM_MESSAGE_BUFFERS - FIRST_RX_MB)
+
+/*
+ *  Most messages a pool thread holds at once.
+ */
+#define POOL_HOLD_MAX       16
+
+/*
+ *  Largest gap between timestamps in the ordering check, so that all
+ *  of a full set of mailboxes fits inside one TIMER wrap.
+ */
+#define ORDER_MAX_GAP       1000
+
+#define ORDER_TRIALS        20000
+
+#define DRAIN_ITERATIONS    10000
+
+
+struct pool_thread {
+
+    pthread_t thread;
+    struct canbus_device_t *dev;
+    unsigned int id;
+    unsigned int rand_state;
+    unsigned long long iterations;
+    unsigned long long ops;
+    unsigned long long empty;       /* alloc returned NULL */
+    unsigned long long corrupt;     /* Someone else wrote our message */
+    u64 elapsed_ns;
+};
+
+
+static unsigned int thread_rand(unsigned int *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return *state >> 1;
+}
+
+
+/*
+ *  A standard frame with can_id carrying seq in Data[0..3].
+ */
+static void seq_frame(unsigned int can_id, unsigned int seq, CANBUS_MESSAGE *message)
+{
+    memset(message, 0, sizeof(CANBUS_MESSAGE));
+
+    message->Type = CmtStandard;
+    message->Id = can_id << 18;
+    message->DataLength = 8;
+    message->Data[0] = (unsigned char)(seq >> 24);
+    message->Data[1] = (unsigned char)(seq >> 16);
+    message->Data[2] = (unsigned char)(seq >> 8);
+    message->Data[3] = (unsigned char)seq;
+}
+
+
+static unsigned int frame_seq(const CANBUS_MESSAGE *message)
+{
+    return ((unsigned int)message->Data[0] << 24) |
+           ((unsigned int)message->Data[1] << 16) |
+           ((unsigned int)message->Data[2] << 8) |
+           (unsigned int)message->Data[3];
+}
+
+
+/*
+ *  Read whatever is queued, checking it continues from *next_seq.
+ *  Returns the number of frames out of order.
+ */
+static unsigned int read_in_order(struct file *filp, unsigned int *next_seq)
+{
+    struct canbus_file_t *file = filp->private_data;
+    CANBUS_MESSAGE message;
+    unsigned int bad = 0;
+
+    while (file->stats.cur_rx_queue_count){
+        can_read(filp, (char *)&message, sizeof(message), NULL);
+        if (frame_seq(&message) != *next_seq){
+            bad++;
+        }
+        *next_seq = frame_seq(&message) + 1;
+    }
+
+    return bad;
+}
+
+
+static void show_result(const char *name, int failed)
+{
+    printf("%-20s %s\n", name, failed ? "FAILED" : "ok");
+}
+
+
+
+/****************************************************************************
+ *  pool mode
+ */
+static void *pool_thread_fn(void *arg)
+{
+    struct pool_thread *t = arg;
+    struct kcanbus_message *held[POOL_HOLD_MAX];
+    unsigned long long it;
+    unsigned int count;
+    unsigned int n;
+    unsigned int i;
+    u64 start_ns;
+
+    start_ns = bench_ns();
+
+    for (it = 0; it<t->iterations; it++){
+
+        n = 1 + thread_rand(&t->rand_state) % POOL_HOLD_MAX;
+
+        for (count = 0; count<n; count++){
+            held[count] = alloc_kcanbus_message(t->dev);
+            t->ops++;
+            if (!held[count]){
+                t->empty++;
+                break;
+            }
+            held[count]->user_message.Id = t->id;
+            held[count]->user_message.DataLength = count;
+        }
+
+        if (!(thread_rand(&t->rand_state) % 4)){
+            sched_yield();
+        }
+
+        for (i = 0; i<count; i++){
+            if (held[i]->user_message.Id != t->id || held[i]->user_message.DataLength != i){
+                t->corrupt++;
+            }
+            free_kcanbus_message(t->dev, held[i]);
+            t->ops++;
+        }
+    }
+
+    t->elapsed_ns = bench_ns() - start_ns;
+
+    return NULL;
+}
+
+
+int bench_pool(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct kcanbus_message **msgs;
+    struct pool_thread *threads;
+    unsigned int thread_count = cfg->threads ? cfg->threads : 1;
+    unsigned long long ops = 0;
+    unsigned long long empty = 0;
+    unsigned long long corrupt = 0;
+    u64 elapsed_ns = 0;
+    u64 start_ns;
+    u64 alloc_ns;
+    int pool_size;
+    int pool_free;
+    int allocated;
+    int failed = 0;
+    unsigned long long i;
+
+    msgs = calloc(cfg->pool_size + 1, sizeof(struct kcanbus_message *));
+    threads = calloc(thread_count, sizeof(struct pool_thread));
+    if (!msgs || !threads){
+        free(msgs);
+        free(threads);
+        return 1;
+    }
+
+    /*
+     *  One alloc and its free, over and over.
+     */
+    start_ns = bench_ns();
+    for (i = 0; i<cfg->frames; i++){
+        free_kcanbus_message(sim->dev, alloc_kcanbus_message(sim->dev));
+    }
+    printf("alloc+free pair      %llu ns/op\n", cfg->frames ? (bench_ns() - start_ns) / (cfg->frames * 2) : 0);
+
+    /*
+     *  Empty the pool, then fill it again.  It must hold exactly pool_size.
+     */
+    start_ns = bench_ns();
+    for (allocated = 0; allocated <= (int)cfg->pool_size; allocated++){
+        msgs[allocated] = alloc_kcanbus_message(sim->dev);
+        if (!msgs[allocated]){
+            break;
+        }
+    }
+    alloc_ns = bench_ns() - start_ns;
+
+    start_ns = bench_ns();
+    for (i = 0; i<(unsigned long long)allocated; i++){
+        free_kcanbus_message(sim->dev, msgs[i]);
+    }
+    printf("alloc whole pool     %llu ns/op\n", allocated ? alloc_ns / allocated : 0);
+    printf("free whole pool      %llu ns/op\n", allocated ? (bench_ns() - start_ns) / allocated : 0);
+
+    show_result("pool size exact", allocated != (int)cfg->pool_size);
+    failed |= allocated != (int)cfg->pool_size;
+
+    /*
+     *  Everyone at once.
+     */
+    for (i = 0; i<thread_count; i++){
+        threads[i].dev = sim->dev;
+        threads[i].id = (unsigned int)i + 1;
+        threads[i].rand_state = (unsigned int)i * 7919 + 1;
+        threads[i].iterations = cfg->frames / POOL_HOLD_MAX / thread_count + 1;
+        pthread_create(&threads[i].thread, NULL, pool_thread_fn, &threads[i]);
+    }
+    for (i = 0; i<thread_count; i++){
+        pthread_join(threads[i].thread, NULL);
+        ops += threads[i].ops;
+        empty += threads[i].empty;
+        corrupt += threads[i].corrupt;
+        if (threads[i].elapsed_ns > elapsed_ns){
+            elapsed_ns = threads[i].elapsed_ns;
+        }
+    }
+
+    printf("%u threads            %llu ops, %llu ns/op, %llu empty\n",
+            thread_count, ops, ops ? elapsed_ns / ops : 0, empty);
+
+    show_result("no double handout", corrupt != 0);
+    failed |= corrupt != 0;
+
+    kcanbus_message_pool_usage(sim->dev, &pool_size, &pool_free);
+    show_result("all returned", pool_free != pool_size || pool_size != (int)cfg->pool_size);
+    failed |= pool_free != pool_size || pool_size != (int)cfg->pool_size;
+
+    free(threads);
+    free(msgs);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  drain mode
+ */
+
+/*
+ *  Frames go into random mailboxes, so mailbox order is not arrival
+ *  order, with timestamps that may wrap, then the ISR runs at a TIMER
+ *  0-3 bit times after the last one arrived.
+ */
+static int check_drain_order(struct sim_device *sim, struct file *filp)
+{
+    CANBUS_MESSAGE message;
+    int mbs[NUM_RX_MB];
+    unsigned int next_seq;
+    unsigned int timer;
+    unsigned int count;
+    unsigned int trial;
+    unsigned int bad_trials = 0;
+    unsigned int wrapped = 0;
+    unsigned int wraps;
+    unsigned int i, j;
+    int tmp;
+
+    for (trial = 0; trial<ORDER_TRIALS; trial++){
+
+        count = 1 + bench_rand() % NUM_RX_MB;
+
+        for (i = 0; i<NUM_RX_MB; i++){
+            mbs[i] = FIRST_RX_MB + i;
+        }
+        for (i = 0; i<count; i++){
+            j = i + bench_rand() % (NUM_RX_MB - i);
+            tmp = mbs[i];
+            mbs[i] = mbs[j];
+            mbs[j] = tmp;
+        }
+
+        timer = bench_rand() & TIMER_MASK;
+        wraps = 0;
+
+        for (i = 0; i<count; i++){
+            timer = (timer + 1 + bench_rand() % ORDER_MAX_GAP) & TIMER_MASK;
+            if (i && timer < ORDER_MAX_GAP){
+                wraps = 1;
+            }
+            flexcan_model_hold_timer(sim->model, 1, timer);
+            seq_frame(0x100, i, &message);
+            flexcan_model_receive_mb(sim->model, &message, mbs[i]);
+        }
+
+        wrapped += wraps;
+
+        flexcan_model_hold_timer(sim->model, 1, (timer + bench_rand() % 4) & TIMER_MASK);
+
+        sim_device_service(sim);
+
+        next_seq = 0;
+        if (read_in_order(filp, &next_seq) || next_seq != count){
+            bad_trials++;
+        }
+    }
+
+    flexcan_model_hold_timer(sim->model, 0, timer);
+
+    printf("drain order          %u trials, %u across a TIMER wrap, %u out of order\n",
+            ORDER_TRIALS, wrapped, bad_trials);
+
+    return bad_trials != 0;
+}
+
+
+int bench_drain(const struct bench_config *cfg, struct sim_device *sim)
+{
+    static const unsigned int occupancies[] = { 1, 2, 4, 8, 16, 32, NUM_RX_MB };
+    struct can_histogram_t *hist;
+    struct file **files;
+    CANBUS_MESSAGE message;
+    unsigned int occupancy;
+    unsigned int it;
+    unsigned int i, r;
+    u64 start_ns;
+    u64 p50;
+    int failed;
+
+    hist = malloc(sizeof(struct can_histogram_t));
+    files = calloc(cfg->readers + 1, sizeof(struct file *));
+    if (!hist || !files){
+        free(hist);
+        free(files);
+        return 1;
+    }
+
+    files[0] = sim_open(sim);
+    for (r = 1; r<cfg->readers; r++){
+        files[r] = sim_open(sim);
+    }
+
+    failed = check_drain_order(sim, files[0]);
+    show_result("drain order", failed);
+
+    for (r = 1; r<cfg->readers; r++){
+        drain_reader(files[r]);
+    }
+
+    printf("%u readers\n", cfg->readers ? cfg->readers : 1);
+
+    for (i = 0; i<sizeof(occupancies) / sizeof(occupancies[0]); i++){
+
+        occupancy = occupancies[i];
+        memset(hist, 0, sizeof(struct can_histogram_t));
+
+        for (it = 0; it<DRAIN_ITERATIONS; it++){
+
+            for (r = 0; r<occupancy; r++){
+                make_frame(cfg, &message);
+                flexcan_model_receive(sim->model, &message);
+            }
+
+            start_ns = bench_ns();
+            sim_device_service(sim);
+            can_histogram_add(hist, bench_ns() - start_ns);
+
+            for (r = 0; r<cfg->readers || r == 0; r++){
+                drain_reader(files[r]);
+            }
+        }
+
+        p50 = can_histogram_percentile(hist, 500000);
+        printf("occupancy %-2u         isr p50 %6llu ns  p99 %6llu ns  %5llu ns/mailbox\n",
+                occupancy, p50, can_histogram_percentile(hist, 990000), p50 / occupancy);
+    }
+
+    for (r = 0; r<cfg->readers || r == 0; r++){
+        sim_close(sim, files[r]);
+    }
+    free(files);
+    free(hist);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  fanout mode
+ */
+static int fanout_step(const struct bench_config *cfg, struct sim_device *sim, unsigned int readers)
+{
+    struct can_histogram_t *hist;
+    struct file **files;
+    unsigned int *next_seq;
+    CANBUS_MESSAGE message;
+    unsigned long long frames = cfg->frames / readers;
+    unsigned long long seq = 0;
+    unsigned long long bad = 0;
+    unsigned long long lost = 0;
+    unsigned int i, r;
+    u64 start_ns;
+    u64 p50;
+
+    if (frames < cfg->burst){
+        frames = cfg->burst;
+    }
+
+    hist = calloc(1, sizeof(struct can_histogram_t));
+    files = calloc(readers, sizeof(struct file *));
+    next_seq = calloc(readers, sizeof(unsigned int));
+    if (!hist || !files || !next_seq){
+        free(hist);
+        free(files);
+        free(next_seq);
+        return 1;
+    }
+
+    for (r = 0; r<readers; r++){
+        files[r] = sim_open(sim);
+    }
+
+    while (seq < frames){
+
+        for (i = 0; i<cfg->burst && seq < frames; i++){
+            seq_frame(0x100, (unsigned int)seq++, &message);
+            flexcan_model_receive(sim->model, &message);
+        }
+
+        start_ns = bench_ns();
+        sim_device_service(sim);
+        can_histogram_add(hist, bench_ns() - start_ns);
+
+        for (r = 0; r<readers; r++){
+            bad += read_in_order(files[r], &next_seq[r]);
+        }
+    }
+
+    for (r = 0; r<readers; r++){
+        lost += frames - next_seq[r];
+        sim_close(sim, files[r]);
+    }
+
+    p50 = can_histogram_percentile(hist, 500000);
+    printf("readers %-3u          isr p50 %7llu ns  p99 %7llu ns  %5llu ns/frame/reader  %llu lost  %llu out of order\n",
+            readers, p50, can_histogram_percentile(hist, 990000),
+            p50 / (cfg->burst * readers), lost, bad);
+
+    free(next_seq);
+    free(files);
+    free(hist);
+
+    return bad || lost;
+}
+
+
+int bench_fanout(const struct bench_config *cfg, struct sim_device *sim)
+{
+    unsigned int max_readers = cfg->readers ? cfg->readers : 1;
+    unsigned int readers;
+    int failed = 0;
+
+    printf("burst %u\n", cfg->burst);
+
+    for (readers = 1; readers < max_readers; readers *= 2){
+        failed |= fanout_step(cfg, sim, readers);
+    }
+    failed |= fanout_step(cfg, sim, max_readers);
+
+    show_result("fanout delivery", failed);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  churn mode
+ */
+struct churn_thread {
+
+    pthread_t thread;
+    struct sim_device *sim;
+    volatile int stop;
+    unsigned long long opens;
+};
+
+
+static void *churn_fn(void *arg)
+{
+    struct churn_thread *churn = arg;
+
+    while (!churn->stop){
+        sim_close(churn->sim, sim_open(churn->sim));
+        churn->opens++;
+    }
+
+    return NULL;
+}
+
+
+static unsigned long long churn_run( const struct bench_config *cfg, struct sim_device *sim,
+                                     const char *name, int churning)
+{
+    struct can_histogram_t *hist;
+    struct churn_thread churn;
+    struct file *filp;
+    CANBUS_MESSAGE message;
+    unsigned long long seq = 0;
+    unsigned long long bad = 0;
+    unsigned int next_seq = 0;
+    unsigned int i;
+    u64 start_ns;
+    u64 elapsed_ns;
+
+    hist = calloc(1, sizeof(struct can_histogram_t));
+    if (!hist){
+        return 1;
+    }
+
+    filp = sim_open(sim);
+
+    memset(&churn, 0, sizeof(churn));
+    churn.sim = sim;
+    if (churning){
+        pthread_create(&churn.thread, NULL, churn_fn, &churn);
+    }
+
+    elapsed_ns = bench_ns();
+
+    while (seq < cfg->frames){
+
+        for (i = 0; i<cfg->burst && seq < cfg->frames; i++){
+            seq_frame(0x100, (unsigned int)seq++, &message);
+            flexcan_model_receive(sim->model, &message);
+        }
+
+        start_ns = bench_ns();
+        sim_device_service(sim);
+        can_histogram_add(hist, bench_ns() - start_ns);
+
+        bad += read_in_order(filp, &next_seq);
+
+        /*
+         *  Let the other thread in, there may be only one CPU.
+         */
+        if (churning && !(seq % (cfg->burst * 16))){
+            sched_yield();
+        }
+    }
+
+    elapsed_ns = bench_ns() - elapsed_ns;
+
+    if (churning){
+        churn.stop = 1;
+        pthread_join(churn.thread, NULL);
+    }
+
+    sim_close(sim, filp);
+
+    printf("%-20s isr p50 %7llu ns  p99 %7llu ns  max %8llu ns  %llu opens/s  %llu lost  %llu out of order\n",
+            name,
+            can_histogram_percentile(hist, 500000),
+            can_histogram_percentile(hist, 990000),
+            hist->max,
+            elapsed_ns ? churn.opens * NSEC_PER_SEC / elapsed_ns : 0,
+            cfg->frames - next_seq, bad);
+
+    free(hist);
+
+    return bad + (cfg->frames - next_seq);
+}
+
+
+int bench_churn(const struct bench_config *cfg, struct sim_device *sim)
+{
+    int pool_size;
+    int pool_free;
+    int failed = 0;
+
+    printf("burst %u\n", cfg->burst);
+
+    failed |= churn_run(cfg, sim, "no churn", 0) != 0;
+    failed |= churn_run(cfg, sim, "open/close churn", 1) != 0;
+
+    show_result("reader delivery", failed);
+
+    kcanbus_message_pool_usage(sim->dev, &pool_size, &pool_free);
+    show_result("all returned", pool_free != pool_size);
+    failed |= pool_free != pool_size;
+
+    printf("%-20s acquired %llu, contended %llu\n", "ReaderLock",
+            sim->dev->reader_lock.stats.acquired, sim->dev->reader_lock.stats.contended);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  group mode
+ */
+#define GROUP_IDS           64      /* Frames cycle through IDs 0x100 .. 0x13F */
+#define GROUP_READ_EVERY    8       /* ISRs between reads, so members hold unread frames */
+#define GROUP_RECYCLE       64      /* Frames a plain reader gets from recycled group frames */
+
+struct group_check {
+
+    unsigned char *seen;            /* Per frame, times a member read it */
+    unsigned int next_seq[GROUP_IDS];
+    int ordered;                    /* Check each ID stays in order */
+    unsigned long long out_of_order;
+};
+
+
+static void group_read(struct file *filp, struct group_check *check)
+{
+    struct canbus_file_t *file = filp->private_data;
+    CANBUS_MESSAGE message;
+    unsigned int seq;
+    unsigned int id;
+
+    while (file->stats.cur_rx_queue_count){
+
+        can_read(filp, (char *)&message, sizeof(message), NULL);
+
+        seq = frame_seq(&message);
+        id = (can_frame_id(&message) - 0x100) % GROUP_IDS;
+
+        if (check->seen[seq] < 255){
+            check->seen[seq]++;
+        }
+
+        if (check->ordered && seq < check->next_seq[id]){
+            check->out_of_order++;
+        }
+        check->next_seq[id] = seq + 1;
+    }
+}
+
+
+/*
+ *  Frames through the ISR to members plain readers, or to a group of
+ *  them.  Returns the ISR's p50.
+ */
+static u64 group_isr(const struct bench_config *cfg, struct sim_device *sim, 
+                     unsigned int members, int grouped)
+{
+    struct can_group_config_t config;
+    struct can_histogram_t *hist;
+    struct file *files[CAN_GROUP_MAX_MEMBERS];
+    CANBUS_MESSAGE message;
+    unsigned long long seq = 0;
+    unsigned int i;
+    u64 start_ns;
+    u64 p50;
+
+    hist = calloc(1, sizeof(struct can_histogram_t));
+    if (!hist){
+        return 0;
+    }
+
+    memset(&config, 0, sizeof(config));
+    strcpy(config.name, "isr");
+    config.policy = CAN_GROUP_ROUND_ROBIN;
+
+    for (i = 0; i<members; i++){
+        files[i] = sim_open(sim);
+        if (grouped){
+            can_ioctl(files[i], CAN_IOCTL_JOIN_GROUP, (unsigned long)&config);
+        }
+    }
+
+    while (seq < cfg->frames / 4){
+
+        for (i = 0; i<cfg->burst; i++){
+            seq_frame(0x100, (unsigned int)seq++, &message);
+            flexcan_model_receive(sim->model, &message);
+        }
+
+        start_ns = bench_ns();
+        sim_device_service(sim);
+        can_histogram_add(hist, bench_ns() - start_ns);
+
+        for (i = 0; i<members; i++){
+            drain_reader(files[i]);
+        }
+    }
+
+    for (i = 0; i<members; i++){
+        sim_close(sim, files[i]);
+    }
+
+    p50 = can_histogram_percentile(hist, 500000);
+    free(hist);
+
+    return p50;
+}
+
+
+static int group_run(const struct bench_config *cfg, struct sim_device *sim, 
+                     unsigned int members, unsigned int policy)
+{
+    struct can_group_config_t config;
+    struct can_group_stats_t stats;
+    struct group_check check;
+    struct file *files[CAN_GROUP_MAX_MEMBERS];
+    CANBUS_MESSAGE message;
+    unsigned long long seq = 0;
+    unsigned long long missing = 0;
+    unsigned long long twice = 0;
+    unsigned int num_files = members;
+    unsigned int isrs = 0;
+    unsigned int unread = 0;
+    int left = 0;
+    int closed = 0;
+    int joined = 0;
+    int failed = 0;
+    unsigned int i;
+
+    memset(&check, 0, sizeof(check));
+    check.seen = calloc(cfg->frames, 1);
+    check.ordered = policy == CAN_GROUP_HASH_ID;
+    if (!check.seen){
+        return 1;
+    }
+
+    memset(&config, 0, sizeof(config));
+    strcpy(config.name, policy == CAN_GROUP_HASH_ID ? "hash" : "rr");
+    config.policy = policy;
+
+    for (i = 0; i<members; i++){
+        files[i] = sim_open(sim);
+        failed |= can_ioctl(files[i], CAN_IOCTL_JOIN_GROUP, (unsigned long)&config) != 0;
+    }
+
+    while (seq < cfg->frames){
+
+        for (i = 0; i<cfg->burst && seq < cfg->frames; i++){
+            seq_frame(0x100 + (unsigned int)(seq % GROUP_IDS), (unsigned int)seq, &message);
+            flexcan_model_receive(sim->model, &message);
+            seq++;
+        }
+
+        sim_device_service(sim);
+
+        /*
+         *  A third of the way in the first member leaves, which must
+         *  leave it nothing to read.  Half way the second just closes,
+         *  and two thirds of the way a new one joins.
+         */
+        if (!left && seq >= cfg->frames / 3){
+            failed |= can_ioctl(files[0], CAN_IOCTL_LEAVE_GROUP, 0) != 0;
+            failed |= ((struct canbus_file_t *)files[0]->private_data)->stats.cur_rx_queue_count != 0;
+            sim_close(sim, files[0]);
+            files[0] = NULL;
+            left = 1;
+        }
+
+        if (!closed && seq >= cfg->frames / 2){
+            unread = ((struct canbus_file_t *)files[1]->private_data)->stats.cur_rx_queue_count;
+            sim_close(sim, files[1]);
+            files[1] = NULL;
+            closed = 1;
+        }
+
+        if (!joined && seq >= cfg->frames * 2 / 3){
+            files[num_files] = sim_open(sim);
+            failed |= can_ioctl(files[num_files], CAN_IOCTL_JOIN_GROUP, (unsigned long)&config) != 0;
+            num_files++;
+            joined = 1;
+        }
+
+        if (!(++isrs % GROUP_READ_EVERY)){
+            for (i = 0; i<num_files; i++){
+                if (files[i]){
+                    group_read(files[i], &check);
+                }
+            }
+        }
+    }
+
+    for (i = 0; i<num_files; i++){
+        if (files[i]){
+            group_read(files[i], &check);
+        }
+    }
+
+    for (seq = 0; seq < cfg->frames; seq++){
+        missing += !check.seen[seq];
+        twice += check.seen[seq] > 1;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    strcpy(stats.name, config.name);
+    failed |= can_ioctl(files[2], CAN_IOCTL_GET_GROUP_STATS, (unsigned long)&stats) != 0;
+
+    printf("%-20s %llu frames, %llu requeued (%u unread at close), members",
+            policy == CAN_GROUP_HASH_ID ? "hash by id" : "round robin",
+            stats.frames, stats.requeued, unread);
+    for (i = 0; i<stats.num_members; i++){
+        printf(" %llu", stats.member_frames[i]);
+    }
+    printf("\n%-20s %llu missing, %llu read twice, %llu out of order\n", "", 
+            missing, twice, check.out_of_order);
+
+    failed |= missing || twice || check.out_of_order || stats.frames != cfg->frames;
+
+    for (i = 0; i<num_files; i++){
+        if (files[i]){
+            sim_close(sim, files[i]);
+        }
+    }
+
+    /*
+     *  The group went with its last member.
+     */
+    files[0] = sim_open(sim);
+    failed |= can_ioctl(files[0], CAN_IOCTL_GET_GROUP_STATS, (unsigned long)&stats) != -ENOENT;
+    sim_close(sim, files[0]);
+
+    free(check.seen);
+
+    return failed;
+}
+
+
+/*
+ *  Group frames go back to the pool, and come out again as a plain
+ *  reader's.  Joining and leaving must leave that reader its frames.
+ */
+static int group_recycle(struct sim_device *sim)
+{
+    struct can_group_config_t config;
+    struct file *members[2];
+    struct file *plain;
+    struct canbus_file_t *file;
+    struct kcanbus_message *message;
+    struct group_check check;
+    CANBUS_MESSAGE frame;
+    unsigned int flagged = 0;
+    unsigned int kept;
+    unsigned int i;
+    int failed = 0;
+
+    memset(&check, 0, sizeof(check));
+    check.seen = calloc(GROUP_RECYCLE * 2, 1);
+    if (!check.seen){
+        return 1;
+    }
+
+    memset(&config, 0, sizeof(config));
+    strcpy(config.name, "recycle");
+    config.policy = CAN_GROUP_ROUND_ROBIN;
+
+    for (i = 0; i<2; i++){
+        members[i] = sim_open(sim);
+        failed |= can_ioctl(members[i], CAN_IOCTL_JOIN_GROUP, (unsigned long)&config) != 0;
+    }
+
+    for (i = 0; i<GROUP_RECYCLE; i++){
+        seq_frame(0x100, i, &frame);
+        flexcan_model_receive(sim->model, &frame);
+        sim_device_service(sim);
+    }
+
+    for (i = 0; i<2; i++){
+        drain_reader(members[i]);
+    }
+
+    /*
+     *  The pool hands the group's frames out first.
+     */
+    plain = sim_open(sim);
+    file = plain->private_data;
+
+    for (i = GROUP_RECYCLE; i<GROUP_RECYCLE * 2; i++){
+        seq_frame(0x100, i, &frame);
+        flexcan_model_receive(sim->model, &frame);
+        sim_device_service(sim);
+    }
+
+    list_for_each_entry(message, &file->receive_queue, entry){
+        flagged += !!(message->flags & KCANBUS_GROUP);
+    }
+
+    failed |= can_ioctl(plain, CAN_IOCTL_JOIN_GROUP, (unsigned long)&config) != 0;
+    failed |= can_ioctl(plain, CAN_IOCTL_LEAVE_GROUP, 0) != 0;
+
+    kept = file->stats.cur_rx_queue_count;
+    group_read(plain, &check);
+
+    for (i = GROUP_RECYCLE; i<GROUP_RECYCLE * 2; i++){
+        failed |= check.seen[i] != 1;
+    }
+
+    printf("%-20s %u of %u plain frames flagged, %u kept after join and leave\n",
+            "recycled", flagged, GROUP_RECYCLE, kept);
+
+    failed |= flagged || kept != GROUP_RECYCLE;
+
+    sim_close(sim, plain);
+    for (i = 0; i<2; i++){
+        sim_close(sim, members[i]);
+    }
+
+    free(check.seen);
+
+    return failed;
+}
+
+
+int bench_group(const struct bench_config *cfg, struct sim_device *sim)
+{
+    unsigned int members = cfg->readers;
+    u64 plain_ns;
+    u64 group_ns;
+    int failed = 0;
+
+    if (members < 4){
+        members = 4;
+    }
+    if (members > CAN_GROUP_MAX_MEMBERS - 1){
+        members = CAN_GROUP_MAX_MEMBERS - 1;
+    }
+
+    printf("burst %u, %u members\n", cfg->burst, members);
+
+    plain_ns = group_isr(cfg, sim, members, 0);
+    group_ns = group_isr(cfg, sim, members, 1);
+    printf("plain readers        isr p50 %7llu ns  %5llu ns/frame\n", plain_ns, plain_ns / cfg->burst);
+    printf("group                isr p50 %7llu ns  %5llu ns/frame\n", group_ns, group_ns / cfg->burst);
+
+    failed |= group_run(cfg, sim, members, CAN_GROUP_ROUND_ROBIN);
+    failed |= group_run(cfg, sim, members, CAN_GROUP_HASH_ID);
+    failed |= group_recycle(sim);
+
+    show_result("group delivery", failed);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  classes mode
+ */
+#define CLASSES_BUS_ID      0x100
+#define CLASSES_TX_ID       0x7F0
+#define CLASSES_ROUNDS      2000
+#define CLASSES_STORM_EVERY 4       /* Rounds between error interrupts */
+#define CLASSES_TX_EVERY    10      /* Rounds between writes */
+
+enum {
+    CLASS_DATA,
+    CLASS_STATUS,
+    CLASS_ECHO,
+    CLASS_COUNT
+};
+
+
+static void classes_read(struct file *filp, unsigned long long *counts)
+{
+    struct canbus_file_t *file = filp->private_data;
+    CANBUS_MESSAGE message;
+
+    while (file->stats.cur_rx_queue_count){
+
+        can_read(filp, (char *)&message, sizeof(message), NULL);
+
+        if ((message.Id & CANBUS_STATUS_CHANGE_FLAG) == CANBUS_STATUS_CHANGE_FLAG){
+            counts[CLASS_STATUS]++;
+        }
+        else if (can_frame_id(&message) == CLASSES_TX_ID){
+            counts[CLASS_ECHO]++;
+        }
+        else{
+            counts[CLASS_DATA]++;
+        }
+    }
+}
+
+
+/*
+ *  ISR p50 with readers files that asked for nothing, during a storm.
+ */
+static u64 classes_isr(const struct bench_config *cfg, struct sim_device *sim, unsigned int readers)
+{
+    struct can_histogram_t *hist;
+    struct file **files;
+    CANBUS_MESSAGE message;
+    unsigned long long seq = 0;
+    unsigned int classes = 0;
+    unsigned int i;
+    u64 start_ns;
+    u64 p50;
+
+    hist = calloc(1, sizeof(struct can_histogram_t));
+    files = calloc(readers + 1, sizeof(struct file *));
+    if (!hist || !files){
+        free(hist);
+        free(files);
+        return 0;
+    }
+
+    for (i = 0; i<readers; i++){
+        files[i] = sim_open(sim);
+        can_ioctl(files[i], CAN_IOCTL_SET_CLASSES, (unsigned long)&classes);
+    }
+
+    while (seq < cfg->frames / 4){
+
+        for (i = 0; i<cfg->burst; i++){
+            seq_frame(CLASSES_BUS_ID, (unsigned int)seq++, &message);
+            flexcan_model_receive(sim->model, &message);
+        }
+        flexcan_model_raise_esr1(sim->model, ESR1_ERR_INT | ESR1_CRC_ERR);
+
+        start_ns = bench_ns();
+        sim_device_service(sim);
+        can_histogram_add(hist, bench_ns() - start_ns);
+    }
+
+    for (i = 0; i<readers; i++){
+        sim_close(sim, files[i]);
+    }
+
+    p50 = can_histogram_percentile(hist, 500000);
+    free(files);
+    free(hist);
+
+    return p50;
+}
+
+
+int bench_classes(const struct bench_config *cfg, struct sim_device *sim)
+{
+    static const char *names[] = { "default", "data only", "echo only", "status event" };
+    static const unsigned int classes[] = {
+        CAN_CLASS_DEFAULT, 
+        CAN_CLASS_DATA, 
+        CAN_CLASS_TX_ECHO, 
+        CAN_CLASS_STATUS_EVENT
+    };
+    unsigned long long counts[4][CLASS_COUNT];
+    struct can_status_t status;
+    struct file *files[4];
+    CANBUS_MESSAGE message;
+    unsigned long long bus_frames = 0;
+    unsigned long long written = 0;
+    __u64 events = 0;
+    unsigned int readers = cfg->readers > 1 ? cfg->readers : 8;
+    unsigned int seq = 0;
+    unsigned int round;
+    unsigned int i;
+    u64 none_ns;
+    u64 opted_out_ns;
+    int efd;
+    int failed = 0;
+
+    printf("burst %u\n", cfg->burst);
+
+    none_ns = classes_isr(cfg, sim, 0);
+    opted_out_ns = classes_isr(cfg, sim, readers);
+    printf("no files             isr p50 %7llu ns\n", none_ns);
+    printf("%-3u opted out        isr p50 %7llu ns\n", readers, opted_out_ns);
+
+    efd = eventfd(0, EFD_NONBLOCK);
+    if (efd < 0){
+        return 1;
+    }
+
+    memset(counts, 0, sizeof(counts));
+
+    for (i = 0; i<4; i++){
+        files[i] = sim_open(sim);
+        failed |= can_ioctl(files[i], CAN_IOCTL_SET_CLASSES, (unsigned long)&classes[i]) != 0;
+    }
+
+    failed |= can_ioctl(files[3], CAN_IOCTL_SET_STATUS_EVENTFD, (unsigned long)&efd) != 0;
+    can_ioctl(files[0], CAN_IOCTL_ENABLE_SELF_RECEPTION, 0);
+
+    for (round = 0; round < CLASSES_ROUNDS; round++){
+
+        for (i = 0; i<cfg->burst; i++){
+            seq_frame(CLASSES_BUS_ID, seq++, &message);
+            flexcan_model_receive(sim->model, &message);
+            bus_frames++;
+        }
+
+        if (!(round % CLASSES_STORM_EVERY)){
+            flexcan_model_raise_esr1(sim->model, ESR1_ERR_INT | ESR1_CRC_ERR);
+        }
+
+        if (!(round % CLASSES_TX_EVERY)){
+            seq_frame(CLASSES_TX_ID, (unsigned int)written++, &message);
+            can_write(files[0], (const char *)&message, sizeof(message), NULL);
+        }
+
+        while (sim_device_service(sim))
+            ;
+
+        for (i = 0; i<4; i++){
+            classes_read(files[i], counts[i]);
+        }
+    }
+
+    can_ioctl(files[0], CAN_IOCTL_DISABLE_SELF_RECEPTION, 0);
+
+    if (read(efd, &events, sizeof(events)) != sizeof(events)){
+        events = 0;
+    }
+    failed |= can_ioctl(files[3], CAN_IOCTL_GET_STATUS, (unsigned long)&status) != 0;
+
+    for (i = 0; i<4; i++){
+        printf("%-20s %llu data, %llu status, %llu echoes\n",
+                names[i], counts[i][CLASS_DATA], counts[i][CLASS_STATUS], counts[i][CLASS_ECHO]);
+    }
+    printf("%-20s %llu eventfd, %llu status, latest Status1 0x%x\n", 
+            "", (unsigned long long)events, status.count, status.latest.Status1);
+
+    /*
+     *  The default file sees everything, which says what the others
+     *  should have had.
+     */
+    failed |= counts[0][CLASS_DATA] != bus_frames;
+    failed |= counts[0][CLASS_ECHO] != written;
+    failed |= counts[0][CLASS_STATUS] == 0;
+
+    failed |= counts[1][CLASS_DATA] != bus_frames;
+    failed |= counts[1][CLASS_STATUS] || counts[1][CLASS_ECHO];
+
+    failed |= counts[2][CLASS_ECHO] != written;
+    failed |= counts[2][CLASS_DATA] || counts[2][CLASS_STATUS];
+
+    failed |= counts[3][CLASS_DATA] || counts[3][CLASS_STATUS] || counts[3][CLASS_ECHO];
+    failed |= events != counts[0][CLASS_STATUS];
+    failed |= status.count != counts[0][CLASS_STATUS];
+    failed |= !(status.latest.Status1 & Csc1CrcErr);
+
+    for (i = 0; i<4; i++){
+        sim_close(sim, files[i]);
+    }
+    close(efd);
+
+    show_result("class delivery", failed);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  storm mode
+ *
+ *  An error interrupt after every frame time, as with the bus unplugged.
+ *  Readers that don't read must end up with one status record each,
+ *  holding every change, and a reader with an interval must get no more
+ *  records than the interval allows, missing nothing.  Two readers with
+ *  different intervals must each get theirs when their own is up, the
+ *  short one not waiting for the long one.
+ */
+#define STORM_EVENTS        20000
+#define STORM_INTERVAL_US   20000
+#define STORM_RUN_NS        (200 * NSEC_PER_MSEC)
+#define STORM_SHORT_US      10000
+#define STORM_LONG_US       200000
+
+static const unsigned int storm_errors[] = { 
+    ESR1_ERR_INT | ESR1_ACK_ERR,
+    ESR1_ERR_INT | ESR1_BIT0_ERR,
+    ESR1_ERR_INT | ESR1_CRC_ERR,
+    ESR1_ERR_INT | ESR1_ACK_ERR | ESR1_STF_ERR,
+};
+
+#define STORM_STATUS1   (Csc1AckErr | Csc1Bit0Err | Csc1CrcErr | Csc1StuffErr)
+
+
+/*
+ *  Read the status records queued for filp, adding up the changes in
+ *  them.  Returns how many records.
+ */
+static unsigned int storm_read(struct file *filp, unsigned int *status1, unsigned long long *changes)
+{
+    struct canbus_file_t *file = filp->private_data;
+    CANBUS_STATUS_CHANGE status;
+    unsigned int records = 0;
+
+    while (file->stats.cur_rx_queue_count){
+
+        can_read(filp, (char *)&status, sizeof(status), NULL);
+
+        if (status.StatusChangeFlag == CANBUS_STATUS_CHANGE_FLAG){
+            *status1 |= status.Status1;
+            *changes += 1 + status.Status3;
+            records++;
+        }
+    }
+
+    return records;
+}
+
+
+/*
+ *  One change held back for a short interval reader and a long one,
+ *  with the long one's delay scheduled first.
+ */
+static int storm_intervals(struct sim_device *sim)
+{
+    struct file *files[2];
+    struct canbus_file_t *file;
+    unsigned int classes = CAN_CLASS_STATUS;
+    unsigned int interval_us[2] = { STORM_SHORT_US, STORM_LONG_US };
+    u64 delivered_ns[2] = { 0, 0 };
+    unsigned long long changes = 0;
+    unsigned int status1 = 0;
+    unsigned int records = 0;
+    unsigned int i;
+    int failed = 0;
+    u64 start_ns;
+
+    /*
+     *  Opened last is first in the reader list, so the long interval
+     *  is held back first.
+     */
+    for (i = 0; i<2; i++){
+        files[i] = sim_open(sim);
+        failed |= can_ioctl(files[i], CAN_IOCTL_SET_CLASSES, (unsigned long)&classes) != 0;
+        failed |= can_ioctl(files[i], CAN_IOCTL_SET_STATUS_INTERVAL, (unsigned long)&interval_us[i]) != 0;
+    }
+
+    /*
+     *  The first change goes at once, the second is held back.
+     */
+    flexcan_model_raise_esr1(sim->model, storm_errors[0]);
+    sim_device_service(sim);
+
+    for (i = 0; i<2; i++){
+        records += storm_read(files[i], &status1, &changes);
+    }
+
+    /*
+     *  Nothing pending from before, setting the intervals included, to
+     *  run the work early.
+     */
+    start_ns = bench_ns();
+    while (ACCESS_ONCE(sim->dev->status_work.pending) && bench_ns() - start_ns < NSEC_PER_SEC){
+        kernel_shim_run_work();
+        sched_yield();
+    }
+
+    flexcan_model_raise_esr1(sim->model, storm_errors[1]);
+    sim_device_service(sim);
+
+    start_ns = bench_ns();
+
+    while ((!delivered_ns[0] || !delivered_ns[1]) &&
+           bench_ns() - start_ns < 4 * (u64)STORM_LONG_US * NSEC_PER_USEC){
+
+        kernel_shim_run_work();
+
+        for (i = 0; i<2; i++){
+            file = files[i]->private_data;
+            if (!delivered_ns[i] && file->stats.cur_rx_queue_count){
+                delivered_ns[i] = bench_ns() - start_ns;
+                records += storm_read(files[i], &status1, &changes);
+            }
+        }
+        sched_yield();
+    }
+
+    printf("intervals %u/%u us   held back change queued after %llu/%llu us\n",
+            STORM_SHORT_US, STORM_LONG_US, 
+            delivered_ns[0] / NSEC_PER_USEC, delivered_ns[1] / NSEC_PER_USEC);
+
+    failed |= records != 4 || changes != 4;
+
+    /*
+     *  The short one well before the long one is due, neither early.
+     */
+    failed |= !delivered_ns[0] || !delivered_ns[1];
+    failed |= delivered_ns[0] > (u64)STORM_LONG_US * NSEC_PER_USEC / 2;
+    failed |= delivered_ns[1] + (u64)STORM_SHORT_US * NSEC_PER_USEC < (u64)STORM_LONG_US * NSEC_PER_USEC;
+
+    for (i = 0; i<2; i++){
+        sim_close(sim, files[i]);
+    }
+
+    return failed;
+}
+
+
+int bench_storm(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct can_device_stats_t *stats = &sim->dev->stats;
+    struct can_histogram_t *hist;
+    struct file **files;
+    unsigned int readers = max_t(unsigned int, cfg->readers, 4);
+    unsigned int classes = CAN_CLASS_STATUS;
+    unsigned int interval_us = STORM_INTERVAL_US;
+    unsigned int status1;
+    unsigned int records;
+    unsigned long long changes;
+    unsigned long long events;
+    int pool_size, pool_free;
+    int failed = 0;
+    unsigned int i;
+    u64 start_ns;
+    u64 now_ns;
+
+    hist = calloc(1, sizeof(struct can_histogram_t));
+    files = calloc(readers, sizeof(struct file *));
+    if (!hist || !files){
+        free(hist);
+        free(files);
+        return 1;
+    }
+
+    printf("%u error interrupts, %u readers\n", STORM_EVENTS, readers);
+
+    reset_can_device_stats(sim->dev);
+
+    for (i = 0; i<readers; i++){
+        files[i] = sim_open(sim);
+        failed |= can_ioctl(files[i], CAN_IOCTL_SET_CLASSES, (unsigned long)&classes) != 0;
+    }
+
+    /*
+     *  Nobody reads.
+     */
+    for (i = 0; i<STORM_EVENTS; i++){
+
+        flexcan_model_raise_esr1(sim->model, storm_errors[i % ARRAY_SIZE(storm_errors)]);
+
+        start_ns = bench_ns();
+        sim_device_service(sim);
+        can_histogram_add(hist, bench_ns() - start_ns);
+    }
+
+    kcanbus_message_pool_usage(sim->dev, &pool_size, &pool_free);
+
+    printf("unread               %d pool messages for %u readers\n", pool_size - pool_free, readers);
+    show_hist("isr", hist);
+
+    failed |= pool_size - pool_free != (int)readers;
+
+    for (i = 0; i<readers; i++){
+        status1 = 0;
+        changes = 0;
+        records = storm_read(files[i], &status1, &changes);
+
+        failed |= records != 1 || changes != STORM_EVENTS || status1 != STORM_STATUS1;
+    }
+
+    printf("coalesced            %llu, %u storm, %llu us\n", 
+            stats->status_coalesced, stats->storm_count, stats->storm_total_ns / NSEC_PER_USEC);
+
+    failed |= stats->status_coalesced != (unsigned long long)readers * (STORM_EVENTS - 1);
+    failed |= stats->storm_count != 1 || !stats->storm_total_ns;
+    failed |= stats->storm_max_ns != stats->storm_total_ns;
+
+    /*
+     *  Now one reader reading as fast as it can, with an interval.
+     */
+    for (i = 1; i<readers; i++){
+        sim_close(sim, files[i]);
+    }
+
+    failed |= can_ioctl(files[0], CAN_IOCTL_SET_STATUS_INTERVAL, (unsigned long)&interval_us) != 0;
+
+    status1 = 0;
+    changes = 0;
+    records = 0;
+    events = 0;
+
+    start_ns = bench_ns();
+
+    do {
+        flexcan_model_raise_esr1(sim->model, storm_errors[events % ARRAY_SIZE(storm_errors)]);
+        sim_device_service(sim);
+        events++;
+
+        kernel_shim_run_work();
+        records += storm_read(files[0], &status1, &changes);
+
+        now_ns = bench_ns();
+
+    } while (now_ns - start_ns < STORM_RUN_NS);
+
+    /*
+     *  What the interval held back at the end.
+     */
+    while (bench_ns() - now_ns < 2 * (u64)STORM_INTERVAL_US * NSEC_PER_USEC){
+        kernel_shim_run_work();
+        sched_yield();
+    }
+    records += storm_read(files[0], &status1, &changes);
+
+    printf("interval %5u us     %llu changes in %u records over %llu ms\n", 
+            STORM_INTERVAL_US, events, records, (now_ns - start_ns) / NSEC_PER_MSEC);
+
+    failed |= changes != events || status1 != STORM_STATUS1;
+    failed |= records > (now_ns - start_ns) / ((u64)STORM_INTERVAL_US * NSEC_PER_USEC) + 2;
+
+    sim_close(sim, files[0]);
+
+    failed |= storm_intervals(sim);
+
+    free(files);
+    free(hist);
+
+    show_result("storm coalescing", failed);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  multi mode
+ */
+struct multi_device {
+
+    pthread_t thread;
+    struct sim_device *sim;
+    unsigned int can_id;            /* Every frame on this device has it */
+    unsigned long long frames;
+    unsigned int burst;
+    unsigned long long received;
+    unsigned long long bad;         /* Out of order, or another device's frame */
+    u64 elapsed_ns;
+};
+
+
+static void *multi_fn(void *arg)
+{
+    struct multi_device *md = arg;
+    struct canbus_file_t *file;
+    struct file *filp;
+    CANBUS_MESSAGE message;
+    unsigned int next_seq = 0;
+    unsigned int seq = 0;
+    unsigned int i;
+    u64 start_ns;
+
+    filp = sim_open(md->sim);
+    file = filp->private_data;
+
+    start_ns = bench_ns();
+
+    while (seq < md->frames){
+
+        for (i = 0; i<md->burst && seq < md->frames; i++){
+            seq_frame(md->can_id, seq++, &message);
+            flexcan_model_receive(md->sim->model, &message);
+        }
+
+        sim_device_service(md->sim);
+
+        while (file->stats.cur_rx_queue_count){
+            can_read(filp, (char *)&message, sizeof(message), NULL);
+            if (message.Id != md->can_id << 18 || frame_seq(&message) != next_seq){
+                md->bad++;
+            }
+            next_seq = frame_seq(&message) + 1;
+            md->received++;
+        }
+    }
+
+    md->elapsed_ns = bench_ns() - start_ns;
+
+    sim_close(md->sim, filp);
+
+    return NULL;
+}
+
+
+/*
+ *  Run the first count devices at once.  Returns the aggregate frames/sec.
+ */
+static unsigned long long multi_run(struct multi_device *mds, unsigned int count,
+                                    const struct bench_config *cfg, int *failed)
+{
+    unsigned long long total = 0;
+    u64 elapsed_ns = 0;
+    unsigned int i;
+
+    for (i = 0; i<count; i++){
+        mds[i].frames = cfg->frames;
+        mds[i].burst = cfg->burst;
+        mds[i].received = 0;
+        mds[i].bad = 0;
+        pthread_create(&mds[i].thread, NULL, multi_fn, &mds[i]);
+    }
+
+    for (i = 0; i<count; i++){
+        pthread_join(mds[i].thread, NULL);
+        total += mds[i].received;
+        if (mds[i].elapsed_ns > elapsed_ns){
+            elapsed_ns = mds[i].elapsed_ns;
+        }
+    }
+
+    for (i = 0; i<count; i++){
+        printf("  %-18s %8llu fps  isr p50 %6llu ns  %llu received  %llu bad\n",
+                mds[i].sim->dev->name,
+                mds[i].elapsed_ns ? mds[i].received * NSEC_PER_SEC / mds[i].elapsed_ns : 0,
+                can_histogram_percentile(&mds[i].sim->dev->stats.isr_time_hist, 500000),
+                mds[i].received, mds[i].bad);
+
+        if (mds[i].received != cfg->frames || mds[i].bad){
+            *failed = 1;
+        }
+        can_histogram_reset(&mds[i].sim->dev->stats.isr_time_hist);
+    }
+
+    return elapsed_ns ? total * NSEC_PER_SEC / elapsed_ns : 0;
+}
+
+
+int bench_multi(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct multi_device *mds;
+    unsigned int devices = cfg->devices ? cfg->devices : 1;
+    unsigned long long alone;
+    unsigned long long together;
+    int pool_size;
+    int pool_free;
+    int failed = 0;
+    unsigned int i;
+
+    mds = calloc(devices, sizeof(struct multi_device));
+    if (!mds){
+        return 1;
+    }
+
+    mds[0].sim = sim;
+    for (i = 1; i<devices; i++){
+        mds[i].sim = sim_device_create(cfg->pool_size);
+        if (!mds[i].sim){
+            fprintf(stderr, "sim_device_create failed\n");
+            devices = i;
+            failed = 1;
+            goto EXIT;
+        }
+    }
+    for (i = 0; i<devices; i++){
+        mds[i].can_id = 0x100 + i;
+    }
+
+    printf("1 device\n");
+    alone = multi_run(mds, 1, cfg, &failed);
+    printf("  total              %8llu fps\n", alone);
+
+    printf("%u devices at once\n", devices);
+    together = multi_run(mds, devices, cfg, &failed);
+    printf("  total              %8llu fps, %llu.%02llu x one device\n",
+            together,
+            alone ? together / alone : 0,
+            alone ? together * 100 / alone % 100 : 0);
+
+    for (i = 0; i<devices; i++){
+        kcanbus_message_pool_usage(mds[i].sim->dev, &pool_size, &pool_free);
+        if (pool_free != pool_size){
+            failed = 1;
+        }
+    }
+
+    show_result("multi delivery", failed);
+
+EXIT:
+    for (i = 1; i<devices; i++){
+        sim_device_destroy(mds[i].sim);
+    }
+    free(mds);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  gateway mode
+ */
+#define GATEWAY_SRC_ID      0x100
+#define GATEWAY_OTHER_ID    0x101       /* Every 4th frame, not routed */
+#define GATEWAY_DEST_ID     0x200
+#define GATEWAY_MARK        0x5A        /* Forced into Data[7] */
+
+
+static int gateway_check(const CANBUS_MESSAGE *message, unsigned int *next_seq)
+{
+    unsigned int seq = frame_seq(message);
+    int bad = 0;
+
+    /*
+     *  The unrouted frames leave gaps, but never go backwards.
+     */
+    if (seq < *next_seq || (seq & 3) == 3){
+        bad = 1;
+    }
+    if (message->Id != GATEWAY_DEST_ID << 18 || message->Data[7] != GATEWAY_MARK){
+        bad = 1;
+    }
+
+    *next_seq = seq + 1;
+
+    return bad;
+}
+
+
+int bench_gateway(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct sim_device *dest;
+    struct can_route_t route;
+    struct can_route_stats_t stats;
+    struct canbus_file_t *dest_file;
+    struct file *src_filp;
+    struct file *dest_filp;
+    CANBUS_MESSAGE message;
+    unsigned long long routed = 0;
+    unsigned long long received = 0;
+    unsigned long long bad = 0;
+    unsigned int next_seq = 0;
+    unsigned int seq = 0;
+    unsigned int i;
+    int pool_size;
+    int pool_free;
+    int failed = 0;
+    u64 start_ns;
+    u64 elapsed_ns;
+
+    dest = sim_device_create(cfg->pool_size);
+    if (!dest){
+        fprintf(stderr, "sim_device_create failed\n");
+        return 1;
+    }
+
+    src_filp = sim_open(sim);
+    dest_filp = sim_open(dest);
+    dest_file = dest_filp->private_data;
+
+    /*
+     *  The forwarded frames come back to dest_filp through self reception.
+     */
+    can_ioctl(dest_filp, CAN_IOCTL_ENABLE_SELF_RECEPTION, 0);
+
+    memset(&route, 0, sizeof(route));
+    route.dest_index = dest->dev->index;
+    route.match_type = CmtStandard;
+    route.match_id = GATEWAY_SRC_ID;
+    route.match_mask = 0x7FF;
+    route.flags = CAN_ROUTE_REWRITE_ID | CAN_ROUTE_MASK_DATA;
+    route.new_id = GATEWAY_DEST_ID;
+    memset(route.data_and, 0xFF, 7);
+    route.data_or[7] = GATEWAY_MARK;
+
+    if (can_ioctl(src_filp, CAN_IOCTL_ADD_ROUTE, (unsigned long)&route)){
+        fprintf(stderr, "CAN_IOCTL_ADD_ROUTE failed\n");
+        failed = 1;
+        goto EXIT;
+    }
+
+    can_histogram_reset(&sim->dev->stats.isr_time_hist);
+
+    start_ns = bench_ns();
+
+    while (seq < cfg->frames){
+
+        for (i = 0; i<cfg->burst && seq < cfg->frames; i++){
+            if ((seq & 3) == 3){
+                seq_frame(GATEWAY_OTHER_ID, seq++, &message);
+            }
+            else{
+                seq_frame(GATEWAY_SRC_ID, seq++, &message);
+                routed++;
+            }
+            flexcan_model_receive(sim->model, &message);
+        }
+
+        sim_device_service(sim);
+        drain_reader(src_filp);
+
+        /*
+         *  Each TX complete starts the next queued frame.
+         */
+        while (sim_device_service(dest))
+            ;
+
+        while (dest_file->stats.cur_rx_queue_count){
+            can_read(dest_filp, (char *)&message, sizeof(message), NULL);
+            bad += gateway_check(&message, &next_seq);
+            received++;
+        }
+    }
+
+    elapsed_ns = bench_ns() - start_ns;
+
+    stats.route_id = route.route_id;
+    if (can_ioctl(src_filp, CAN_IOCTL_GET_ROUTE_STATS, (unsigned long)&stats)){
+        failed = 1;
+    }
+    else if (stats.hits != routed || stats.forwarded != routed || stats.drops){
+        failed = 1;
+    }
+
+    printf("route %u -> %s       %llu hits  %llu forwarded  %llu drops\n",
+            stats.route_id, dest->dev->name, stats.hits, stats.forwarded, stats.drops);
+    printf("forwarded            %llu received  %llu bad  %llu fps\n",
+            received, bad, elapsed_ns ? received * NSEC_PER_SEC / elapsed_ns : 0);
+    show_hist("source isr ns", &sim->dev->stats.isr_time_hist);
+    show_hist("gateway latency ns", &dest->dev->stats.gateway_latency_hist);
+
+    if (received != routed || bad || dest->dev->stats.gateway_tx_count != routed){
+        failed = 1;
+    }
+
+    if (cfg->show_proc){
+        kernel_shim_proc_show(sim->dev->name, stdout);
+    }
+
+EXIT:
+    sim_close(dest, dest_filp);
+
+    /*
+     *  Taking the destination away takes the route with it.
+     */
+    sim_device_destroy(dest);
+
+    if (sim->dev->num_routes || 
+        can_ioctl(src_filp, CAN_IOCTL_GET_ROUTE_STATS, (unsigned long)&stats) != -ENOENT){
+        failed = 1;
+    }
+
+    sim_close(sim, src_filp);
+
+    kcanbus_message_pool_usage(sim->dev, &pool_size, &pool_free);
+    if (pool_free != pool_size){
+        failed = 1;
+    }
+
+    show_result("gateway", failed);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  history mode
+ */
+static u64 history_inject(const struct bench_config *cfg, struct sim_device *sim, unsigned int *seq)
+{
+    CANBUS_MESSAGE message;
+    unsigned long long injected = 0;
+    unsigned int i;
+
+    can_histogram_reset(&sim->dev->stats.isr_time_hist);
+
+    while (injected < cfg->frames){
+
+        for (i = 0; i<cfg->burst && injected < cfg->frames; i++){
+            seq_frame(0x123, (*seq)++, &message);
+            flexcan_model_receive(sim->model, &message);
+            injected++;
+        }
+
+        sim_device_service(sim);
+    }
+
+    return can_histogram_percentile(&sim->dev->stats.isr_time_hist, 500000);
+}
+
+
+/*
+ *  Check the entries are consecutive from first, with the payload each
+ *  frame was sent with.  We inject far faster than a real bus, many
+ *  frames per bit time, so timestamps may step back by up to a bit time
+ *  between ISRs.  Returns the number that aren't right.
+ */
+static unsigned int history_check( const struct can_history_entry_t *entries,
+                                    unsigned int count,
+                                    unsigned long long first,
+                                    unsigned int bit_time_ns)
+{
+    unsigned int bad = 0;
+    unsigned int i;
+
+    for (i = 0; i<count; i++){
+        if (entries[i].seq != first + i || frame_seq(&entries[i].message) != first + i){
+            bad++;
+        }
+        if (i && entries[i].timestamp_ns + bit_time_ns < entries[i - 1].timestamp_ns){
+            bad++;
+        }
+    }
+
+    return bad;
+}
+
+
+int bench_history(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct can_history_ring *history = &sim->dev->history;
+    struct can_history_request_t request;
+    struct can_history_entry_t *entries;
+    struct file *filp;
+    unsigned int size = history->size;
+    unsigned int seq = 0;
+    unsigned int held;
+    unsigned int tail;
+    unsigned int k;
+    u64 isr_off;
+    u64 isr_on;
+    u64 start_ns;
+    u64 dump_ns;
+    int failed = 0;
+
+    if (!size){
+        fprintf(stderr, "history ring is off\n");
+        return 1;
+    }
+
+    entries = calloc(size, sizeof(struct can_history_entry_t));
+    if (!entries){
+        return 1;
+    }
+
+    /*
+     *  Nobody has the device open, the writes happen anyway.
+     */
+    isr_on = history_inject(cfg, sim, &seq);
+
+    filp = sim_open(sim);
+
+    held = (cfg->frames < size) ? (unsigned int)cfg->frames : size;
+
+    /*
+     *  Everything held.
+     */
+    memset(&request, 0, sizeof(request));
+    request.start = CAN_HISTORY_ALL;
+    request.max_entries = size;
+    request.entries = (unsigned long)entries;
+
+    start_ns = bench_ns();
+    if (can_ioctl(filp, CAN_IOCTL_GET_HISTORY, (unsigned long)&request)){
+        failed = 1;
+        goto EXIT;
+    }
+    dump_ns = bench_ns() - start_ns;
+
+    if (request.num_entries != held || request.next_seq != seq ||
+        request.first_seq != seq - held || request.lost ||
+        history_check(entries, request.num_entries, seq - held, sim->dev->bit_time_ns)){
+        failed = 1;
+    }
+
+    printf("all                  %u frames, %llu..%llu, %llu ns per frame\n",
+            request.num_entries, request.first_seq, request.next_seq - 1,
+            request.num_entries ? dump_ns / request.num_entries : 0);
+
+    /*
+     *  From a sequence number the ring has lapped, so the first
+     *  ones are lost.
+     */
+    if (seq >= held + 5){
+        request.start = CAN_HISTORY_FROM_SEQ;
+        request.from = seq - held - 5;
+
+        if (can_ioctl(filp, CAN_IOCTL_GET_HISTORY, (unsigned long)&request) ||
+            request.lost != 5 || request.num_entries != held ||
+            history_check(entries, request.num_entries, seq - held, sim->dev->bit_time_ns)){
+            failed = 1;
+        }
+
+        printf("from lapped seq      %u frames, %llu lost\n", request.num_entries, request.lost);
+    }
+
+    /*
+     *  From the middle, by sequence number and then by that frame's
+     *  timestamp.  By time starts at the first frame at or after it,
+     *  which given the above may not be quite the same one.
+     */
+    request.start = CAN_HISTORY_ALL;
+    can_ioctl(filp, CAN_IOCTL_GET_HISTORY, (unsigned long)&request);
+
+    k = held / 2;
+    tail = (held - k < 10) ? held - k : 10;
+
+    request.start = CAN_HISTORY_FROM_SEQ;
+    request.from = entries[k].seq;
+    request.max_entries = 10;
+
+    if (can_ioctl(filp, CAN_IOCTL_GET_HISTORY, (unsigned long)&request) ||
+        request.num_entries != tail || request.lost ||
+        history_check(entries, tail, request.from, sim->dev->bit_time_ns)){
+        failed = 1;
+    }
+
+    request.start = CAN_HISTORY_FROM_TIME;
+    request.from = entries[0].timestamp_ns;
+
+    if (can_ioctl(filp, CAN_IOCTL_GET_HISTORY, (unsigned long)&request) ||
+        request.num_entries < tail ||
+        entries[0].timestamp_ns < request.from ||
+        (entries[0].seq > request.first_seq && 
+            history->ring[(entries[0].seq - 1) & (size - 1)].timestamp_ns >= request.from)){
+        failed = 1;
+    }
+
+    printf("from time            starts at %llu, seq %llu\n", entries[0].seq, seq - held + (u64)k);
+
+    /*
+     *  Following the bus: nothing new yet.
+     */
+    request.start = CAN_HISTORY_FROM_SEQ;
+    request.from = seq;
+
+    if (can_ioctl(filp, CAN_IOCTL_GET_HISTORY, (unsigned long)&request) ||
+        request.num_entries != 0 || request.next_seq != seq){
+        failed = 1;
+    }
+
+    /*
+     *  Last, because the ring isn't consistent after it is switched 
+     *  off and on: the same traffic with it off.
+     */
+    sim_close(sim, filp);
+    filp = NULL;
+
+    history->size = 0;
+    isr_off = history_inject(cfg, sim, &seq);
+    history->size = size;
+
+    printf("isr p50              %llu ns ring off, %llu ns ring on, burst %u\n",
+            isr_off, isr_on, cfg->burst);
+
+EXIT:
+    if (filp){
+        sim_close(sim, filp);
+    }
+    free(entries);
+
+    show_result("history", failed);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  capture mode
+ */
+#define CAPTURE_TRAFFIC_ID  0x100
+#define CAPTURE_TRIGGER_ID  0x321
+#define CAPTURE_MARK        0xAB        /* Data[4] of the trigger frame */
+#define CAPTURE_PRE         100
+#define CAPTURE_POST        50
+
+
+/*
+ *  Inject count frames of traffic, one burst per ISR, with frame 
+ *  special (if < count) the trigger ID with Data[4] = mark.  filp
+ *  keeps up with them.
+ */
+static void capture_inject( const struct bench_config *cfg, struct sim_device *sim,
+                            struct file *filp, unsigned int *seq, unsigned int count, 
+                            unsigned int special, unsigned char mark)
+{
+    CANBUS_MESSAGE message;
+    unsigned int i;
+    unsigned int n;
+
+    for (n = 0; n<count; ){
+
+        for (i = 0; i<cfg->burst && n < count; i++, n++){
+            if (n == special){
+                seq_frame(CAPTURE_TRIGGER_ID, (*seq)++, &message);
+                message.Data[4] = mark;
+            }
+            else{
+                seq_frame(CAPTURE_TRAFFIC_ID, (*seq)++, &message);
+            }
+            flexcan_model_receive(sim->model, &message);
+        }
+
+        sim_device_service(sim);
+        drain_reader(filp);
+    }
+}
+
+
+/*
+ *  The frozen window is pre frames, the trigger and post frames, all
+ *  consecutive.  Returns 0 if so.
+ */
+static int capture_check_window(const struct can_capture_request_t *request,
+                                const struct can_history_entry_t *entries,
+                                unsigned int pre, unsigned int post,
+                                int status_trigger)
+{
+    const struct can_history_entry_t *trigger;
+    const CANBUS_STATUS_CHANGE *status;
+    unsigned int i;
+
+    if (request->state != CAN_CAPTURE_FROZEN || 
+        request->window != pre + post + 1 ||
+        request->num_entries != request->window ||
+        request->trigger_entry != pre){
+        return 1;
+    }
+
+    trigger = &entries[pre];
+    if (trigger->seq != request->trigger_seq || trigger->timestamp_ns != request->trigger_ns){
+        return 1;
+    }
+
+    if (status_trigger){
+        status = (const CANBUS_STATUS_CHANGE *)&trigger->message;
+        if (status->StatusChangeFlag != CANBUS_STATUS_CHANGE_FLAG || !(status->Status1 & Csc1BusOff)){
+            return 1;
+        }
+    }
+    else if (trigger->message.Id != CAPTURE_TRIGGER_ID << 18 || 
+             trigger->message.Data[4] != CAPTURE_MARK){
+        return 1;
+    }
+
+    /*
+     *  A status change has the seq of the frame after it.
+     */
+    for (i = 0; i<request->window; i++){
+        if (i != pre || !status_trigger){
+            if (frame_seq(&entries[i].message) != entries[i].seq){
+                return 1;
+            }
+        }
+        if (i && i != pre + 1 && entries[i].seq != entries[i - 1].seq + 1){
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+int bench_capture(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct can_capture_config_t config;
+    struct can_capture_request_t request;
+    struct can_history_entry_t *entries;
+    struct can_history_entry_t *mapped;
+    struct vm_area_struct vma;
+    struct file *filp;
+    unsigned int frames = cfg->frames < 10000 ? 10000 : (unsigned int)cfg->frames;
+    unsigned int seq = 0;
+    unsigned int i;
+    u64 isr_off;
+    u64 isr_armed;
+    u64 start_ns;
+    u64 get_ns;
+    int failed = 0;
+
+    entries = calloc(CAPTURE_PRE + CAPTURE_POST + 1, sizeof(struct can_history_entry_t));
+    if (!entries){
+        return 1;
+    }
+
+    filp = sim_open(sim);
+
+    /*
+     *  The ISR, with capture off and then armed but never firing.
+     */
+    can_histogram_reset(&sim->dev->stats.isr_time_hist);
+    capture_inject(cfg, sim, filp, &seq, frames, frames, 0);
+    isr_off = can_histogram_percentile(&sim->dev->stats.isr_time_hist, 500000);
+
+    memset(&config, 0, sizeof(config));
+    config.trigger = CAN_CAPTURE_ON_FRAME;
+    config.match_type = CmtStandard;
+    config.match_id = CAPTURE_TRIGGER_ID;
+    config.match_mask = 0x7FF;
+    config.data_mask[4] = 0xFF;
+    config.data_value[4] = CAPTURE_MARK;
+    config.pre_frames = CAPTURE_PRE;
+    config.post_frames = CAPTURE_POST;
+
+    if (can_ioctl(filp, CAN_IOCTL_SET_CAPTURE, (unsigned long)&config)){
+        failed = 1;
+        goto EXIT;
+    }
+
+    can_histogram_reset(&sim->dev->stats.isr_time_hist);
+    capture_inject(cfg, sim, filp, &seq, frames, frames, 0);
+    isr_armed = can_histogram_percentile(&sim->dev->stats.isr_time_hist, 500000);
+
+    printf("isr p50              %llu ns capture off, %llu ns armed, burst %u\n",
+            isr_off, isr_armed, cfg->burst);
+
+    /*
+     *  The decoy has the trigger ID but the wrong Data[4].
+     */
+    capture_inject(cfg, sim, filp, &seq, 500, 200, CAPTURE_MARK + 1);
+    capture_inject(cfg, sim, filp, &seq, 500, 300, CAPTURE_MARK);
+
+    memset(&request, 0, sizeof(request));
+    request.wait = 1;
+    request.max_entries = CAPTURE_PRE + CAPTURE_POST + 1;
+    request.entries = (unsigned long)entries;
+
+    start_ns = bench_ns();
+    if (can_ioctl(filp, CAN_IOCTL_GET_CAPTURE, (unsigned long)&request) ||
+        capture_check_window(&request, entries, CAPTURE_PRE, CAPTURE_POST, 0) ||
+        request.triggers != 1 ||
+        frame_seq(&entries[CAPTURE_PRE].message) != frames * 2 + 500 + 300){
+        failed = 1;
+    }
+    get_ns = bench_ns() - start_ns;
+
+    printf("frame trigger        window %u, trigger at seq %llu, copied in %llu ns\n",
+            request.window, request.trigger_seq, get_ns);
+
+    /*
+     *  The same window through mmap().
+     */
+    memset(&vma, 0, sizeof(vma));
+    vma.vm_end = sim->dev->capture.buffer_size;
+
+    if (can_mmap(filp, &vma)){
+        failed = 1;
+        goto EXIT;
+    }
+
+    mapped = (struct can_history_entry_t *)vma.vm_start;
+
+    for (i = 0; i<request.window; i++){
+        if (memcmp( &mapped[(request.first_slot + i) % request.slots], &entries[i], 
+                    sizeof(struct can_history_entry_t))){
+            failed = 1;
+            break;
+        }
+    }
+
+    /*
+     *  Frozen: more traffic, even another trigger, changes nothing.
+     */
+    capture_inject(cfg, sim, filp, &seq, 500, 100, CAPTURE_MARK);
+
+    request.wait = 0;
+    if (can_ioctl(filp, CAN_IOCTL_GET_CAPTURE, (unsigned long)&request) ||
+        capture_check_window(&request, entries, CAPTURE_PRE, CAPTURE_POST, 0) ||
+        request.trigger_seq != entries[CAPTURE_PRE].seq ||
+        request.triggers != 1){
+        failed = 1;
+    }
+
+    /*
+     *  Mapped, so it can't change size.
+     */
+    config.trigger = CAN_CAPTURE_ON_STATUS;
+    config.status_mask = Csc1BusOff;
+    config.pre_frames = 10;
+    config.post_frames = 5;
+
+    if (can_ioctl(filp, CAN_IOCTL_SET_CAPTURE, (unsigned long)&config) != -EBUSY){
+        failed = 1;
+    }
+
+    vma.vm_ops->close(&vma);
+
+    /*
+     *  Re-armed on a bus off, with a capture size that needs a new 
+     *  buffer.  The status change lands between two bursts.
+     */
+    if (can_ioctl(filp, CAN_IOCTL_SET_CAPTURE, (unsigned long)&config)){
+        failed = 1;
+        goto EXIT;
+    }
+
+    capture_inject(cfg, sim, filp, &seq, 100, 100, 0);
+    flexcan_model_raise_esr1(sim->model, ESR1_BOFF_INT);
+    sim_device_service(sim);
+    drain_reader(filp);
+    capture_inject(cfg, sim, filp, &seq, 100, 100, 0);
+
+    request.wait = 1;
+    if (can_ioctl(filp, CAN_IOCTL_GET_CAPTURE, (unsigned long)&request) ||
+        capture_check_window(&request, entries, 10, 5, 1) ||
+        request.triggers != 2){
+        failed = 1;
+    }
+
+    printf("status trigger       window %u, trigger before seq %llu\n",
+            request.window, request.trigger_seq);
+
+    /*
+     *  ARM starts over with the same config.
+     */
+    request.wait = 0;
+    if (can_ioctl(filp, CAN_IOCTL_ARM_CAPTURE, 0) ||
+        can_ioctl(filp, CAN_IOCTL_GET_CAPTURE, (unsigned long)&request) ||
+        request.state != CAN_CAPTURE_ARMED){
+        failed = 1;
+    }
+
+    /*
+     *  And off.
+     */
+    config.trigger = 0;
+    if (can_ioctl(filp, CAN_IOCTL_SET_CAPTURE, (unsigned long)&config) ||
+        can_ioctl(filp, CAN_IOCTL_GET_CAPTURE, (unsigned long)&request) ||
+        request.state != CAN_CAPTURE_OFF ||
+        sim->dev->capture.buffer){
+        failed = 1;
+    }
+
+EXIT:
+    sim_close(sim, filp);
+    free(entries);
+
+    show_result("capture", failed);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  splice mode
+ */
+#define SPLICE_ID           0x123
+#define SPLICE_LEN          (1 << 20)   /* Asked for per splice(), the pipe's room limits it */
+#define LOG_PAGE_RECORDS    (PAGE_SIZE / sizeof(struct can_log_record_t))
+
+/*
+ *  A logger has no reason to wake for every frame, it sleeps this long
+ *  of bus time and then catches up, whichever way it reads.
+ */
+#define SPLICE_WAKE_MS      10
+
+enum splice_logger {
+
+    LOG_NONE,               /* Nobody reading, the ISR alone */
+    LOG_READ_WRITE,         /* read() and write() per frame */
+    LOG_READ_BUFFERED,      /* read() per frame, write() per page of records */
+    LOG_SPLICE,             /* splice() to a pipe, then the pipe to the file */
+    LOG_NUM_LOGGERS
+};
+
+static const char *splice_logger_names[LOG_NUM_LOGGERS] = {
+    "isr only",
+    "read+write",
+    "read+buffered",
+    "splice",
+};
+
+struct splice_result {
+
+    u64 cpu_ns;
+    unsigned long long calls;       /* read(), write() and splice() */
+    unsigned long long records;     /* As the driver counted them */
+    unsigned long long requeued;
+};
+
+
+static u64 cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+    return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+
+/*
+ *  What a user space logger makes of a frame it read(), the same
+ *  record the driver writes for splice() but with the time it read
+ *  it rather than the ISR's.
+ */
+static void log_from_message(struct can_log_record_t *record, const CANBUS_MESSAGE *message)
+{
+    memset(record, 0, sizeof(*record));
+
+    record->timestamp_ns = bench_ns();
+    record->id = can_frame_id(message);
+    if (message->Type == CmtExtended){
+        record->flags = CAN_LOG_EXTENDED;
+    }
+    record->dlc = (unsigned char)message->DataLength;
+    memcpy(record->data, message->Data, sizeof(record->data));
+}
+
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    return write(fd, buf, len) == (ssize_t)len ? 0 : 1;
+}
+
+
+/*
+ *  cfg->frames through the ISR, with logger catching up every batch
+ *  frames and writing to fd.  Returns nonzero if a write failed.
+ */
+static int splice_run(  const struct bench_config *cfg, struct sim_device *sim, int fd,
+                        enum splice_logger logger, unsigned int batch, 
+                        struct splice_result *result)
+{
+    struct can_log_record_t buffer[LOG_PAGE_RECORDS];
+    struct pipe_inode_info pipe;
+    struct canbus_file_t *file = NULL;
+    struct file *filp = NULL;
+    CANBUS_MESSAGE message;
+    unsigned long long injected = 0;
+    unsigned int seq = 0;
+    unsigned int used = 0;
+    unsigned int pending = 0;
+    unsigned int i;
+    int failed = 0;
+    u64 start;
+
+    memset(result, 0, sizeof(*result));
+    kernel_shim_pipe_init(&pipe);
+
+    if (logger != LOG_NONE){
+        filp = sim_open(sim);
+        file = filp->private_data;
+    }
+
+    start = cpu_ns();
+
+    while (injected < cfg->frames){
+
+        for (i = 0; i<cfg->burst && injected < cfg->frames; i++){
+            seq_frame(SPLICE_ID, seq++, &message);
+            flexcan_model_receive(sim->model, &message);
+            injected++;
+            pending++;
+        }
+
+        sim_device_service(sim);
+
+        if (pending < batch && injected < cfg->frames){
+            continue;
+        }
+        pending = 0;
+
+        switch (logger){
+
+            case LOG_READ_WRITE:
+            case LOG_READ_BUFFERED:
+                while (file->stats.cur_rx_queue_count){
+                    can_read(filp, (char *)&message, sizeof(message), NULL);
+                    result->calls++;
+
+                    log_from_message(&buffer[used++], &message);
+
+                    if (logger == LOG_READ_WRITE || used == LOG_PAGE_RECORDS){
+                        failed |= write_all(fd, buffer, used * sizeof(buffer[0]));
+                        result->calls++;
+                        used = 0;
+                    }
+                }
+                break;
+
+            case LOG_SPLICE:
+                while (can_splice_read(filp, NULL, &pipe, SPLICE_LEN, SPLICE_F_NONBLOCK) > 0){
+                    if (kernel_shim_pipe_drain(&pipe, fd) < 0){
+                        failed = 1;
+                    }
+                    result->calls += 2;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    if (used){
+        failed |= write_all(fd, buffer, used * sizeof(buffer[0]));
+        result->calls++;
+    }
+
+    result->cpu_ns = cpu_ns() - start;
+
+    if (filp){
+        result->records = file->stats.splice_records;
+        result->requeued = file->stats.splice_requeued;
+        sim_close(sim, filp);
+    }
+
+    return failed;
+}
+
+
+/*
+ *  seq_frame()'s seq, from a record.
+ */
+static unsigned int record_seq(const struct can_log_record_t *record)
+{
+    return ((unsigned int)record->data[0] << 24) |
+           ((unsigned int)record->data[1] << 16) |
+           ((unsigned int)record->data[2] << 8) |
+           (unsigned int)record->data[3];
+}
+
+
+/*
+ *  fd should hold one record per frame, in order.  Returns the number
+ *  that aren't right, and empties it for the next run.
+ */
+static unsigned long long splice_check(unsigned long long frames, int fd)
+{
+    struct can_log_record_t records[LOG_PAGE_RECORDS];
+    unsigned long long seq = 0;
+    unsigned long long bad = 0;
+    ssize_t n;
+    ssize_t i;
+
+    lseek(fd, 0, SEEK_SET);
+
+    while ((n = read(fd, records, sizeof(records))) > 0){
+
+        if (n % sizeof(records[0])){
+            bad++;
+        }
+
+        for (i = 0; i<n / (ssize_t)sizeof(records[0]); i++, seq++){
+            if (records[i].id != SPLICE_ID || records[i].flags || records[i].dlc != 8 ||
+                record_seq(&records[i]) != (unsigned int)seq){
+                bad++;
+            }
+        }
+    }
+
+    if (seq != frames){
+        bad++;
+    }
+
+    if (ftruncate(fd, 0)){
+        bad++;
+    }
+    lseek(fd, 0, SEEK_SET);
+
+    return bad;
+}
+
+
+/*
+ *  A full pipe takes nothing.  What splice() took off the receive queue
+ *  for it must go back, in order, and come out in the next one.
+ */
+static int splice_full(struct sim_device *sim, int fd)
+{
+    struct pipe_inode_info pipe;
+    struct canbus_file_t *file;
+    struct file *filp;
+    CANBUS_MESSAGE message;
+    unsigned int frames = (PIPE_DEF_BUFFERS + 1) * LOG_PAGE_RECORDS;
+    unsigned int seq = 0;
+    unsigned int queued;
+    unsigned long long bad;
+    unsigned int i;
+    int failed = 0;
+    ssize_t ret;
+
+    kernel_shim_pipe_init(&pipe);
+
+    filp = sim_open(sim);
+    file = filp->private_data;
+
+    while (seq < frames){
+        for (i = 0; i<16 && seq < frames; i++){
+            seq_frame(SPLICE_ID, seq++, &message);
+            flexcan_model_receive(sim->model, &message);
+        }
+        sim_device_service(sim);
+    }
+
+    /*
+     *  Fills the pipe, with a page's worth left over.
+     */
+    ret = can_splice_read(filp, NULL, &pipe, SPLICE_LEN, SPLICE_F_NONBLOCK);
+    failed |= ret != (ssize_t)(PIPE_DEF_BUFFERS * LOG_PAGE_RECORDS * sizeof(struct can_log_record_t));
+
+    queued = file->stats.cur_rx_queue_count;
+
+    ret = can_splice_read(filp, NULL, &pipe, SPLICE_LEN, SPLICE_F_NONBLOCK);
+
+    printf("pipe full            splice() %zd, %u of %u frames back on the queue\n",
+            ret, file->stats.cur_rx_queue_count, queued);
+
+    failed |= ret != -EAGAIN || queued != LOG_PAGE_RECORDS;
+    failed |= file->stats.cur_rx_queue_count != queued || file->stats.splice_requeued != queued;
+
+    while (file->stats.cur_rx_queue_count || pipe.nrbufs){
+        failed |= kernel_shim_pipe_drain(&pipe, fd) < 0;
+        if (can_splice_read(filp, NULL, &pipe, SPLICE_LEN, SPLICE_F_NONBLOCK) < 0 && pipe.nrbufs){
+            failed = 1;
+            break;
+        }
+    }
+
+    bad = splice_check(frames, fd);
+
+    failed |= bad || file->stats.splice_records != frames;
+
+    sim_close(sim, filp);
+
+    return failed;
+}
+
+
+int bench_splice(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct splice_result results[LOG_NUM_LOGGERS];
+    char path[] = "/tmp/ta_canbus_splice.XXXXXX";
+    CANBUS_MESSAGE message;
+    unsigned int frames_per_sec;
+    unsigned int batch;
+    unsigned long long bad;
+    int failed = 0;
+    int logger;
+    int fd;
+
+    fd = mkstemp(path);
+    if (fd < 0){
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+
+    seq_frame(SPLICE_ID, 0, &message);
+    frames_per_sec = 1000000 / can_frame_bits(&message);
+    batch = frames_per_sec * SPLICE_WAKE_MS / 1000;
+
+    printf("1 Mbps fully loaded  %u frames/sec of 8 byte standard frames, logger wakes every %u\n", 
+            frames_per_sec, batch);
+
+    for (logger = LOG_NONE; logger<LOG_NUM_LOGGERS; logger++){
+
+        struct splice_result *result = &results[logger];
+        u64 ns_per_frame;
+
+        failed |= splice_run(cfg, sim, fd, logger, batch, result);
+
+        if (logger == LOG_NONE){
+            printf("%-20s %llu ns per frame\n", splice_logger_names[logger], 
+                    result->cpu_ns / cfg->frames);
+            continue;
+        }
+
+        bad = splice_check(cfg->frames, fd);
+        if (bad){
+            failed = 1;
+        }
+
+        if (logger == LOG_SPLICE && (result->records != cfg->frames || result->requeued)){
+            failed = 1;
+        }
+
+        /*
+         *  On top of the ISR, which is the same whoever reads.
+         */
+        ns_per_frame = (result->cpu_ns > results[LOG_NONE].cpu_ns) ?
+                        (result->cpu_ns - results[LOG_NONE].cpu_ns) / cfg->frames : 0;
+
+        printf("%-20s %llu ns per frame, %.4f calls per frame, %.2f%% of a CPU at 1 Mbps, %llu bad\n",
+                splice_logger_names[logger], ns_per_frame, 
+                (double)result->calls / cfg->frames,
+                (double)ns_per_frame * frames_per_sec / 1e7, bad);
+    }
+
+    failed |= splice_full(sim, fd);
+
+    close(fd);
+
+    show_result("splice", failed);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  txerr mode
+ *
+ *  Frames written while nobody acks them, under each policy.  FLUSH, DROP
+ *  and RETRY must give up on every one, with the right attempts, and say
+ *  so in the drop ring.  HOLD must keep them all, back off while the
+ *  errors go on, and send them all in order once there is someone to
+ *  ack, straight away if a frame comes in.
+ */
+#define TXERR_FRAMES        8
+#define TXERR_RETRIES       2
+#define TXERR_BACKOFF_US    1000
+#define TXERR_BACKOFF_MAX   4000
+#define TXERR_HOLD_NS       (20 * NSEC_PER_MSEC)
+#define TXERR_CAN_ID        0x123
+#define TXERR_RX_CAN_ID     0x321
+
+
+/*
+ *  Write TXERR_FRAMES with ack off, and run the ISR until it stops.
+ */
+static void txerr_write(struct sim_device *sim, struct file *filp)
+{
+    CANBUS_MESSAGE message;
+    unsigned int i;
+
+    flexcan_model_set_ack(sim->model, 0);
+
+    for (i = 0; i<TXERR_FRAMES; i++){
+        seq_frame(TXERR_CAN_ID, i, &message);
+        can_write(filp, (const char *)&message, sizeof(message), NULL);
+    }
+
+    while (sim_device_service(sim))
+        ;
+}
+
+
+/*
+ *  Read the echoes of our own frames, checking they come in order.
+ *  Returns how many.
+ */
+static unsigned int txerr_read(struct file *filp, unsigned int *next_seq, unsigned int *bad)
+{
+    struct canbus_file_t *file = filp->private_data;
+    CANBUS_MESSAGE message;
+    unsigned int count = 0;
+
+    while (file->stats.cur_rx_queue_count){
+
+        can_read(filp, (char *)&message, sizeof(message), NULL);
+
+        if (message.Id != TXERR_CAN_ID << 18){
+            continue;
+        }
+
+        if (frame_seq(&message) != *next_seq){
+            (*bad)++;
+        }
+        *next_seq = frame_seq(&message) + 1;
+        count++;
+    }
+
+    return count;
+}
+
+
+/*
+ *  Ack on, and run the timers and the ISR until the queue is empty.
+ */
+static int txerr_resume(struct sim_device *sim)
+{
+    u64 start_ns = bench_ns();
+
+    flexcan_model_set_ack(sim->model, 1);
+
+    while (ACCESS_ONCE(sim->dev->transmit_in_progress)){
+
+        kernel_shim_run_work();
+        while (sim_device_service(sim))
+            ;
+
+        if (bench_ns() - start_ns > NSEC_PER_SEC){
+            return 1;
+        }
+        sched_yield();
+    }
+
+    return 0;
+}
+
+
+static int txerr_give_up(struct sim_device *sim, const struct can_tx_policy_t *policy)
+{
+    struct can_device_stats_t *stats = &sim->dev->stats;
+    struct can_tx_dropped_request_t *request;
+    struct file *filp;
+    unsigned int attempts = policy->policy == CAN_TX_RETRY ? TXERR_RETRIES + 1 : 1;
+    int failed = 0;
+    unsigned int i;
+
+    request = calloc(1, sizeof(struct can_tx_dropped_request_t));
+    if (!request){
+        return 1;
+    }
+
+    reset_can_device_stats(sim->dev);
+
+    filp = sim_open(sim);
+
+    failed |= can_ioctl(filp, CAN_IOCTL_SET_TX_POLICY, (unsigned long)policy) != 0;
+
+    txerr_write(sim, filp);
+
+    failed |= can_ioctl(filp, CAN_IOCTL_GET_TX_DROPPED, (unsigned long)request) != 0;
+
+    printf("policy %u             %llu aborted, %llu retried, %llu dropped, %u reported\n",
+            policy->policy, stats->tx_aborted, stats->tx_retried, stats->tx_dropped, 
+            request->num_entries);
+
+    failed |= stats->tx_dropped != TXERR_FRAMES || stats->tx_holds;
+    failed |= stats->tx_retried != (unsigned long long)TXERR_FRAMES * (attempts - 1);
+    failed |= sim->dev->transmit_in_progress || sim->dev->tx_aborting || stats->cur_tx_queue_count;
+
+    failed |= request->num_entries != TXERR_FRAMES || request->lost;
+    failed |= request->next_seq != TXERR_FRAMES;
+
+    for (i = 0; i<request->num_entries; i++){
+        failed |= request->entries[i].seq != i;
+        failed |= request->entries[i].policy != policy->policy;
+        failed |= frame_seq(&request->entries[i].message) != i;
+
+        /*
+         *  FLUSH aborts the first one only, the rest never got loaded.
+         */
+        if (policy->policy == CAN_TX_FLUSH){
+            failed |= request->entries[i].attempts != (i == 0);
+        }
+        else{
+            failed |= request->entries[i].attempts != attempts;
+        }
+    }
+
+    flexcan_model_set_ack(sim->model, 1);
+
+    sim_close(sim, filp);
+
+    free(request);
+
+    return failed;
+}
+
+
+static int txerr_hold(struct sim_device *sim)
+{
+    struct can_device_stats_t *stats = &sim->dev->stats;
+    struct can_tx_policy_t policy;
+    struct file *filp;
+    CANBUS_MESSAGE message;
+    unsigned int next_seq = 0;
+    unsigned int bad = 0;
+    unsigned int echoes;
+    unsigned long long holds;
+    int failed = 0;
+    u64 start_ns;
+
+    memset(&policy, 0, sizeof(policy));
+    policy.policy = CAN_TX_HOLD;
+    policy.backoff_min_us = TXERR_BACKOFF_US;
+    policy.backoff_max_us = TXERR_BACKOFF_MAX;
+
+    reset_can_device_stats(sim->dev);
+
+    filp = sim_open(sim);
+
+    can_ioctl(filp, CAN_IOCTL_ENABLE_SELF_RECEPTION, 0);
+    failed |= can_ioctl(filp, CAN_IOCTL_SET_TX_POLICY, (unsigned long)&policy) != 0;
+
+    /*
+     *  Backing off while the errors go on.
+     */
+    txerr_write(sim, filp);
+
+    failed |= !sim->dev->tx_held || stats->cur_tx_queue_count != TXERR_FRAMES - 1;
+
+    start_ns = bench_ns();
+
+    while (bench_ns() - start_ns < TXERR_HOLD_NS){
+        kernel_shim_run_work();
+        while (sim_device_service(sim))
+            ;
+        sched_yield();
+    }
+
+    holds = stats->tx_holds;
+
+    failed |= stats->tx_dropped || holds < 3;
+    failed |= sim->dev->tx_backoff_ns != (u64)TXERR_BACKOFF_MAX * NSEC_PER_USEC;
+
+    failed |= txerr_resume(sim);
+
+    echoes = txerr_read(filp, &next_seq, &bad);
+
+    printf("hold backoff         %llu holds in %llu ms, %u of %u sent, %u out of order\n",
+            holds, (unsigned long long)(TXERR_HOLD_NS / NSEC_PER_MSEC), echoes, TXERR_FRAMES, bad);
+
+    failed |= echoes != TXERR_FRAMES || bad || stats->tx_dropped;
+    failed |= sim->dev->tx_backoff_ns != 0;
+
+    /*
+     *  Held again, then a frame comes in.  No timers run.
+     */
+    txerr_write(sim, filp);
+
+    failed |= !sim->dev->tx_held;
+
+    flexcan_model_set_ack(sim->model, 1);
+
+    seq_frame(TXERR_RX_CAN_ID, 0, &message);
+    flexcan_model_receive(sim->model, &message);
+
+    while (sim_device_service(sim))
+        ;
+
+    next_seq = 0;
+    echoes = txerr_read(filp, &next_seq, &bad);
+
+    printf("hold until rx        %u of %u sent, %u out of order\n", echoes, TXERR_FRAMES, bad);
+
+    failed |= echoes != TXERR_FRAMES || bad || stats->tx_dropped;
+    failed |= sim->dev->transmit_in_progress || sim->dev->tx_held || sim->dev->tx_aborting;
+
+    sim_close(sim, filp);
+
+    return failed;
+}
+
+
+int bench_txerr(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct can_tx_policy_t policy;
+    int failed = 0;
+
+    printf("%u frames written with nobody acking\n", TXERR_FRAMES);
+
+    memset(&policy, 0, sizeof(policy));
+
+    policy.policy = CAN_TX_FLUSH;
+    failed |= txerr_give_up(sim, &policy);
+
+    policy.policy = CAN_TX_DROP;
+    failed |= txerr_give_up(sim, &policy);
+
+    policy.policy = CAN_TX_RETRY;
+    policy.max_retries = TXERR_RETRIES;
+    failed |= txerr_give_up(sim, &policy);
+
+    failed |= txerr_hold(sim);
+
+    show_result("tx error policies", failed);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  busoff mode
+ *
+ *  The fault confinement state machine.  A frame in TX_MB when the
+ *  controller goes BUS OFF, and those queued and written while it is
+ *  off, must all go out in order once it is back, under each recovery
+ *  mode, or be dropped and reported with CAN_BOFF_TX_FLUSH.  WARNING and
+ *  PASSIVE, which have no interrupt to leave by, must be left by the
+ *  poll, and the time in each state must add up.
+ */
+#define BUSOFF_FRAMES       8
+#define BUSOFF_DELAY_US     5000
+#define BUSOFF_CAN_ID       0x234
+#define BUSOFF_TIMEOUT_NS   NSEC_PER_SEC
+
+/*
+ *  128 x 11 bit times at the sim's 500 kbps.
+ */
+#define BUSOFF_RECOVERY_NS  (128ULL * 11 * 2000)
+
+
+struct busoff_check {
+
+    unsigned int next_seq;
+    unsigned int echoes;
+    unsigned int bad;               /* Out of order */
+    unsigned int status1;           /* Status changes seen */
+    unsigned int status4;           /* The state in the last one */
+};
+
+
+static void busoff_read(struct file *filp, struct busoff_check *check)
+{
+    struct canbus_file_t *file = filp->private_data;
+    CANBUS_MESSAGE message;
+    CANBUS_STATUS_CHANGE *status = (CANBUS_STATUS_CHANGE *)&message;
+
+    while (file->stats.cur_rx_queue_count){
+
+        can_read(filp, (char *)&message, sizeof(message), NULL);
+
+        if (status->StatusChangeFlag == CANBUS_STATUS_CHANGE_FLAG){
+            check->status1 |= status->Status1;
+            check->status4 = status->Status4;
+            continue;
+        }
+
+        if (frame_seq(&message) != check->next_seq){
+            check->bad++;
+        }
+        check->next_seq = frame_seq(&message) + 1;
+        check->echoes++;
+    }
+}
+
+
+/*
+ *  Write count frames from *seq on.
+ */
+static void busoff_write(struct file *filp, unsigned int *seq, unsigned int count)
+{
+    CANBUS_MESSAGE message;
+
+    while (count--){
+        seq_frame(BUSOFF_CAN_ID, (*seq)++, &message);
+        can_write(filp, (const char *)&message, sizeof(message), NULL);
+    }
+}
+
+
+/*
+ *  Run the timers and the ISR until the device is in state, or for
+ *  timeout_ns.  Returns 1 if it never got there.
+ */
+static int busoff_wait(struct sim_device *sim, struct file *filp, struct busoff_check *check,
+                       unsigned int state, u64 timeout_ns)
+{
+    u64 start_ns = bench_ns();
+
+    for (;;){
+
+        kernel_shim_run_work();
+        while (sim_device_service(sim))
+            ;
+        busoff_read(filp, check);
+
+        if (ACCESS_ONCE(sim->dev->stats.can_state) == state){
+            return 0;
+        }
+
+        if (bench_ns() - start_ns > timeout_ns){
+            return 1;
+        }
+        sched_yield();
+    }
+}
+
+
+/*
+ *  Write BUSOFF_FRAMES, the first still on the wire as the controller
+ *  goes BUS OFF.
+ */
+static void busoff_enter(struct sim_device *sim, struct file *filp, unsigned int *seq)
+{
+    sim->model->timed_tx = 1;
+    busoff_write(filp, seq, BUSOFF_FRAMES);
+
+    flexcan_model_set_fault(sim->model, ESR1_FLT_CONF_ERROR_BUS_OFF);
+    while (sim_device_service(sim))
+        ;
+
+    sim->model->timed_tx = 0;
+}
+
+
+static int busoff_recover( struct sim_device *sim, const struct can_recovery_t *recovery,
+                           const char *name)
+{
+    struct can_device_stats_t *stats = &sim->dev->stats;
+    struct can_tx_dropped_request_t *request;
+    struct busoff_check check;
+    struct file *filp;
+    unsigned int seq = 0;
+    unsigned int expect;
+    int failed = 0;
+    unsigned int i;
+
+    request = calloc(1, sizeof(struct can_tx_dropped_request_t));
+    if (!request){
+        return 1;
+    }
+
+    memset(&check, 0, sizeof(check));
+
+    reset_can_device_stats(sim->dev);
+
+    filp = sim_open(sim);
+
+    can_ioctl(filp, CAN_IOCTL_ENABLE_SELF_RECEPTION, 0);
+    failed |= can_ioctl(filp, CAN_IOCTL_SET_RECOVERY, (unsigned long)recovery) != 0;
+
+    busoff_enter(sim, filp, &seq);
+
+    failed |= stats->state_entries[CAN_STATE_BUS_OFF] != 1;
+    failed |= !sim->dev->transmit_in_progress;
+
+    if (recovery->tx == CAN_BOFF_TX_FLUSH){
+        failed |= can_ioctl(filp, CAN_IOCTL_GET_TX_DROPPED, (unsigned long)request) != 0;
+        failed |= stats->tx_dropped != BUSOFF_FRAMES || request->num_entries != BUSOFF_FRAMES;
+
+        for (i = 0; i<request->num_entries; i++){
+            failed |= request->entries[i].policy != CAN_TX_BUS_OFF;
+            failed |= frame_seq(&request->entries[i].message) != i;
+        }
+
+        check.next_seq = seq;
+    }
+    else{
+        failed |= stats->cur_tx_queue_count != BUSOFF_FRAMES - 1;
+    }
+
+    /*
+     *  Written while off the bus, queued.
+     */
+    busoff_write(filp, &seq, BUSOFF_FRAMES);
+
+    if (recovery->mode == CAN_RECOVER_MANUAL){
+
+        /*
+         *  Stays off until asked.
+         */
+        busoff_wait(sim, filp, &check, CAN_STATE_ERROR_ACTIVE, 4 * BUSOFF_RECOVERY_NS);
+
+        failed |= stats->can_state != CAN_STATE_BUS_OFF;
+        failed |= !(sim->model->regs.CTRL1 & CTRL1_BOFF_REC);
+        failed |= can_ioctl(filp, CAN_IOCTL_RECOVER, 0) != 0;
+    }
+
+    failed |= busoff_wait(sim, filp, &check, CAN_STATE_ERROR_ACTIVE, BUSOFF_TIMEOUT_NS);
+
+    /*
+     *  Nothing left in flight.
+     */
+    while (sim->dev->transmit_in_progress && !busoff_wait(sim, filp, &check, CAN_STATE_ERROR_ACTIVE, 0))
+        ;
+    busoff_read(filp, &check);
+
+    expect = recovery->tx == CAN_BOFF_TX_FLUSH ? BUSOFF_FRAMES : 2 * BUSOFF_FRAMES;
+
+    printf("%-20s %u of %u sent, %u out of order, off the bus %llu us\n",
+            name, check.echoes, expect, check.bad, stats->last_bus_off_ns / NSEC_PER_USEC);
+
+    failed |= check.echoes != expect || check.bad;
+    failed |= stats->recoveries != 1 || sim->dev->transmit_in_progress;
+    failed |= stats->last_bus_off_ns < BUSOFF_RECOVERY_NS;
+    failed |= !(check.status1 & Csc1BusOff) || !(check.status1 & Csc1BusOn);
+    failed |= check.status4 != CAN_STATE_ERROR_ACTIVE;
+
+    if (recovery->mode == CAN_RECOVER_DELAYED){
+        failed |= stats->last_bus_off_ns < (u64)BUSOFF_DELAY_US * NSEC_PER_USEC + BUSOFF_RECOVERY_NS;
+    }
+
+    /*
+     *  Next time held again, unless automatic.
+     */
+    failed |= !(sim->model->regs.CTRL1 & CTRL1_BOFF_REC) != (recovery->mode == CAN_RECOVER_AUTO);
+
+    sim_close(sim, filp);
+
+    free(request);
+
+    return failed;
+}
+
+
+static int busoff_states(struct sim_device *sim)
+{
+    struct can_device_stats_t *stats;
+    struct busoff_check check;
+    struct file *filp;
+    unsigned long long total_ns = 0;
+    int failed = 0;
+    unsigned int i;
+    u64 start_ns;
+    u64 elapsed_ns;
+
+    stats = calloc(1, sizeof(struct can_device_stats_t));
+    if (!stats){
+        return 1;
+    }
+
+    memset(&check, 0, sizeof(check));
+
+    filp = sim_open(sim);
+
+    start_ns = bench_ns();
+    reset_can_device_stats(sim->dev);
+
+    /*
+     *  TWRN_INT takes us to WARNING, nothing interrupts for the rest.
+     */
+    flexcan_model_set_fault(sim->model, ESR1_TX_WRN);
+    failed |= busoff_wait(sim, filp, &check, CAN_STATE_WARNING, BUSOFF_TIMEOUT_NS);
+
+    flexcan_model_set_fault(sim->model, ESR1_FLT_CONF_ERROR_PASSIVE | ESR1_TX_WRN);
+    failed |= busoff_wait(sim, filp, &check, CAN_STATE_PASSIVE, BUSOFF_TIMEOUT_NS);
+
+    flexcan_model_set_fault(sim->model, 0);
+    failed |= busoff_wait(sim, filp, &check, CAN_STATE_ERROR_ACTIVE, BUSOFF_TIMEOUT_NS);
+
+    failed |= can_ioctl(filp, CAN_IOCTL_GET_DEVICE_STATS, (unsigned long)stats) != 0;
+
+    elapsed_ns = bench_ns() - start_ns;
+
+    for (i = 0; i<CAN_NUM_STATES; i++){
+        total_ns += stats->state_time_ns[i];
+    }
+
+    printf("warning / passive    %llu us warning, %llu us passive, %llu of %llu us accounted for\n",
+            stats->state_time_ns[CAN_STATE_WARNING] / NSEC_PER_USEC,
+            stats->state_time_ns[CAN_STATE_PASSIVE] / NSEC_PER_USEC,
+            total_ns / NSEC_PER_USEC, elapsed_ns / NSEC_PER_USEC);
+
+    failed |= stats->state_entries[CAN_STATE_WARNING] != 1 || stats->state_entries[CAN_STATE_PASSIVE] != 1;
+    failed |= stats->state_entries[CAN_STATE_ERROR_ACTIVE] != 1;
+    failed |= !stats->state_time_ns[CAN_STATE_WARNING] || !stats->state_time_ns[CAN_STATE_PASSIVE];
+    failed |= total_ns > elapsed_ns;
+    failed |= !(check.status1 & Csc1TxWarn) || !(check.status1 & Csc1Passive);
+
+    sim_close(sim, filp);
+
+    free(stats);
+
+    return failed;
+}
+
+
+int bench_busoff(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct can_recovery_t recovery;
+    int failed = 0;
+
+    printf("%u frames queued through BUS OFF, %llu us to recover\n", 
+            BUSOFF_FRAMES, BUSOFF_RECOVERY_NS / NSEC_PER_USEC);
+
+    memset(&recovery, 0, sizeof(recovery));
+
+    recovery.mode = CAN_RECOVER_AUTO;
+    recovery.tx = CAN_BOFF_TX_KEEP;
+    failed |= busoff_recover(sim, &recovery, "auto");
+
+    recovery.mode = CAN_RECOVER_DELAYED;
+    recovery.delay_us = BUSOFF_DELAY_US;
+    failed |= busoff_recover(sim, &recovery, "delayed");
+
+    recovery.mode = CAN_RECOVER_MANUAL;
+    recovery.tx = CAN_BOFF_TX_FLUSH;
+    failed |= busoff_recover(sim, &recovery, "manual, flush");
+
+    failed |= busoff_states(sim);
+
+    show_result("bus off recovery", failed);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  cyclic mode
+ *
+ *  Cyclic transmit jobs.  A job with a count sends exactly that many
+ *  frames, one that starts later doesn't send before its start, a
+ *  deleted one stops, and a closed file's jobs go with it.  The data is
+ *  updated while they run, and every frame must have all old or all new
+ *  bytes.  The achieved period and jitter are printed, the sim's timers
+ *  run as often as this loop polls them.
+ */
+#define CYCLIC_A_ID         0x100
+#define CYCLIC_B_ID         0x200
+#define CYCLIC_A_PERIOD_US  1000
+#define CYCLIC_B_PERIOD_US  2000
+#define CYCLIC_A_COUNT      50
+#define CYCLIC_B_DELAY_NS   (5 * NSEC_PER_MSEC)
+#define CYCLIC_UPDATE_EVERY 10          /* Job A frames between data updates */
+#define CYCLIC_TIMEOUT_NS   NSEC_PER_SEC
+
+
+struct cyclic_check {
+
+    unsigned int frames[2];             /* Echoes of jobs A and B */
+    unsigned int version[2];            /* Their latest data */
+    unsigned int torn;                  /* Frames with a mix of old and new data */
+    unsigned int backwards;             /* Frames with older data than the one before */
+    unsigned int other;
+    u64 first_b_ns;                     /* When B's first frame came back */
+};
+
+
+static void cyclic_frame(unsigned int can_id, unsigned char version, CANBUS_MESSAGE *message)
+{
+    memset(message, 0, sizeof(CANBUS_MESSAGE));
+
+    message->Type = CmtStandard;
+    message->Id = can_id << 18;
+    message->DataLength = 8;
+    memset(message->Data, version, 8);
+}
+
+
+static void cyclic_read(struct file *filp, struct cyclic_check *check)
+{
+    struct canbus_file_t *file = filp->private_data;
+    CANBUS_MESSAGE message;
+    unsigned int job;
+    unsigned int i;
+
+    while (file->stats.cur_rx_queue_count){
+
+        can_read(filp, (char *)&message, sizeof(message), NULL);
+
+        if (message.Id == CYCLIC_A_ID << 18){
+            job = 0;
+        }
+        else if (message.Id == CYCLIC_B_ID << 18){
+            job = 1;
+            if (!check->first_b_ns){
+                check->first_b_ns = bench_ns();
+            }
+        }
+        else{
+            check->other++;
+            continue;
+        }
+
+        for (i = 1; i<8; i++){
+            if (message.Data[i] != message.Data[0]){
+                check->torn++;
+                break;
+            }
+        }
+
+        if (message.Data[0] < check->version[job]){
+            check->backwards++;
+        }
+
+        check->version[job] = message.Data[0];
+        check->frames[job]++;
+    }
+}
+
+
+static void cyclic_poll(struct sim_device *sim, struct file *filp, struct cyclic_check *check)
+{
+    kernel_shim_run_work();
+    while (sim_device_service(sim))
+        ;
+    cyclic_read(filp, check);
+}
+
+
+static int cyclic_update(struct file *filp, unsigned int job_id, unsigned char version)
+{
+    struct can_cyclic_update_t update;
+
+    update.job_id = job_id;
+    update.data_length = 8;
+    memset(update.data, version, 8);
+
+    return can_ioctl(filp, CAN_IOCTL_UPDATE_CYCLIC, (unsigned long)&update) != 0;
+}
+
+
+int bench_cyclic(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct can_cyclic_stats_t *stats;
+    struct cyclic_check check;
+    struct can_cyclic_t job_a;
+    struct can_cyclic_t job_b;
+    struct can_cyclic_t job_c;
+    struct file *filp;
+    struct file *other;
+    unsigned char version = 0;
+    unsigned int frames_b;
+    int failed = 0;
+    u64 start_ns;
+
+    stats = calloc(1, sizeof(struct can_cyclic_stats_t));
+    if (!stats){
+        return 1;
+    }
+
+    memset(&check, 0, sizeof(check));
+
+    filp = sim_open(sim);
+    can_ioctl(filp, CAN_IOCTL_ENABLE_SELF_RECEPTION, 0);
+
+    /*
+     *  Out of range.
+     */
+    memset(&job_a, 0, sizeof(job_a));
+    cyclic_frame(CYCLIC_A_ID, 0, &job_a.message);
+    job_a.period_us = CAN_CYCLIC_MIN_PERIOD_US - 1;
+    failed |= can_ioctl(filp, CAN_IOCTL_ADD_CYCLIC, (unsigned long)&job_a) != -EINVAL;
+
+    job_a.period_us = CYCLIC_A_PERIOD_US;
+    job_a.count = CYCLIC_A_COUNT;
+
+    memset(&job_b, 0, sizeof(job_b));
+    cyclic_frame(CYCLIC_B_ID, 0, &job_b.message);
+    job_b.period_us = CYCLIC_B_PERIOD_US;
+
+    start_ns = bench_ns();
+    job_b.start_ns = start_ns + CYCLIC_B_DELAY_NS;
+
+    failed |= can_ioctl(filp, CAN_IOCTL_ADD_CYCLIC, (unsigned long)&job_a) != 0;
+    failed |= can_ioctl(filp, CAN_IOCTL_ADD_CYCLIC, (unsigned long)&job_b) != 0;
+    failed |= !job_a.job_id || !job_b.job_id || job_a.job_id == job_b.job_id;
+
+    /*
+     *  Until A has sent its count, new data every CYCLIC_UPDATE_EVERY.
+     */
+    for (;;){
+
+        cyclic_poll(sim, filp, &check);
+
+        if (check.frames[0] >= (version + 1) * CYCLIC_UPDATE_EVERY && check.frames[0] < CYCLIC_A_COUNT){
+            version++;
+            failed |= cyclic_update(filp, job_a.job_id, version);
+            failed |= cyclic_update(filp, job_b.job_id, version);
+        }
+
+        stats->job_id = job_a.job_id;
+        failed |= can_ioctl(filp, CAN_IOCTL_GET_CYCLIC_STATS, (unsigned long)stats) != 0;
+
+        if (!stats->active && !sim->dev->transmit_in_progress){
+            break;
+        }
+
+        if (bench_ns() - start_ns > CYCLIC_TIMEOUT_NS){
+            failed = 1;
+            break;
+        }
+        sched_yield();
+    }
+    cyclic_poll(sim, filp, &check);
+
+    printf("%u frames every %u us, period %llu .. %llu us, jitter max %llu us, late max %llu us\n",
+            CYCLIC_A_COUNT, CYCLIC_A_PERIOD_US,
+            stats->min_period_ns / NSEC_PER_USEC, stats->max_period_ns / NSEC_PER_USEC,
+            stats->jitter_hist.max / NSEC_PER_USEC, stats->late_hist.max / NSEC_PER_USEC);
+
+    failed |= stats->sent != CYCLIC_A_COUNT || check.frames[0] != CYCLIC_A_COUNT;
+    failed |= stats->jitter_hist.count != CYCLIC_A_COUNT - 1 || stats->skipped;
+    failed |= stats->max_period_ns < stats->min_period_ns;
+    failed |= check.torn || check.backwards || check.other;
+    failed |= check.version[0] != version || stats->job.message.Data[7] != version;
+
+    /*
+     *  B started late, and stops when deleted.
+     */
+    failed |= !check.frames[1] || check.first_b_ns < job_b.start_ns;
+    failed |= can_ioctl(filp, CAN_IOCTL_DELETE_CYCLIC, (unsigned long)&job_b.job_id) != 0;
+    failed |= can_ioctl(filp, CAN_IOCTL_DELETE_CYCLIC, (unsigned long)&job_b.job_id) != -ENOENT;
+
+    while (sim->dev->transmit_in_progress){
+        cyclic_poll(sim, filp, &check);
+    }
+    frames_b = check.frames[1];
+
+    start_ns = bench_ns();
+    while (bench_ns() - start_ns < 4 * CYCLIC_B_PERIOD_US * NSEC_PER_USEC){
+        cyclic_poll(sim, filp, &check);
+    }
+    failed |= check.frames[1] != frames_b;
+
+    /*
+     *  Another file's job, forever, goes when it closes.  A stays until
+     *  deleted.
+     */
+    other = sim_open(sim);
+
+    memset(&job_c, 0, sizeof(job_c));
+    cyclic_frame(CYCLIC_B_ID, 0, &job_c.message);
+    job_c.period_us = CYCLIC_B_PERIOD_US;
+    failed |= can_ioctl(other, CAN_IOCTL_ADD_CYCLIC, (unsigned long)&job_c) != 0;
+    failed |= sim->dev->num_cyclic != 2;
+
+    sim_close(sim, other);
+    failed |= sim->dev->num_cyclic != 1;
+
+    failed |= can_ioctl(filp, CAN_IOCTL_DELETE_CYCLIC, (unsigned long)&job_a.job_id) != 0;
+    failed |= sim->dev->num_cyclic != 0;
+
+    while (sim->dev->transmit_in_progress){
+        cyclic_poll(sim, filp, &check);
+    }
+    cyclic_poll(sim, filp, &check);
+
+    printf("job B %u frames, %u data updates, %u torn\n", frames_b, version, check.torn);
+
+    sim_close(sim, filp);
+
+    free(stats);
+
+    show_result("cyclic transmit", failed);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  timed mode
+ *
+ *  Timed transmit.  On an idle bus the frame goes at its deadline, not
+ *  before, with the transmit time stamp reported back.  Behind a backlog
+ *  of frames that each take a frame time on the wire, the fence keeps
+ *  TX_MB free, so a deadline halfway through a backlog frame is still
+ *  met rather than waiting for it, and the timed frame jumps the queue.
+ */
+#define TIMED_CAN_ID        0x050
+#define TIMED_QUEUE_ID      0x300
+#define TIMED_AHEAD_NS      (2 * NSEC_PER_MSEC)
+#define TIMED_BACKLOG       20
+#define TIMED_DUE_FRAMES    4           /* Backlog frames before the deadline */
+#define TIMED_TRIALS        3
+#define TIMED_TIMEOUT_NS    NSEC_PER_SEC
+
+
+struct timed_check {
+
+    unsigned int next_seq;
+    unsigned int backlog;               /* Backlog frames echoed */
+    unsigned int bad;                   /* Out of order */
+    unsigned int timed;                 /* Timed frames echoed */
+    unsigned int position;              /* Backlog frames echoed before the last */
+};
+
+
+static void timed_poll(struct sim_device *sim, struct file *filp, struct timed_check *check)
+{
+    struct canbus_file_t *file = filp->private_data;
+    CANBUS_MESSAGE message;
+
+    kernel_shim_run_work();
+    flexcan_model_poll(sim->model, bench_ns());
+    while (sim_device_service(sim))
+        ;
+
+    while (file->stats.cur_rx_queue_count){
+
+        can_read(filp, (char *)&message, sizeof(message), NULL);
+
+        if (message.Id == TIMED_CAN_ID << 18){
+            check->timed++;
+            check->position = check->backlog;
+            continue;
+        }
+
+        if (frame_seq(&message) != check->next_seq){
+            check->bad++;
+        }
+        check->next_seq = frame_seq(&message) + 1;
+        check->backlog++;
+    }
+}
+
+
+/*
+ *  Poll until the timed frame is sent or dropped and nothing is left to
+ *  transmit.  Returns 1 on a timeout.
+ */
+static int timed_finish(struct sim_device *sim, struct file *filp, struct timed_check *check,
+                        struct can_timed_tx_t *result)
+{
+    u64 start_ns = bench_ns();
+
+    for (;;){
+
+        timed_poll(sim, filp, check);
+
+        can_ioctl(filp, CAN_IOCTL_GET_TIMED_TX, (unsigned long)result);
+
+        if (result->status >= CAN_TIMED_SENT && !sim->dev->transmit_in_progress){
+            timed_poll(sim, filp, check);
+            return 0;
+        }
+
+        if (bench_ns() - start_ns > TIMED_TIMEOUT_NS){
+            return 1;
+        }
+    }
+}
+
+
+static void timed_request(struct can_timed_tx_t *request, u64 deadline_ns)
+{
+    memset(request, 0, sizeof(struct can_timed_tx_t));
+
+    request->message.Type = CmtStandard;
+    request->message.Id = TIMED_CAN_ID << 18;
+    request->message.DataLength = 8;
+    request->deadline_ns = deadline_ns;
+}
+
+
+static int timed_idle(struct sim_device *sim, struct file *filp)
+{
+    struct can_timed_tx_t request;
+    struct can_timed_tx_t result;
+    struct timed_check check;
+    unsigned int bit_time_ns = sim->dev->bit_time_ns;
+    int failed = 0;
+
+    memset(&check, 0, sizeof(check));
+
+    timed_request(&request, bench_ns() + TIMED_AHEAD_NS);
+
+    failed |= can_ioctl(filp, CAN_IOCTL_TIMED_WRITE, (unsigned long)&request) != 0;
+    failed |= request.status != CAN_TIMED_PENDING;
+
+    /*
+     *  One at a time.
+     */
+    timed_request(&result, request.deadline_ns);
+    failed |= can_ioctl(filp, CAN_IOCTL_TIMED_WRITE, (unsigned long)&result) != -EBUSY;
+
+    failed |= timed_finish(sim, filp, &check, &result);
+
+    printf("idle bus             loaded %llu ns late, time stamp %lld ns from loading\n",
+            result.load_ns - result.deadline_ns, (long long)(result.tx_ns - result.load_ns));
+
+    failed |= result.status != CAN_TIMED_SENT || check.timed != 1;
+    failed |= result.load_ns < request.deadline_ns;
+
+    /*
+     *  The time stamp counts bit times, and the sim sends at once.
+     */
+    failed |= result.tx_ns + 2 * bit_time_ns < result.load_ns;
+    failed |= result.tx_ns > result.load_ns + TIMED_AHEAD_NS;
+
+    return failed;
+}
+
+
+/*
+ *  One trial behind the backlog.  *late_ns is how long after the
+ *  deadline the timed frame started on the bus.
+ */
+static int timed_backlog(struct sim_device *sim, struct file *filp, u64 *late_ns)
+{
+    struct can_timed_tx_t request;
+    struct can_timed_tx_t result;
+    struct timed_check check;
+    CANBUS_MESSAGE message;
+    unsigned int frame_ns;
+    unsigned int i;
+    int failed = 0;
+    u64 start_ns;
+
+    memset(&check, 0, sizeof(check));
+
+    seq_frame(TIMED_QUEUE_ID, 0, &message);
+    frame_ns = can_frame_bits(&message) * sim->dev->bit_time_ns;
+
+    sim->model->timed_tx = 1;
+
+    start_ns = bench_ns();
+
+    for (i = 0; i<TIMED_BACKLOG; i++){
+        seq_frame(TIMED_QUEUE_ID, i, &message);
+        can_write(filp, (const char *)&message, sizeof(message), NULL);
+    }
+
+    /*
+     *  Halfway through a backlog frame.  Without the fence it would wait
+     *  half a frame time for TX_MB.
+     */
+    timed_request(&request, start_ns + TIMED_DUE_FRAMES * frame_ns + frame_ns / 2);
+
+    failed |= can_ioctl(filp, CAN_IOCTL_TIMED_WRITE, (unsigned long)&request) != 0;
+    failed |= timed_finish(sim, filp, &check, &result);
+
+    sim->model->timed_tx = 0;
+
+    *late_ns = result.tx_ns > request.deadline_ns ? result.tx_ns - request.deadline_ns : 0;
+
+    printf("behind %u frames     on the bus %llu us late, after %u of them, frame time %u us\n",
+            TIMED_BACKLOG, *late_ns / NSEC_PER_USEC, check.position, frame_ns / 1000);
+
+    failed |= result.status != CAN_TIMED_SENT || check.timed != 1;
+    failed |= check.backlog != TIMED_BACKLOG || check.bad;
+    failed |= !check.position || check.position >= TIMED_BACKLOG;
+
+    if (*late_ns > frame_ns / 4){
+        *late_ns = ~0ULL;
+    }
+
+    return failed;
+}
+
+
+int bench_timed(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct can_device_stats_t *stats;
+    struct file *filp;
+    u64 best_ns = ~0ULL;
+    u64 late_ns;
+    unsigned int i;
+    int failed = 0;
+
+    stats = calloc(1, sizeof(struct can_device_stats_t));
+    if (!stats){
+        return 1;
+    }
+
+    reset_can_device_stats(sim->dev);
+
+    filp = sim_open(sim);
+    can_ioctl(filp, CAN_IOCTL_ENABLE_SELF_RECEPTION, 0);
+
+    failed |= timed_idle(sim, filp);
+
+    /*
+     *  The sim's timers are only as good as this loop, so the best of a
+     *  few must be within a quarter frame.
+     */
+    for (i = 0; i<TIMED_TRIALS; i++){
+        failed |= timed_backlog(sim, filp, &late_ns);
+        best_ns = min_t(u64, best_ns, late_ns);
+    }
+    failed |= best_ns == ~0ULL;
+
+    failed |= can_ioctl(filp, CAN_IOCTL_GET_DEVICE_STATS, (unsigned long)stats) != 0;
+    failed |= stats->timed_tx != 1 + TIMED_TRIALS || stats->timed_load_hist.count != 1 + TIMED_TRIALS;
+
+    sim_close(sim, filp);
+
+    free(stats);
+
+    show_result("timed transmit", failed);
+
+    return failed;
+}
+
+
+
+/****************************************************************************
+ *  txcomplete mode
+ *
+ *  TX complete records.  A backlog written with cookies, each frame
+ *  taking a frame time on the wire, must come back as one record per
+ *  frame, in order, with its cookie and a time stamp a frame time after
+ *  the last, and the reader woken once per batch rather than per frame.
+ *  Frames nobody acks must come back dropped, a reader too far behind
+ *  must be told how many it lost, and frames written with it off get no
+ *  record.
+ */
+#define TXC_CAN_ID          0x0C0
+#define TXC_FRAMES          40
+#define TXC_BATCH           8
+#define TXC_DROPPED         4
+#define TXC_COOKIE          0xC00C1E0000000000ULL
+#define TXC_TIMEOUT_NS      NSEC_PER_SEC
+
+
+static void txc_write(struct file *filp, unsigned int seq)
+{
+    struct can_tx_write_t write;
+
+    seq_frame(TXC_CAN_ID, seq, &write.message);
+    write.cookie = TXC_COOKIE + seq;
+
+    can_write(filp, (const char *)&write, sizeof(write), NULL);
+}
+
+
+/*
+ *  Take what's ready into records[*count].  Returns the lost count.
+ */
+static unsigned long long txc_get(struct file *filp, struct can_tx_complete_t *records,
+                                  unsigned int *count, unsigned int max_entries, int *failed)
+{
+    struct can_tx_complete_request_t request;
+
+    memset(&request, 0, sizeof(request));
+    request.entries = (unsigned long)&records[*count];
+    request.max_entries = max_entries - *count;
+
+    *failed |= can_ioctl(filp, CAN_IOCTL_GET_TX_COMPLETE, (unsigned long)&request) != 0;
+
+    *count += request.num_entries;
+
+    return request.lost;
+}
+
+
+static int txc_backlog(struct sim_device *sim, struct file *filp, struct can_tx_complete_t *records)
+{
+    struct canbus_file_t *file = filp->private_data;
+    struct can_tx_complete_config_t config;
+    CANBUS_MESSAGE message;
+    unsigned int frame_ns;
+    unsigned int count = 0;
+    unsigned int reads = 0;
+    unsigned int bad = 0;
+    unsigned int i;
+    int failed = 0;
+    u64 start_ns;
+
+    seq_frame(TXC_CAN_ID, 0, &message);
+    frame_ns = can_frame_bits(&message) * sim->dev->bit_time_ns;
+
+    config.enable = 1;
+    config.batch = TXC_BATCH;
+    failed |= can_ioctl(filp, CAN_IOCTL_SET_TX_COMPLETE, (unsigned long)&config) != 0;
+
+    sim->model->timed_tx = 1;
+
+    for (i = 0; i<TXC_FRAMES; i++){
+        txc_write(filp, i);
+    }
+
+    /*
+     *  Read only when woken, as a reader blocked in the ioctl would.
+     */
+    start_ns = bench_ns();
+
+    while (count < TXC_FRAMES){
+
+        kernel_shim_run_work();
+        flexcan_model_poll(sim->model, bench_ns());
+        while (sim_device_service(sim))
+            ;
+
+        if (ACCESS_ONCE(file->tx_complete_ready)){
+            txc_get(filp, records, &count, TXC_FRAMES, &failed);
+            reads++;
+        }
+
+        if (bench_ns() - start_ns > TXC_TIMEOUT_NS){
+            failed = 1;
+            break;
+        }
+    }
+
+    sim->model->timed_tx = 0;
+
+    for (i = 0; i<count; i++){
+        bad += records[i].seq != i || records[i].cookie != TXC_COOKIE + i;
+        bad += records[i].status != CAN_TX_COMPLETE_SENT || records[i].attempts != 1;
+        bad += records[i].id != TXC_CAN_ID << 18;
+
+        /*
+         *  The time stamp counts bit times.
+         */
+        bad += records[i].tx_ns + 2 * sim->dev->bit_time_ns < records[i].write_ns;
+        if (i){
+            bad += records[i].tx_ns + 2 * sim->dev->bit_time_ns < records[i - 1].tx_ns + frame_ns;
+        }
+    }
+
+    printf("%u frames, batch %u  %u records in %u reads, %llu wakeups, last queued %llu us\n",
+            TXC_FRAMES, TXC_BATCH, count, reads, file->stats.tx_complete_wakeups,
+            count ? (records[count - 1].tx_ns - records[count - 1].write_ns) / NSEC_PER_USEC : 0);
+
+    failed |= count != TXC_FRAMES || bad || file->tx_in_flight;
+    failed |= file->stats.tx_complete_wakeups != (TXC_FRAMES + TXC_BATCH - 1) / TXC_BATCH;
+    failed |= reads != file->stats.tx_complete_wakeups;
+
+    return failed;
+}
+
+
+static int txc_dropped(struct sim_device *sim, struct file *filp, struct can_tx_complete_t *records)
+{
+    struct can_tx_complete_request_t request;
+    struct can_tx_policy_t policy;
+    unsigned int count = 0;
+    unsigned int bad = 0;
+    unsigned int i;
+    int failed = 0;
+
+    memset(&policy, 0, sizeof(policy));
+    policy.policy = CAN_TX_DROP;
+    failed |= can_ioctl(filp, CAN_IOCTL_SET_TX_POLICY, (unsigned long)&policy) != 0;
+
+    flexcan_model_set_ack(sim->model, 0);
+
+    for (i = 0; i<TXC_DROPPED; i++){
+        txc_write(filp, i);
+    }
+
+    while (sim_device_service(sim))
+        ;
+
+    flexcan_model_set_ack(sim->model, 1);
+
+    /*
+     *  Nothing left in flight, so waiting returns at once.
+     */
+    memset(&request, 0, sizeof(request));
+    request.entries = (unsigned long)records;
+    request.max_entries = CAN_TX_COMPLETE_MAX;
+    request.wait = 1;
+
+    failed |= can_ioctl(filp, CAN_IOCTL_GET_TX_COMPLETE, (unsigned long)&request) != 0;
+    count = request.num_entries;
+
+    for (i = 0; i<count; i++){
+        bad += records[i].seq != TXC_FRAMES + i || records[i].cookie != TXC_COOKIE + i;
+        bad += records[i].status != CAN_TX_COMPLETE_DROPPED || records[i].policy != CAN_TX_DROP;
+        bad += records[i].attempts != 1 || records[i].tx_ns < records[i].write_ns;
+    }
+
+    printf("nobody acking        %u of %u records dropped, %u bad\n", count, TXC_DROPPED, bad);
+
+    failed |= count != TXC_DROPPED || bad || request.in_flight || request.lost;
+
+    policy.policy = CAN_TX_FLUSH;
+    failed |= can_ioctl(filp, CAN_IOCTL_SET_TX_POLICY, (unsigned long)&policy) != 0;
+
+    return failed;
+}
+
+
+static int txc_lost(struct sim_device *sim, struct file *filp, struct can_tx_complete_t *records)
+{
+    struct canbus_file_t *file = filp->private_data;
+    struct can_tx_complete_config_t config;
+    CANBUS_MESSAGE message;
+    unsigned long long lost;
+    unsigned long long seq = file->tx_complete_head;
+    unsigned int extra = CAN_TX_COMPLETE_MAX / 4;
+    unsigned int count = 0;
+    unsigned int i;
+    int failed = 0;
+
+    for (i = 0; i<CAN_TX_COMPLETE_MAX + extra; i++){
+        txc_write(filp, i);
+        while (sim_device_service(sim))
+            ;
+    }
+
+    lost = txc_get(filp, records, &count, CAN_TX_COMPLETE_MAX, &failed);
+
+    failed |= lost != extra || count != CAN_TX_COMPLETE_MAX;
+    failed |= records[0].seq != seq + extra || records[0].cookie != TXC_COOKIE + extra;
+
+    /*
+     *  Off, a plain write() gets no record.
+     */
+    config.enable = 0;
+    config.batch = 0;
+    failed |= can_ioctl(filp, CAN_IOCTL_SET_TX_COMPLETE, (unsigned long)&config) != 0;
+
+    seq_frame(TXC_CAN_ID, 0, &message);
+    can_write(filp, (const char *)&message, sizeof(message), NULL);
+    while (sim_device_service(sim))
+        ;
+
+    printf("reader behind        %llu of %u records lost, %llu in /proc\n",
+            lost, CAN_TX_COMPLETE_MAX + extra, file->stats.tx_complete_lost);
+
+    failed |= file->stats.tx_complete_lost != lost;
+    failed |= file->tx_complete_head != seq + CAN_TX_COMPLETE_MAX + extra || file->tx_in_flight;
+
+    return failed;
+}
+
+
+int bench_txcomplete(const struct bench_config *cfg, struct sim_device *sim)
+{
+    struct can_tx_complete_t *records;
+    struct file *filp;
+    int failed = 0;
+
+    records = calloc(CAN_TX_COMPLETE_MAX, sizeof(struct can_tx_complete_t));
+    if (!records){
+        return 1;
+    }
+
+    reset_can_device_stats(sim->dev);
+
+    filp = sim_open(sim);
+
+    failed |= txc_backlog(sim, filp, records);
+    failed |= txc_dropped(sim, filp, records);
+    failed |= txc_lost(sim, filp, records);
+
+    sim_close(sim, filp);
+
+    free(records);
+
+    show_result("tx complete", failed);
+
+    return failed;
+}
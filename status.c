@@ -0,0 +1,418 @@
+/****************************************************************************
+ *  status.c
+ *
+ *  Status changes for the receive queues, coalesced.  A file has at most
+ *  one CANBUS_STATUS_CHANGE record in its receive queue.  A status change
+ *  while that one is unread is ORed into it in place, and Status3 counts
+ *  the changes merged in, so a disconnected bus raising an error
+ *  interrupt per frame time costs each reader one pool message and one
+ *  wakeup, not thousands.
+ *
+ *  A file can also ask for a minimum interval between its records, with
+ *  CAN_IOCTL_SET_STATUS_INTERVAL.  Changes inside it are held back in the
+ *  file, merged the same way, and a work item per device queues them
+ *  once the interval is up.  The same happens when the pool is empty,
+ *  so a status change is never dropped.  The work is pending for the
+ *  earliest change due, whichever file it is for, and the others are
+ *  queued when it runs or left for its next run.
+ *
+ *  The record, the held back change and the interval are under the
+ *  file's rx_lock.  The storm statistics are under register_lock.
+ *
+ ***************************************************************************/
+#include <linux/workqueue.h>
+
+#include "can_private.h"
+#include "can_trace.h"
+
+
+static unsigned int status_interval_us;
+module_param(status_interval_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(status_interval_us,
+                "Minimum time between status records on a file's receive queue, microseconds, for files opened after");
+
+
+/*
+ *  Retry for a held back change the pool had no message for.
+ */
+#define STATUS_RETRY_MS     1
+
+
+static inline void merge_status(CANBUS_STATUS_CHANGE *into, const CANBUS_STATUS_CHANGE *status_change)
+{
+    into->Status1 |= status_change->Status1;
+    into->Status3++;
+    into->Status4 = status_change->Status4;
+}
+
+
+/**
+ *  Move the held back change to the receive queue.  rx_lock held.
+ *  Returns the new record, or NULL if the pool is empty and it stays
+ *  held.
+ */
+static struct kcanbus_message *queue_held_status(struct canbus_file_t *file, u64 enqueue_ns)
+{
+    struct kcanbus_message *message;
+
+    message = alloc_kcanbus_message(file->dev);
+    if (!message){
+        return NULL;
+    }
+
+    memcpy(&message->user_message, &file->status_held, sizeof(CANBUS_STATUS_CHANGE));
+    INIT_LIST_HEAD(&message->entry);
+    message->signature = KCANBUS_SIGNATURE;
+    message->capture_ns = file->status_held_ns;
+    message->enqueue_ns = enqueue_ns;
+    message->flags = 0;
+
+    list_add_tail(&message->entry, &file->receive_queue);
+
+    file->stats.cur_rx_queue_count++;
+    if (file->stats.cur_rx_queue_count > file->stats.max_rx_queue_count){
+        file->stats.max_rx_queue_count = file->stats.cur_rx_queue_count;
+    }
+    file->stats.rx_status++;
+
+    file->status_pending = message;
+    file->status_queued_ns = enqueue_ns;
+    memset(&file->status_held, 0, sizeof(CANBUS_STATUS_CHANGE));
+
+    return message;
+}
+
+
+/**
+ *  Have the work run in delay_ns, unless it's due sooner already.  Any
+ *  context.
+ */
+static void schedule_status_work(struct canbus_device_t *dev, u64 delay_ns)
+{
+    u64 due_ns = can_clock_ns() + delay_ns;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->status_work_lock, flags);
+
+    if (dev->status_work_running &&
+        (!dev->status_work_due_ns || due_ns < dev->status_work_due_ns)){
+
+        dev->status_work_due_ns = due_ns;
+        mod_delayed_work(system_wq, &dev->status_work,
+                         msecs_to_jiffies(div_u64(delay_ns, NSEC_PER_MSEC) + 1));
+    }
+
+    spin_unlock_irqrestore(&dev->status_work_lock, flags);
+}
+
+
+/**
+ *  Give file a status change.  From the ISR, register_lock held.
+ */
+void can_status_enqueue(struct canbus_file_t *file,
+                        const CANBUS_STATUS_CHANGE *status_change,
+                        u64 capture_ns,
+                        u64 enqueue_ns)
+{
+    struct canbus_device_t *dev = file->dev;
+    struct kcanbus_message *message = NULL;
+    u64 delay_ns = 0;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock(&file->rx_lock);
+
+    /*
+     *  The reader hasn't got to the last one yet, and has been woken
+     *  for it already.
+     */
+    if (file->status_pending){
+
+        merge_status((CANBUS_STATUS_CHANGE *)&file->status_pending->user_message, status_change);
+        file->stats.status_coalesced++;
+
+        /*
+         *  UNLOCK --------------------------------------------------
+         */
+        can_unlock(&file->rx_lock);
+
+        dev->stats.status_coalesced++;
+        return;
+    }
+
+    if (file->status_held.Status1){
+        merge_status(&file->status_held, status_change);
+        file->stats.status_coalesced++;
+        dev->stats.status_coalesced++;
+    }
+    else{
+        file->status_held = *status_change;
+        file->status_held_ns = capture_ns;
+    }
+
+    if (enqueue_ns - file->status_queued_ns >= file->status_interval_ns){
+        message = queue_held_status(file, enqueue_ns);
+        if (!message){
+            delay_ns = STATUS_RETRY_MS * NSEC_PER_MSEC;
+        }
+    }
+    else{
+        delay_ns = file->status_queued_ns + file->status_interval_ns - enqueue_ns;
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock(&file->rx_lock);
+
+    if (message){
+        trace_can_rx_enqueue(file, &message->user_message);
+        wake_up_interruptible(&file->receive_wq);
+    }
+    else{
+        schedule_status_work(dev, delay_ns);
+    }
+}
+
+
+/**
+ *  Tell every file that wants it about a status change, as the latest
+ *  status word, a receive queue record or both.  From the ISR or the 
+ *  state poll, register_lock held.  Returns -EBADFD if the reader list
+ *  is corrupt.
+ */
+int can_status_deliver( struct canbus_device_t *dev,
+                        const CANBUS_STATUS_CHANGE *status_change,
+                        u64 capture_ns)
+{
+    struct canbus_file_t *file;
+    u64 enqueue_ns;
+    int ret = 0;
+
+    can_capture_add(dev, (CANBUS_MESSAGE *)status_change, capture_ns, 1);
+    can_status_storm(dev, capture_ns);
+
+    enqueue_ns = can_clock_ns();
+
+    /*
+     *  The reader list is RCU, open() and close() never hold us up.
+     */
+    rcu_read_lock();
+
+    list_for_each_entry_rcu(file, &dev->reader_list, reader_list_entry){
+
+        if (file->signature != CANBUS_FILE_SIGNATURE){
+            can_event(dev, CAN_EVENT_FILE_SIGNATURE, __LINE__);
+            ret = -EBADFD;
+            break;
+        }
+
+        /*
+         *  The latest status word and its eventfd, under our
+         *  register_lock, see CAN_IOCTL_SET_STATUS_EVENTFD.
+         */
+        if (file->rx_classes & CAN_CLASS_STATUS_EVENT){
+            file->status.latest = *status_change;
+            file->status.timestamp_ns = capture_ns;
+            file->status.count++;
+            file->stats.status_events++;
+
+            if (file->status_eventfd){
+                eventfd_signal(file->status_eventfd, 1);
+            }
+        }
+
+        /*
+         *  Coalesced into the record the file hasn't read yet, if
+         *  any.
+         */
+        if (file->rx_classes & CAN_CLASS_STATUS){
+            can_status_enqueue(file, status_change, capture_ns, enqueue_ns);
+        }
+    }
+
+    rcu_read_unlock();
+
+    return ret;
+}
+
+
+/**
+ *  Queue what the interval, or an empty pool, held back.
+ */
+static void can_status_work_fn(struct work_struct *work)
+{
+    struct canbus_device_t *dev = container_of(work, struct canbus_device_t, status_work.work);
+    struct canbus_file_t *file;
+    struct kcanbus_message *message;
+    unsigned long flags;
+    u64 now_ns;
+    u64 due_ns;
+    u64 delay_ns = 0;
+
+    /*
+     *  Not pending any more, a change held back from here on schedules
+     *  us again.
+     */
+    spin_lock_irqsave(&dev->status_work_lock, flags);
+    dev->status_work_due_ns = 0;
+    spin_unlock_irqrestore(&dev->status_work_lock, flags);
+
+    now_ns = can_clock_ns();
+
+    rcu_read_lock();
+
+    list_for_each_entry_rcu(file, &dev->reader_list, reader_list_entry){
+
+        if (file->signature != CANBUS_FILE_SIGNATURE){
+            can_event(dev, CAN_EVENT_FILE_SIGNATURE, __LINE__);
+            break;
+        }
+
+        message = NULL;
+
+        /*
+         *  LOCK --------------------------------------------------------
+         */
+        can_lock_irqsave(&file->rx_lock, flags);
+
+        if (file->status_held.Status1){
+
+            due_ns = file->status_queued_ns + file->status_interval_ns;
+
+            if ((s64)(now_ns - due_ns) < 0){
+                due_ns -= now_ns;
+                if (!delay_ns || due_ns < delay_ns){
+                    delay_ns = due_ns;
+                }
+            }
+            else{
+                message = queue_held_status(file, now_ns);
+                if (!message && (!delay_ns || delay_ns > STATUS_RETRY_MS * NSEC_PER_MSEC)){
+                    delay_ns = STATUS_RETRY_MS * NSEC_PER_MSEC;
+                }
+            }
+        }
+
+        /*
+         *  UNLOCK ------------------------------------------------------
+         */
+        can_unlock_irqrestore(&file->rx_lock, flags);
+
+        if (message){
+            trace_can_rx_enqueue(file, &message->user_message);
+            wake_up_interruptible(&file->receive_wq);
+        }
+    }
+
+    rcu_read_unlock();
+
+    if (delay_ns){
+        schedule_status_work(dev, delay_ns);
+    }
+}
+
+
+/**
+ *  Error storm statistics.  A storm is status changes coming less than
+ *  CAN_STORM_GAP_MS apart, one on its own isn't one.  Called for every
+ *  status change, register_lock held.
+ */
+void can_status_storm(struct canbus_device_t *dev, u64 now_ns)
+{
+    struct can_device_stats_t *stats = &dev->stats;
+    u64 gap_ns = now_ns - dev->storm_last_ns;
+
+    if (dev->storm_last_ns && gap_ns < CAN_STORM_GAP_MS * NSEC_PER_MSEC){
+
+        if (!stats->storm_cur_ns){
+            stats->storm_count++;
+        }
+
+        stats->storm_cur_ns += gap_ns;
+        stats->storm_total_ns += gap_ns;
+
+        if (stats->storm_cur_ns > stats->storm_max_ns){
+            stats->storm_max_ns = stats->storm_cur_ns;
+        }
+    }
+    else{
+        stats->storm_cur_ns = 0;
+    }
+
+    dev->storm_last_ns = now_ns;
+}
+
+
+/**
+ *  A new file's status coalescing state.
+ */
+void can_status_open(struct canbus_file_t *file)
+{
+    file->status_pending = NULL;
+    memset(&file->status_held, 0, sizeof(CANBUS_STATUS_CHANGE));
+    file->status_held_ns = 0;
+    file->status_queued_ns = 0;
+    file->status_interval_ns = (u64)ACCESS_ONCE(status_interval_us) * NSEC_PER_USEC;
+}
+
+
+/**
+ *  CAN_IOCTL_SET_STATUS_INTERVAL, in microseconds.
+ */
+long can_status_set_interval(struct canbus_file_t *file, unsigned long arg)
+{
+    unsigned int interval_us;
+    unsigned long flags;
+
+    if (copy_from_user(&interval_us, (void __user *)arg, sizeof(unsigned int))){
+        return -EFAULT;
+    }
+
+    if (interval_us > CAN_STATUS_MAX_INTERVAL_US){
+        return -EINVAL;
+    }
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&file->rx_lock, flags);
+
+    file->status_interval_ns = (u64)interval_us * NSEC_PER_USEC;
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&file->rx_lock, flags);
+
+    /*
+     *  Anything held back under a longer interval goes now, or when
+     *  the new one is up.
+     */
+    schedule_status_work(file->dev, 0);
+
+    return 0;
+}
+
+
+void init_can_status(struct canbus_device_t *dev)
+{
+    dev->storm_last_ns = 0;
+    INIT_DELAYED_WORK(&dev->status_work, can_status_work_fn);
+    spin_lock_init(&dev->status_work_lock);
+    dev->status_work_due_ns = 0;
+    dev->status_work_running = 1;
+}
+
+
+void destroy_can_status(struct canbus_device_t *dev)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->status_work_lock, flags);
+    dev->status_work_running = 0;
+    spin_unlock_irqrestore(&dev->status_work_lock, flags);
+
+    cancel_delayed_work_sync(&dev->status_work);
+}
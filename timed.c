@@ -0,0 +1,353 @@
+/****************************************************************************
+ *  timed.c
+ *
+ *  Transmit at an absolute time, CAN_IOCTL_TIMED_WRITE.  A write() goes
+ *  out as soon as the mailbox is free, and a thread that sleeps until
+ *  the moment it wants loses its wake up latency on top.  Here the frame
+ *  waits on the device's timed_queue, in deadline order, and one hrtimer
+ *  loads the first into TX_MB when it is due.
+ *
+ *  Loading it on time doesn't help if TX_MB is busy with a frame that
+ *  is still waiting for the bus.  So the timer fires twice per frame:
+ *  one worst case frame time before the deadline it sets tx_fence, and
+ *  from then on tx.c loads no more queued frames.  Whatever is in TX_MB
+ *  has that long to get out.  At the deadline the timed frame goes in,
+ *  or first in the queue if TX_MB is still busy, and the fence is
+ *  lifted unless the next timed frame is close behind.
+ *
+ *  When it has been sent, the TX_MB time stamp says when it started on
+ *  the bus, and the writer gets that back.  All of it is under tx_lock.
+ *
+ ***************************************************************************/
+#include <linux/hrtimer.h>
+
+#include "can_private.h"
+
+
+/*
+ *  The longest frame on the wire: extended, 8 data bytes and the worst
+ *  case of stuff bits.
+ */
+#define TIMED_GUARD_BITS    160
+
+
+/**
+ *  Set the timer for the first timed frame, for its fence or its
+ *  deadline, and the fence itself.  tx_lock held.
+ */
+static void timed_arm(struct canbus_device_t *dev, u64 now_ns)
+{
+    struct kcanbus_message *message;
+    u64 guard_ns = (u64)TIMED_GUARD_BITS * dev->bit_time_ns;
+    u64 fence_ns;
+    u64 due_ns;
+
+    if (list_empty(&dev->timed_queue)){
+        dev->tx_fence = 0;
+        hrtimer_try_to_cancel(&dev->timed_timer);
+        return;
+    }
+
+    message = list_first_entry(&dev->timed_queue, struct kcanbus_message, entry);
+
+    fence_ns = message->tx_deadline_ns > guard_ns ? message->tx_deadline_ns - guard_ns : 0;
+
+    if (now_ns >= fence_ns){
+        dev->tx_fence = 1;
+        due_ns = message->tx_deadline_ns;
+    }
+    else{
+        dev->tx_fence = 0;
+        due_ns = fence_ns;
+    }
+
+    hrtimer_start(&dev->timed_timer, ns_to_ktime(due_ns), HRTIMER_MODE_ABS);
+}
+
+
+/**
+ *  message is due, into TX_MB with it.  tx_lock held.
+ */
+static void timed_load(struct canbus_device_t *dev, struct kcanbus_message *message, u64 now_ns)
+{
+    struct canbus_file_t *file = message->tx_file;
+
+    can_histogram_add(&dev->stats.timed_load_hist, now_ns - message->tx_deadline_ns);
+
+    if (file){
+        file->timed_tx.status = CAN_TIMED_LOADED;
+        file->timed_tx.load_ns = now_ns;
+    }
+
+    can_tx_submit_first(dev, message);
+}
+
+
+static enum hrtimer_restart can_timed_timer_fn(struct hrtimer *timer)
+{
+    struct canbus_device_t *dev = container_of(timer, struct canbus_device_t, timed_timer);
+    struct kcanbus_message *message;
+    unsigned long flags;
+    u64 now_ns;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    now_ns = can_clock_ns();
+
+    while (!list_empty(&dev->timed_queue)){
+
+        message = list_first_entry(&dev->timed_queue, struct kcanbus_message, entry);
+        if (message->tx_deadline_ns > now_ns){
+            break;
+        }
+
+        list_del_init(&message->entry);
+        timed_load(dev, message, now_ns);
+    }
+
+    timed_arm(dev, now_ns);
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+
+    return HRTIMER_NORESTART;
+}
+
+
+/**
+ *  A timed frame was sent, with TX_MB's IFLAG just seen, or dropped.
+ *  Tell its writer.  tx_lock held.
+ */
+void can_timed_done( struct canbus_device_t *dev,
+                     struct kcanbus_message *message,
+                     unsigned int status)
+{
+    struct canbus_file_t *file = message->tx_file;
+    u64 tx_ns = 0;
+
+    if (status == CAN_TIMED_SENT){
+        tx_ns = hw_get_tx_timestamp_ns(dev);
+
+        dev->stats.timed_tx++;
+        can_histogram_add(  &dev->stats.timed_tx_hist,
+                            tx_ns > message->tx_deadline_ns ? tx_ns - message->tx_deadline_ns : 0);
+    }
+
+    if (!file){
+        return;
+    }
+
+    file->timed_tx.status = status;
+    file->timed_tx.tx_ns = tx_ns;
+
+    wake_up_interruptible(&file->timed_wq);
+}
+
+
+void init_can_timed(struct canbus_device_t *dev)
+{
+    INIT_LIST_HEAD(&dev->timed_queue);
+    dev->tx_fence = 0;
+
+    hrtimer_init(&dev->timed_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    dev->timed_timer.function = can_timed_timer_fn;
+}
+
+
+/**
+ *  No more writes or interrupts, give back the frames not due yet.
+ */
+void destroy_can_timed(struct canbus_device_t *dev)
+{
+    struct kcanbus_message *message;
+    unsigned long flags;
+
+    hrtimer_cancel(&dev->timed_timer);
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    while (!list_empty(&dev->timed_queue)){
+        message = list_first_entry(&dev->timed_queue, struct kcanbus_message, entry);
+        list_del_init(&message->entry);
+        free_kcanbus_message(dev, message);
+    }
+
+    dev->tx_fence = 0;
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+}
+
+
+void can_timed_open(struct canbus_file_t *file)
+{
+    init_waitqueue_head(&file->timed_wq);
+}
+
+
+
+static int check_timed(const struct can_timed_tx_t *request, u64 now_ns)
+{
+    const CANBUS_MESSAGE *message = &request->message;
+
+    if (request->deadline_ns > now_ns + CAN_TIMED_MAX_AHEAD_NS){
+        return -EINVAL;
+    }
+
+    /*
+     *  The same as a write().
+     */
+    if (message->Type != CmtStandard && message->Type != CmtExtended){
+        return -EPROTO;
+    }
+
+    if (message->Id & 0xE0000000){
+        return -EPROTO;
+    }
+
+    if (message->DataLength > 8){
+        return -EPROTO;
+    }
+
+    return 0;
+}
+
+
+static long get_timed_tx(struct canbus_file_t *file, unsigned long arg)
+{
+    struct canbus_device_t *dev = file->dev;
+    struct can_timed_tx_t result;
+    unsigned long flags;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    result = file->timed_tx;
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+
+    if (copy_to_user((void __user *)arg, &result, sizeof(struct can_timed_tx_t))){
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+
+static long timed_write(struct canbus_file_t *file, unsigned long arg)
+{
+    struct canbus_device_t *dev = file->dev;
+    struct kcanbus_message *message;
+    struct kcanbus_message *next;
+    struct can_timed_tx_t request;
+    unsigned long flags;
+    u64 now_ns;
+    long ret = 0;
+
+    if (copy_from_user(&request, (void __user *)arg, sizeof(struct can_timed_tx_t))){
+        return -EFAULT;
+    }
+
+    now_ns = can_clock_ns();
+
+    ret = check_timed(&request, now_ns);
+    if (ret){
+        return ret;
+    }
+
+    message = alloc_kcanbus_message(dev);
+    if (!message){
+        return -ENOMEM;
+    }
+
+    memset(message, 0, sizeof(struct kcanbus_message));
+    INIT_LIST_HEAD(&message->entry);
+    message->signature = KCANBUS_SIGNATURE;
+    message->flags = KCANBUS_TIMED;
+    message->tx_file = file;
+    message->tx_deadline_ns = request.deadline_ns;
+    message->user_message = request.message;
+
+    file->stats.write_count++;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    if (file->timed_tx.status == CAN_TIMED_PENDING || file->timed_tx.status == CAN_TIMED_LOADED){
+        ret = -EBUSY;
+    }
+    else{
+        file->timed_tx = request;
+        file->timed_tx.status = CAN_TIMED_PENDING;
+        file->timed_tx.load_ns = 0;
+        file->timed_tx.tx_ns = 0;
+
+        /*
+         *  After any due at the same time, they were written first.
+         */
+        list_for_each_entry(next, &dev->timed_queue, entry){
+            if (next->tx_deadline_ns > request.deadline_ns){
+                break;
+            }
+        }
+        list_add_tail(&message->entry, &next->entry);
+
+        timed_arm(dev, now_ns);
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+
+    if (ret){
+        free_kcanbus_message(dev, message);
+        return ret;
+    }
+
+    if (request.wait){
+        /*
+         *  It is queued, a restarted ioctl would send it twice.
+         */
+        if (wait_event_interruptible(file->timed_wq,
+                    ACCESS_ONCE(file->timed_tx.status) >= CAN_TIMED_SENT)){
+            return -EINTR;
+        }
+    }
+
+    return get_timed_tx(file, arg);
+}
+
+
+long can_timed_ioctl(   struct canbus_file_t *file,
+                        unsigned int cmd,
+                        unsigned long arg)
+{
+    switch(cmd){
+
+        case CAN_IOCTL_TIMED_WRITE:
+            return timed_write(file, arg);
+
+        case CAN_IOCTL_GET_TIMED_TX:
+            return get_timed_tx(file, arg);
+    }
+
+    return -EINVAL;
+}
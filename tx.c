@@ -0,0 +1,760 @@
+/****************************************************************************
+ *  tx.c
+ *
+ *  The transmit path that write(), the gateway and the ISR share, and
+ *  what happens to a frame nobody acknowledges.
+ *
+ *  The frame in TX_MB stays allocated as dev->tx_current until it has
+ *  gone out, so an ACK error doesn't lose it.  What happens then is the
+ *  device's struct can_tx_policy_t:
+ *
+ *  - CAN_TX_FLUSH   abort, and drop it and everything queued, as the
+ *                   driver always did.  The default.
+ *  - CAN_TX_DROP    abort, drop only it, and go on with the queue.
+ *  - CAN_TX_RETRY   abort and load it again, up to max_retries times,
+ *                   then drop it and go on.
+ *  - CAN_TX_HOLD    abort, and keep it and the queue.  An hrtimer loads
+ *                   it again after a backoff, which doubles from
+ *                   backoff_min_us to backoff_max_us while nobody acks.
+ *                   A received frame means someone is there to ack, so
+ *                   that resumes at once.
+ *
+ *  The abort doesn't wait in the ISR.  A frame already on the wire
+ *  finishes first, so TX_MB's IFLAG says which it was, and
+ *  can_tx_aborted() applies the policy when it comes.
+ *
+ *  A timed frame, see timed.c, is due soon when tx_fence is set.  Queued
+ *  frames then wait rather than take TX_MB, and the timed frame jumps
+ *  the queue if it has to.
+ *
+ *  In BUS OFF none of that applies.  can_tx_bus_off() takes the frame
+ *  out of TX_MB and keeps it and the queue, or drops them, and
+ *  can_tx_bus_on() carries on where it left off, see errstate.c.
+ *
+ *  A dropped frame is counted for the device and its writer, and goes in
+ *  the writer's ring for CAN_IOCTL_GET_TX_DROPPED, so it can tell which
+ *  frames never made it.  A file with CAN_IOCTL_SET_TX_COMPLETE on also
+ *  gets a record for every frame it wrote, sent or dropped, see
+ *  tx_complete.c.  All of it is under tx_lock.
+ *
+ ***************************************************************************/
+#include <linux/hrtimer.h>
+
+#include "can_private.h"
+#include "can_trace.h"
+
+
+#define CAN_TX_POLICIES     (CAN_TX_HOLD + 1)
+
+
+/**
+ *  Load message into TX_MB.  It is ours until it has gone out or been
+ *  dropped.  tx_lock held.
+ */
+static void can_tx_start(struct canbus_device_t *dev, struct kcanbus_message *message)
+{
+    dev->transmit_in_progress = 1;
+    dev->tx_current = message;
+
+    if (++message->tx_attempts == 1){
+        can_gateway_tx_started(dev, message);
+    }
+    hw_transmit_message(dev, &message->user_message);
+}
+
+
+/**
+ *  Start the next queued frame, or go idle.  tx_lock held.
+ */
+static void can_tx_next(struct canbus_device_t *dev)
+{
+    struct kcanbus_message *message;
+
+    dev->tx_current = NULL;
+
+    /*
+     *  The queue waits for can_tx_bus_on(), and so do writes.
+     */
+    if (dev->tx_bus_off){
+        hw_disable_message_buffer_interrupt(dev, TX_MB);
+        return;
+    }
+
+    while (!list_empty(&dev->transmit_queue)){
+
+        message = list_first_entry(&dev->transmit_queue, struct kcanbus_message, entry);
+
+        /*
+         *  Keep TX_MB free for the timed frame due.
+         */
+        if (dev->tx_fence && !(message->flags & KCANBUS_TIMED)){
+            break;
+        }
+
+        list_del_init(&message->entry);
+
+        dev->stats.cur_tx_queue_count--;
+
+        if (message->signature != KCANBUS_SIGNATURE){
+            can_event(dev, CAN_EVENT_MSG_SIGNATURE, __LINE__);
+            continue;
+        }
+
+        can_tx_start(dev, message);
+        return;
+    }
+
+    dev->transmit_in_progress = 0;
+    hw_disable_message_buffer_interrupt(dev, TX_MB);
+}
+
+
+static void can_tx_queue(struct canbus_device_t *dev, struct kcanbus_message *message, int first)
+{
+    if (first){
+        list_add(&message->entry, &dev->transmit_queue);
+    }
+    else{
+        list_add_tail(&message->entry, &dev->transmit_queue);
+    }
+
+    dev->stats.cur_tx_queue_count++;
+    if (dev->stats.cur_tx_queue_count > dev->stats.max_tx_queue_count){
+        dev->stats.max_tx_queue_count = dev->stats.cur_tx_queue_count;
+    }
+}
+
+
+/**
+ *  Transmit message now if the mailbox is free, otherwise queue it.
+ *  Returns 1 if it went straight to the mailbox.  tx_lock held.
+ */
+int can_tx_submit(struct canbus_device_t *dev, struct kcanbus_message *message)
+{
+    if (dev->transmit_in_progress || dev->tx_fence){
+        can_tx_queue(dev, message, 0);
+        return 0;
+    }
+
+    can_tx_start(dev, message);
+    hw_enable_message_buffer_interrupt(dev, TX_MB);
+
+    return 1;
+}
+
+
+/**
+ *  The same for a timed frame that is due, which goes ahead of the queue
+ *  if it has to wait.  tx_lock held.
+ */
+int can_tx_submit_first(struct canbus_device_t *dev, struct kcanbus_message *message)
+{
+    if (dev->transmit_in_progress){
+        can_tx_queue(dev, message, 1);
+        return 0;
+    }
+
+    can_tx_start(dev, message);
+    hw_enable_message_buffer_interrupt(dev, TX_MB);
+
+    return 1;
+}
+
+
+/**
+ *  TX_MB's IFLAG, the frame went out.  From the ISR, tx_lock held.
+ */
+void can_tx_complete(struct canbus_device_t *dev)
+{
+    if (dev->tx_current){
+        if (dev->tx_current->flags & KCANBUS_TIMED){
+            can_timed_done(dev, dev->tx_current, CAN_TIMED_SENT);
+        }
+        if (dev->tx_current->flags & KCANBUS_TX_COMPLETE){
+            can_tx_complete_done(   dev, dev->tx_current, CAN_TX_COMPLETE_SENT, 0,
+                                    hw_get_tx_timestamp_ns(dev));
+        }
+        free_kcanbus_message(dev, dev->tx_current);
+    }
+
+    dev->tx_backoff_ns = 0;
+
+    /*
+     *  An abort too late, the frame went out first.
+     */
+    dev->tx_aborting = 0;
+    dev->tx_abort_keep = 0;
+
+    can_tx_next(dev);
+}
+
+
+/**
+ *  Give up on message.  tx_lock held.
+ */
+static void drop_tx_message(struct canbus_device_t *dev,
+                            struct kcanbus_message *message,
+                            unsigned int reason,
+                            u64 now_ns)
+{
+    struct canbus_file_t *file = message->tx_file;
+    struct can_tx_dropped_t *dropped;
+
+    dev->stats.tx_dropped++;
+
+    if (file){
+        dropped = &file->tx_dropped[file->tx_dropped_head % CAN_TX_DROPPED_MAX];
+        dropped->seq = file->tx_dropped_head++;
+        dropped->timestamp_ns = now_ns;
+        dropped->policy = reason;
+        dropped->attempts = message->tx_attempts;
+        dropped->message = message->user_message;
+
+        file->stats.tx_dropped++;
+    }
+
+    if (message->flags & KCANBUS_TIMED){
+        can_timed_done(dev, message, CAN_TIMED_DROPPED);
+    }
+    if (message->flags & KCANBUS_TX_COMPLETE){
+        can_tx_complete_done(dev, message, CAN_TX_COMPLETE_DROPPED, reason, now_ns);
+    }
+
+    free_kcanbus_message(dev, message);
+}
+
+
+/**
+ *  Give up on the frame in TX_MB and everything queued.  Returns how
+ *  many.  tx_lock held.
+ */
+static unsigned int flush_tx_messages(struct canbus_device_t *dev, unsigned int reason, u64 now_ns)
+{
+    struct kcanbus_message *message;
+    unsigned int dropped = 0;
+
+    if (dev->tx_current){
+        drop_tx_message(dev, dev->tx_current, reason, now_ns);
+        dev->tx_current = NULL;
+        dropped++;
+    }
+
+    while (!list_empty(&dev->transmit_queue)){
+
+        message = list_first_entry(&dev->transmit_queue, struct kcanbus_message, entry);
+        list_del_init(&message->entry);
+
+        dev->stats.cur_tx_queue_count--;
+
+        if (message->signature != KCANBUS_SIGNATURE){
+            can_event(dev, CAN_EVENT_MSG_SIGNATURE, __LINE__);
+            continue;
+        }
+
+        drop_tx_message(dev, message, reason, now_ns);
+        dropped++;
+    }
+
+    return dropped;
+}
+
+
+/**
+ *  Load the held frame again.  tx_lock held.
+ */
+static void can_tx_resume(struct canbus_device_t *dev)
+{
+    dev->tx_held = 0;
+
+    can_tx_start(dev, dev->tx_current);
+    hw_enable_message_buffer_interrupt(dev, TX_MB);
+}
+
+
+/**
+ *  Nobody acknowledged the frame in TX_MB.  Write ABORT, and leave the
+ *  rest to can_tx_aborted().  From the ISR, tx_lock held.
+ */
+void can_tx_ack_error(struct canbus_device_t *dev, unsigned int esr1)
+{
+    /*
+     *  Held, aborting already, or nothing of ours on the bus.
+     */
+    if (!dev->tx_current || dev->tx_held || dev->tx_aborting || dev->tx_bus_off){
+        return;
+    }
+
+    /*
+     *  Or it went out after all, and its IFLAG finishes it.
+     */
+    if (hw_abort_transmit(dev)){
+        dev->tx_aborting = 1;
+        dev->tx_abort_esr1 = esr1;
+    }
+}
+
+
+/**
+ *  TX_MB's IFLAG, and the frame was aborted.  Keep it, retry it or drop
+ *  it.  From the ISR, tx_lock held.
+ */
+void can_tx_aborted(struct canbus_device_t *dev)
+{
+    struct kcanbus_message *message = dev->tx_current;
+    unsigned int dropped = 0;
+    u64 now_ns;
+
+    dev->tx_aborting = 0;
+
+    /*
+     *  BUS OFF took it out, it and the queue wait for can_tx_bus_on().
+     */
+    if (dev->tx_bus_off){
+        dev->tx_abort_keep = 0;
+        hw_disable_message_buffer_interrupt(dev, TX_MB);
+        return;
+    }
+
+    /*
+     *  The same, but we're back on the bus already.
+     */
+    if (dev->tx_abort_keep || !message){
+        dev->tx_abort_keep = 0;
+
+        if (message){
+            can_tx_resume(dev);
+        }
+        else{
+            can_tx_next(dev);
+        }
+        return;
+    }
+
+    dev->stats.tx_aborted++;
+    if (message->tx_file){
+        message->tx_file->stats.tx_aborted++;
+    }
+
+    now_ns = can_clock_ns();
+
+    switch (dev->tx_policy.policy){
+
+        case CAN_TX_RETRY:
+            if (message->tx_attempts <= dev->tx_policy.max_retries){
+
+                dev->stats.tx_retried++;
+                if (message->tx_file){
+                    message->tx_file->stats.tx_retried++;
+                }
+
+                can_tx_start(dev, message);
+                break;
+            }
+
+            drop_tx_message(dev, message, CAN_TX_RETRY, now_ns);
+            dropped = 1;
+            can_tx_next(dev);
+            break;
+
+        case CAN_TX_DROP:
+            drop_tx_message(dev, message, CAN_TX_DROP, now_ns);
+            dropped = 1;
+            can_tx_next(dev);
+            break;
+
+        /*
+         *  transmit_in_progress stays set, so writes keep queueing.
+         */
+        case CAN_TX_HOLD:
+            if (!dev->tx_backoff_ns){
+                dev->tx_backoff_ns = (u64)dev->tx_policy.backoff_min_us * NSEC_PER_USEC;
+            }
+            else{
+                dev->tx_backoff_ns = min_t(u64, dev->tx_backoff_ns * 2,
+                                           (u64)dev->tx_policy.backoff_max_us * NSEC_PER_USEC);
+            }
+
+            dev->tx_held = 1;
+            dev->stats.tx_holds++;
+            hw_disable_message_buffer_interrupt(dev, TX_MB);
+
+            hrtimer_start(&dev->tx_timer, ns_to_ktime(dev->tx_backoff_ns), HRTIMER_MODE_REL);
+            break;
+
+        default:
+            dropped = flush_tx_messages(dev, CAN_TX_FLUSH, now_ns);
+
+            dev->transmit_in_progress = 0;
+            hw_disable_message_buffer_interrupt(dev, TX_MB);
+            break;
+    }
+
+    trace_can_tx_ack_abort(dev, dev->tx_abort_esr1, dropped);
+}
+
+
+/**
+ *  Frames arrived, so there's a node to ack ours.  From the ISR, with
+ *  register_lock held.
+ */
+void can_tx_bus_alive(struct canbus_device_t *dev)
+{
+    if (!ACCESS_ONCE(dev->tx_held)){
+        return;
+    }
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock(&dev->tx_lock);
+
+    if (dev->tx_held){
+        hrtimer_try_to_cancel(&dev->tx_timer);
+        dev->tx_backoff_ns = 0;
+        can_tx_resume(dev);
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock(&dev->tx_lock);
+}
+
+
+/**
+ *  The controller went BUS OFF.  Take our frame out of TX_MB, and keep
+ *  it and the queue for can_tx_bus_on(), or drop them all.  From the ISR
+ *  or the state poll, tx_lock held.
+ */
+void can_tx_bus_off(struct canbus_device_t *dev, int flush)
+{
+    if (dev->tx_bus_off){
+        return;
+    }
+
+    dev->tx_bus_off = 1;
+
+    if (dev->tx_held){
+        hrtimer_try_to_cancel(&dev->tx_timer);
+        dev->tx_held = 0;
+    }
+    else if (dev->tx_current){
+
+        /*
+         *  An ACK error's abort is on its way already.  Otherwise it 
+         *  went out just before, or nothing is on the wire in BUS OFF 
+         *  and the IFLAG comes at once.
+         */
+        if (!dev->tx_aborting){
+            dev->tx_aborting = hw_abort_transmit(dev);
+        }
+        dev->tx_abort_keep = dev->tx_aborting;
+
+        if (!dev->tx_aborting){
+            hw_clear_message_buffer_interrupt(dev, TX_MB);
+            can_tx_complete(dev);
+        }
+    }
+
+    /*
+     *  can_tx_aborted() wants the IFLAG.
+     */
+    if (!dev->tx_aborting){
+        hw_disable_message_buffer_interrupt(dev, TX_MB);
+    }
+
+    if (flush){
+        flush_tx_messages(dev, CAN_TX_BUS_OFF, can_clock_ns());
+    }
+
+    /*
+     *  Writes queue until we're back.
+     */
+    dev->transmit_in_progress = 1;
+}
+
+
+/**
+ *  Back on the bus, load TX_MB with the frame BUS OFF took out of it, or
+ *  the next one queued.  tx_lock held.
+ */
+void can_tx_bus_on(struct canbus_device_t *dev)
+{
+    if (!dev->tx_bus_off){
+        return;
+    }
+
+    dev->tx_bus_off = 0;
+    dev->tx_backoff_ns = 0;
+
+    /*
+     *  BUS OFF's abort hasn't come back yet, can_tx_aborted() carries on.
+     */
+    if (dev->tx_aborting){
+        return;
+    }
+
+    if (dev->tx_current){
+        can_tx_resume(dev);
+        return;
+    }
+
+    can_tx_next(dev);
+
+    if (dev->tx_current){
+        hw_enable_message_buffer_interrupt(dev, TX_MB);
+    }
+}
+
+
+static enum hrtimer_restart can_tx_timer_fn(struct hrtimer *timer)
+{
+    struct canbus_device_t *dev = container_of(timer, struct canbus_device_t, tx_timer);
+    unsigned long flags;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    if (dev->tx_held){
+        dev->stats.tx_retried++;
+        if (dev->tx_current->tx_file){
+            dev->tx_current->tx_file->stats.tx_retried++;
+        }
+
+        can_tx_resume(dev);
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+
+    return HRTIMER_NORESTART;
+}
+
+
+/**
+ *  file is closing, its frames still queued go out without a writer
+ *  to report to.
+ */
+void can_tx_release(struct canbus_file_t *file)
+{
+    struct canbus_device_t *dev = file->dev;
+    struct kcanbus_message *message;
+    unsigned long flags;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    if (dev->tx_current && dev->tx_current->tx_file == file){
+        dev->tx_current->tx_file = NULL;
+    }
+
+    list_for_each_entry(message, &dev->transmit_queue, entry){
+        if (message->tx_file == file){
+            message->tx_file = NULL;
+        }
+    }
+
+    list_for_each_entry(message, &dev->timed_queue, entry){
+        if (message->tx_file == file){
+            message->tx_file = NULL;
+        }
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+}
+
+
+static long get_tx_dropped(struct canbus_file_t *file, unsigned long arg)
+{
+    struct canbus_device_t *dev = file->dev;
+    struct can_tx_dropped_request_t *request;
+    unsigned long flags;
+    u64 seq;
+    u64 head;
+    long ret = 0;
+
+    /*
+     *  Too big for the stack, and we don't want to copy_to_user()
+     *  with the lock held.
+     */
+    request = kmalloc(sizeof(struct can_tx_dropped_request_t), GFP_KERNEL);
+    if (!request){
+        return -ENOMEM;
+    }
+
+    if (copy_from_user(&request->start_seq, (void __user *)arg, sizeof(request->start_seq))){
+        ret = -EFAULT;
+        goto EXIT;
+    }
+
+    request->num_entries = 0;
+    request->lost = 0;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    head = file->tx_dropped_head;
+    seq = request->start_seq;
+
+    if (head > CAN_TX_DROPPED_MAX && seq < head - CAN_TX_DROPPED_MAX){
+        request->lost = head - CAN_TX_DROPPED_MAX - seq;
+        seq = head - CAN_TX_DROPPED_MAX;
+    }
+
+    for (; seq < head; seq++){
+        request->entries[request->num_entries++] = file->tx_dropped[seq % CAN_TX_DROPPED_MAX];
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+
+    request->next_seq = max_t(u64, seq, request->start_seq);
+
+    if (copy_to_user((void __user *)arg, request, sizeof(struct can_tx_dropped_request_t))){
+        ret = -EFAULT;
+    }
+
+EXIT:
+    kfree(request);
+    return ret;
+}
+
+
+long can_tx_ioctl(struct canbus_file_t *file, unsigned int cmd, unsigned long arg)
+{
+    struct canbus_device_t *dev = file->dev;
+    struct can_tx_policy_t policy;
+    unsigned long flags;
+
+    switch (cmd){
+
+        case CAN_IOCTL_SET_TX_POLICY:
+            if (copy_from_user(&policy, (void __user *)arg, sizeof(struct can_tx_policy_t))){
+                return -EFAULT;
+            }
+
+            if (policy.policy >= CAN_TX_POLICIES){
+                return -EINVAL;
+            }
+
+            if (policy.policy == CAN_TX_HOLD &&
+                (!policy.backoff_min_us || policy.backoff_max_us < policy.backoff_min_us)){
+                return -EINVAL;
+            }
+
+            /*
+             *  LOCK --------------------------------------------------------
+             */
+            can_lock_irqsave(&dev->tx_lock, flags);
+
+            dev->tx_policy = policy;
+            dev->tx_backoff_ns = 0;
+
+            /*
+             *  Held under the old policy, try again under the new.
+             */
+            if (dev->tx_held){
+                hrtimer_try_to_cancel(&dev->tx_timer);
+                can_tx_resume(dev);
+            }
+
+            /*
+             *  UNLOCK --------------------------------------------------------
+             */
+            can_unlock_irqrestore(&dev->tx_lock, flags);
+            break;
+
+        case CAN_IOCTL_GET_TX_POLICY:
+            /*
+             *  LOCK --------------------------------------------------------
+             */
+            can_lock_irqsave(&dev->tx_lock, flags);
+
+            policy = dev->tx_policy;
+
+            /*
+             *  UNLOCK --------------------------------------------------------
+             */
+            can_unlock_irqrestore(&dev->tx_lock, flags);
+
+            if (copy_to_user((void __user *)arg, &policy, sizeof(struct can_tx_policy_t))){
+                return -EFAULT;
+            }
+            break;
+
+        case CAN_IOCTL_GET_TX_DROPPED:
+            return get_tx_dropped(file, arg);
+
+        default:
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+
+void init_can_tx(struct canbus_device_t *dev)
+{
+    INIT_LIST_HEAD(&dev->transmit_queue);
+    dev->transmit_in_progress = 0;
+    dev->tx_current = NULL;
+    dev->tx_held = 0;
+    dev->tx_backoff_ns = 0;
+    dev->tx_bus_off = 0;
+
+    memset(&dev->tx_policy, 0, sizeof(struct can_tx_policy_t));
+    dev->tx_policy.policy = CAN_TX_FLUSH;
+
+    hrtimer_init(&dev->tx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    dev->tx_timer.function = can_tx_timer_fn;
+}
+
+
+/**
+ *  No more writes or interrupts, give back what's left.
+ */
+void destroy_can_tx(struct canbus_device_t *dev)
+{
+    struct kcanbus_message *message;
+    unsigned long flags;
+
+    hrtimer_cancel(&dev->tx_timer);
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    if (dev->tx_current){
+        free_kcanbus_message(dev, dev->tx_current);
+        dev->tx_current = NULL;
+    }
+
+    while (!list_empty(&dev->transmit_queue)){
+        message = list_first_entry(&dev->transmit_queue, struct kcanbus_message, entry);
+        list_del_init(&message->entry);
+        free_kcanbus_message(dev, message);
+    }
+
+    dev->stats.cur_tx_queue_count = 0;
+    dev->transmit_in_progress = 0;
+    dev->tx_held = 0;
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+}
@@ -0,0 +1,276 @@
+/****************************************************************************
+ *  tx_complete.c
+ *
+ *  TX complete records, CAN_IOCTL_SET_TX_COMPLETE.  write() returns once
+ *  the frame is in TX_MB or queued, which says nothing of when it got on
+ *  the bus.  A file that asks gets a struct can_tx_complete_t per frame
+ *  it writes, with its cookie, the TX_MB time stamp and whether it went
+ *  out, in a ring of its own that CAN_IOCTL_GET_TX_COMPLETE reads.
+ *
+ *  The ring is separate from the receive queue because completions come
+ *  under tx_lock, inside rx_lock in the lock order, and because it costs
+ *  the ISR no pool message.  Filling in a record is all the ISR does per
+ *  frame.  The reader is only woken when tx_complete_batch records are
+ *  ready, or when the last frame it wrote is done, so a burst that never
+ *  fills a batch isn't left waiting.  A reader too far behind loses the
+ *  oldest records, and is told how many.
+ *
+ *  All of it is under tx_lock.  The ring is allocated on the first
+ *  enable and freed with the file.
+ *
+ ***************************************************************************/
+#include "can_private.h"
+
+
+void can_tx_complete_open(struct canbus_file_t *file)
+{
+    file->tx_complete_batch = 1;
+    init_waitqueue_head(&file->tx_complete_wq);
+}
+
+
+/**
+ *  A grace period after close, nothing refers to file.
+ */
+void can_tx_complete_close(struct canbus_file_t *file)
+{
+    kfree(file->tx_complete);
+    file->tx_complete = NULL;
+}
+
+
+/**
+ *  write() is about to submit message.  Flag it for a record if we're
+ *  asked to.  tx_lock held.
+ */
+void can_tx_complete_write(struct canbus_file_t *file, struct kcanbus_message *message)
+{
+    if (!file->tx_complete_on){
+        return;
+    }
+
+    message->flags |= KCANBUS_TX_COMPLETE;
+    message->tx_write_ns = can_clock_ns();
+
+    file->tx_in_flight++;
+}
+
+
+/**
+ *  Is a batch ready?  tx_lock held.
+ */
+static int tx_complete_batch_ready(struct canbus_file_t *file)
+{
+    u64 ready = file->tx_complete_head - file->tx_complete_tail;
+
+    return ready >= file->tx_complete_batch || (ready && !file->tx_in_flight);
+}
+
+
+/**
+ *  A flagged frame was sent, with tx_ns from TX_MB, or dropped by policy
+ *  at tx_ns.  Record it for its writer.  tx_lock held.
+ */
+void can_tx_complete_done( struct canbus_device_t *dev,
+                           struct kcanbus_message *message,
+                           unsigned int status,
+                           unsigned int policy,
+                           u64 tx_ns)
+{
+    struct canbus_file_t *file = message->tx_file;
+    struct can_tx_complete_t *record;
+
+    /*
+     *  Closed since.
+     */
+    if (!file){
+        return;
+    }
+
+    record = &file->tx_complete[file->tx_complete_head % CAN_TX_COMPLETE_MAX];
+    record->seq = file->tx_complete_head++;
+    record->cookie = message->tx_cookie;
+    record->write_ns = message->tx_write_ns;
+    record->tx_ns = tx_ns;
+    record->status = status;
+    record->policy = policy;
+    record->attempts = message->tx_attempts;
+    record->id = message->user_message.Id;
+
+    file->stats.tx_complete++;
+    file->tx_in_flight--;
+
+    if (!file->tx_complete_ready && tx_complete_batch_ready(file)){
+        file->tx_complete_ready = 1;
+        file->stats.tx_complete_wakeups++;
+
+        wake_up_interruptible(&file->tx_complete_wq);
+    }
+}
+
+
+static long set_tx_complete(struct canbus_file_t *file, unsigned long arg)
+{
+    struct canbus_device_t *dev = file->dev;
+    struct can_tx_complete_config_t config;
+    struct can_tx_complete_t *ring = NULL;
+    unsigned long flags;
+
+    if (copy_from_user(&config, (void __user *)arg, sizeof(struct can_tx_complete_config_t))){
+        return -EFAULT;
+    }
+
+    if (config.enable && (!config.batch || config.batch > CAN_TX_COMPLETE_MAX)){
+        return -EINVAL;
+    }
+
+    if (config.enable && !ACCESS_ONCE(file->tx_complete)){
+        ring = kmalloc(CAN_TX_COMPLETE_MAX * sizeof(struct can_tx_complete_t), GFP_KERNEL);
+        if (!ring){
+            return -ENOMEM;
+        }
+    }
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    /*
+     *  Two enables at once, the loser frees its ring below.
+     */
+    if (ring && !file->tx_complete){
+        file->tx_complete = ring;
+        ring = NULL;
+    }
+
+    /*
+     *  Frames flagged already still get their records.
+     */
+    file->tx_complete_on = config.enable;
+    if (config.enable){
+        file->tx_complete_batch = config.batch;
+    }
+
+    if (!file->tx_complete_ready && tx_complete_batch_ready(file)){
+        file->tx_complete_ready = 1;
+        file->stats.tx_complete_wakeups++;
+
+        wake_up_interruptible(&file->tx_complete_wq);
+    }
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+
+    kfree(ring);
+
+    return 0;
+}
+
+
+static long get_tx_complete(struct canbus_file_t *file, unsigned long arg)
+{
+    struct canbus_device_t *dev = file->dev;
+    struct can_tx_complete_request_t request;
+    struct can_tx_complete_t *entries = NULL;
+    unsigned long flags;
+    unsigned int max_entries;
+    u64 seq;
+    long ret = 0;
+
+    if (copy_from_user(&request, (void __user *)arg, sizeof(struct can_tx_complete_request_t))){
+        return -EFAULT;
+    }
+
+    max_entries = min_t(unsigned int, request.max_entries, CAN_TX_COMPLETE_MAX);
+
+    /*
+     *  We don't want to copy_to_user() with the lock held.
+     */
+    if (max_entries){
+        entries = kmalloc(max_entries * sizeof(struct can_tx_complete_t), GFP_KERNEL);
+        if (!entries){
+            return -ENOMEM;
+        }
+    }
+
+    if (request.wait){
+        /*
+         *  Nothing taken yet, a restart is fine.
+         */
+        if (wait_event_interruptible(file->tx_complete_wq,
+                    ACCESS_ONCE(file->tx_complete_ready) || !ACCESS_ONCE(file->tx_in_flight))){
+            ret = -EINTR;
+            goto EXIT;
+        }
+    }
+
+    request.num_entries = 0;
+    request.lost = 0;
+
+    /*
+     *  LOCK --------------------------------------------------------
+     */
+    can_lock_irqsave(&dev->tx_lock, flags);
+
+    seq = file->tx_complete_tail;
+
+    if (file->tx_complete_head - seq > CAN_TX_COMPLETE_MAX){
+        request.lost = file->tx_complete_head - CAN_TX_COMPLETE_MAX - seq;
+        seq = file->tx_complete_head - CAN_TX_COMPLETE_MAX;
+
+        file->stats.tx_complete_lost += request.lost;
+    }
+
+    for (; seq < file->tx_complete_head && request.num_entries < max_entries; seq++){
+        entries[request.num_entries++] = file->tx_complete[seq % CAN_TX_COMPLETE_MAX];
+    }
+
+    file->tx_complete_tail = seq;
+
+    /*
+     *  What we left behind may be a batch by itself.
+     */
+    file->tx_complete_ready = tx_complete_batch_ready(file);
+
+    request.in_flight = file->tx_in_flight;
+
+    /*
+     *  UNLOCK ------------------------------------------------------
+     */
+    can_unlock_irqrestore(&dev->tx_lock, flags);
+
+    if (request.num_entries &&
+        copy_to_user(   (void __user *)(unsigned long)request.entries, entries,
+                        request.num_entries * sizeof(struct can_tx_complete_t))){
+        ret = -EFAULT;
+        goto EXIT;
+    }
+
+    if (copy_to_user((void __user *)arg, &request, sizeof(struct can_tx_complete_request_t))){
+        ret = -EFAULT;
+    }
+
+EXIT:
+    kfree(entries);
+    return ret;
+}
+
+
+long can_tx_complete_ioctl( struct canbus_file_t *file,
+                            unsigned int cmd,
+                            unsigned long arg)
+{
+    switch(cmd){
+
+        case CAN_IOCTL_SET_TX_COMPLETE:
+            return set_tx_complete(file, arg);
+
+        case CAN_IOCTL_GET_TX_COMPLETE:
+            return get_tx_complete(file, arg);
+    }
+
+    return -EINVAL;
+}
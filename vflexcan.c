@@ -0,0 +1,392 @@
+/****************************************************************************
+ *  vflexcan.c
+ *
+ *  A virtual Flexcan for load testing on any Linux box, built with
+ *  "make TA_CANBUS_VIRTUAL=y".  Loading the module registers a "vflexcan"
+ *  platform device, and flexcan_probe() runs for it as for the real one,
+ *  except that the registers are a flexcan_model (see flexcan_model.h)
+ *  instead of ioremap()ed hardware, and there is no clock, pin, GPIO or
+ *  IRQ to request.
+ *
+ *  Two hrtimers stand in for the bus and the interrupt line:
+ *
+ *  - rx_timer is a traffic generator.  It injects frames into the RX
+ *    mailboxes at vflexcan_rate frames/sec on average, vflexcan_burst
+ *    at a time.  Frames within a burst arrive back to back at the wire
+ *    time of each frame, at the bit rate the driver programmed.
+ *
+ *  - tx_timer completes a transmit one frame time after the driver
+ *    started it.
+ *
+ *  Either one calls can_irq_fn() when the model has an interrupt pending,
+ *  so the ISR runs in hard interrupt context as it would on the board.
+ *  The ISR time in /proc/ta_canbusN includes the model's register
+ *  emulation, so compare it against other vflexcan runs, not a board.
+ *
+ *  The generator parameters can be changed at run time through
+ *  /sys/module/ta_canbus/parameters/.  Data bytes 0-3 of every frame
+ *  with 4 or more bytes hold a big endian sequence number, so a reader
+ *  can count lost frames.
+ *
+ *  vflexcan_count devices are registered, each with its own model and
+ *  generator, and they can be probed alongside real Flexcans.  The
+ *  generator parameters are shared by all of them.
+ *
+ ***************************************************************************/
+#include <linux/hrtimer.h>
+#include <linux/random.h>
+
+#include "can_private.h"
+
+
+#define VFLEXCAN_NAME               "vflexcan"
+
+/*
+ *  What the i.MX6 PER clock runs the Flexcan at.
+ */
+#define VFLEXCAN_CLOCK_FREQ         30000000
+
+/*
+ *  With the generator off, look for a new rate this often.
+ */
+#define VFLEXCAN_IDLE_POLL_NS       (100 * NSEC_PER_MSEC)
+
+/*
+ *  At most one mailbox worth of frames per timer tick.  A generator
+ *  further behind than that skips ahead rather than hogging the CPU.
+ */
+#define VFLEXCAN_MAX_FRAMES_PER_TICK    (FLEXCAN_NUM_MESSAGE_BUFFERS - FIRST_RX_MB)
+
+
+static unsigned int vflexcan_count = 1;
+module_param(vflexcan_count, uint, S_IRUGO);
+MODULE_PARM_DESC(vflexcan_count, "Virtual Flexcans to create, at load time only");
+
+static unsigned int vflexcan_rate = 1000;
+module_param(vflexcan_rate, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(vflexcan_rate, "Frames/sec the virtual bus delivers, 0 = none");
+
+static unsigned int vflexcan_burst = 1;
+module_param(vflexcan_burst, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(vflexcan_burst, "Frames per burst, sent back to back");
+
+static unsigned int vflexcan_id_min;
+module_param(vflexcan_id_min, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(vflexcan_id_min, "Lowest CAN ID generated");
+
+static unsigned int vflexcan_id_max = 0x7FF;
+module_param(vflexcan_id_max, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(vflexcan_id_max, "Highest CAN ID generated (11 bits for standard frames)");
+
+static bool vflexcan_id_sequential;
+module_param(vflexcan_id_sequential, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(vflexcan_id_sequential, "Step through the ID range instead of picking uniformly");
+
+static unsigned int vflexcan_ext_percent;
+module_param(vflexcan_ext_percent, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(vflexcan_ext_percent, "Share of extended frames, percent");
+
+static int vflexcan_dlc = -1;
+module_param(vflexcan_dlc, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(vflexcan_dlc, "Data length of every frame, -1 = random 0-8");
+
+
+struct vflexcan {
+
+    struct flexcan_model *model;
+    struct canbus_device_t *dev;
+
+    struct hrtimer rx_timer;            /* Traffic generator */
+    struct hrtimer tx_timer;            /* Transmit completion */
+
+    u64 next_frame_ns;                  /* When rx_timer injects the next frame */
+    u64 burst_start_ns;                 /* When the current burst started */
+    unsigned int burst_left;            /* Frames still to come in it */
+    unsigned int next_id;               /* For vflexcan_id_sequential */
+    u32 sequence;                       /* Goes in the data bytes */
+
+    unsigned long long generated;       /* Frames injected */
+    unsigned long long skipped;         /* Frames not injected, generator fell behind */
+};
+
+
+static struct platform_device *vflexcan_pdevs[CAN_MAX_DEVICES];
+
+
+
+static void vflexcan_make_frame(struct vflexcan *vf, CANBUS_MESSAGE *message)
+{
+    unsigned int id_min = min(vflexcan_id_min, vflexcan_id_max);
+    unsigned int id_span = max(vflexcan_id_min, vflexcan_id_max) - id_min + 1;
+    unsigned int id;
+    unsigned int i;
+
+    memset(message, 0, sizeof(CANBUS_MESSAGE));
+
+    if (vflexcan_id_sequential){
+        id = id_min + vf->next_id++ % id_span;
+    }
+    else{
+        id = id_min + prandom_u32() % id_span;
+    }
+
+    if (prandom_u32() % 100 < vflexcan_ext_percent){
+        message->Type = CmtExtended;
+        message->Id = id & 0x1FFFFFFF;
+    }
+    else{
+        message->Type = CmtStandard;
+        message->Id = (id & 0x7FF) << 18;
+    }
+
+    if (vflexcan_dlc >= 0 && vflexcan_dlc <= 8){
+        message->DataLength = vflexcan_dlc;
+    }
+    else{
+        message->DataLength = prandom_u32() % 9;
+    }
+
+    for (i = 0; i<message->DataLength; i++){
+        message->Data[i] = (unsigned char)prandom_u32();
+    }
+
+    if (message->DataLength >= 4){
+        message->Data[0] = (unsigned char)(vf->sequence >> 24);
+        message->Data[1] = (unsigned char)(vf->sequence >> 16);
+        message->Data[2] = (unsigned char)(vf->sequence >> 8);
+        message->Data[3] = (unsigned char)vf->sequence;
+    }
+    vf->sequence++;
+}
+
+
+/*
+ *  Work out when the frame after this one arrives.  The next burst starts
+ *  one burst period after this one did, or right after it ends if the bus
+ *  can't fit the rate.
+ */
+static void vflexcan_advance(struct vflexcan *vf, const CANBUS_MESSAGE *message)
+{
+    unsigned int burst = max(vflexcan_burst, 1U);
+    u64 frame_end_ns = vf->next_frame_ns +
+                        (u64)can_frame_bits(message) * vf->model->bit_time_ns;
+
+    if (vf->burst_left > 1){
+        vf->burst_left--;
+        vf->next_frame_ns = frame_end_ns;
+        return;
+    }
+
+    vf->burst_left = burst;
+    vf->burst_start_ns += div_u64((u64)burst * NSEC_PER_SEC, vflexcan_rate);
+    vf->next_frame_ns = max(vf->burst_start_ns, frame_end_ns);
+}
+
+
+static void vflexcan_interrupt(struct vflexcan *vf)
+{
+    if (flexcan_model_irq_pending(vf->model)){
+        can_irq_fn(vf->dev->irq, vf->dev);
+    }
+}
+
+
+static enum hrtimer_restart vflexcan_rx_timer_fn(struct hrtimer *timer)
+{
+    struct vflexcan *vf = container_of(timer, struct vflexcan, rx_timer);
+    CANBUS_MESSAGE message;
+    u64 now_ns = can_clock_ns();
+    unsigned int count = 0;
+
+    while (vf->next_frame_ns <= now_ns){
+
+        if (!vflexcan_rate){
+            vf->burst_left = 0;
+            vf->next_frame_ns = now_ns + VFLEXCAN_IDLE_POLL_NS;
+            break;
+        }
+
+        /*
+         *  Just switched on, start a burst now.
+         */
+        if (!vf->burst_left){
+            vf->burst_left = max(vflexcan_burst, 1U);
+            vf->burst_start_ns = now_ns;
+            vf->next_frame_ns = now_ns;
+        }
+
+        if (count == VFLEXCAN_MAX_FRAMES_PER_TICK){
+            vf->skipped += vf->burst_left;
+            vf->burst_left = 0;
+            vf->next_frame_ns = now_ns;
+            break;
+        }
+
+        vflexcan_make_frame(vf, &message);
+        flexcan_model_receive(vf->model, &message);
+        vf->generated++;
+        count++;
+
+        vflexcan_advance(vf, &message);
+    }
+
+    vflexcan_interrupt(vf);
+
+    /*
+     *  Skipping ahead, come back on the next tick rather than looping here.
+     */
+    if (vf->next_frame_ns <= now_ns){
+        vf->next_frame_ns = now_ns + VFLEXCAN_IDLE_POLL_NS / 100;
+    }
+
+    hrtimer_set_expires(timer, ns_to_ktime(vf->next_frame_ns));
+
+    return HRTIMER_RESTART;
+}
+
+
+static enum hrtimer_restart vflexcan_tx_timer_fn(struct hrtimer *timer)
+{
+    struct vflexcan *vf = container_of(timer, struct vflexcan, tx_timer);
+
+    flexcan_model_poll(vf->model, can_clock_ns());
+
+    vflexcan_interrupt(vf);
+
+    return HRTIMER_NORESTART;
+}
+
+
+/*
+ *  The driver just wrote a TX mailbox, with the model locked.
+ *  This may be from inside tx_timer's own callback (the ISR
+ *  starting the next frame), which hrtimer_start() allows
+ *  as long as the callback returns HRTIMER_NORESTART.
+ */
+static void vflexcan_tx_started(struct flexcan_model *model, u64 done_ns)
+{
+    struct vflexcan *vf = model->owner;
+
+    hrtimer_start(&vf->tx_timer, ns_to_ktime(done_ns), HRTIMER_MODE_ABS);
+}
+
+
+
+/****************************************************************************
+ *  Probe / remove, called from flexcan_probe() and flexcan_remove().
+ */
+int vflexcan_is_virtual(struct platform_device *pdev)
+{
+    return !strcmp(pdev->name, VFLEXCAN_NAME);
+}
+
+
+int vflexcan_attach(struct platform_device *pdev, struct canbus_device_t *dev)
+{
+    struct vflexcan *vf;
+
+    vf = kzalloc(sizeof(struct vflexcan), GFP_KERNEL);
+    if (!vf){
+        return -ENOMEM;
+    }
+
+    vf->model = flexcan_model_create(VFLEXCAN_CLOCK_FREQ);
+    if (!vf->model){
+        kfree(vf);
+        return -ENOMEM;
+    }
+
+    vf->model->timed_tx = 1;
+    vf->model->tx_started = vflexcan_tx_started;
+    vf->model->owner = vf;
+    vf->dev = dev;
+
+    hrtimer_init(&vf->rx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    vf->rx_timer.function = vflexcan_rx_timer_fn;
+
+    hrtimer_init(&vf->tx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    vf->tx_timer.function = vflexcan_tx_timer_fn;
+
+    dev->registers = (struct FLEXCAN_HW_REGISTERS __iomem *)&vf->model->regs;
+    dev->clock_freq = VFLEXCAN_CLOCK_FREQ;
+    dev->irq = 0;
+    dev->stby_gpio = -ENOENT;
+    dev->id = pdev->id;
+    dev->vflexcan = vf;
+
+    /*
+     *  The model drops frames until hw_initialize_hardware()
+     *  takes it out of freeze, so this can start now.
+     */
+    vf->next_frame_ns = can_clock_ns();
+    hrtimer_start(&vf->rx_timer, ns_to_ktime(vf->next_frame_ns), HRTIMER_MODE_ABS);
+
+    printk( KERN_INFO PRINTK_DEV_NAME "%s is a virtual Flexcan, registers: %p\n",
+            dev->name, dev->registers);
+
+    return 0;
+}
+
+
+void vflexcan_detach(struct canbus_device_t *dev)
+{
+    struct vflexcan *vf = dev->vflexcan;
+
+    hrtimer_cancel(&vf->rx_timer);
+    hrtimer_cancel(&vf->tx_timer);
+
+    printk( KERN_INFO PRINTK_DEV_NAME
+            "%s virtual Flexcan: generated %llu, skipped %llu, lost %llu, transmitted %llu\n",
+            dev->name, vf->generated, vf->skipped, vf->model->rx_lost, vf->model->tx_frames);
+
+    flexcan_model_destroy(vf->model);
+    kfree(vf);
+
+    dev->registers = NULL;
+    dev->vflexcan = NULL;
+}
+
+
+
+/****************************************************************************
+ *  Module init / exit.
+ */
+int vflexcan_register_devices(void)
+{
+    struct platform_device *pdev;
+    unsigned int i;
+
+    if (vflexcan_count > CAN_MAX_DEVICES){
+        printk( KERN_ERR PRINTK_DEV_NAME
+                "vflexcan_count %u, at most %d\n", vflexcan_count, CAN_MAX_DEVICES);
+        return -EINVAL;
+    }
+
+    for (i = 0; i<vflexcan_count; i++){
+
+        pdev = platform_device_register_simple(VFLEXCAN_NAME, i, NULL, 0);
+        if (IS_ERR(pdev)){
+            printk( KERN_ERR PRINTK_DEV_NAME
+                    "Failed registering virtual Flexcan %u %ld\n", i, PTR_ERR(pdev));
+            vflexcan_unregister_devices();
+            return PTR_ERR(pdev);
+        }
+
+        vflexcan_pdevs[i] = pdev;
+    }
+
+    return 0;
+}
+
+
+void vflexcan_unregister_devices(void)
+{
+    int i;
+
+    for (i = 0; i<CAN_MAX_DEVICES; i++){
+        if (vflexcan_pdevs[i]){
+            platform_device_unregister(vflexcan_pdevs[i]);
+            vflexcan_pdevs[i] = NULL;
+        }
+    }
+}